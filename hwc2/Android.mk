@@ -22,6 +22,28 @@ ifeq ($(TARGET_USES_HWC2),true)
 
 LOCAL_PATH := $(call my-dir)
 
+# Shared with the host tests
+hwc2_src_files := \
+	hwc2.cpp \
+	hwc2_dev.cpp \
+	hwc2_display.cpp \
+	hwc2_config.cpp \
+	hwc2_callback.cpp \
+	hwc2_layer.cpp \
+	hwc2_layer_map.cpp \
+	hwc2_buffer.cpp \
+	hwc2_gralloc.cpp \
+	hwc2_fill_cache.cpp \
+	hwc2_window.cpp \
+	hwc2_region.cpp \
+	hwc2_plan_cache.cpp \
+	hwc2_trace.cpp \
+	hwc2_stats.cpp \
+	hwc2_vsync_model.cpp \
+	hwc2_sw_composer.cpp \
+	hwc2_post_worker.cpp \
+	hwc2_window_caps.cpp
+
 include $(CLEAR_VARS)
 
 # HAL module implemenation, not prelinked and stored in
@@ -33,23 +55,16 @@ LOCAL_MODULE := hwcomposer.$(TARGET_BOOTLOADER_BOARD_NAME)
 LOCAL_SHARED_LIBRARIES := \
 	liblog \
 	libutils \
-	libcutils
+	libcutils \
+	libhardware \
+	libsync
 
 LOCAL_STATIC_LIBRARIES := \
 	libadfhwc \
 	libadf \
 	libbase
 
-LOCAL_SRC_FILES := \
-	hwc2.cpp \
-	hwc2_dev.cpp \
-	hwc2_display.cpp \
-	hwc2_config.cpp \
-	hwc2_callback.cpp \
-	hwc2_layer.cpp \
-	hwc2_buffer.cpp \
-	hwc2_gralloc.cpp \
-	hwc2_window.cpp
+LOCAL_SRC_FILES := $(hwc2_src_files)
 
 LOCAL_C_INCLUDES := $(LOCAL_PATH)/include
 
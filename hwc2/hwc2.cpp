@@ -20,9 +20,24 @@
 #include <cstdlib>
 #include <new>
 #include <array>
+#include <algorithm>
 
 #include "hwc2.h"
 
+/* Pack call arguments into 64 bit trace words */
+static uint64_t trace_float(float value)
+{
+    uint32_t bits;
+    memcpy(&bits, &value, sizeof(bits));
+    return bits;
+}
+
+static uint64_t trace_color(const hwc_color_t &color)
+{
+    return static_cast<uint32_t>(color.r) << 24 | color.g << 16
+            | color.b << 8 | color.a;
+}
+
 static int hwc2_device_open(const struct hw_module_t *module, const char *name,
     struct hw_device_t **device);
 
@@ -56,6 +71,50 @@ hwc2_error_t destroy_virtual_display(hwc2_device_t *device,
     return dev->destroy_virtual_display(display);
 }
 
+hwc2_error_t get_predicted_present_times(hwc2_device_t *device,
+        hwc2_display_t display, uint32_t *out_count, int64_t *out_times)
+{
+    hwc2_dev *dev = reinterpret_cast<hwc2_context *>(device)->hwc2_dev;
+    hwc2_trace_call call(dev->get_trace(),
+            static_cast<hwc2_function_descriptor_t>(
+            HWC2_VENDOR_FUNCTION_GET_PREDICTED_PRESENT_TIMES), display, 0,
+            {out_times != nullptr, out_count? *out_count: 0});
+    hwc2_error_t ret = dev->get_predicted_present_times(display, out_count,
+            out_times);
+
+    /* The times are only written on success */
+    if (ret != HWC2_ERROR_NONE || !dev->get_trace().is_enabled())
+        return call.end(ret);
+    for (uint32_t idx = 0; out_times && idx < *out_count; idx++)
+        call.add_data(out_times[idx]);
+    return call.end(ret, {*out_count});
+}
+
+hwc2_error_t set_layer_commands(hwc2_device_t *device, hwc2_display_t display,
+        uint32_t num_words, const uint32_t *commands,
+        uint32_t *out_error_offset)
+{
+    hwc2_dev *dev = reinterpret_cast<hwc2_context *>(device)->hwc2_dev;
+    hwc2_trace_call call(dev->get_trace(),
+            static_cast<hwc2_function_descriptor_t>(
+            HWC2_VENDOR_FUNCTION_SET_LAYER_COMMANDS), display, 0,
+            {num_words});
+
+    /* Two command words to a data word, the first in the low half */
+    for (uint32_t idx = 0; commands && idx < num_words; idx += 2)
+        call.add_data(hwc2_trace_pair((idx + 1 < num_words)?
+                commands[idx + 1]: 0, commands[idx]));
+
+    uint32_t error_offset = 0;
+    hwc2_error_t ret = dev->set_layer_commands(display, num_words, commands,
+            &error_offset);
+    if (ret == HWC2_ERROR_NONE)
+        return call.end(ret);
+
+    *out_error_offset = error_offset;
+    return call.end(ret, {error_offset});
+}
+
 void dump(hwc2_device_t *device, uint32_t *out_size, char *out_buffer)
 {
     hwc2_dev *dev = reinterpret_cast<hwc2_context *>(device)->hwc2_dev;
@@ -80,21 +139,32 @@ hwc2_error_t accept_display_changes(hwc2_device_t *device,
         hwc2_display_t display)
 {
     hwc2_dev *dev = reinterpret_cast<hwc2_context *>(device)->hwc2_dev;
-    return dev->accept_display_changes(display);
+    hwc2_trace_call call(dev->get_trace(),
+            HWC2_FUNCTION_ACCEPT_DISPLAY_CHANGES, display);
+    return call.end(dev->accept_display_changes(display));
 }
 
 hwc2_error_t create_layer(hwc2_device_t *device, hwc2_display_t display,
         hwc2_layer_t *out_layer)
 {
     hwc2_dev *dev = reinterpret_cast<hwc2_context *>(device)->hwc2_dev;
-    return dev->create_layer(display, out_layer);
+    hwc2_trace_call call(dev->get_trace(), HWC2_FUNCTION_CREATE_LAYER,
+            display);
+    hwc2_error_t ret = dev->create_layer(display, out_layer);
+
+    /* out_layer is only written on success */
+    if (ret != HWC2_ERROR_NONE || !dev->get_trace().is_enabled())
+        return call.end(ret);
+    return call.end(ret, {*out_layer});
 }
 
 hwc2_error_t destroy_layer(hwc2_device_t *device, hwc2_display_t display,
         hwc2_layer_t layer)
 {
     hwc2_dev *dev = reinterpret_cast<hwc2_context *>(device)->hwc2_dev;
-    return dev->destroy_layer(display, layer);
+    hwc2_trace_call call(dev->get_trace(), HWC2_FUNCTION_DESTROY_LAYER,
+            display, layer);
+    return call.end(dev->destroy_layer(display, layer));
 }
 
 hwc2_error_t get_active_config(hwc2_device_t *device, hwc2_display_t display,
@@ -109,8 +179,21 @@ hwc2_error_t get_changed_composition_types(hwc2_device_t *device,
         hwc2_layer_t *out_layers, hwc2_composition_t *out_types)
 {
     hwc2_dev *dev = reinterpret_cast<hwc2_context *>(device)->hwc2_dev;
-    return dev->get_changed_composition_types(display, out_num_elements,
-            out_layers, out_types);
+    hwc2_trace_call call(dev->get_trace(),
+            HWC2_FUNCTION_GET_CHANGED_COMPOSITION_TYPES, display, 0,
+            {out_layers != nullptr && out_types != nullptr});
+    hwc2_error_t ret = dev->get_changed_composition_types(display,
+            out_num_elements, out_layers, out_types);
+
+    /* Each changed layer takes two words, its id and its new type */
+    if (ret != HWC2_ERROR_NONE || !dev->get_trace().is_enabled())
+        return call.end(ret);
+    for (uint32_t idx = 0; out_layers && out_types
+            && idx < *out_num_elements; idx++) {
+        call.add_data(out_layers[idx]);
+        call.add_data(out_types[idx]);
+    }
+    return call.end(ret, {*out_num_elements});
 }
 
 hwc2_error_t get_client_target_support(hwc2_device_t *device,
@@ -157,8 +240,23 @@ hwc2_error_t get_display_requests(hwc2_device_t *device, hwc2_display_t display,
         hwc2_layer_request_t *out_layer_requests)
 {
     hwc2_dev *dev = reinterpret_cast<hwc2_context *>(device)->hwc2_dev;
-    return dev->get_display_requests(display, out_display_requests,
-            out_num_elements, out_layers, out_layer_requests);
+    hwc2_trace_call call(dev->get_trace(),
+            HWC2_FUNCTION_GET_DISPLAY_REQUESTS, display, 0,
+            {out_layers != nullptr && out_layer_requests != nullptr});
+    hwc2_error_t ret = dev->get_display_requests(display,
+            out_display_requests, out_num_elements, out_layers,
+            out_layer_requests);
+
+    /* Each layer request takes two words, the layer id and the request */
+    if (ret != HWC2_ERROR_NONE || !dev->get_trace().is_enabled())
+        return call.end(ret);
+    for (uint32_t idx = 0; out_layers && out_layer_requests
+            && idx < *out_num_elements; idx++) {
+        call.add_data(out_layers[idx]);
+        call.add_data(out_layer_requests[idx]);
+    }
+    return call.end(ret, {*out_num_elements,
+            static_cast<uint64_t>(*out_display_requests)});
 }
 
 hwc2_error_t get_display_type(hwc2_device_t *device, hwc2_display_t display,
@@ -198,14 +296,18 @@ hwc2_error_t present_display(hwc2_device_t *device, hwc2_display_t display,
         int32_t *out_present_fence)
 {
     hwc2_dev *dev = reinterpret_cast<hwc2_context *>(device)->hwc2_dev;
-    return dev->present_display(display, out_present_fence);
+    hwc2_trace_call call(dev->get_trace(), HWC2_FUNCTION_PRESENT_DISPLAY,
+            display);
+    return call.end(dev->present_display(display, out_present_fence));
 }
 
 hwc2_error_t set_active_config(hwc2_device_t *device, hwc2_display_t display,
         hwc2_config_t config)
 {
     hwc2_dev *dev = reinterpret_cast<hwc2_context *>(device)->hwc2_dev;
-    return dev->set_active_config(display, config);
+    hwc2_trace_call call(dev->get_trace(), HWC2_FUNCTION_SET_ACTIVE_CONFIG,
+            display, 0, {config});
+    return call.end(dev->set_active_config(display, config));
 }
 
 hwc2_error_t set_client_target(hwc2_device_t *device, hwc2_display_t display,
@@ -213,78 +315,119 @@ hwc2_error_t set_client_target(hwc2_device_t *device, hwc2_display_t display,
         android_dataspace_t dataspace, hwc_region_t damage)
 {
     hwc2_dev *dev = reinterpret_cast<hwc2_context *>(device)->hwc2_dev;
-    return dev->set_client_target(display, target, acquire_fence, dataspace,
-            damage);
+    hwc2_trace_call call(dev->get_trace(), HWC2_FUNCTION_SET_CLIENT_TARGET,
+            display, 0, {reinterpret_cast<uintptr_t>(target),
+            acquire_fence >= 0, dataspace, damage.numRects});
+    call.add_buffer(target);
+    call.add_rects(damage.rects, damage.numRects);
+    return call.end(dev->set_client_target(display, target, acquire_fence,
+            dataspace, damage));
 }
 
 hwc2_error_t set_color_mode(hwc2_device_t *device, hwc2_display_t display,
         android_color_mode_t mode)
 {
     hwc2_dev *dev = reinterpret_cast<hwc2_context *>(device)->hwc2_dev;
-    return dev->set_color_mode(display, mode);
+    hwc2_trace_call call(dev->get_trace(), HWC2_FUNCTION_SET_COLOR_MODE,
+            display, 0, {mode});
+    return call.end(dev->set_color_mode(display, mode));
 }
 
 hwc2_error_t set_color_transform(hwc2_device_t *device, hwc2_display_t display,
         const float *matrix, android_color_transform_t hint)
 {
     hwc2_dev *dev = reinterpret_cast<hwc2_context *>(device)->hwc2_dev;
-    return dev->set_color_transform(display, matrix, hint);
+    hwc2_trace_call call(dev->get_trace(), HWC2_FUNCTION_SET_COLOR_TRANSFORM,
+            display, 0, {hint, matrix != nullptr});
+    for (size_t idx = 0; matrix && idx < 16; idx++)
+        call.add_data(trace_float(matrix[idx]));
+    return call.end(dev->set_color_transform(display, matrix, hint));
 }
 
 hwc2_error_t set_output_buffer(hwc2_device_t *device, hwc2_display_t display,
         buffer_handle_t buffer, int32_t release_fence)
 {
     hwc2_dev *dev = reinterpret_cast<hwc2_context *>(device)->hwc2_dev;
-    return dev->set_output_buffer(display, buffer, release_fence);
+    hwc2_trace_call call(dev->get_trace(), HWC2_FUNCTION_SET_OUTPUT_BUFFER,
+            display, 0, {reinterpret_cast<uintptr_t>(buffer)});
+    call.add_buffer(buffer);
+    return call.end(dev->set_output_buffer(display, buffer, release_fence));
 }
 
 hwc2_error_t set_power_mode(hwc2_device_t *device, hwc2_display_t display,
         hwc2_power_mode_t mode)
 {
     hwc2_dev *dev = reinterpret_cast<hwc2_context *>(device)->hwc2_dev;
-    return dev->set_power_mode(display, mode);
+    hwc2_trace_call call(dev->get_trace(), HWC2_FUNCTION_SET_POWER_MODE,
+            display, 0, {mode});
+    return call.end(dev->set_power_mode(display, mode));
 }
 
 hwc2_error_t set_vsync_enabled(hwc2_device_t *device, hwc2_display_t display,
         hwc2_vsync_t enabled)
 {
     hwc2_dev *dev = reinterpret_cast<hwc2_context *>(device)->hwc2_dev;
-    return dev->set_vsync_enabled(display, static_cast<hwc2_vsync_t>(enabled));
+    hwc2_trace_call call(dev->get_trace(), HWC2_FUNCTION_SET_VSYNC_ENABLED,
+            display, 0, {enabled});
+    return call.end(dev->set_vsync_enabled(display,
+            static_cast<hwc2_vsync_t>(enabled)));
 }
 
 hwc2_error_t validate_display(hwc2_device_t *device, hwc2_display_t display,
         uint32_t *out_num_types, uint32_t *out_num_requests)
 {
     hwc2_dev *dev = reinterpret_cast<hwc2_context *>(device)->hwc2_dev;
-    return dev->validate_display(display, out_num_types, out_num_requests);
+    hwc2_trace_call call(dev->get_trace(), HWC2_FUNCTION_VALIDATE_DISPLAY,
+            display);
+    hwc2_error_t ret = dev->validate_display(display, out_num_types,
+            out_num_requests);
+
+    /* The counts are only written when validation completes */
+    if ((ret != HWC2_ERROR_NONE && ret != HWC2_ERROR_HAS_CHANGES)
+            || !dev->get_trace().is_enabled())
+        return call.end(ret);
+    return call.end(ret, {*out_num_types, *out_num_requests});
 }
 
 hwc2_error_t set_cursor_position(hwc2_device_t *device, hwc2_display_t display,
         hwc2_layer_t layer, int32_t x, int32_t y)
 {
     hwc2_dev *dev = reinterpret_cast<hwc2_context *>(device)->hwc2_dev;
-    return dev->set_cursor_position(display, layer, x, y);
+    hwc2_trace_call call(dev->get_trace(), HWC2_FUNCTION_SET_CURSOR_POSITION,
+            display, layer, {hwc2_trace_pair(x, y)});
+    return call.end(dev->set_cursor_position(display, layer, x, y));
 }
 
 hwc2_error_t set_layer_buffer(hwc2_device_t *device, hwc2_display_t display,
         hwc2_layer_t layer, buffer_handle_t buffer, int32_t acquire_fence)
 {
     hwc2_dev *dev = reinterpret_cast<hwc2_context *>(device)->hwc2_dev;
-    return dev->set_layer_buffer(display, layer, buffer, acquire_fence);
+    hwc2_trace_call call(dev->get_trace(), HWC2_FUNCTION_SET_LAYER_BUFFER,
+            display, layer,
+            {reinterpret_cast<uintptr_t>(buffer), acquire_fence >= 0});
+    call.add_buffer(buffer);
+    return call.end(dev->set_layer_buffer(display, layer, buffer,
+            acquire_fence));
 }
 
 hwc2_error_t set_layer_surface_damage(hwc2_device_t *device,
         hwc2_display_t display, hwc2_layer_t layer, hwc_region_t damage)
 {
     hwc2_dev *dev = reinterpret_cast<hwc2_context *>(device)->hwc2_dev;
-    return dev->set_layer_surface_damage(display, layer, damage);
+    hwc2_trace_call call(dev->get_trace(),
+            HWC2_FUNCTION_SET_LAYER_SURFACE_DAMAGE, display, layer,
+            {damage.numRects});
+    call.add_rects(damage.rects, damage.numRects);
+    return call.end(dev->set_layer_surface_damage(display, layer, damage));
 }
 
 hwc2_error_t set_layer_blend_mode(hwc2_device_t *device, hwc2_display_t display,
         hwc2_layer_t layer, hwc2_blend_mode_t mode)
 {
     hwc2_dev *dev = reinterpret_cast<hwc2_context *>(device)->hwc2_dev;
-    return dev->set_layer_blend_mode(display, layer, mode);
+    hwc2_trace_call call(dev->get_trace(), HWC2_FUNCTION_SET_LAYER_BLEND_MODE,
+            display, layer, {mode});
+    return call.end(dev->set_layer_blend_mode(display, layer, mode));
 }
 
 hwc2_error_t set_layer_color(hwc2_device_t *device,
@@ -292,63 +435,87 @@ hwc2_error_t set_layer_color(hwc2_device_t *device,
         hwc_color_t color)
 {
     hwc2_dev *dev = reinterpret_cast<hwc2_context *>(device)->hwc2_dev;
-    return dev->set_layer_color(display, layer, color);
+    hwc2_trace_call call(dev->get_trace(), HWC2_FUNCTION_SET_LAYER_COLOR,
+            display, layer, {trace_color(color)});
+    return call.end(dev->set_layer_color(display, layer, color));
 }
 
 hwc2_error_t set_layer_composition_type(hwc2_device_t *device,
         hwc2_display_t display, hwc2_layer_t layer, hwc2_composition_t type)
 {
     hwc2_dev *dev = reinterpret_cast<hwc2_context *>(device)->hwc2_dev;
-    return dev->set_layer_composition_type(display, layer, type);
+    hwc2_trace_call call(dev->get_trace(),
+            HWC2_FUNCTION_SET_LAYER_COMPOSITION_TYPE, display, layer, {type});
+    return call.end(dev->set_layer_composition_type(display, layer, type));
 }
 
 hwc2_error_t set_layer_dataspace(hwc2_device_t *device, hwc2_display_t display,
         hwc2_layer_t layer, android_dataspace_t dataspace)
 {
     hwc2_dev *dev = reinterpret_cast<hwc2_context *>(device)->hwc2_dev;
-    return dev->set_layer_dataspace(display, layer, dataspace);
+    hwc2_trace_call call(dev->get_trace(), HWC2_FUNCTION_SET_LAYER_DATASPACE,
+            display, layer, {dataspace});
+    return call.end(dev->set_layer_dataspace(display, layer, dataspace));
 }
 
 hwc2_error_t set_layer_display_frame(hwc2_device_t *device,
         hwc2_display_t display, hwc2_layer_t layer, hwc_rect_t frame)
 {
     hwc2_dev *dev = reinterpret_cast<hwc2_context *>(device)->hwc2_dev;
-    return dev->set_layer_display_frame(display, layer, frame);
+    hwc2_trace_call call(dev->get_trace(),
+            HWC2_FUNCTION_SET_LAYER_DISPLAY_FRAME, display, layer,
+            {hwc2_trace_pair(frame.left, frame.top),
+            hwc2_trace_pair(frame.right, frame.bottom)});
+    return call.end(dev->set_layer_display_frame(display, layer, frame));
 }
 
 hwc2_error_t set_layer_plane_alpha(hwc2_device_t *device,
         hwc2_display_t display, hwc2_layer_t layer, float alpha)
 {
     hwc2_dev *dev = reinterpret_cast<hwc2_context *>(device)->hwc2_dev;
-    return dev->set_layer_plane_alpha(display, layer, alpha);
+    hwc2_trace_call call(dev->get_trace(), HWC2_FUNCTION_SET_LAYER_PLANE_ALPHA,
+            display, layer, {trace_float(alpha)});
+    return call.end(dev->set_layer_plane_alpha(display, layer, alpha));
 }
 
 hwc2_error_t set_layer_source_crop(hwc2_device_t *device,
         hwc2_display_t display, hwc2_layer_t layer, hwc_frect_t crop)
 {
     hwc2_dev *dev = reinterpret_cast<hwc2_context *>(device)->hwc2_dev;
-    return dev->set_layer_source_crop(display, layer, crop);
+    hwc2_trace_call call(dev->get_trace(), HWC2_FUNCTION_SET_LAYER_SOURCE_CROP,
+            display, layer,
+            {trace_float(crop.left), trace_float(crop.top),
+            trace_float(crop.right), trace_float(crop.bottom)});
+    return call.end(dev->set_layer_source_crop(display, layer, crop));
 }
 
 hwc2_error_t set_layer_transform(hwc2_device_t *device, hwc2_display_t display,
         hwc2_layer_t layer, hwc_transform_t transform)
 {
     hwc2_dev *dev = reinterpret_cast<hwc2_context *>(device)->hwc2_dev;
-    return dev->set_layer_transform(display, layer, transform);
+    hwc2_trace_call call(dev->get_trace(), HWC2_FUNCTION_SET_LAYER_TRANSFORM,
+            display, layer, {transform});
+    return call.end(dev->set_layer_transform(display, layer, transform));
 }
 
 hwc2_error_t set_layer_visible_region(hwc2_device_t *device,
         hwc2_display_t display, hwc2_layer_t layer, hwc_region_t visible)
 {
     hwc2_dev *dev = reinterpret_cast<hwc2_context *>(device)->hwc2_dev;
-    return dev->set_layer_visible_region(display, layer, visible);
+    hwc2_trace_call call(dev->get_trace(),
+            HWC2_FUNCTION_SET_LAYER_VISIBLE_REGION, display, layer,
+            {visible.numRects});
+    call.add_rects(visible.rects, visible.numRects);
+    return call.end(dev->set_layer_visible_region(display, layer, visible));
 }
 
 hwc2_error_t set_layer_z_order(hwc2_device_t *device, hwc2_display_t display,
         hwc2_layer_t layer, uint32_t z)
 {
     hwc2_dev *dev = reinterpret_cast<hwc2_context *>(device)->hwc2_dev;
-    return dev->set_layer_z_order(display, layer, z);
+    hwc2_trace_call call(dev->get_trace(), HWC2_FUNCTION_SET_LAYER_Z_ORDER,
+            display, layer, {z});
+    return call.end(dev->set_layer_z_order(display, layer, z));
 }
 
 /* Indexed using the hwc2_function_descriptor_t enum to find the corresponding
@@ -404,6 +571,11 @@ static const std::array<hwc2_function_pointer_t, 44> hwc2_func_ptrs = {{
 hwc2_function_pointer_t get_function(struct hwc2_device* /*device*/,
         /*hwc2_function_descriptor_t*/ int32_t descriptor)
 {
+    if (descriptor == HWC2_VENDOR_FUNCTION_GET_PREDICTED_PRESENT_TIMES)
+        return (hwc2_function_pointer_t) get_predicted_present_times;
+    if (descriptor == HWC2_VENDOR_FUNCTION_SET_LAYER_COMMANDS)
+        return (hwc2_function_pointer_t) set_layer_commands;
+
     if (descriptor == HWC2_FUNCTION_INVALID ||
             static_cast<size_t>(descriptor) >= hwc2_func_ptrs.size()) {
         ALOGW("invalid descriptor");
@@ -413,9 +585,21 @@ hwc2_function_pointer_t get_function(struct hwc2_device* /*device*/,
 }
 
 void get_capabilities(struct hwc2_device* /*device*/, uint32_t *out_count,
-        /*hwc2_capability_t*/ int32_t* /*outCapabilities*/)
+        /*hwc2_capability_t*/ int32_t *out_capabilities)
 {
-    *out_count = 0;
+    /* present_display returns NOT_VALIDATED whenever something that affects
+     * composition changed, so the client may present without validating */
+    static const std::array<int32_t, 1> capabilities = {{
+        HWC2_CAPABILITY_SKIP_VALIDATE,
+    }};
+
+    if (!out_capabilities) {
+        *out_count = capabilities.size();
+        return;
+    }
+
+    *out_count = std::min<uint32_t>(*out_count, capabilities.size());
+    std::copy_n(capabilities.begin(), *out_count, out_capabilities);
 }
 
 static int32_t hwc2_device_close(struct hw_device_t *device)
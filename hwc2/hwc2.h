@@ -26,18 +26,38 @@
 #include <android-base/unique_fd.h>
 
 #include <unordered_map>
+#include <memory>
+#include <initializer_list>
+#include <atomic>
+#include <list>
 #include <queue>
 #include <array>
 #include <vector>
 #include <string>
 #include <mutex>
+#include <condition_variable>
+#include <thread>
 #include <string>
 
+#include <hardware/gralloc.h>
 #include <adf/adf.h>
 #include <adfhwc/adfhwc.h>
+#include <utils/Timers.h>
 
 #define HWC2_WINDOW_COUNT         4
 
+/* Vsync periods without a new post before the layers of a display are folded
+ * into the client target. Overridden by debug.hwc2.idle_frames */
+#define HWC2_IDLE_FRAMES          60
+
+/* Color management unit coefficients are S3.8 fixed point */
+#define HWC2_CMU_CSC_ONE          0x100
+#define HWC2_CMU_CSC_MIN          -0x800
+#define HWC2_CMU_CSC_MAX          0x7ff
+#define HWC2_CMU_CSC_MASK         0xfff
+
+/* Default layer limits of the windows. The kernel does not report them, so
+ * hwc2_window_caps starts from these */
 #define HWC2_WINDOW_MIN_SOURCE_CROP_WIDTH       1.0
 #define HWC2_WINDOW_MIN_SOURCE_CROP_HEIGHT      1.0
 #define HWC2_WINDOW_MIN_DISPLAY_FRAME_WIDTH     4
@@ -47,6 +67,151 @@
 #define HWC2_WINDOW_MAX_ROT_SRC_HEIGHT            2560
 #define HWC2_WINDOW_MAX_ROT_SRC_HEIGHT_NO_SCALE   3600
 
+/* Extra cost, as a percentage of the layer area, of composing a scaled or
+ * rotated layer with the client instead of a window */
+#define HWC2_CLIENT_COST_SCALE_PERCENT    50
+#define HWC2_CLIENT_COST_ROTATE_PERCENT   50
+
+/* Extra memory fetch, as a percentage of the window bandwidth, of a rotated
+ * window. Scanning a pitch linear buffer by columns wastes most of each
+ * memory burst */
+#define HWC2_BANDWIDTH_ROTATE_PERCENT     100
+
+/* The number of composition plans each display remembers */
+#define HWC2_PLAN_CACHE_SIZE              8
+
+/* The number of buffer handles whose gralloc metadata is remembered. This
+ * comfortably covers the BufferQueues of every visible layer */
+#define HWC2_GRALLOC_CACHE_SIZE           64
+
+/* The number of exported dma-buf fds kept open for reuse that no buffer
+ * holds. Fds held by a recent buffer of a layer or client target, or by the
+ * last post of a display, are not counted and never evicted */
+#define HWC2_DMA_BUF_CACHE_SIZE           16
+
+/* The number of distinct buffers a layer or client target keeps dma-buf fds
+ * open for. A BufferQueue cycling through this many buffers posts without
+ * exporting or closing fds */
+#define HWC2_BUFFER_HISTORY_SIZE          4
+
+/* The largest trace ring debug.hwc2.trace may request, and the number of
+ * argument words kept per traced call */
+#define HWC2_TRACE_MAX_RECORDS            65536
+#define HWC2_TRACE_ARG_COUNT              6
+
+/* Variable-length data, such as the rects of a region, is kept in a second
+ * ring of this many words per record. Records whose data was overwritten
+ * are dropped from dumps */
+#define HWC2_TRACE_DATA_WORDS             16
+
+/* Trace events from this value up to the vendor functions are callbacks
+ * rather than functions */
+#define HWC2_TRACE_CALLBACK               0x1000
+
+/* The binary trace written to debug.hwc2.trace_file, read by hwc2_replay */
+#define HWC2_TRACE_MAGIC                  0x54324348
+#define HWC2_TRACE_VERSION                2
+
+/* The vsync model fits a line through the most recent hardware vsyncs. It
+ * is trusted once HWC2_VSYNC_MIN_SAMPLES of them are all within
+ * HWC2_VSYNC_MAX_ERROR of the line, and for at most HWC2_VSYNC_MAX_AGE after
+ * the last one before hardware vsync is sampled again */
+#define HWC2_VSYNC_SAMPLES                16
+#define HWC2_VSYNC_MIN_SAMPLES            6
+#define HWC2_VSYNC_MAX_ERROR              300000
+#define HWC2_VSYNC_MAX_AGE                1000000000
+
+/* Predictions further out than this many vsyncs are not reported */
+#define HWC2_VSYNC_MAX_PREDICTIONS        8
+
+/* Vendor functions, numbered past the hwc2_function_descriptor_t range */
+#define HWC2_VENDOR_FUNCTION_GET_PREDICTED_PRESENT_TIMES   0x10000
+
+/* Returns the times at which a frame presented now or on the following
+ * vsyncs is expected to be displayed. outCount is the capacity of outTimes
+ * on input and the number of times written on output. If outTimes is null,
+ * outCount is set to the number of times the device can predict, which is
+ * 0 until a hardware vsync has been seen */
+typedef int32_t /*hwc2_error_t*/ (*HWC2_VENDOR_PFN_GET_PREDICTED_PRESENT_TIMES)(
+        hwc2_device_t *device, hwc2_display_t display, uint32_t *outCount,
+        int64_t *outTimes);
+
+#define HWC2_VENDOR_FUNCTION_SET_LAYER_COMMANDS            0x10001
+
+/* A layer command is a header word followed by its argument words. The
+ * header holds the command in its upper 16 bits and the argument word count
+ * in its lower 16 bits. Every command but SELECT_LAYER applies to the layer
+ * selected last */
+#define HWC2_LAYER_COMMAND_HEADER(command, length) \
+        ((static_cast<uint32_t>(command) << 16) | ((length) & 0xffff))
+
+typedef enum {
+    HWC2_LAYER_COMMAND_SELECT_LAYER = 1, /* 2 words: layer id, low word first */
+    HWC2_LAYER_COMMAND_COMPOSITION_TYPE, /* 1 word: hwc2_composition_t */
+    HWC2_LAYER_COMMAND_BUFFER,           /* 3 words: handle, low word first,
+                                          * then the acquire fence */
+    HWC2_LAYER_COMMAND_DATASPACE,        /* 1 word: android_dataspace_t */
+    HWC2_LAYER_COMMAND_DISPLAY_FRAME,    /* 4 words: hwc_rect_t */
+    HWC2_LAYER_COMMAND_SOURCE_CROP,      /* 4 words: hwc_frect_t */
+    HWC2_LAYER_COMMAND_Z_ORDER,          /* 1 word */
+    HWC2_LAYER_COMMAND_SURFACE_DAMAGE,   /* 4 words per hwc_rect_t */
+    HWC2_LAYER_COMMAND_BLEND_MODE,       /* 1 word: hwc2_blend_mode_t */
+    HWC2_LAYER_COMMAND_PLANE_ALPHA,      /* 1 word: float */
+    HWC2_LAYER_COMMAND_TRANSFORM,        /* 1 word: hwc_transform_t */
+    HWC2_LAYER_COMMAND_VISIBLE_REGION,   /* 4 words per hwc_rect_t */
+    HWC2_LAYER_COMMAND_COLOR,            /* 1 word: r, g, b, a from the low
+                                          * byte up */
+    HWC2_LAYER_COMMAND_CURSOR_POSITION,  /* 2 words: x, y */
+} hwc2_layer_command_t;
+
+/* Applies numWords of layer commands to the display in one call. Every
+ * command is applied even if an earlier one failed. The first error is
+ * returned and outErrorOffset is set to the word offset of the command that
+ * caused it. A malformed command stops the stream with BAD_PARAMETER.
+ *
+ * The device owns the acquire fence of every buffer command, whether or not
+ * it was applied. After a malformed command the rest of the stream is only
+ * scanned for buffer commands to close their fences. The scan stops at the
+ * first header whose length runs past numWords, and the caller still owns
+ * any fence in the words after it */
+typedef int32_t /*hwc2_error_t*/ (*HWC2_VENDOR_PFN_SET_LAYER_COMMANDS)(
+        hwc2_device_t *device, hwc2_display_t display, uint32_t numWords,
+        const uint32_t *commands, uint32_t *outErrorOffset);
+
+/* Latency histograms have log2 buckets of microseconds. The last bucket holds
+ * everything from 2^(HWC2_STATS_BUCKETS - 2)us up */
+#define HWC2_STATS_BUCKETS                20
+
+/* Composition mix is counted per layer count up to this value. Larger layer
+ * counts share the last entry */
+#define HWC2_STATS_LAYER_COUNTS           16
+
+/* Identifies the binary stats dump and the layout of its records */
+#define HWC2_STATS_MAGIC                  0x53324348
+#define HWC2_STATS_VERSION                1
+
+/* Virtual display slots are created at open, disconnected, and connected by
+ * create_virtual_display. Their output is composed on the cpu */
+#define HWC2_VIRTUAL_DISPLAY_COUNT        1
+#define HWC2_VIRTUAL_DISPLAY_MAX_SIZE     2048
+#define HWC2_VIRTUAL_DISPLAY_VSYNC_PERIOD 16666667
+
+/* The cpu composer leaves frames whose layers cover more than this many times
+ * the output to the client, and drops a frame if a fence it waits on has not
+ * signaled within the timeout in ms */
+#define HWC2_SW_COMPOSER_MAX_OVERDRAW     3
+#define HWC2_SW_COMPOSER_FENCE_TIMEOUT    1000
+
+/* A physical display queues at most this many posts for its post worker,
+ * counting the one being posted. The worker warns every this many ms while
+ * it waits for the present fence of a post. Overridden to synchronous posts
+ * by debug.hwc2.async_post=0 */
+#define HWC2_POST_QUEUE_SIZE              2
+#define HWC2_POST_FENCE_TIMEOUT           1000
+
+/* NVIDIA buffers are made of at most three surfaces (Y, U and V planes) */
+#define HWC2_GRALLOC_MAX_SURFACES         3
+
 #define HWC2_WINDOW_CAP_YUV                  0x001
 #define HWC2_WINDOW_CAP_SCALE                0x002
 #define HWC2_WINDOW_CAP_FLIP                 0x004
@@ -68,36 +233,99 @@
                                | HWC2_WINDOW_CAP_TILED \
                                | HWC2_WINDOW_CAP_BLOCK_LINEAR)
 
-static const std::array<uint32_t, HWC2_WINDOW_COUNT> window_capabilities = {{
-    HWC2_WINDOW_CAP_COMMON | HWC2_WINDOW_CAP_ROTATE_PLANAR,
-    HWC2_WINDOW_CAP_COMMON,
-    HWC2_WINDOW_CAP_COMMON,
-    HWC2_WINDOW_CAP_PITCH
-}};
+/* The bits from HWC2_WINDOW_CAP_FORMAT_SHIFT up are the buffer formats a
+ * window can scan out, one per entry of the format table in
+ * hwc2_window_caps.cpp */
+#define HWC2_WINDOW_CAP_FORMAT_SHIFT         8
+#define HWC2_WINDOW_FORMAT_COUNT             15
+
+#define HWC2_WINDOW_CAP_FORMATS (((1 << HWC2_WINDOW_FORMAT_COUNT) - 1) \
+                               << HWC2_WINDOW_CAP_FORMAT_SHIFT)
+
+/* The layout of one surface (plane) of a gralloc buffer */
+struct hwc2_gralloc_surface {
+    int32_t  layout;
+    uint32_t pitch;
+    uint32_t hmem;
+    uint32_t offset;
+    uint32_t block_height_log2;
+};
+
+/* Everything hwc2 needs to know about a gralloc buffer, read once per buffer
+ * handle instead of once per query */
+struct hwc2_gralloc_metadata {
+    int      format;
+    bool     yuv;
+    bool     stereo;
+    size_t   surf_cnt;
+    std::array<hwc2_gralloc_surface, HWC2_GRALLOC_MAX_SURFACES> surfaces;
+};
 
 class hwc2_gralloc {
 public:
     /* hwc2_gralloc follows the singleton design pattern */
     static const hwc2_gralloc &get_instance();
 
+    std::string dump() const;
+
     bool     is_valid(buffer_handle_t handle) const;
-    bool     is_stereo(buffer_handle_t handle) const;
-    bool     is_yuv(buffer_handle_t handle) const;
+    bool     get_metadata(buffer_handle_t handle,
+                 hwc2_gralloc_metadata *out_metadata) const;
+    /* The gralloc pixel format, where the metadata has the adf format */
+    int      get_pixel_format(buffer_handle_t handle) const;
+    /* The returned fd stays owned by hwc2_gralloc and must not be closed */
+    void     get_dma_buf(uint32_t hmem, int *out_fd) const;
+
+    /* A held dma-buf stays open until every hold is released. Buffers hold
+     * the hmems they recently showed and displays hold the fds they last
+     * posted */
+    void     hold_dma_buf(uint32_t hmem) const;
+    void     release_dma_buf(uint32_t hmem) const;
+    void     hold_posted_dma_buf(int fd) const;
+    void     release_posted_dma_buf(int fd) const;
+    uint32_t decompress(buffer_handle_t handle, int in_fence,
+                 int *out_fence) const;
+
+private:
+    hwc2_gralloc();
+    ~hwc2_gralloc();
+
+    bool     read_metadata(buffer_handle_t handle,
+                 hwc2_gralloc_metadata *out_metadata) const;
     int      get_format(buffer_handle_t handle) const;
-    void     get_surfaces(buffer_handle_t handle, const void **surf,
-                 size_t *surf_cnt) const;
-    void     get_dma_buf(const void *surf, uint32_t surf_idx, int *out_fd) const;
     int32_t  get_layout(const void *surf, uint32_t surf_idx) const;
     uint32_t get_pitch(const void *surf, uint32_t surf_idx) const;
     uint32_t get_hmem(const void *surf, uint32_t surf_idx) const;
     uint32_t get_offset(const void *surf, uint32_t surf_idx) const;
     uint32_t get_block_height_log2(const void *surf, uint32_t surf_idx) const;
-    uint32_t decompress(buffer_handle_t handle, int in_fence,
-                 int *out_fence) const;
 
-private:
-    hwc2_gralloc();
-    ~hwc2_gralloc();
+    /* A cached copy of the metadata of one buffer handle. The whole native
+     * handle is kept so that a handle address reused by a different buffer
+     * is detected and read again, even if the new buffer got the same fd */
+    struct hwc2_gralloc_entry {
+        buffer_handle_t handle;
+        int num_fds;
+        int num_ints;
+        std::vector<int> data;
+        hwc2_gralloc_metadata metadata;
+    };
+
+    bool is_current(const hwc2_gralloc_entry &entry,
+            buffer_handle_t handle) const;
+    void release_dma_bufs(const hwc2_gralloc_metadata &metadata) const;
+
+    /* An exported dma-buf fd of an NvRm memory handle. While the fd is open
+     * the memory cannot be freed, so the hmem can not be recycled for a
+     * different buffer. A held hmem is only exported once it is posted, so
+     * fd is -1 until then */
+    struct hwc2_dma_buf {
+        uint32_t hmem;
+        int fd;
+        uint32_t holds;
+    };
+
+    void close_dma_buf(std::list<hwc2_dma_buf>::iterator it) const;
+    void evict_dma_bufs() const;
 
     /* The address of the nvgr_is_valid symbol. This NVIDIA function checks if a
      * buffer is valid */
@@ -132,39 +360,163 @@ private:
 
     /* A symbol table handle to the NVIDIA gralloc .so file. */
     void *nvgr;
+
+    /* Guards the metadata cache, which is shared by every display */
+    mutable std::mutex cache_mutex;
+
+    /* The cached metadata ordered from most to least recently used, and an
+     * index into it by buffer handle */
+    mutable std::list<hwc2_gralloc_entry> cache;
+    mutable std::unordered_map<buffer_handle_t,
+            std::list<hwc2_gralloc_entry>::iterator> cache_index;
+
+    /* Metadata lookups served from the cache and read from gralloc */
+    mutable uint64_t cache_hits;
+    mutable uint64_t cache_misses;
+
+    /* The open dma-buf fds ordered from most to least recently used, and an
+     * index into them by hmem. Guarded by cache_mutex */
+    mutable std::list<hwc2_dma_buf> dma_bufs;
+    mutable std::unordered_map<uint32_t, std::list<hwc2_dma_buf>::iterator>
+            dma_buf_index;
+
+    /* dma-buf lookups served from the cache, fds exported from NvRm and fds
+     * closed again */
+    mutable uint64_t dma_buf_hits;
+    mutable uint64_t dma_buf_exports;
+    mutable uint64_t dma_buf_closes;
+};
+
+#define HWC2_FILL_CACHE_SIZE      8
+#define HWC2_FILL_BUFFER_SIZE     16
+
+/* Only the center of a fill buffer is scanned out, so the scaler filter never
+ * samples past its edges */
+#define HWC2_FILL_BUFFER_BORDER   4
+
+/* Small buffers filled with a single color. Solid color layers scan them out
+ * through a window, stretched to the display frame by the window scaler */
+class hwc2_fill_cache {
+public:
+    /* hwc2_fill_cache follows the singleton design pattern */
+    static hwc2_fill_cache &get_instance();
+
+    std::string dump() const;
+
+    /* Returns nullptr if no fill buffer could be allocated. The buffer stays
+     * valid while the returned pointer is held, even after it is evicted */
+    std::shared_ptr<const native_handle_t> get(const hwc_color_t &color,
+                    bool premultiplied);
+
+private:
+    hwc2_fill_cache();
+    ~hwc2_fill_cache();
+
+    std::shared_ptr<const native_handle_t> allocate(uint32_t pixel);
+
+    /* The gralloc module used to fill the buffers and the device which
+     * allocates them. alloc_dev is NULL if gralloc could not be opened */
+    const gralloc_module_t *gralloc_module;
+    alloc_device_t *alloc_dev;
+
+    /* Guards the cache, which is shared by every display */
+    mutable std::mutex cache_mutex;
+
+    /* The fill buffers by pixel value, ordered from most to least recently
+     * used */
+    std::list<std::pair<uint32_t, std::shared_ptr<const native_handle_t>>>
+            cache;
+
+    /* Lookups served from the cache and buffers allocated for misses */
+    uint64_t cache_hits;
+    uint64_t cache_allocs;
+};
+
+/* A set of pixels stored as disjoint rects */
+class hwc2_region {
+public:
+    hwc2_region();
+    hwc2_region(const hwc_rect_t &rect);
+
+    void clear();
+    void set(const hwc_rect_t &rect);
+    void set(const hwc_rect_t *in_rects, size_t rect_cnt);
+
+    bool     is_empty() const { return rects.empty(); }
+    uint64_t get_area() const;
+    bool     contains(const hwc2_region &other) const;
+    const hwc_rect_t &get_bounds() const { return bounds; }
+    const std::vector<hwc_rect_t> &get_rects() const { return rects; }
+
+    hwc2_region &unite(const hwc_rect_t &rect);
+    hwc2_region &unite(const hwc2_region &other);
+    hwc2_region &intersect(const hwc2_region &other);
+    hwc2_region &subtract(const hwc2_region &other);
+
+private:
+    static void subtract_rect(const hwc_rect_t &cut,
+                    std::vector<hwc_rect_t> *out_rects);
+    void update_bounds();
+
+    /* The disjoint, non-empty rects of the region and their bounding box.
+     * Operations on regions whose bounds do not intersect return early */
+    std::vector<hwc_rect_t> rects;
+    hwc_rect_t bounds;
+
+    /* Scratch space kept so repeated operations do not allocate. contains()
+     * uses it too, which is why it is mutable */
+    mutable std::vector<hwc_rect_t> scratch;
 };
 
 class hwc2_buffer {
 public:
     hwc2_buffer();
-    ~hwc2_buffer();
 
     std::string dump() const;
 
     hwc2_error_t decompress();
+    bool         is_decompressed() const { return decompressed; }
     hwc2_error_t get_adf_post_props(struct tegra_adf_flip_windowattr *win_attr,
                     struct adf_buffer_config *adf_buf, size_t win_idx,
                     size_t buf_idx, uint32_t z_order) const;
 
     void close_acquire_fence();
 
+    /* False only if the client reported that nothing changed, with a single
+     * empty damage rect */
+    bool is_damaged() const;
+
+    /* Must be called before the buffer is destroyed with a display still
+     * open, or the fds of its recent buffers stay open */
+    void release_dma_bufs();
+
     /* Get properties */
     uint32_t         get_z_order() const { return z_order; }
     buffer_handle_t  get_buffer_handle() const { return handle; }
     hwc_transform_t  get_transform() const { return transform; }
+    hwc2_blend_mode_t get_blend_mode() const { return blend_mode; }
+    float            get_plane_alpha() const { return plane_alpha; }
+    int              get_acquire_fence() const { return acquire_fence.get(); }
+    const std::vector<hwc_rect_t> &get_visible_region() const
+                        { return visible_region; }
     uint32_t         get_adf_buffer_format() const;
     uint32_t         get_layout() const;
+    const hwc_rect_t &get_display_frame() const { return display_frame; }
+    const hwc_frect_t &get_source_crop() const { return source_crop; }
     int     get_display_frame_width() const;
     int     get_display_frame_height() const;
     float   get_source_crop_width() const;
     float   get_source_crop_height() const;
     float   get_scale_width() const;
     float   get_scale_height() const;
-    void    get_surfaces(const void **surf, size_t *surf_cnt) const;
+    size_t  get_surface_count() const { return metadata.surf_cnt; }
     bool    is_source_crop_int_aligned() const;
-    bool    is_stereo() const;
-    bool    is_yuv() const;
+    bool    is_stereo() const { return metadata.stereo; }
+    bool    is_yuv() const { return metadata.yuv; }
     bool    is_overlapped() const;
+    bool    is_opaque() const;
+    uint64_t get_bandwidth(int32_t display_height, int32_t vsync_period) const;
+    void    get_signature(std::vector<uint32_t> *signature) const;
 
     bool    get_modified() const { return modified; }
 
@@ -180,16 +532,27 @@ public:
     hwc2_error_t set_transform(hwc_transform_t transform);
     hwc2_error_t set_visible_region(const hwc_region_t &visible_region);
 
+    /* Translates the display frame and visible region to x, y without
+     * forcing revalidation */
+    void move_display_frame(int32_t x, int32_t y);
+
     void set_modified(bool modified) { this->modified = modified; }
 
 private:
     /* A handle to the buffer */
     buffer_handle_t handle;
 
+    /* The gralloc metadata of the buffer, zeroed if there is no buffer */
+    hwc2_gralloc_metadata metadata;
+
+    /* The hmems of the most recently set buffers, newest first, whose dma-buf
+     * fds are held open. 0 marks an unused entry */
+    std::array<uint32_t, HWC2_BUFFER_HISTORY_SIZE> recent_hmems;
+
     /* A sync fence object which will be signaled when it is safe to read
      * from the buffer. If the acquire_fence is -1, it is already safe to
      * read from the buffer */
-    int32_t acquire_fence;
+    android::base::unique_fd acquire_fence;
 
     /* Provides more info on how to interpret the buffer contents such as
      * the encoding standard and color transformation */
@@ -223,13 +586,15 @@ private:
      * translucent areas of other buffers */
     std::vector<hwc_rect_t> visible_region;
 
-    /* Used to determine if the current buffer has a different format than the
-     * previous buffer */
-    uint32_t previous_format;
-
     /* The buffer is modified and will force revalidation of the display */
     bool modified;
 
+    /* The current buffer has been through nvgr_decompress and its acquire
+     * fence now covers the decompression */
+    bool decompressed;
+
+    void hold_recent_dma_buf();
+
     hwc2_error_t get_adf_buf_config(struct adf_buffer_config *adf_buf) const;
     hwc2_error_t get_adf_win_attr(struct tegra_adf_flip_windowattr *win_attr,
                         size_t win_idx, size_t buf_idx, uint32_t z_order) const;
@@ -266,6 +631,7 @@ public:
             hwc2_function_pointer_t pointer);
 
     void call_hotplug(hwc2_display_t dpy_id, hwc2_connection_t connection);
+    void call_refresh(hwc2_display_t dpy_id);
     void call_vsync(hwc2_display_t dpy_id, int64_t timestamp);
 
 private:
@@ -293,12 +659,15 @@ public:
     std::string dump() const;
 
     hwc2_error_t decompress_buffer();
+    bool         is_decompressed() const { return buffer.is_decompressed(); }
 
     hwc2_error_t get_adf_post_props(struct tegra_adf_flip_windowattr *win_attr,
                     struct adf_buffer_config *adf_buf, size_t win_idx,
                     size_t buf_idx, uint32_t z_order) const;
 
     void close_acquire_fence() { buffer.close_acquire_fence(); }
+    bool is_damaged() const { return buffer.is_damaged(); }
+    void release_dma_bufs() { buffer.release_dma_bufs(); }
 
     /* Get properties */
     hwc2_layer_t        get_id() const { return id; }
@@ -308,17 +677,34 @@ public:
     hwc_transform_t     get_transform() const;
     uint32_t            get_adf_buffer_format() const;
     uint32_t            get_layout() const;
+    const hwc_rect_t   &get_display_frame() const
+                            { return buffer.get_display_frame(); }
+    const hwc_frect_t  &get_source_crop() const
+                            { return buffer.get_source_crop(); }
+    hwc2_blend_mode_t   get_blend_mode() const
+                            { return buffer.get_blend_mode(); }
+    float               get_plane_alpha() const
+                            { return buffer.get_plane_alpha(); }
+    int                 get_acquire_fence() const
+                            { return buffer.get_acquire_fence(); }
+    const hwc_color_t  &get_color() const { return color; }
+    const std::vector<hwc_rect_t> &get_visible_region() const
+                            { return buffer.get_visible_region(); }
     int     get_display_frame_width() const;
     int     get_display_frame_height() const;
     float   get_source_crop_width() const;
     float   get_source_crop_height() const;
     float   get_scale_width() const;
     float   get_scale_height() const;
-    void    get_surfaces(const void **surf, size_t *surf_cnt) const;
+    size_t  get_surface_count() const;
     bool    is_source_crop_int_aligned() const;
     bool    is_stereo() const;
     bool    is_yuv() const;
     bool    is_overlapped() const;
+    bool    is_opaque() const { return buffer.is_opaque(); }
+    uint64_t get_bandwidth(int32_t display_height, int32_t vsync_period) const
+                    { return buffer.get_bandwidth(display_height, vsync_period); }
+    void    get_signature(std::vector<uint32_t> *signature) const;
 
     bool    get_modified() const { return modified || buffer.get_modified(); }
 
@@ -334,12 +720,12 @@ public:
     hwc2_error_t set_plane_alpha(float plane_alpha);
     hwc2_error_t set_transform(hwc_transform_t transform);
     hwc2_error_t set_visible_region(const hwc_region_t &visible_region);
+    hwc2_error_t set_cursor_position(int32_t x, int32_t y);
+    hwc2_error_t set_color(const hwc_color_t &color);
 
     void set_modified(bool modified) { this->modified = modified;
                         buffer.set_modified(modified); }
 
-    static hwc2_layer_t get_next_id();
-
 private:
     /* Identifies the layer to the client */
     hwc2_layer_t id;
@@ -350,12 +736,76 @@ private:
     /* Composition type of the layer */
     hwc2_composition_t comp_type;
 
+    hwc2_error_t update_fill_buffer();
+
+    /* The client's source crop. Solid color layers crop the fill buffer
+     * instead and restore this crop when they change composition type */
+    hwc_frect_t source_crop;
+
+    /* The color of a solid color layer and the fill buffer placed in the
+     * layer's buffer to scan it out */
+    hwc_color_t color;
+    std::shared_ptr<const native_handle_t> fill_buffer;
+
     /* The layer is modified and will force revalidation of the display */
     bool modified;
+};
 
-    /* Keep track to total number of layers so new layer ids can be
-     * generated */
-    static uint64_t layer_cnt;
+/* Stores the layers of a display contiguously. Layer ids pack a slot number in
+ * the low 32 bits and the slot's generation in the high 32 bits, so lookups
+ * are a bounds and generation check and ids of destroyed layers are never
+ * honored again. Destroying a layer moves the last layer into its place */
+class hwc2_layer_map {
+public:
+    /* Ids of fresh slots start at initial_generation. Tests start close to
+     * the wrap around */
+    hwc2_layer_map(uint32_t initial_generation = 1);
+
+    hwc2_layer_t emplace();
+    bool         erase(hwc2_layer_t lyr_id);
+
+    hwc2_layer       *find(hwc2_layer_t lyr_id);
+    const hwc2_layer *find(hwc2_layer_t lyr_id) const;
+
+    size_t size() const { return layers.size(); }
+
+    std::vector<hwc2_layer>::iterator begin() { return layers.begin(); }
+    std::vector<hwc2_layer>::iterator end() { return layers.end(); }
+    std::vector<hwc2_layer>::const_iterator begin() const
+                    { return layers.begin(); }
+    std::vector<hwc2_layer>::const_iterator end() const
+                    { return layers.end(); }
+
+    /* Must be called whenever the z order of a layer may have changed */
+    void invalidate_z_order() { z_order_valid = false; }
+    void get_z_order(std::vector<const hwc2_layer *> *out_layers);
+
+private:
+    struct hwc2_layer_slot {
+        uint32_t generation;
+        uint32_t index;
+    };
+
+    uint32_t get_slot(hwc2_layer_t lyr_id) const;
+
+    /* The layers, in no particular order */
+    std::vector<hwc2_layer> layers;
+
+    /* The slot of each entry in layers */
+    std::vector<uint32_t> layer_slots;
+
+    /* Maps slot numbers to positions in layers */
+    std::vector<hwc2_layer_slot> slots;
+
+    /* Slots that can be reused by new layers */
+    std::vector<uint32_t> free_slots;
+
+    uint32_t initial_generation;
+
+    /* The slots of all layers sorted by z order then id. It is only sorted
+     * again after a layer's z order changes or a layer is created */
+    std::vector<uint32_t> z_order;
+    bool z_order_valid;
 };
 
 class hwc2_window {
@@ -363,7 +813,7 @@ public:
     hwc2_window();
 
     void clear();
-    hwc2_error_t assign_client_target(uint32_t z_order);
+    hwc2_error_t assign_client_target(uint32_t z_order, uint32_t layouts);
     hwc2_error_t assign_layer(uint32_t z_order, const hwc2_layer &lyr);
 
     bool is_empty() const;
@@ -377,8 +827,6 @@ public:
     bool has_requirements(uint32_t required_capabilities) const;
     void set_capabilities(uint32_t capabilities);
 
-    static bool is_supported(const hwc2_layer &lyr);
-
 private:
     /* Each window can contain the client target, a layer or nothing */
     enum hwc2_window_content_t {
@@ -401,6 +849,427 @@ private:
     uint32_t capabilities;
 };
 
+class hwc2_window_caps {
+public:
+    hwc2_window_caps();
+
+    std::string dump() const;
+
+    void query(hwc2_display_t dpy_id, struct adf_device *adf_dev);
+
+    uint32_t get_capabilities(size_t win_idx) const
+                    { return capabilities[win_idx]; }
+    uint32_t get_layouts() const { return layouts; }
+    bool     get_cursor_mode() const { return cursor_mode; }
+
+    bool is_supported(const hwc2_layer &lyr) const;
+
+    static uint32_t get_format_capability(uint32_t format);
+
+private:
+    void query_device(hwc2_display_t dpy_id, struct adf_device *adf_dev);
+    void query_overlay_engines(hwc2_display_t dpy_id,
+                    struct adf_device *adf_dev);
+
+    /* The HWC2_WINDOW_CAP_* bits of each window, including the formats it
+     * scans out */
+    std::array<uint32_t, HWC2_WINDOW_COUNT> capabilities;
+
+    /* The buffer layouts the display controller can scan out */
+    uint32_t layouts;
+
+    /* Layers outside of these limits cannot be scanned out by any window */
+    float   min_source_crop_width;
+    float   min_source_crop_height;
+    int32_t min_display_frame_width;
+    int32_t min_display_frame_height;
+    float   min_scale;
+    float   max_rot_src_height;
+    float   max_rot_src_height_no_scale;
+
+    /* The display controller can flip cursor layers in a window on their
+     * own */
+    bool cursor_mode;
+
+    /* The window formats were reported by the overlay engines rather than
+     * assumed */
+    bool queried_formats;
+};
+
+class hwc2_plan_cache {
+public:
+    hwc2_plan_cache();
+
+    std::string dump() const;
+
+    /* Looks up the plan stored for a layer signature. On a hit, the window
+     * assignment, composition changes, layer requests and whether the plan
+     * was cut back to fit the bandwidth budget are copied to the outputs */
+    bool find(const std::vector<uint32_t> &signature,
+                    std::array<hwc2_window, HWC2_WINDOW_COUNT> *out_windows,
+                    std::vector<std::pair<hwc2_layer_t,
+                    hwc2_composition_t>> *out_comp_types,
+                    std::vector<std::pair<hwc2_layer_t,
+                    hwc2_layer_request_t>> *out_layer_requests,
+                    bool *out_client_target_used, bool *out_over_budget);
+    void insert(const std::vector<uint32_t> &signature,
+                    const std::array<hwc2_window, HWC2_WINDOW_COUNT> &windows,
+                    const std::vector<std::pair<hwc2_layer_t,
+                    hwc2_composition_t>> &comp_types,
+                    const std::vector<std::pair<hwc2_layer_t,
+                    hwc2_layer_request_t>> &layer_requests,
+                    bool client_target_used, bool over_budget);
+    void clear();
+
+private:
+    struct hwc2_plan {
+        /* Hash of the signature, checked before comparing signatures */
+        uint64_t hash;
+
+        /* Every layer property that can change the outcome of
+         * assign_composition */
+        std::vector<uint32_t> signature;
+
+        /* The result of assign_composition for the signature */
+        std::array<hwc2_window, HWC2_WINDOW_COUNT> windows;
+        std::vector<std::pair<hwc2_layer_t, hwc2_composition_t>>
+                changed_comp_types;
+        std::vector<std::pair<hwc2_layer_t, hwc2_layer_request_t>>
+                layer_requests;
+        bool client_target_used;
+        bool over_budget;
+    };
+
+    /* The cached plans, most recently used first */
+    std::list<hwc2_plan> entries;
+
+    /* Lookup statistics */
+    uint64_t hits;
+    uint64_t misses;
+
+    static uint64_t get_hash(const std::vector<uint32_t> &signature);
+};
+
+enum hwc2_stats_latency_t {
+    HWC2_STATS_VALIDATE,
+    HWC2_STATS_ACCEPT,
+    HWC2_STATS_PRESENT,
+    /* From the post to the present fence signaling */
+    HWC2_STATS_PRESENT_FENCE,
+    HWC2_STATS_LATENCY_COUNT
+};
+
+enum hwc2_stats_mix_t {
+    /* Every layer is in a window */
+    HWC2_STATS_MIX_DEVICE,
+    /* Some layers are in windows, some in the client target */
+    HWC2_STATS_MIX_MIXED,
+    /* Every layer is in the client target */
+    HWC2_STATS_MIX_CLIENT,
+    HWC2_STATS_MIX_COUNT
+};
+
+/* Predicts vsync timestamps from a linear fit of hardware vsyncs, so
+ * hardware vsync events can stay off while the fit holds. It has its own
+ * mutex and is shared by the vsync event thread, the software vsync thread
+ * and the display */
+class hwc2_vsync_model {
+public:
+    hwc2_vsync_model();
+
+    std::string dump() const;
+
+    void reset(nsecs_t nominal_period);
+    void set_enabled(bool enabled);
+    void set_hw_enabled(bool hw_enabled);
+    bool is_hw_enabled() const;
+    bool needs_hw_vsync(nsecs_t now) const;
+
+    bool add_sample(nsecs_t timestamp);
+    bool check_sample(nsecs_t timestamp);
+
+    nsecs_t get_next_vsync(nsecs_t now) const;
+    bool    deliver(nsecs_t timestamp);
+
+    /* Returns the number of times written, or that would be written if
+     * out_times is null */
+    size_t  predict(nsecs_t after, size_t cnt, int64_t *out_times) const;
+
+private:
+    mutable std::mutex model_mutex;
+
+    /* Ring of the most recent hardware vsync timestamps */
+    std::array<nsecs_t, HWC2_VSYNC_SAMPLES> samples;
+    size_t sample_cnt;
+    size_t next_sample;
+
+    /* The period of the active config, and the fitted period and a fitted
+     * vsync time. Predicted vsyncs are reference + n * period */
+    nsecs_t nominal_period;
+    nsecs_t period;
+    nsecs_t reference;
+
+    /* Every sample is within HWC2_VSYNC_MAX_ERROR of the fit */
+    bool locked;
+
+    /* The client wants vsync callbacks, and hardware vsync events are
+     * currently on */
+    bool enabled;
+    bool hw_enabled;
+
+    /* The timestamp of the last vsync callback, from either source */
+    nsecs_t last_delivered;
+
+    /* Times the model locked and lost lock, and the callbacks delivered
+     * from hardware and predicted vsyncs */
+    uint64_t lock_cnt;
+    uint64_t resync_cnt;
+    uint64_t hw_vsync_cnt;
+    uint64_t sw_vsync_cnt;
+
+    void    clear_samples();
+    void    fit();
+    nsecs_t get_error(nsecs_t timestamp) const;
+    nsecs_t get_newest_sample() const;
+    nsecs_t get_next_vsync_locked(nsecs_t after) const;
+};
+
+/* Starts the binary stats dump and is followed by display_cnt records */
+struct hwc2_stats_header {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t record_size;
+    uint32_t display_cnt;
+};
+
+/* One display's record in the binary stats dump. Every field is a plain
+ * integer so the layout only changes with HWC2_STATS_VERSION */
+struct hwc2_stats_data {
+    uint64_t display;
+    uint64_t latency[HWC2_STATS_LATENCY_COUNT][HWC2_STATS_BUCKETS];
+    uint64_t latency_total[HWC2_STATS_LATENCY_COUNT];
+    uint64_t latency_max[HWC2_STATS_LATENCY_COUNT];
+    uint64_t mix[HWC2_STATS_LAYER_COUNTS + 1][HWC2_STATS_MIX_COUNT];
+    uint64_t missed_vsync_cnt;
+    uint64_t unsignaled_fence_cnt;
+};
+
+/* Frame timing counters of a display. Every counter is a relaxed atomic, so
+ * recording never takes a lock and dump can read while the display is busy */
+class hwc2_stats {
+public:
+    hwc2_stats();
+
+    std::string dump() const;
+    void get_data(hwc2_display_t dpy_id, struct hwc2_stats_data *out_data)
+                    const;
+
+    void record_latency(hwc2_stats_latency_t latency, nsecs_t duration);
+    void record_mix(size_t layer_cnt, hwc2_stats_mix_t mix);
+    nsecs_t record_present_fence(int fence, nsecs_t post_time,
+                    nsecs_t vsync_period);
+
+    static size_t get_bucket(nsecs_t duration);
+    static nsecs_t get_signal_time(int fence);
+
+private:
+    std::array<std::array<std::atomic<uint64_t>, HWC2_STATS_BUCKETS>,
+            HWC2_STATS_LATENCY_COUNT> latency;
+
+    /* Sum and maximum of each latency in nanoseconds */
+    std::array<std::atomic<uint64_t>, HWC2_STATS_LATENCY_COUNT> latency_total;
+    std::array<std::atomic<uint64_t>, HWC2_STATS_LATENCY_COUNT> latency_max;
+
+    /* Posted frames by layer count and composition mix */
+    std::array<std::array<std::atomic<uint64_t>, HWC2_STATS_MIX_COUNT>,
+            HWC2_STATS_LAYER_COUNTS + 1> mix;
+
+    /* Vsyncs that passed between a post and its flip, and present fences
+     * still pending when the next frame was presented */
+    std::atomic<uint64_t> missed_vsync_cnt;
+    std::atomic<uint64_t> unsignaled_fence_cnt;
+};
+
+/* Composes layers into a virtual display's output buffer on the cpu. Sources
+ * are 32 bit rgb pitch linear buffers or solid colors, sampled at the nearest
+ * pixel, and are blended in premultiplied alpha */
+class hwc2_sw_composer {
+public:
+    hwc2_sw_composer();
+
+    std::string dump() const;
+
+    static bool is_supported(const hwc2_layer &lyr);
+
+    /* Both wait for the fences of their inputs and of the output, and have
+     * finished with every buffer when they return */
+    hwc2_error_t compose(const std::vector<const hwc2_layer *> &layers,
+                    buffer_handle_t output, int output_fence, int32_t width,
+                    int32_t height);
+    hwc2_error_t copy(const hwc2_buffer &client_target,
+                    buffer_handle_t output, int output_fence, int32_t width,
+                    int32_t height);
+
+    /* The row kernels of draw(). premultiply_row converts pixels of a blend
+     * mode to premultiplied alpha with the plane alpha applied, and
+     * blend_row draws premultiplied pixels over dst. They use NEON where the
+     * build has it and must match the _scalar versions exactly */
+    static void  premultiply_row(uint32_t *px, size_t cnt,
+                    hwc2_blend_mode_t blend_mode, uint8_t plane_alpha);
+    static void  blend_row(const uint32_t *src, uint32_t *dst, size_t cnt);
+    static void  premultiply_row_scalar(uint32_t *px, size_t cnt,
+                    hwc2_blend_mode_t blend_mode, uint8_t plane_alpha);
+    static void  blend_row_scalar(const uint32_t *src, uint32_t *dst,
+                    size_t cnt);
+
+private:
+    /* What the composer reads of a layer or the client target. handle is
+     * NULL for a solid color */
+    struct hwc2_sw_source {
+        buffer_handle_t   handle;
+        int               acquire_fence;
+        hwc_frect_t       source_crop;
+        hwc_rect_t        display_frame;
+        hwc_transform_t   transform;
+        hwc2_blend_mode_t blend_mode;
+        uint8_t           plane_alpha;
+        hwc_color_t       color;
+    };
+
+    hwc2_error_t lock_output(buffer_handle_t output, int output_fence,
+                    int32_t width, int32_t height);
+    void         unlock_output();
+    void         clear_output();
+    hwc2_error_t draw(const hwc2_sw_source &src);
+    void         get_sample_offsets(const hwc2_sw_source &src,
+                    const hwc_rect_t &clip, uint32_t src_stride);
+
+    static void  get_source(const hwc2_layer &lyr, hwc2_sw_source *out_src);
+
+    /* The gralloc module used to map buffers, NULL if it could not be
+     * loaded */
+    const gralloc_module_t *gralloc_module;
+
+    /* The mapped output buffer and its size, valid between lock_output and
+     * unlock_output. The stride is in pixels */
+    buffer_handle_t output;
+    uint32_t *output_px;
+    uint32_t  output_stride;
+    int32_t   output_width;
+    int32_t   output_height;
+
+    /* Scratch space kept between frames. Pixel x of output row y of a layer
+     * is read from source pixel row_offsets[y] + col_offsets[x], which
+     * covers scaling, flips and rotation alike. row holds one source row
+     * while it is premultiplied */
+    std::vector<int32_t>  col_offsets;
+    std::vector<int32_t>  row_offsets;
+    std::vector<uint32_t> row;
+
+    /* Composed frames and layers, frames that failed, and the time spent
+     * composing */
+    uint64_t frame_cnt;
+    uint64_t layer_cnt;
+    uint64_t failed_cnt;
+    nsecs_t  compose_time;
+};
+
+/* Posts the flips of one physical display on its own thread, so a slow flip
+ * ioctl on one adf device does not hold up presents to the others. A queued
+ * post gets a fence on the worker's sw_sync timeline, which signals once the
+ * post's own present fence has */
+class hwc2_post_worker {
+public:
+    hwc2_post_worker(hwc2_display_t id);
+    ~hwc2_post_worker();
+
+    std::string dump() const;
+
+    /* Returns false, and the display posts synchronously, if async posts are
+     * disabled or there is no sw_sync timeline */
+    bool start(struct adf_device *adf_dev, size_t flip_args_size);
+    void stop();
+    bool is_running() const { return worker_thread.joinable(); }
+
+    /* Takes over the buffer fds, which must already be held with
+     * hold_posted_dma_buf, and dups the acquire fences. A queued post that
+     * has not been started is replaced, so this never waits for the worker.
+     * Returns the placeholder present fence or -1 */
+    int  queue_post(const struct tegra_adf_flip *flip_args,
+                    const struct adf_buffer_config *adf_bufs, size_t buf_cnt);
+
+    /* Waits until every queued post has been posted */
+    void flush();
+
+    /* Whether a post failed since the last call */
+    bool take_failed();
+
+    /* The present fence of the newest post, or -1 if it was already taken */
+    int  take_present_fence(nsecs_t *out_post_time);
+
+private:
+    struct hwc2_post_job {
+        struct tegra_adf_flip *flip_args;
+        std::array<struct adf_buffer_config, HWC2_WINDOW_COUNT> adf_bufs;
+        size_t buf_cnt;
+
+        /* Timeline points to signal once posted, more than one if it
+         * replaced a queued post */
+        uint32_t points;
+    };
+
+    void release_job(hwc2_post_job &job);
+    void post_loop();
+
+    hwc2_display_t id;
+    struct adf_device *adf_dev;
+    size_t flip_args_size;
+
+    /* Guards everything below up to the counters. post_cond is notified
+     * when a post is queued, finished or the worker should exit */
+    mutable std::mutex post_mutex;
+    std::condition_variable post_cond;
+    std::array<hwc2_post_job, HWC2_POST_QUEUE_SIZE> jobs;
+    size_t job_head;
+    size_t job_cnt;
+    bool   posting;
+    bool   post_exit;
+
+    /* Placeholder present fences are points on this timeline */
+    android::base::unique_fd timeline;
+    uint32_t queued_point;
+
+    /* Points of failed posts, signaled with the next successful post */
+    uint32_t unsignaled_points;
+
+    /* The buffer fds of the last successful post, held until the next one
+     * replaces them on screen */
+    std::array<int, HWC2_WINDOW_COUNT> posted_fds;
+    size_t posted_cnt;
+
+    /* The present fence of the last successful post and when it was
+     * posted */
+    android::base::unique_fd present_fence;
+    nsecs_t present_time;
+    bool    failed;
+
+    /* Posts made, failed and replaced before they were posted, and the time
+     * spent in the flip ioctl */
+    uint64_t post_cnt;
+    uint64_t failed_cnt;
+    uint64_t replaced_cnt;
+    nsecs_t  post_time;
+
+    std::thread worker_thread;
+};
+
+/* Converts a color matrix to the cmu csc that applies it ahead of the csc
+ * the kernel programmed, which holds the panel calibration. Fails if the
+ * matrix has offsets or a coefficient of the product is out of range */
+bool hwc2_get_cmu_csc(const std::array<float, 16> &matrix,
+        const std::array<uint16_t, 9> &default_csc,
+        std::array<uint16_t, 9> *out_csc);
+
 class hwc2_display {
 public:
     hwc2_display(hwc2_display_t id, int adf_intf_fd,
@@ -410,6 +1279,9 @@ public:
 
     std::string dump() const;
 
+    /* Serializes every call into the display, including its layers */
+    std::mutex &get_state_mutex() const { return state_mutex; }
+
     /* Display functions */
     hwc2_display_t      get_id() const { return id; }
     hwc2_display_type_t get_type() const { return type; }
@@ -417,6 +1289,7 @@ public:
     hwc2_vsync_t        get_vsync_enabled() const { return vsync_enabled; }
     hwc2_error_t        get_name(uint32_t *out_size, char *out_name) const;
     void                init_name();
+    void                init_window_caps();
 
     hwc2_error_t set_connection(hwc2_connection_t connection);
     hwc2_error_t set_vsync_enabled(hwc2_vsync_t enabled);
@@ -430,6 +1303,11 @@ public:
                     uint32_t *out_num_requests);
     void         force_client_composition();
     void         assign_composition();
+    bool         is_window_composition(const hwc2_layer &lyr) const;
+    bool         is_inside_display(const hwc_rect_t &rect) const;
+    void         order_layers();
+    void         cull_layers();
+    static uint64_t get_client_cost(const hwc2_layer &lyr);
 
     hwc2_error_t get_changed_composition_types(uint32_t *out_num_elements,
                     hwc2_layer_t *out_layers, hwc2_composition_t *out_types)
@@ -440,20 +1318,51 @@ public:
                     hwc2_layer_request_t *out_layer_requests) const;
     hwc2_error_t accept_display_changes();
 
+    /* On a physical display with a post worker the present and release
+     * fences returned are placeholders that signal once the flip is on
+     * screen. If a frame is presented while the one before it is still
+     * queued behind a slow flip, the queued frame is never shown: the newer
+     * one replaces it, and the fences of both signal when the newer one is
+     * on screen. Replacements are counted in the dump */
     hwc2_error_t present_display(int32_t *out_present_fence);
     hwc2_error_t prepare_present_display();
+    bool         is_same_post(size_t buf_cnt) const;
+    int          post(size_t buf_cnt, int *out_present_fence);
+    void         hold_posted_dma_bufs(size_t buf_cnt);
     void         close_acquire_fences();
+    void         merge_acquire_fences();
+    void         count_present();
 
     hwc2_error_t get_release_fences(uint32_t *out_num_elements,
                     hwc2_layer_t *out_layers, int32_t *out_fences) const;
+    void         update_released_layers();
+
+    /* Virtual display functions */
+    hwc2_error_t connect_virtual(uint32_t width, uint32_t height);
+    void         disconnect_virtual();
+    hwc2_error_t set_output_buffer(buffer_handle_t buffer,
+                    int32_t release_fence);
+    void         assign_sw_composition();
+    hwc2_error_t present_virtual_display(int32_t *out_present_fence);
+
+    /* Idle functions */
+    void         set_idle_frames(int32_t idle_frames);
+    nsecs_t      get_idle_deadline() const;
+    void         enter_idle();
+    void         exit_idle();
 
     /* Window functions */
     void init_windows();
     void clear_windows();
     hwc2_error_t assign_client_target_window(uint32_t z_order);
-    hwc2_error_t assign_layer_window(uint32_t z_order, hwc2_layer_t lyr_id);
+    bool         assign_windows(const std::vector<const hwc2_layer *> &slots,
+                    size_t slot_idx);
+    bool         assign_client_holes(size_t begin, size_t end);
+    void         get_slots(size_t begin, size_t end);
+    bool         is_over_budget(uint64_t bandwidth) const;
 
     hwc2_error_t  decompress_window_buffers();
+    bool          holds_window(hwc2_layer_t lyr_id) const;
 
     /* Config functions */
     int          retrieve_display_configs(struct adf_hwc_helper *adf_helper);
@@ -475,6 +1384,26 @@ public:
                     float *out_min_luminance) const;
     hwc2_error_t set_color_transform(const float *color_matrix,
                     android_color_transform_t color_hint);
+    void         init_cmu(uint32_t dc_idx);
+    void         update_cmu();
+
+    /* Vsync model functions */
+    hwc2_vsync_model &get_vsync_model() { return vsync_model; }
+    void         reset_vsync_model();
+
+    /* Stats functions */
+    hwc2_stats  &get_stats() { return stats; }
+    const hwc2_stats &get_stats() const { return stats; }
+    void         sample_present_fence();
+    void         record_mix();
+
+    /* Bandwidth functions */
+    uint64_t     get_predicted_bandwidth() const { return plan_bandwidth; }
+    bool         set_bandwidth_budget(uint64_t avail_bw);
+    uint64_t     get_windows_bandwidth() const;
+    void         get_bandwidth_mode(int32_t *out_height,
+                    int32_t *out_vsync_period) const;
+    void         propose_bandwidth(size_t buf_cnt);
 
     /* Client target functions */
     hwc2_error_t get_client_target_support(uint32_t width, uint32_t height,
@@ -512,11 +1441,43 @@ public:
     hwc2_error_t set_layer_color(hwc2_layer_t lyr_id, const hwc_color_t &color);
     hwc2_error_t set_cursor_position(hwc2_layer_t lyr_id, int32_t x, int32_t y);
 
+    hwc2_error_t set_layer_commands(uint32_t num_words,
+                    const uint32_t *commands, uint32_t *out_error_offset);
+
     static hwc2_display_t get_next_id();
 
     static void reset_ids() { display_cnt = 0; }
 
 private:
+    /* Set layer functions after the layer has been looked up. The per
+     * function entry points and the layer commands share them */
+    hwc2_layer  *find_layer(hwc2_layer_t lyr_id);
+    hwc2_error_t set_layer_composition_type(hwc2_layer &lyr,
+                    hwc2_composition_t comp_type);
+    hwc2_error_t set_layer_buffer(hwc2_layer &lyr, buffer_handle_t handle,
+                    int32_t acquire_fence);
+    hwc2_error_t set_layer_dataspace(hwc2_layer &lyr,
+                    android_dataspace_t dataspace);
+    hwc2_error_t set_layer_display_frame(hwc2_layer &lyr,
+                    const hwc_rect_t &display_frame);
+    hwc2_error_t set_layer_source_crop(hwc2_layer &lyr,
+                    const hwc_frect_t &source_crop);
+    hwc2_error_t set_layer_z_order(hwc2_layer &lyr, uint32_t z_order);
+    hwc2_error_t set_layer_blend_mode(hwc2_layer &lyr,
+                    hwc2_blend_mode_t blend_mode);
+    hwc2_error_t set_layer_plane_alpha(hwc2_layer &lyr, float plane_alpha);
+    hwc2_error_t set_layer_transform(hwc2_layer &lyr,
+                    hwc_transform_t transform);
+    hwc2_error_t set_layer_visible_region(hwc2_layer &lyr,
+                    const hwc_region_t &visible_region);
+    hwc2_error_t set_layer_color(hwc2_layer &lyr, const hwc_color_t &color);
+    hwc2_error_t set_cursor_position(hwc2_layer &lyr, int32_t x, int32_t y);
+    hwc2_error_t set_layer_command(hwc2_layer &lyr, uint32_t command,
+                    uint32_t length, const uint32_t *args);
+
+    /* Held by hwc2_dev around each call into the display */
+    mutable std::mutex state_mutex;
+
     /* Identifies the display to the client */
     hwc2_display_t id;
 
@@ -542,10 +1503,21 @@ private:
         valid = 2,
     } display_state;
 
+    /* validate_display has been called since the last present_display. When
+     * it has not, present relies on display_state alone to skip validation */
+    bool validated;
+
     /* The last call to validate determined that the client target buffer is
      * necessary */
     bool client_target_used;
 
+    /* The display controller can flip cursor layers in a window on their own.
+     * Without cursor mode cursor layers are composed by the client */
+    bool cursor_mode;
+
+    /* What the display windows can scan out */
+    hwc2_window_caps window_caps;
+
     /* The display windows */
     std::array<hwc2_window, HWC2_WINDOW_COUNT> windows;
 
@@ -553,14 +1525,57 @@ private:
     hwc2_buffer client_target;
 
     /* The layers currently in use */
-    std::unordered_map<hwc2_layer_t, hwc2_layer> layers;
+    hwc2_layer_map layers;
+
+    /* The layers ordered from back to front and the signature of their
+     * composition relevant properties. Both are rebuilt on every
+     * assign_composition */
+    std::vector<const hwc2_layer *> ordered_layers;
+    std::vector<uint32_t> plan_signature;
+
+    /* For each ordered layer, whether the part of its display frame outside
+     * its visible region is covered by opaque layers above it. The display
+     * controller blends windows in z order, so such a layer can be scanned
+     * out as is. Otherwise the client has to compose it */
+    std::vector<bool> overlap_covered;
+
+    /* Scratch regions for cull_layers: the area covered by opaque layers
+     * above the current layer, and the current layer's frame and visible
+     * region */
+    hwc2_region opaque_region;
+    hwc2_region frame_region;
+    hwc2_region visible_region;
+
+    /* Recently computed composition plans */
+    hwc2_plan_cache plan_cache;
+
+    /* Scratch space for assign_composition. It is kept between frames so
+     * validating the same number of layers does not allocate */
+    std::vector<uint64_t> client_cost;
+    std::vector<const hwc2_layer *> slots;
+
+    /* The ordered layers inside the client range that get a window below the
+     * client target instead, and the candidates tried for it */
+    std::vector<bool> client_holes;
+    std::vector<size_t> hole_candidates;
+
+    /* Prefix sums of the memory bandwidth of scanning out each ordered layer
+     * from a window, and the bandwidth of the client target, in KB/s. Like
+     * client_cost they are kept between frames */
+    std::vector<uint64_t> layer_bandwidth;
+    uint64_t client_target_bandwidth;
 
     /* Is vsync enabled */
     hwc2_vsync_t vsync_enabled;
 
     /* The layers that need a composition change. The list is populated during
      * validate_display. */
-    std::unordered_map<hwc2_layer_t, hwc2_composition_t> changed_comp_types;
+    std::vector<std::pair<hwc2_layer_t, hwc2_composition_t>> changed_comp_types;
+
+    /* The layers the client should clear from its target, populated during
+     * validate_display. Each one is scanned out in a window under the
+     * client target, which must be transparent over it */
+    std::vector<std::pair<hwc2_layer_t, hwc2_layer_request_t>> layer_requests;
 
     /* All the valid configurations for the display */
     std::unordered_map<hwc2_config_t, hwc2_config> configs;
@@ -578,21 +1593,229 @@ private:
      * HAL_COLOR_TRANSFORM_ARBITRARY */
     android_color_transform_t color_hint;
 
+    /* The display controller node and the color management unit state read
+     * back from it at open. cmu is NULL when the color transform can only be
+     * applied by the client */
+    int dc_fd;
+    struct tegra_dc_ext_cmu *cmu;
+
+    /* The cmu csc the kernel programmed. It is used as is whenever the cmu
+     * is not applying the color transform */
+    std::array<uint16_t, 9> default_csc;
+
+    /* The color matrix followed by default_csc, in cmu coefficients. Only
+     * valid if cmu_transform is set, meaning the matrix has no offsets and
+     * every coefficient fits */
+    std::array<uint16_t, 9> transform_csc;
+    bool cmu_transform;
+
+    /* The memory bandwidth the display controller can use for this display
+     * in KB/s, as last renegotiated by the kernel. 0 until the first
+     * renegotiation, which leaves plans unlimited */
+    uint64_t bandwidth_budget;
+
+    /* The predicted bandwidth of the current plan in KB/s, and the highest
+     * bandwidth proposed to the kernel since it last went down */
+    uint64_t plan_bandwidth;
+    uint64_t proposed_bandwidth;
+
+    /* Predicts vsyncs while hardware vsync events are off */
+    hwc2_vsync_model vsync_model;
+
+    /* Frame timing counters. present_fence_pending is set from a post until
+     * its present fence is sampled */
+    hwc2_stats stats;
+    bool present_fence_pending;
+
+    /* Preallocated argument of TEGRA_ADF_SET_PROPOSED_BW */
+    struct tegra_adf_proposed_bw *proposed_bw;
+    size_t proposed_bw_size;
+
+    /* Validated frames whose plan was cut back to fit the bandwidth budget,
+     * and budget renegotiations */
+    uint64_t over_budget_cnt;
+    uint64_t renegotiate_cnt;
+
     /* Sync fence object which will be signaled after the device has finished
      * reading from the buffer presented in the prior frame */
     android::base::unique_fd release_fence;
 
+    /* The layer and buffer on each window of the last successful post, and
+     * scratch space used to build the same list for the next post */
+    std::vector<std::pair<hwc2_layer_t, buffer_handle_t>> scanned_out;
+    std::vector<std::pair<hwc2_layer_t, buffer_handle_t>> scanning_out;
+
+    /* The layers whose previous buffer is released by the last post */
+    std::vector<hwc2_layer_t> released_layers;
+
+    /* Composes a virtual display on the cpu into the client's output buffer,
+     * which may be written once output_fence signals */
+    hwc2_sw_composer sw_composer;
+    buffer_handle_t output_buffer;
+    android::base::unique_fd output_fence;
+
     /* The adf interface file descriptor for the display */
     int adf_intf_fd;
 
     /* The adf device associated with the display */
     struct adf_device adf_dev;
 
+    /* Preallocated post arguments. They are rebuilt in place every
+     * present_display so presenting does not allocate */
+    std::array<struct adf_buffer_config, HWC2_WINDOW_COUNT> adf_bufs;
+    struct tegra_adf_flip *flip_args;
+    size_t flip_args_size;
+
+    /* Posts the flips of a physical display unless posts are synchronous */
+    hwc2_post_worker post_worker;
+
+    /* Decompressions started by the buffer setters and the time they took.
+     * That time no longer lands inside present_display */
+    uint64_t early_decompress_cnt;
+    nsecs_t  early_decompress_time;
+
+    /* Decompressions that were still left for present_display and the time
+     * present spent on them */
+    uint64_t late_decompress_cnt;
+    nsecs_t  late_decompress_time;
+
+    /* Vsync periods without a new post after which the display is idle. 0
+     * disables idle detection */
+    int32_t idle_frames;
+
+    /* Idle displays fold every layer into the client target, so the display
+     * controller fetches a single window */
+    enum idle_state_t {
+        /* A post changed the screen within the last idle_frames */
+        awake = 0,
+        /* The display went idle. The next validate_display folds the layers */
+        fold_pending = 1,
+        /* The folded plan has been validated but not presented */
+        folding = 2,
+        /* The folded plan is on screen. The next frame wakes the display */
+        folded = 3,
+    } idle_state;
+
+    /* When the screen last changed, when the display last went idle, and how
+     * often and for how long it was idle */
+    nsecs_t  last_post_time;
+    nsecs_t  idle_start;
+    uint64_t idle_cnt;
+    nsecs_t  idle_time;
+
+    /* The arguments of the last successful post. A present that would post
+     * the same flip with the same buffers is skipped */
+    struct tegra_adf_flip *last_flip_args;
+    std::array<struct adf_buffer_config, HWC2_WINDOW_COUNT> last_adf_bufs;
+    size_t last_buf_cnt;
+    bool   last_post_valid;
+    uint64_t skipped_post_cnt;
+
+    /* Successful presents and how many of them skipped validate_display */
+    uint64_t present_cnt;
+    uint64_t skipped_validate_cnt;
+
+    /* Layers dropped from validated plans because opaque layers above hid
+     * them, the windows that freed, counting only the culled layers a window
+     * could have scanned out, and partially hidden layers that were scanned
+     * out from a window instead of being composed by the client */
+    uint64_t culled_layer_cnt;
+    uint64_t freed_window_cnt;
+    uint64_t overlapped_window_cnt;
+
     /* Keep track to total number of displays so new display ids can be
      * generated */
     static uint64_t display_cnt;
 };
 
+/* One call into hwc2, or one callback out of it. Its data_cnt data words
+ * start at data_pos in the data ring */
+struct hwc2_trace_record {
+    nsecs_t  timestamp;
+    nsecs_t  duration;
+    int32_t  event;
+    int32_t  error;
+    uint64_t display;
+    uint64_t layer;
+    uint32_t arg_cnt;
+    uint32_t data_cnt;
+    uint64_t data_pos;
+    std::array<uint64_t, HWC2_TRACE_ARG_COUNT> args;
+};
+
+/* The header of the binary trace. It is followed by record_cnt records,
+ * oldest first, laid out as on the device. Each record is followed by its
+ * data words */
+struct hwc2_trace_header {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t record_size;
+    uint32_t record_cnt;
+};
+
+/* An opt-in ring of the most recent calls and callbacks with their
+ * arguments. It is sized from the debug.hwc2.trace property when the device
+ * opens and is printed by dumpsys */
+class hwc2_trace {
+public:
+    hwc2_trace();
+
+    std::string dump() const;
+    void dump_file() const;
+
+    bool is_enabled() const { return !records.empty(); }
+
+    void record(int32_t event, nsecs_t timestamp, hwc2_error_t error,
+            uint64_t display, uint64_t layer,
+            std::initializer_list<uint64_t> args);
+    void record(const hwc2_trace_record &rec,
+            const std::vector<uint64_t> &rec_data);
+
+private:
+    /* Copies out the records whose data is still in the data ring. The
+     * data_pos of each is rebased to out_data */
+    void get_records(std::vector<hwc2_trace_record> *out_records,
+            std::vector<uint64_t> *out_data, uint64_t *out_total) const;
+
+    /* Written by any thread and copied out by dumps, both under
+     * records_mutex. The rings are only resized by the constructor, so
+     * is_enabled() needs no lock */
+    mutable std::mutex records_mutex;
+    std::vector<hwc2_trace_record> records;
+    uint64_t next;
+    std::vector<uint64_t> data;
+    uint64_t data_next;
+};
+
+/* Packs two call arguments into one 64 bit trace word */
+uint64_t hwc2_trace_pair(int32_t high, int32_t low);
+
+bool hwc2_trace_is_callback(int32_t event);
+const char *hwc2_trace_get_event_name(int32_t event);
+
+/* Times one traced function call. The arguments are captured on construction
+ * and the record is written by end() once the result is known */
+class hwc2_trace_call {
+public:
+    hwc2_trace_call(hwc2_trace &trace, hwc2_function_descriptor_t function,
+            hwc2_display_t display, hwc2_layer_t layer = 0,
+            std::initializer_list<uint64_t> args = {});
+
+    hwc2_error_t end(hwc2_error_t error,
+            std::initializer_list<uint64_t> results = {});
+
+    /* Append variable-length data to the record. Nothing is kept unless
+     * the trace is enabled */
+    void add_data(uint64_t word);
+    void add_rects(const hwc_rect_t *rects, size_t rect_cnt);
+    void add_buffer(buffer_handle_t buffer);
+
+private:
+    hwc2_trace &trace;
+    hwc2_trace_record rec;
+    std::vector<uint64_t> rec_data;
+};
+
 class hwc2_dev {
 public:
     hwc2_dev();
@@ -600,6 +1823,9 @@ public:
 
     std::string dump() const;
     void dump_hwc2(uint32_t *out_size, char *out_buffer);
+    void dump_stats() const;
+
+    hwc2_trace &get_trace() { return trace; }
 
     /* Display functions */
     hwc2_error_t get_display_name(hwc2_display_t dpy_id, uint32_t *out_size,
@@ -700,12 +1926,17 @@ public:
                     const hwc_color_t &color);
     hwc2_error_t set_cursor_position(hwc2_display_t dpy_id, hwc2_layer_t lyr_id,
                     int32_t x, int32_t y);
+    hwc2_error_t set_layer_commands(hwc2_display_t dpy_id, uint32_t num_words,
+                    const uint32_t *commands, uint32_t *out_error_offset);
 
     /* Callback functions */
     void hotplug(hwc2_display_t dpy_id, hwc2_connection_t connection);
     void vsync(hwc2_display_t dpy_id, uint64_t timestamp);
+    void renegotiate_bandwidth(hwc2_display_t dpy_id, uint64_t avail_bw);
 
     hwc2_error_t set_vsync_enabled(hwc2_display_t dpy_id, hwc2_vsync_t enabled);
+    hwc2_error_t get_predicted_present_times(hwc2_display_t dpy_id,
+                    uint32_t *out_count, int64_t *out_times);
 
     hwc2_error_t register_callback(hwc2_callback_descriptor_t descriptor,
                     hwc2_callback_data_t callback_data,
@@ -714,13 +1945,18 @@ public:
     int open_adf_device();
 
 private:
-    /* The mutex is used to protect changing the connection and power mode */
+    /* Protects dump_str and opening the device. Display state is guarded by
+     * each display's own mutex */
     std::mutex state_mutex;
 
     /* General callback functions for all displays */
     hwc2_callback callback_handler;
 
-    /* The physical and virtual displays associated with this device */
+    /* Records calls and callbacks when debug.hwc2.trace is set */
+    hwc2_trace trace;
+
+    /* The physical and virtual displays associated with this device. The map
+     * is only modified while opening the device, so lookups take no lock */
     std::unordered_map<hwc2_display_t, hwc2_display> displays;
 
     /* String containing the dump output between calls */
@@ -729,7 +1965,35 @@ private:
     /* The associated adf hardware composer helper */
     struct adf_hwc_helper *adf_helper;
 
+    /* Sleeps until the earliest idle deadline of the displays, then folds
+     * the idle displays and asks the client to refresh them. idle_waiting is
+     * set while there is no deadline and only a present can wake it */
+    std::thread idle_thread;
+    std::mutex idle_mutex;
+    std::condition_variable idle_cond;
+    bool idle_waiting;
+    bool idle_exit;
+
+    /* Delivers predicted vsyncs while the vsync models are locked, and turns
+     * hardware vsync events on only while a model needs samples. Only runs
+     * if debug.hwc2.soft_vsync is not 0 */
+    std::thread vsync_thread;
+    std::mutex vsync_mutex;
+    std::condition_variable vsync_cond;
+    bool vsync_exit;
+
     int open_adf_display(adf_id_t adf_id);
+    void open_virtual_displays();
+
+    void start_idle_thread();
+    void stop_idle_thread();
+    void wake_idle_thread();
+    void idle_loop();
+
+    void start_vsync_thread();
+    void stop_vsync_thread();
+    void wake_vsync_thread();
+    void vsync_loop();
 };
 
 struct hwc2_context {
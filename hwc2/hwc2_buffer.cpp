@@ -19,6 +19,7 @@
 #include <tegrafb.h>
 #include <tegra_adf.h>
 #include <android-base/macros.h>
+#include <algorithm>
 #include <sstream>
 
 #include "hwc2.h"
@@ -53,8 +54,24 @@ static bool cmp_region(std::vector<hwc_rect_t> &r1, const hwc_region_t &r2)
     return std::equal(r1.begin(), r1.end(), r2.rects);
 }
 
+static bool same_layout(const hwc2_gralloc_metadata &m1,
+        const hwc2_gralloc_metadata &m2)
+{
+    if (m1.format != m2.format || m1.yuv != m2.yuv || m1.stereo != m2.stereo
+            || m1.surf_cnt != m2.surf_cnt)
+        return false;
+
+    for (size_t surf = 0; surf < m1.surf_cnt; surf++)
+        if (m1.surfaces[surf].layout != m2.surfaces[surf].layout)
+            return false;
+
+    return true;
+}
+
 hwc2_buffer::hwc2_buffer()
     : handle(),
+      metadata(),
+      recent_hmems(),
       acquire_fence(-1),
       dataspace(),
       display_frame(),
@@ -65,20 +82,15 @@ hwc2_buffer::hwc2_buffer()
       plane_alpha(1.0),
       transform(),
       visible_region(),
-      previous_format(0),
-      modified(true) { }
-
-hwc2_buffer::~hwc2_buffer()
-{
-    close_acquire_fence();
-}
+      modified(true),
+      decompressed(false) { }
 
 std::string hwc2_buffer::dump() const
 {
     std::stringstream dmp;
 
     dmp << "    Buffer: " << std::hex << handle << "/" << std::dec
-            << acquire_fence << "    Z: " << z_order << "\n";
+            << acquire_fence.get() << "    Z: " << z_order << "\n";
     dmp << "    Display Frame: [" << display_frame.left << ", "
             << display_frame.top << ", " << display_frame.right << ", "
             << display_frame.bottom << "]\n";
@@ -98,12 +110,18 @@ std::string hwc2_buffer::dump() const
 
 hwc2_error_t hwc2_buffer::decompress()
 {
-    int ret = hwc2_gralloc::get_instance().decompress(handle, acquire_fence,
-            &acquire_fence);
+    if (decompressed)
+        return HWC2_ERROR_NONE;
+
+    int fence = acquire_fence.release();
+    int ret = hwc2_gralloc::get_instance().decompress(handle, fence, &fence);
+    acquire_fence.reset(fence);
     if (ret < 0) {
         ALOGE("failed to decompress buffer: %s", strerror(ret));
         return HWC2_ERROR_NO_RESOURCES;
     }
+
+    decompressed = true;
     return HWC2_ERROR_NONE;
 }
 
@@ -135,17 +153,15 @@ hwc2_error_t hwc2_buffer::get_adf_post_props(
 hwc2_error_t hwc2_buffer::get_adf_buf_config(
         struct adf_buffer_config *adf_buf) const
 {
-    const hwc2_gralloc& gralloc = hwc2_gralloc::get_instance();
+    const hwc2_gralloc_surface *surf = metadata.surfaces.data();
+    size_t surf_cnt = metadata.surf_cnt;
 
     adf_buf->overlay_engine = 0;
     adf_buf->w = (uint32_t) (ceil(source_crop.right) - ceil(source_crop.left));
     adf_buf->h = (uint32_t) (ceil(source_crop.bottom) - ceil(source_crop.top));
-    adf_buf->format = gralloc.get_format(handle);
+    adf_buf->format = metadata.format;
 
-    const void *surf;
-    size_t surf_cnt;
-    gralloc.get_surfaces(handle, &surf, &surf_cnt);
-    if (!surf || surf_cnt == 0) {
+    if (surf_cnt == 0) {
         ALOGE("failed to get surfaces");
         return HWC2_ERROR_NO_RESOURCES;
     }
@@ -153,7 +169,7 @@ hwc2_error_t hwc2_buffer::get_adf_buf_config(
     adf_buf->n_planes = surf_cnt;
 
     int fd;
-    gralloc.get_dma_buf(surf, 0, &fd);
+    hwc2_gralloc::get_instance().get_dma_buf(surf[0].hmem, &fd);
     for (size_t idx = 0; idx < arraysize(adf_buf->fd); idx++) {
         if (idx < adf_buf->n_planes)
             adf_buf->fd[idx] = fd;
@@ -161,8 +177,8 @@ hwc2_error_t hwc2_buffer::get_adf_buf_config(
             adf_buf->fd[idx] = -1;
     }
 
-    adf_buf->pitch[0] = gralloc.get_pitch(surf, 0);
-    adf_buf->offset[0] = gralloc.get_offset(surf, 0);
+    adf_buf->pitch[0] = surf[0].pitch;
+    adf_buf->offset[0] = surf[0].offset;
 
     if (surf_cnt == 1) {
         adf_buf->pitch[1] = 0;
@@ -172,16 +188,16 @@ hwc2_error_t hwc2_buffer::get_adf_buf_config(
     } else {
         switch (surf_cnt) {
         case 2:
-            adf_buf->pitch[1] = gralloc.get_pitch(surf, 1);
-            adf_buf->pitch[2] = gralloc.get_pitch(surf, 1);
-            adf_buf->offset[1] = gralloc.get_offset(surf, 1);
+            adf_buf->pitch[1] = surf[1].pitch;
+            adf_buf->pitch[2] = surf[1].pitch;
+            adf_buf->offset[1] = surf[1].offset;
             adf_buf->offset[2] = 0;
             break;
         case 3:
-            adf_buf->pitch[1] = gralloc.get_pitch(surf, 1);
-            adf_buf->pitch[2] = gralloc.get_pitch(surf, 1);
-            adf_buf->offset[1] = gralloc.get_offset(surf, 1);
-            adf_buf->offset[2] = gralloc.get_offset(surf, 2);
+            adf_buf->pitch[1] = surf[1].pitch;
+            adf_buf->pitch[2] = surf[1].pitch;
+            adf_buf->offset[1] = surf[1].offset;
+            adf_buf->offset[2] = surf[2].offset;
             break;
         default:
             LOG_ALWAYS_FATAL("Invalid surface count. There must be between 1 to"
@@ -190,7 +206,7 @@ hwc2_error_t hwc2_buffer::get_adf_buf_config(
         }
     }
 
-    adf_buf->acquire_fence = acquire_fence;
+    adf_buf->acquire_fence = acquire_fence.get();
 
     return HWC2_ERROR_NONE;
 }
@@ -199,10 +215,7 @@ hwc2_error_t hwc2_buffer::get_adf_win_attr(
         struct tegra_adf_flip_windowattr *win_attr, size_t win_idx,
         size_t buf_idx, uint32_t z_order) const
 {
-    const hwc2_gralloc& gralloc = hwc2_gralloc::get_instance();
-    const void *surf;
-    size_t surf_cnt;
-    uint32_t layout;
+    int32_t layout;
 
     win_attr->win_index = win_idx;
     win_attr->buf_index = buf_idx;
@@ -231,19 +244,18 @@ hwc2_error_t hwc2_buffer::get_adf_win_attr(
     win_attr->z = z_order;
     win_attr->flags = 0;
 
-    gralloc.get_surfaces(handle, &surf, &surf_cnt);
-    if (!surf || surf_cnt == 0) {
+    if (metadata.surf_cnt == 0) {
         ALOGE("failed to get surfaces");
         return HWC2_ERROR_NO_RESOURCES;
     }
 
-    layout = gralloc.get_layout(surf, 0);
+    layout = metadata.surfaces[0].layout;
     if (layout == HWC2_WINDOW_CAP_TILED)
         win_attr->flags |= TEGRA_FB_WIN_FLAG_TILED;
 
     if (layout == HWC2_WINDOW_CAP_BLOCK_LINEAR) {
         win_attr->flags |= TEGRA_DC_EXT_FLIP_FLAG_BLOCKLINEAR;
-        win_attr->block_height_log2 = gralloc.get_block_height_log2(surf, 0);
+        win_attr->block_height_log2 = metadata.surfaces[0].block_height_log2;
     }
 
     win_attr->flags |= TEGRA_DC_EXT_FLIP_FLAG_GLOBAL_ALPHA;
@@ -263,34 +275,53 @@ hwc2_error_t hwc2_buffer::get_adf_win_attr(
     return HWC2_ERROR_NONE;
 }
 
-void hwc2_buffer::close_acquire_fence()
+void hwc2_buffer::move_display_frame(int32_t x, int32_t y)
 {
-    if (acquire_fence >= 0) {
-        close(acquire_fence);
-        acquire_fence = -1;
+    int32_t dx = x - display_frame.left;
+    int32_t dy = y - display_frame.top;
+
+    display_frame.left += dx;
+    display_frame.top += dy;
+    display_frame.right += dx;
+    display_frame.bottom += dy;
+
+    for (auto &rect: visible_region) {
+        rect.left += dx;
+        rect.top += dy;
+        rect.right += dx;
+        rect.bottom += dy;
     }
 }
 
-uint32_t hwc2_buffer::get_adf_buffer_format() const
+void hwc2_buffer::close_acquire_fence()
 {
-    if (!handle)
-        return 0;
+    acquire_fence.reset();
+}
+
+bool hwc2_buffer::is_damaged() const
+{
+    /* No rects at all means the whole buffer is damaged */
+    if (surface_damage.empty())
+        return true;
+
+    for (auto &rect: surface_damage)
+        if (rect.left < rect.right && rect.top < rect.bottom)
+            return true;
 
-    return hwc2_gralloc::get_instance().get_format(handle);
+    return false;
 }
 
-uint32_t hwc2_buffer::get_layout() const
+uint32_t hwc2_buffer::get_adf_buffer_format() const
 {
-    const hwc2_gralloc &gralloc = hwc2_gralloc::get_instance();
-    const void *surf;
-    size_t surf_cnt;
+    return metadata.format;
+}
 
-    if (!handle)
+uint32_t hwc2_buffer::get_layout() const
+{
+    if (metadata.surf_cnt == 0)
         return 0;
 
-    gralloc.get_surfaces(handle, &surf, &surf_cnt);
-
-    return gralloc.get_layout(surf, 0);
+    return metadata.surfaces[0].layout;
 }
 
 int hwc2_buffer::get_display_frame_width() const
@@ -331,14 +362,6 @@ float hwc2_buffer::get_scale_height() const
     return get_display_frame_height() / source_crop_height;
 }
 
-void hwc2_buffer::get_surfaces(const void **surf, size_t *surf_cnt) const
-{
-    if (!handle)
-        *surf_cnt = 0;
-    else
-        hwc2_gralloc::get_instance().get_surfaces(handle, surf, surf_cnt);
-}
-
 bool hwc2_buffer::is_source_crop_int_aligned() const
 {
     return (source_crop.left == ceil(source_crop.left)
@@ -347,22 +370,6 @@ bool hwc2_buffer::is_source_crop_int_aligned() const
             && source_crop.bottom == ceil(source_crop.bottom));
 }
 
-bool hwc2_buffer::is_stereo() const
-{
-    if (!handle)
-        return false;
-
-    return hwc2_gralloc::get_instance().is_stereo(handle);
-}
-
-bool hwc2_buffer::is_yuv() const
-{
-    if (!handle)
-        return false;
-
-    return hwc2_gralloc::get_instance().is_yuv(handle);
-}
-
 bool hwc2_buffer::is_overlapped() const
 {
     if (visible_region.size() != 1)
@@ -377,29 +384,162 @@ bool hwc2_buffer::is_overlapped() const
     return false;
 }
 
+bool hwc2_buffer::is_opaque() const
+{
+    return blend_mode == HWC2_BLEND_MODE_NONE && plane_alpha == 1.0;
+}
+
+static uint32_t get_bits_per_pixel(uint32_t format)
+{
+    switch (format) {
+    case DRM_FORMAT_YUV420:
+    case DRM_FORMAT_YVU420:
+    case DRM_FORMAT_NV12:
+    case DRM_FORMAT_NV21:
+        return 12;
+    case DRM_FORMAT_YUV422:
+    case DRM_FORMAT_NV16:
+    case DRM_FORMAT_UYVY:
+    case DRM_FORMAT_YUYV:
+    case DRM_FORMAT_RGB565:
+    case DRM_FORMAT_BGR565:
+        return 16;
+    case DRM_FORMAT_RGB888:
+    case DRM_FORMAT_BGR888:
+        return 24;
+    default:
+        return 32;
+    }
+}
+
+uint64_t hwc2_buffer::get_bandwidth(int32_t display_height,
+        int32_t vsync_period) const
+{
+    int32_t frame_height = get_display_frame_height();
+    if (frame_height <= 0 || display_height <= 0 || vsync_period <= 0)
+        return 0;
+
+    uint64_t frame_bytes = static_cast<uint64_t>(get_source_crop_width())
+            * static_cast<uint64_t>(get_source_crop_height())
+            * get_bits_per_pixel(metadata.format) / 8;
+
+    /* The window fetches its whole source crop while the display scans out
+     * the rows the window covers. A vertically downscaled window fetches
+     * several source rows per output line, so its peak rate is above the
+     * frame average by the same factor */
+    uint64_t bandwidth = frame_bytes * display_height / frame_height;
+
+    if (transform & HWC_TRANSFORM_ROT_90)
+        bandwidth += bandwidth * HWC2_BANDWIDTH_ROTATE_PERCENT / 100;
+
+    /* Refresh rate in mHz keeps the math in integers, the result is KB/s */
+    uint64_t refresh_mhz = 1000000000000ULL / vsync_period;
+    return bandwidth * refresh_mhz / 1000000;
+}
+
+static uint32_t float_bits(float value)
+{
+    uint32_t bits;
+    memcpy(&bits, &value, sizeof(bits));
+    return bits;
+}
+
+void hwc2_buffer::get_signature(std::vector<uint32_t> *signature) const
+{
+    signature->push_back(z_order);
+    signature->push_back(metadata.format);
+    signature->push_back(get_layout());
+    signature->push_back(metadata.surf_cnt);
+    signature->push_back(metadata.yuv | metadata.stereo << 1);
+    signature->push_back(transform);
+    signature->push_back(float_bits(source_crop.left));
+    signature->push_back(float_bits(source_crop.top));
+    signature->push_back(float_bits(source_crop.right));
+    signature->push_back(float_bits(source_crop.bottom));
+    signature->push_back(display_frame.left);
+    signature->push_back(display_frame.top);
+    signature->push_back(display_frame.right);
+    signature->push_back(display_frame.bottom);
+    signature->push_back(blend_mode);
+    signature->push_back(float_bits(plane_alpha));
+
+    signature->push_back(visible_region.size());
+    for (auto &rect: visible_region) {
+        signature->push_back(rect.left);
+        signature->push_back(rect.top);
+        signature->push_back(rect.right);
+        signature->push_back(rect.bottom);
+    }
+}
+
 hwc2_error_t hwc2_buffer::set_buffer(buffer_handle_t handle,
         int32_t acquire_fence)
 {
     /* Only check if non-null buffers are valid. Layer buffers are determined to
      * be non-null in hwc2_layer. Client target buffers can be null and should
      * not produce an error. */
-    if (handle && !hwc2_gralloc::get_instance().is_valid(handle)) {
+    const hwc2_gralloc &gralloc = hwc2_gralloc::get_instance();
+
+    if (handle && !gralloc.is_valid(handle)) {
         ALOGE("invalid buffer handle");
         return HWC2_ERROR_BAD_PARAMETER;
     }
 
-    close_acquire_fence();
-
     this->handle = handle;
-    this->acquire_fence = acquire_fence;
+    this->acquire_fence.reset(acquire_fence);
+    decompressed = false;
+
+    hwc2_gralloc_metadata previous = metadata;
 
-    uint32_t format = get_adf_buffer_format();
-    modified = modified || format != previous_format;
-    previous_format = format;
+    if (!handle || !gralloc.get_metadata(handle, &metadata))
+        metadata = hwc2_gralloc_metadata();
+    else
+        hold_recent_dma_buf();
+
+    /* A new buffer with the same layout as the previous one can be scanned
+     * out by the same window, so only a layout change forces validation */
+    modified = modified || !same_layout(previous, metadata);
 
     return HWC2_ERROR_NONE;
 }
 
+/* Keeps the fd of the new buffer open for as long as it is one of the last
+ * HWC2_BUFFER_HISTORY_SIZE buffers set. The fd of the buffer it pushes out is
+ * released, which closes it unless a display still scans it out */
+void hwc2_buffer::hold_recent_dma_buf()
+{
+    uint32_t hmem = metadata.surfaces[0].hmem;
+    if (metadata.surf_cnt == 0 || hmem == 0)
+        return;
+
+    auto it = std::find(recent_hmems.begin(), recent_hmems.end(), hmem);
+    if (it != recent_hmems.end()) {
+        std::rotate(recent_hmems.begin(), it, it + 1);
+        return;
+    }
+
+    const hwc2_gralloc &gralloc = hwc2_gralloc::get_instance();
+    gralloc.hold_dma_buf(hmem);
+
+    if (recent_hmems.back() != 0)
+        gralloc.release_dma_buf(recent_hmems.back());
+
+    std::rotate(recent_hmems.begin(), recent_hmems.end() - 1,
+            recent_hmems.end());
+    recent_hmems.front() = hmem;
+}
+
+void hwc2_buffer::release_dma_bufs()
+{
+    const hwc2_gralloc &gralloc = hwc2_gralloc::get_instance();
+
+    for (auto &hmem: recent_hmems) {
+        if (hmem != 0)
+            gralloc.release_dma_buf(hmem);
+        hmem = 0;
+    }
+}
+
 hwc2_error_t hwc2_buffer::set_dataspace(android_dataspace_t dataspace)
 {
     modified = modified || dataspace != this->dataspace;
@@ -434,9 +574,10 @@ hwc2_error_t hwc2_buffer::set_z_order(uint32_t z_order)
 
 hwc2_error_t hwc2_buffer::set_surface_damage(const hwc_region_t &surface_damage)
 {
-    this->surface_damage.clear();
-    for (size_t idx = 0; idx < surface_damage.numRects; idx++)
-        this->surface_damage.push_back(surface_damage.rects[idx]);
+    /* assign reuses the existing storage, so once the vector has grown to the
+     * usual rect count updating it does not allocate */
+    this->surface_damage.assign(surface_damage.rects,
+            surface_damage.rects + surface_damage.numRects);
 
     return HWC2_ERROR_NONE;
 }
@@ -474,9 +615,8 @@ hwc2_error_t hwc2_buffer::set_visible_region(const hwc_region_t &visible_region)
 {
     modified = modified || !cmp_region(this->visible_region, visible_region);
 
-    this->visible_region.clear();
-    for (size_t idx = 0; idx < visible_region.numRects; idx++)
-        this->visible_region.push_back(visible_region.rects[idx]);
+    this->visible_region.assign(visible_region.rects,
+            visible_region.rects + visible_region.numRects);
 
     return HWC2_ERROR_NONE;
 }
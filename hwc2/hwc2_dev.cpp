@@ -15,12 +15,17 @@
  */
 
 #include <fcntl.h>
+#include <unistd.h>
 #include <cutils/log.h>
+#include <cutils/properties.h>
+#include <tegra_adf.h>
 #include <inttypes.h>
 
 #include <sstream>
 #include <cstdlib>
 #include <vector>
+#include <algorithm>
+#include <chrono>
 
 #include "hwc2.h"
 
@@ -41,10 +46,17 @@ static void hwc2_hotplug(void *data, int dpy_id, bool connected)
             HWC2_CONNECTION_DISCONNECTED);
 }
 
-static void hwc2_custom_event(void* /*data*/, int /*dpy_id*/,
-        struct adf_event* /*event*/)
+static void hwc2_custom_event(void *data, int dpy_id,
+        struct adf_event *event)
 {
-    return;
+    if (event->type != TEGRA_ADF_EVENT_BANDWIDTH_RENEGOTIATE)
+        return;
+
+    hwc2_dev *dev = static_cast<hwc2_dev *>(data);
+    const struct tegra_adf_event_bandwidth *bw =
+            reinterpret_cast<const struct tegra_adf_event_bandwidth *>(event);
+    dev->renegotiate_bandwidth(static_cast<hwc2_display_t>(dpy_id),
+            bw->avail_bw);
 }
 
 const struct adf_hwc_event_callbacks hwc2_adfhwc_callbacks = {
@@ -56,12 +68,25 @@ const struct adf_hwc_event_callbacks hwc2_adfhwc_callbacks = {
 hwc2_dev::hwc2_dev()
     : state_mutex(),
       callback_handler(),
+      trace(),
       displays(),
       dump_str(),
-      adf_helper(nullptr) { }
+      adf_helper(nullptr),
+      idle_thread(),
+      idle_mutex(),
+      idle_cond(),
+      idle_waiting(false),
+      idle_exit(false),
+      vsync_thread(),
+      vsync_mutex(),
+      vsync_cond(),
+      vsync_exit(false) { }
 
 hwc2_dev::~hwc2_dev()
 {
+    stop_idle_thread();
+    stop_vsync_thread();
+
     if (adf_helper)
         adf_hwc_close(adf_helper);
     hwc2_display::reset_ids();
@@ -72,8 +97,14 @@ std::string hwc2_dev::dump() const
     std::stringstream dmp;
 
     dmp << "NVIDIA HWC2:\n";
-    for (auto &dpy: displays)
+    for (auto &dpy: displays) {
+        std::lock_guard<std::mutex> guard(dpy.second.get_state_mutex());
         dmp << dpy.second.dump() << "\n";
+    }
+
+    dmp << hwc2_gralloc::get_instance().dump();
+    dmp << hwc2_fill_cache::get_instance().dump();
+    dmp << trace.dump();
 
     return dmp.str();
 }
@@ -86,6 +117,8 @@ void hwc2_dev::dump_hwc2(uint32_t *out_size, char *out_buffer)
         dump_str.clear();
         dump_str.append(dump());
         *out_size = dump_str.length();
+        dump_stats();
+        trace.dump_file();
         return;
     }
 
@@ -94,89 +127,176 @@ void hwc2_dev::dump_hwc2(uint32_t *out_size, char *out_buffer)
     dump_str.clear();
 }
 
+void hwc2_dev::dump_stats() const
+{
+    /* Tools collecting stats in the field set debug.hwc2.stats_file, run
+     * dumpsys SurfaceFlinger and read back the binary snapshot */
+    char path[PROPERTY_VALUE_MAX];
+    if (property_get("debug.hwc2.stats_file", path, "") <= 0)
+        return;
+
+    struct hwc2_stats_header header;
+    header.magic = HWC2_STATS_MAGIC;
+    header.version = HWC2_STATS_VERSION;
+    header.record_size = sizeof(struct hwc2_stats_data);
+    header.display_cnt = displays.size();
+
+    std::vector<struct hwc2_stats_data> records(displays.size());
+    size_t idx = 0;
+    for (auto &dpy: displays)
+        dpy.second.get_stats().get_data(dpy.first, &records[idx++]);
+
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        ALOGE("failed to open %s: %s", path, strerror(errno));
+        return;
+    }
+
+    size_t size = records.size() * sizeof(records[0]);
+    if (write(fd, &header, sizeof(header)) != sizeof(header)
+            || write(fd, records.data(), size)
+            != static_cast<ssize_t>(size))
+        ALOGE("failed to write %s: %s", path, strerror(errno));
+
+    close(fd);
+}
+
 hwc2_error_t hwc2_dev::get_display_name(hwc2_display_t dpy_id, uint32_t *out_size,
         char *out_name)
 {
-    std::lock_guard<std::mutex> guard(state_mutex);
-
     auto it = displays.find(dpy_id);
     if (it == displays.end()) {
         ALOGE("dpy %" PRIu64 ": invalid display handle", dpy_id);
         return HWC2_ERROR_BAD_DISPLAY;
     }
 
+    std::lock_guard<std::mutex> guard(it->second.get_state_mutex());
+
     return it->second.get_name(out_size, out_name);
 }
 
 hwc2_error_t hwc2_dev::get_display_type(hwc2_display_t dpy_id,
         hwc2_display_type_t *out_type)
 {
-    std::lock_guard<std::mutex> guard(state_mutex);
-
     auto it = displays.find(dpy_id);
     if (it == displays.end()) {
         ALOGE("dpy %" PRIu64 ": invalid display handle", dpy_id);
         return HWC2_ERROR_BAD_DISPLAY;
     }
 
+    std::lock_guard<std::mutex> guard(it->second.get_state_mutex());
+
     *out_type = it->second.get_type();
     return HWC2_ERROR_NONE;
 }
 
 uint32_t hwc2_dev::get_max_virtual_display_count()
 {
-    return 0;
+    return HWC2_VIRTUAL_DISPLAY_COUNT;
 }
 
-hwc2_error_t hwc2_dev::create_virtual_display(uint32_t /*width*/,
-        uint32_t /*height*/, android_pixel_format_t* /*format*/,
-        hwc2_display_t* /*out_display*/)
+hwc2_error_t hwc2_dev::create_virtual_display(uint32_t width,
+        uint32_t height, android_pixel_format_t *format,
+        hwc2_display_t *out_display)
 {
+    if (width == 0 || height == 0 || width > HWC2_VIRTUAL_DISPLAY_MAX_SIZE
+            || height > HWC2_VIRTUAL_DISPLAY_MAX_SIZE) {
+        ALOGE("unsupported virtual display size %ux%u", width, height);
+        return HWC2_ERROR_UNSUPPORTED;
+    }
+
+    /* The cpu composer writes 32 bit rgb. RGBX is kept if asked for, any
+     * other format is replaced */
+    if (*format != HAL_PIXEL_FORMAT_RGBX_8888)
+        *format = HAL_PIXEL_FORMAT_RGBA_8888;
+
+    for (auto &dpy: displays) {
+        if (dpy.second.get_type() != HWC2_DISPLAY_TYPE_VIRTUAL)
+            continue;
+
+        std::lock_guard<std::mutex> guard(dpy.second.get_state_mutex());
+
+        if (dpy.second.get_connection() == HWC2_CONNECTION_CONNECTED)
+            continue;
+
+        hwc2_error_t ret = dpy.second.connect_virtual(width, height);
+        if (ret == HWC2_ERROR_NONE)
+            *out_display = dpy.first;
+        return ret;
+    }
+
+    ALOGE("no virtual display available");
     return HWC2_ERROR_NO_RESOURCES;
 }
 
 hwc2_error_t hwc2_dev::destroy_virtual_display(hwc2_display_t dpy_id)
 {
-    if (displays.find(dpy_id) != displays.end())
+    auto it = displays.find(dpy_id);
+    if (it == displays.end()) {
+        ALOGE("dpy %" PRIu64 ": invalid display handle", dpy_id);
+        return HWC2_ERROR_BAD_DISPLAY;
+    }
+
+    if (it->second.get_type() != HWC2_DISPLAY_TYPE_VIRTUAL) {
+        ALOGE("dpy %" PRIu64 ": not a virtual display", dpy_id);
         return HWC2_ERROR_BAD_PARAMETER;
-    else
+    }
+
+    std::lock_guard<std::mutex> guard(it->second.get_state_mutex());
+
+    if (it->second.get_connection() != HWC2_CONNECTION_CONNECTED) {
+        ALOGE("dpy %" PRIu64 ": virtual display not created", dpy_id);
         return HWC2_ERROR_BAD_DISPLAY;
+    }
+
+    it->second.disconnect_virtual();
+    return HWC2_ERROR_NONE;
 }
 
 hwc2_error_t hwc2_dev::set_output_buffer(hwc2_display_t dpy_id,
-        buffer_handle_t /*buffer*/, int32_t /*release_fence*/)
+        buffer_handle_t buffer, int32_t release_fence)
 {
-    if (displays.find(dpy_id) != displays.end())
-        return HWC2_ERROR_UNSUPPORTED;
-    else
+    auto it = displays.find(dpy_id);
+    if (it == displays.end()) {
+        ALOGE("dpy %" PRIu64 ": invalid display handle", dpy_id);
         return HWC2_ERROR_BAD_DISPLAY;
+    }
+
+    if (it->second.get_type() != HWC2_DISPLAY_TYPE_VIRTUAL) {
+        ALOGE("dpy %" PRIu64 ": not a virtual display", dpy_id);
+        return HWC2_ERROR_UNSUPPORTED;
+    }
+
+    std::lock_guard<std::mutex> guard(it->second.get_state_mutex());
+
+    return it->second.set_output_buffer(buffer, release_fence);
 }
 
 hwc2_error_t hwc2_dev::set_power_mode(hwc2_display_t dpy_id,
         hwc2_power_mode_t mode)
 {
-    std::lock_guard<std::mutex> guard(state_mutex);
-
     auto it = displays.find(dpy_id);
     if (it == displays.end()) {
         ALOGE("dpy %" PRIu64 ": invalid display handle", dpy_id);
         return HWC2_ERROR_BAD_DISPLAY;
     }
 
+    std::lock_guard<std::mutex> guard(it->second.get_state_mutex());
+
     return it->second.set_power_mode(mode);
 }
 
 hwc2_error_t hwc2_dev::get_doze_support(hwc2_display_t dpy_id,
         int32_t *out_support)
 {
-    std::lock_guard<std::mutex> guard(state_mutex);
-
     auto it = displays.find(dpy_id);
     if (it == displays.end()) {
         ALOGE("dpy %" PRIu64 ": invalid display handle", dpy_id);
         return HWC2_ERROR_BAD_DISPLAY;
     }
 
+    std::lock_guard<std::mutex> guard(it->second.get_state_mutex());
+
     return it->second.get_doze_support(out_support);
 }
 
@@ -185,17 +305,22 @@ hwc2_error_t hwc2_dev::validate_display(hwc2_display_t dpy_id,
 {
     ATRACE_BEGIN(__func__);
 
-    std::lock_guard<std::mutex> guard(state_mutex);
-
     auto it = displays.find(dpy_id);
     if (it == displays.end()) {
         ALOGE("dpy %" PRIu64 ": invalid display handle", dpy_id);
+        ATRACE_END();
         return HWC2_ERROR_BAD_DISPLAY;
     }
 
+    nsecs_t start = systemTime(SYSTEM_TIME_MONOTONIC);
+    std::lock_guard<std::mutex> guard(it->second.get_state_mutex());
+
     hwc2_error_t ret = it->second.validate_display(out_num_types,
             out_num_requests);
 
+    it->second.get_stats().record_latency(HWC2_STATS_VALIDATE,
+            systemTime(SYSTEM_TIME_MONOTONIC) - start);
+
     ATRACE_END();
 
     return ret;
@@ -205,14 +330,14 @@ hwc2_error_t hwc2_dev::get_changed_composition_types(hwc2_display_t dpy_id,
         uint32_t *out_num_elements, hwc2_layer_t *out_layers,
         hwc2_composition_t *out_types)
 {
-    std::lock_guard<std::mutex> guard(state_mutex);
-
     auto it = displays.find(dpy_id);
     if (it == displays.end()) {
         ALOGE("dpy %" PRIu64 ": invalid display handle", dpy_id);
         return HWC2_ERROR_BAD_DISPLAY;
     }
 
+    std::lock_guard<std::mutex> guard(it->second.get_state_mutex());
+
     return it->second.get_changed_composition_types(out_num_elements,
             out_layers, out_types);
 }
@@ -222,29 +347,35 @@ hwc2_error_t hwc2_dev::get_display_requests(hwc2_display_t dpy_id,
         uint32_t *out_num_elements, hwc2_layer_t *out_layers,
         hwc2_layer_request_t *out_layer_requests)
 {
-    std::lock_guard<std::mutex> guard(state_mutex);
-
     auto it = displays.find(dpy_id);
     if (it == displays.end()) {
         ALOGE("dpy %" PRIu64 ": invalid display handle", dpy_id);
         return HWC2_ERROR_BAD_DISPLAY;
     }
 
+    std::lock_guard<std::mutex> guard(it->second.get_state_mutex());
+
     return it->second.get_display_requests(out_display_requests,
             out_num_elements, out_layers, out_layer_requests);
 }
 
 hwc2_error_t hwc2_dev::accept_display_changes(hwc2_display_t dpy_id)
 {
-    std::lock_guard<std::mutex> guard(state_mutex);
-
     auto it = displays.find(dpy_id);
     if (it == displays.end()) {
         ALOGE("dpy %" PRIu64 ": invalid display handle", dpy_id);
         return HWC2_ERROR_BAD_DISPLAY;
     }
 
-    return it->second.accept_display_changes();
+    nsecs_t start = systemTime(SYSTEM_TIME_MONOTONIC);
+    std::lock_guard<std::mutex> guard(it->second.get_state_mutex());
+
+    hwc2_error_t ret = it->second.accept_display_changes();
+
+    it->second.get_stats().record_latency(HWC2_STATS_ACCEPT,
+            systemTime(SYSTEM_TIME_MONOTONIC) - start);
+
+    return ret;
 }
 
 hwc2_error_t hwc2_dev::present_display(hwc2_display_t dpy_id,
@@ -252,18 +383,45 @@ hwc2_error_t hwc2_dev::present_display(hwc2_display_t dpy_id,
 {
     ATRACE_BEGIN(__func__);
 
-    std::lock_guard<std::mutex> guard(state_mutex);
-
     auto it = displays.find(dpy_id);
     if (it == displays.end()) {
         ALOGE("dpy %" PRIu64 ": invalid display handle", dpy_id);
+        ATRACE_END();
         return HWC2_ERROR_BAD_DISPLAY;
     }
 
-    hwc2_error_t ret = it->second.present_display(out_present_fence);
+    /* Only this display's mutex is held, so presents to different displays
+     * from different threads overlap. A physical display also hands the
+     * flip to its post worker and returns a placeholder present fence, so
+     * a slow flip ioctl on one adf device never holds up the others. A
+     * frame still queued behind a slow flip is replaced by the next one,
+     * see hwc2_display::present_display */
+    nsecs_t start = systemTime(SYSTEM_TIME_MONOTONIC);
+    hwc2_error_t ret;
+    nsecs_t end;
+    {
+        std::lock_guard<std::mutex> guard(it->second.get_state_mutex());
+
+        ret = it->second.present_display(out_present_fence);
+
+        end = systemTime(SYSTEM_TIME_MONOTONIC);
+        it->second.get_stats().record_latency(HWC2_STATS_PRESENT,
+                end - start);
+    }
 
     ATRACE_END();
 
+    /* The idle thread takes the display locks under idle_mutex, so it is
+     * only woken once the display lock is dropped */
+    if (ret == HWC2_ERROR_NONE)
+        wake_idle_thread();
+
+    /* The present fence may have shown that the vsync model drifted */
+    hwc2_vsync_model &model = it->second.get_vsync_model();
+    if (vsync_thread.joinable()
+            && model.needs_hw_vsync(end) != model.is_hw_enabled())
+        wake_vsync_thread();
+
     return ret;
 }
 
@@ -271,14 +429,14 @@ hwc2_error_t hwc2_dev::get_release_fences(hwc2_display_t dpy_id,
         uint32_t *out_num_elements, hwc2_layer_t *out_layers,
         int32_t *out_fences)
 {
-    std::lock_guard<std::mutex> guard(state_mutex);
-
     auto it = displays.find(dpy_id);
     if (it == displays.end()) {
         ALOGE("dpy %" PRIu64 ": invalid display handle", dpy_id);
         return HWC2_ERROR_BAD_DISPLAY;
     }
 
+    std::lock_guard<std::mutex> guard(it->second.get_state_mutex());
+
     return it->second.get_release_fences(out_num_elements, out_layers,
             out_fences);
 }
@@ -286,84 +444,84 @@ hwc2_error_t hwc2_dev::get_release_fences(hwc2_display_t dpy_id,
 hwc2_error_t hwc2_dev::get_display_attribute(hwc2_display_t dpy_id,
         hwc2_config_t config, hwc2_attribute_t attribute, int32_t *out_value)
 {
-    std::lock_guard<std::mutex> guard(state_mutex);
-
     auto it = displays.find(dpy_id);
     if (it == displays.end()) {
         ALOGE("dpy %" PRIu64 ": invalid display handle", dpy_id);
         return HWC2_ERROR_BAD_DISPLAY;
     }
 
+    std::lock_guard<std::mutex> guard(it->second.get_state_mutex());
+
     return it->second.get_display_attribute(config, attribute, out_value);
 }
 
 hwc2_error_t hwc2_dev::get_display_configs(hwc2_display_t dpy_id,
         uint32_t *out_num_configs, hwc2_config_t *out_configs)
 {
-    std::lock_guard<std::mutex> guard(state_mutex);
-
     auto it = displays.find(dpy_id);
     if (it == displays.end()) {
         ALOGE("dpy %" PRIu64 ": invalid display handle", dpy_id);
         return HWC2_ERROR_BAD_DISPLAY;
     }
 
+    std::lock_guard<std::mutex> guard(it->second.get_state_mutex());
+
     return it->second.get_display_configs(out_num_configs, out_configs);
 }
 
 hwc2_error_t hwc2_dev::get_active_config(hwc2_display_t dpy_id,
         hwc2_config_t *out_config)
 {
-    std::lock_guard<std::mutex> guard(state_mutex);
-
     auto it = displays.find(dpy_id);
     if (it == displays.end()) {
         ALOGE("dpy %" PRIu64 ": invalid display handle", dpy_id);
         return HWC2_ERROR_BAD_DISPLAY;
     }
 
+    std::lock_guard<std::mutex> guard(it->second.get_state_mutex());
+
     return it->second.get_active_config(out_config);
 }
 
 hwc2_error_t hwc2_dev::set_active_config(hwc2_display_t dpy_id,
         hwc2_config_t config)
 {
-    std::lock_guard<std::mutex> guard(state_mutex);
-
     auto it = displays.find(dpy_id);
     if (it == displays.end()) {
         ALOGE("dpy %" PRIu64 ": invalid display handle", dpy_id);
         return HWC2_ERROR_BAD_DISPLAY;
     }
 
+    std::lock_guard<std::mutex> guard(it->second.get_state_mutex());
+
     return it->second.set_active_config(adf_helper, config);
 }
 
 hwc2_error_t hwc2_dev::get_color_modes(hwc2_display_t dpy_id,
         uint32_t *out_num_modes, android_color_mode_t *out_modes)
 {
-    std::lock_guard<std::mutex> guard(state_mutex);
-
     auto it = displays.find(dpy_id);
     if (it == displays.end()) {
         ALOGE("dpy %" PRIu64 ": invalid display handle", dpy_id);
         return HWC2_ERROR_BAD_DISPLAY;
     }
 
+    std::lock_guard<std::mutex> guard(it->second.get_state_mutex());
+
     return it->second.get_color_modes(out_num_modes, out_modes);
 }
 
 hwc2_error_t hwc2_dev::set_color_mode(hwc2_display_t dpy_id,
         android_color_mode_t mode)
 {
-    std::lock_guard<std::mutex> guard(state_mutex);
-
     auto it = displays.find(dpy_id);
     if (it == displays.end()) {
         ALOGE("dpy %" PRIu64 ": invalid display handle", dpy_id);
         return HWC2_ERROR_BAD_DISPLAY;
     }
 
+    std::lock_guard<std::mutex> guard(it->second.get_state_mutex());
+
     return it->second.set_color_mode(mode);
 }
 
@@ -372,14 +530,14 @@ hwc2_error_t hwc2_dev::get_hdr_capabilities(hwc2_display_t dpy_id,
         float *out_max_luminance, float *out_max_average_luminance,
         float *out_min_luminance)
 {
-    std::lock_guard<std::mutex> guard(state_mutex);
-
     auto it = displays.find(dpy_id);
     if (it == displays.end()) {
         ALOGE("dpy %" PRIu64 ": invalid display handle", dpy_id);
         return HWC2_ERROR_BAD_DISPLAY;
     }
 
+    std::lock_guard<std::mutex> guard(it->second.get_state_mutex());
+
     return it->second.get_hdr_capabilities(out_num_types, out_types,
             out_max_luminance, out_max_average_luminance,
             out_min_luminance);
@@ -388,14 +546,14 @@ hwc2_error_t hwc2_dev::get_hdr_capabilities(hwc2_display_t dpy_id,
 hwc2_error_t hwc2_dev::set_color_transform(hwc2_display_t dpy_id,
         const float *color_matrix, android_color_transform_t color_hint)
 {
-    std::lock_guard<std::mutex> guard(state_mutex);
-
     auto it = displays.find(dpy_id);
     if (it == displays.end()) {
         ALOGE("dpy %" PRIu64 ": invalid display handle", dpy_id);
         return HWC2_ERROR_BAD_DISPLAY;
     }
 
+    std::lock_guard<std::mutex> guard(it->second.get_state_mutex());
+
     return it->second.set_color_transform(color_matrix, color_hint);
 }
 
@@ -403,14 +561,14 @@ hwc2_error_t hwc2_dev::get_client_target_support(hwc2_display_t dpy_id,
         uint32_t width, uint32_t height, android_pixel_format_t format,
         android_dataspace_t dataspace)
 {
-    std::lock_guard<std::mutex> guard(state_mutex);
-
     auto it = displays.find(dpy_id);
     if (it == displays.end()) {
         ALOGE("dpy %" PRIu64 ": invalid display handle", dpy_id);
         return HWC2_ERROR_BAD_DISPLAY;
     }
 
+    std::lock_guard<std::mutex> guard(it->second.get_state_mutex());
+
     return it->second.get_client_target_support(width, height, format,
             dataspace);
 }
@@ -419,133 +577,138 @@ hwc2_error_t hwc2_dev::set_client_target(hwc2_display_t dpy_id,
         buffer_handle_t target, int32_t acquire_fence,
         android_dataspace_t dataspace, const hwc_region_t &surface_damage)
 {
-    std::lock_guard<std::mutex> guard(state_mutex);
-
     auto it = displays.find(dpy_id);
     if (it == displays.end()) {
         ALOGE("dpy %" PRIu64 ": invalid display handle", dpy_id);
         return HWC2_ERROR_BAD_DISPLAY;
     }
 
+    std::lock_guard<std::mutex> guard(it->second.get_state_mutex());
+
     return it->second.set_client_target(target, acquire_fence, dataspace,
             surface_damage);
 }
 
 hwc2_error_t hwc2_dev::create_layer(hwc2_display_t dpy_id, hwc2_layer_t *out_layer)
 {
-    std::lock_guard<std::mutex> guard(state_mutex);
-
     auto it = displays.find(dpy_id);
     if (it == displays.end()) {
         ALOGE("dpy %" PRIu64 ": invalid display handle", dpy_id);
         return HWC2_ERROR_BAD_DISPLAY;
     }
 
+    std::lock_guard<std::mutex> guard(it->second.get_state_mutex());
+
     return it->second.create_layer(out_layer);
 }
 
 hwc2_error_t hwc2_dev::destroy_layer(hwc2_display_t dpy_id, hwc2_layer_t lyr_id)
 {
-    std::lock_guard<std::mutex> guard(state_mutex);
-
     auto it = displays.find(dpy_id);
     if (it == displays.end()) {
         ALOGE("dpy %" PRIu64 ": invalid display handle", dpy_id);
         return HWC2_ERROR_BAD_DISPLAY;
     }
 
+    std::lock_guard<std::mutex> guard(it->second.get_state_mutex());
+
     return it->second.destroy_layer(lyr_id);
 }
 
 hwc2_error_t hwc2_dev::set_layer_composition_type(hwc2_display_t dpy_id,
         hwc2_layer_t lyr_id, hwc2_composition_t comp_type)
 {
-    std::lock_guard<std::mutex> guard(state_mutex);
-    return displays.find(dpy_id)->second.set_layer_composition_type(lyr_id,
-            comp_type);
+    hwc2_display &dpy = displays.find(dpy_id)->second;
+    std::lock_guard<std::mutex> guard(dpy.get_state_mutex());
+    return dpy.set_layer_composition_type(lyr_id, comp_type);
 }
 
 hwc2_error_t hwc2_dev::set_layer_buffer(hwc2_display_t dpy_id,
         hwc2_layer_t lyr_id, buffer_handle_t handle, int32_t acquire_fence)
 {
-    std::lock_guard<std::mutex> guard(state_mutex);
-    return displays.find(dpy_id)->second.set_layer_buffer(lyr_id, handle,
-            acquire_fence);
+    hwc2_display &dpy = displays.find(dpy_id)->second;
+    std::lock_guard<std::mutex> guard(dpy.get_state_mutex());
+    return dpy.set_layer_buffer(lyr_id, handle, acquire_fence);
 }
 
 hwc2_error_t hwc2_dev::set_layer_dataspace(hwc2_display_t dpy_id,
         hwc2_layer_t lyr_id, android_dataspace_t dataspace)
 {
-    std::lock_guard<std::mutex> guard(state_mutex);
-    return displays.find(dpy_id)->second.set_layer_dataspace(lyr_id, dataspace);
+    hwc2_display &dpy = displays.find(dpy_id)->second;
+    std::lock_guard<std::mutex> guard(dpy.get_state_mutex());
+    return dpy.set_layer_dataspace(lyr_id, dataspace);
 }
 
 hwc2_error_t hwc2_dev::set_layer_display_frame(hwc2_display_t dpy_id,
         hwc2_layer_t lyr_id, const hwc_rect_t &display_frame)
 {
-    std::lock_guard<std::mutex> guard(state_mutex);
-    return displays.find(dpy_id)->second.set_layer_display_frame(lyr_id,
-            display_frame);
+    hwc2_display &dpy = displays.find(dpy_id)->second;
+    std::lock_guard<std::mutex> guard(dpy.get_state_mutex());
+    return dpy.set_layer_display_frame(lyr_id, display_frame);
 }
 
 hwc2_error_t hwc2_dev::set_layer_source_crop(hwc2_display_t dpy_id,
         hwc2_layer_t lyr_id, const hwc_frect_t &source_crop)
 {
-    std::lock_guard<std::mutex> guard(state_mutex);
-    return displays.find(dpy_id)->second.set_layer_source_crop(lyr_id,
-            source_crop);
+    hwc2_display &dpy = displays.find(dpy_id)->second;
+    std::lock_guard<std::mutex> guard(dpy.get_state_mutex());
+    return dpy.set_layer_source_crop(lyr_id, source_crop);
 }
 
 hwc2_error_t hwc2_dev::set_layer_z_order(hwc2_display_t dpy_id,
         hwc2_layer_t lyr_id, uint32_t z_order)
 {
-    std::lock_guard<std::mutex> guard(state_mutex);
-    return displays.find(dpy_id)->second.set_layer_z_order(lyr_id, z_order);
+    hwc2_display &dpy = displays.find(dpy_id)->second;
+    std::lock_guard<std::mutex> guard(dpy.get_state_mutex());
+    return dpy.set_layer_z_order(lyr_id, z_order);
 }
 
 hwc2_error_t hwc2_dev::set_layer_surface_damage(hwc2_display_t dpy_id,
         hwc2_layer_t lyr_id, const hwc_region_t &surface_damage)
 {
-    std::lock_guard<std::mutex> guard(state_mutex);
-    return displays.find(dpy_id)->second.set_layer_surface_damage(lyr_id,
-            surface_damage);
+    hwc2_display &dpy = displays.find(dpy_id)->second;
+    std::lock_guard<std::mutex> guard(dpy.get_state_mutex());
+    return dpy.set_layer_surface_damage(lyr_id, surface_damage);
 }
 
 hwc2_error_t hwc2_dev::set_layer_blend_mode(hwc2_display_t dpy_id,
         hwc2_layer_t lyr_id, hwc2_blend_mode_t blend_mode)
 {
-    std::lock_guard<std::mutex> guard(state_mutex);
-    return displays.find(dpy_id)->second.set_layer_blend_mode(lyr_id,
-            blend_mode);
+    hwc2_display &dpy = displays.find(dpy_id)->second;
+    std::lock_guard<std::mutex> guard(dpy.get_state_mutex());
+    return dpy.set_layer_blend_mode(lyr_id, blend_mode);
 }
 
 hwc2_error_t hwc2_dev::set_layer_plane_alpha(hwc2_display_t dpy_id,
         hwc2_layer_t lyr_id, float plane_alpha)
 {
-    std::lock_guard<std::mutex> guard(state_mutex);
-    return displays.find(dpy_id)->second.set_layer_plane_alpha(lyr_id,
-            plane_alpha);
+    hwc2_display &dpy = displays.find(dpy_id)->second;
+    std::lock_guard<std::mutex> guard(dpy.get_state_mutex());
+    return dpy.set_layer_plane_alpha(lyr_id, plane_alpha);
 }
 
 hwc2_error_t hwc2_dev::set_layer_transform(hwc2_display_t dpy_id,
         hwc2_layer_t lyr_id, const hwc_transform_t transform)
 {
-    std::lock_guard<std::mutex> guard(state_mutex);
-    return displays.find(dpy_id)->second.set_layer_transform(lyr_id, transform);
+    hwc2_display &dpy = displays.find(dpy_id)->second;
+    std::lock_guard<std::mutex> guard(dpy.get_state_mutex());
+    return dpy.set_layer_transform(lyr_id, transform);
 }
 
 hwc2_error_t hwc2_dev::set_layer_visible_region(hwc2_display_t dpy_id,
         hwc2_layer_t lyr_id, const hwc_region_t &visible_region)
 {
-    std::lock_guard<std::mutex> guard(state_mutex);
-    return displays.find(dpy_id)->second.set_layer_visible_region(lyr_id,
-            visible_region);
+    hwc2_display &dpy = displays.find(dpy_id)->second;
+    std::lock_guard<std::mutex> guard(dpy.get_state_mutex());
+    return dpy.set_layer_visible_region(lyr_id, visible_region);
 }
 
 hwc2_error_t hwc2_dev::set_layer_color(hwc2_display_t dpy_id,
         hwc2_layer_t lyr_id, const hwc_color_t &color)
 {
-    return displays.find(dpy_id)->second.set_layer_color(lyr_id, color);
+    hwc2_display &dpy = displays.find(dpy_id)->second;
+    std::lock_guard<std::mutex> guard(dpy.get_state_mutex());
+    return dpy.set_layer_color(lyr_id, color);
 }
 
 hwc2_error_t hwc2_dev::set_cursor_position(hwc2_display_t dpy_id,
@@ -557,14 +720,31 @@ hwc2_error_t hwc2_dev::set_cursor_position(hwc2_display_t dpy_id,
         return HWC2_ERROR_BAD_DISPLAY;
     }
 
-    return displays.find(dpy_id)->second.set_cursor_position(lyr_id, x, y);
+    std::lock_guard<std::mutex> guard(it->second.get_state_mutex());
+
+    return it->second.set_cursor_position(lyr_id, x, y);
+}
+
+hwc2_error_t hwc2_dev::set_layer_commands(hwc2_display_t dpy_id,
+        uint32_t num_words, const uint32_t *commands,
+        uint32_t *out_error_offset)
+{
+    auto it = displays.find(dpy_id);
+    if (it == displays.end()) {
+        ALOGE("dpy %" PRIu64 ": invalid display handle", dpy_id);
+        return HWC2_ERROR_BAD_DISPLAY;
+    }
+
+    /* The whole frame of layer updates is applied under one lock */
+    std::lock_guard<std::mutex> guard(it->second.get_state_mutex());
+
+    return it->second.set_layer_commands(num_words, commands,
+            out_error_offset);
 }
 
 void hwc2_dev::hotplug(hwc2_display_t dpy_id, hwc2_connection_t connection)
 {
     {
-        std::lock_guard<std::mutex> guard(state_mutex);
-
         auto it = displays.find(dpy_id);
         if (it == displays.end()) {
             ALOGW("dpy %" PRIu64 ": invalid display handle preventing hotplug"
@@ -572,41 +752,81 @@ void hwc2_dev::hotplug(hwc2_display_t dpy_id, hwc2_connection_t connection)
             return;
         }
 
+        std::lock_guard<std::mutex> guard(it->second.get_state_mutex());
+
         hwc2_error_t ret = it->second.set_connection(connection);
         if (ret != HWC2_ERROR_NONE)
             return;
     }
 
+    trace.record(HWC2_TRACE_CALLBACK + HWC2_CALLBACK_HOTPLUG,
+            systemTime(SYSTEM_TIME_MONOTONIC), HWC2_ERROR_NONE, dpy_id, 0,
+            {connection});
+
     callback_handler.call_hotplug(dpy_id, connection);
 }
 
 void hwc2_dev::vsync(hwc2_display_t dpy_id, uint64_t timestamp)
 {
-    {
-        std::lock_guard<std::mutex> guard(state_mutex);
+    /* The display set never changes after open, so the lookup needs no lock
+     * and vsync never waits on a display that is busy composing */
+    auto it = displays.find(dpy_id);
+    if (it == displays.end()) {
+        ALOGW("dpy %" PRIu64 ": invalid display handle preventing vsync"
+                " callback", dpy_id);
+        return;
+    }
 
-        auto it = displays.find(dpy_id);
-        if (it == displays.end()) {
-            ALOGW("dpy %" PRIu64 ": invalid display handle preventing vsync"
-                    " callback", dpy_id);
+    /* The vsync thread turns hardware vsync off once the model locks */
+    hwc2_vsync_model &model = it->second.get_vsync_model();
+    bool deliver = model.add_sample(timestamp);
+
+    if (vsync_thread.joinable() && !model.needs_hw_vsync(timestamp))
+        wake_vsync_thread();
+
+    if (!deliver)
+        return;
+
+    trace.record(HWC2_TRACE_CALLBACK + HWC2_CALLBACK_VSYNC, timestamp,
+            HWC2_ERROR_NONE, dpy_id, 0, {});
+
+    callback_handler.call_vsync(dpy_id, timestamp);
+}
+
+void hwc2_dev::renegotiate_bandwidth(hwc2_display_t dpy_id, uint64_t avail_bw)
+{
+    auto it = displays.find(dpy_id);
+    if (it == displays.end()) {
+        ALOGW("dpy %" PRIu64 ": invalid display handle preventing bandwidth"
+                " renegotiation", dpy_id);
+        return;
+    }
+
+    {
+        std::lock_guard<std::mutex> guard(it->second.get_state_mutex());
+        if (!it->second.set_bandwidth_budget(avail_bw))
             return;
-        }
     }
 
-    callback_handler.call_vsync(dpy_id, timestamp);
+    /* The current plan may no longer fit, or a richer one may now fit. Ask
+     * the client for a frame so it gets replanned */
+    trace.record(HWC2_TRACE_CALLBACK + HWC2_CALLBACK_REFRESH,
+            systemTime(SYSTEM_TIME_MONOTONIC), HWC2_ERROR_NONE, dpy_id, 0, {});
+
+    callback_handler.call_refresh(dpy_id);
 }
 
 hwc2_error_t hwc2_dev::set_vsync_enabled(hwc2_display_t dpy_id,
         hwc2_vsync_t enabled)
 {
-    std::lock_guard<std::mutex> guard(state_mutex);
-
     auto it = displays.find(dpy_id);
     if (it == displays.end()) {
         ALOGE("dpy %" PRIu64 ": invalid display handle", dpy_id);
         return HWC2_ERROR_BAD_DISPLAY;
     }
 
+    std::lock_guard<std::mutex> guard(it->second.get_state_mutex());
+
     if (it->second.get_type() != HWC2_DISPLAY_TYPE_PHYSICAL)
         return HWC2_ERROR_NONE;
 
@@ -627,6 +847,13 @@ hwc2_error_t hwc2_dev::set_vsync_enabled(hwc2_display_t dpy_id,
         return HWC2_ERROR_BAD_PARAMETER;
     }
 
+    it->second.get_vsync_model().set_enabled(adf_enabled);
+
+    if (vsync_thread.joinable()) {
+        wake_vsync_thread();
+        return it->second.set_vsync_enabled(enabled);
+    }
+
     int ret = adf_eventControl(adf_helper, dpy_id, HWC_EVENT_VSYNC, adf_enabled);
     if (ret < 0) {
         ALOGW("dpy %" PRIu64 ": failed to set vsync enabled: %s", dpy_id,
@@ -634,9 +861,36 @@ hwc2_error_t hwc2_dev::set_vsync_enabled(hwc2_display_t dpy_id,
         return HWC2_ERROR_BAD_PARAMETER;
     }
 
+    it->second.get_vsync_model().set_hw_enabled(adf_enabled);
     return it->second.set_vsync_enabled(enabled);
 }
 
+hwc2_error_t hwc2_dev::get_predicted_present_times(hwc2_display_t dpy_id,
+        uint32_t *out_count, int64_t *out_times)
+{
+    auto it = displays.find(dpy_id);
+    if (it == displays.end()) {
+        ALOGE("dpy %" PRIu64 ": invalid display handle", dpy_id);
+        return HWC2_ERROR_BAD_DISPLAY;
+    }
+
+    if (!out_count) {
+        ALOGE("dpy %" PRIu64 ": invalid predicted present time count", dpy_id);
+        return HWC2_ERROR_BAD_PARAMETER;
+    }
+
+    uint32_t cnt = HWC2_VSYNC_MAX_PREDICTIONS;
+    if (out_times)
+        cnt = std::min(*out_count, cnt);
+
+    /* A frame presented now is flipped on the next vsync, and its present
+     * fence signals then */
+    *out_count = it->second.get_vsync_model().predict(
+            systemTime(SYSTEM_TIME_MONOTONIC), cnt, out_times);
+
+    return HWC2_ERROR_NONE;
+}
+
 hwc2_error_t hwc2_dev::register_callback(hwc2_callback_descriptor_t descriptor,
         hwc2_callback_data_t callback_data, hwc2_function_pointer_t pointer)
 {
@@ -684,6 +938,8 @@ int hwc2_dev::open_adf_device()
     }
 
     for (auto &dpy: displays) {
+        std::lock_guard<std::mutex> dpy_guard(dpy.second.get_state_mutex());
+
         ret = dpy.second.retrieve_display_configs(adf_helper);
         if (ret < 0) {
             ALOGE("dpy %" PRIu64 ": failed to retrieve display configs: %s",
@@ -693,9 +949,15 @@ int hwc2_dev::open_adf_device()
         dpy.second.set_client_target_properties();
     }
 
+    open_virtual_displays();
+
     for (auto &dpy: displays)
-        callback_handler.call_hotplug(dpy.second.get_id(),
-                dpy.second.get_connection());
+        if (dpy.second.get_type() == HWC2_DISPLAY_TYPE_PHYSICAL)
+            callback_handler.call_hotplug(dpy.second.get_id(),
+                    dpy.second.get_connection());
+
+    start_idle_thread();
+    start_vsync_thread();
 
     free(dev_ids);
     return 0;
@@ -743,5 +1005,189 @@ int hwc2_dev::open_adf_display(adf_id_t adf_id) {
 
     adf_free_interface_data(&intf);
 
+    /* Tegra adf devices are numbered after their display controller */
+    displays.find(dpy_id)->second.init_cmu(adf_id);
+
     return intf_fd;
 }
+
+void hwc2_dev::open_virtual_displays()
+{
+    /* Virtual displays have no adf device. They are never hotplugged and
+     * stay disconnected until create_virtual_display */
+    struct adf_device adf_dev;
+    adf_dev.id = 0;
+    adf_dev.fd = -1;
+
+    for (size_t idx = 0; idx < HWC2_VIRTUAL_DISPLAY_COUNT; idx++) {
+        hwc2_display_t dpy_id = hwc2_display::get_next_id();
+        displays.emplace(std::piecewise_construct,
+                std::forward_as_tuple(dpy_id), std::forward_as_tuple(dpy_id,
+                -1, adf_dev, HWC2_CONNECTION_DISCONNECTED,
+                HWC2_DISPLAY_TYPE_VIRTUAL, HWC2_POWER_MODE_OFF));
+    }
+}
+
+void hwc2_dev::start_idle_thread()
+{
+    int32_t idle_frames = property_get_int32("debug.hwc2.idle_frames",
+            HWC2_IDLE_FRAMES);
+    if (idle_frames <= 0)
+        return;
+
+    for (auto &dpy: displays) {
+        std::lock_guard<std::mutex> guard(dpy.second.get_state_mutex());
+        dpy.second.set_idle_frames(idle_frames);
+    }
+
+    idle_thread = std::thread(&hwc2_dev::idle_loop, this);
+}
+
+void hwc2_dev::stop_idle_thread()
+{
+    if (!idle_thread.joinable())
+        return;
+
+    {
+        std::lock_guard<std::mutex> lock(idle_mutex);
+        idle_exit = true;
+    }
+
+    idle_cond.notify_one();
+    idle_thread.join();
+}
+
+void hwc2_dev::wake_idle_thread()
+{
+    /* While some display has a deadline the thread wakes up by itself and
+     * picks up the new post time. Only wake it if it waits for a post */
+    std::lock_guard<std::mutex> lock(idle_mutex);
+    if (idle_waiting)
+        idle_cond.notify_one();
+}
+
+void hwc2_dev::idle_loop()
+{
+    std::unique_lock<std::mutex> lock(idle_mutex);
+    std::vector<hwc2_display_t> idle_displays;
+
+    while (!idle_exit) {
+        nsecs_t now = systemTime(SYSTEM_TIME_MONOTONIC);
+        nsecs_t deadline = INT64_MAX;
+
+        idle_displays.clear();
+        for (auto &dpy: displays) {
+            std::lock_guard<std::mutex> guard(dpy.second.get_state_mutex());
+
+            nsecs_t dpy_deadline = dpy.second.get_idle_deadline();
+            if (dpy_deadline <= now) {
+                dpy.second.enter_idle();
+                idle_displays.push_back(dpy.first);
+            } else {
+                deadline = std::min(deadline, dpy_deadline);
+            }
+        }
+
+        /* The client validates and presents from the refresh callback, so
+         * no lock may be held while calling it */
+        if (!idle_displays.empty()) {
+            lock.unlock();
+            for (auto dpy_id: idle_displays) {
+                trace.record(HWC2_TRACE_CALLBACK + HWC2_CALLBACK_REFRESH,
+                        now, HWC2_ERROR_NONE, dpy_id, 0, {});
+                callback_handler.call_refresh(dpy_id);
+            }
+            lock.lock();
+            continue;
+        }
+
+        idle_waiting = deadline == INT64_MAX;
+        if (idle_waiting)
+            idle_cond.wait(lock);
+        else
+            idle_cond.wait_for(lock, std::chrono::nanoseconds(deadline - now));
+        idle_waiting = false;
+    }
+}
+
+void hwc2_dev::start_vsync_thread()
+{
+    if (property_get_int32("debug.hwc2.soft_vsync", 1) == 0)
+        return;
+
+    vsync_thread = std::thread(&hwc2_dev::vsync_loop, this);
+}
+
+void hwc2_dev::stop_vsync_thread()
+{
+    if (!vsync_thread.joinable())
+        return;
+
+    {
+        std::lock_guard<std::mutex> lock(vsync_mutex);
+        vsync_exit = true;
+    }
+
+    vsync_cond.notify_one();
+    vsync_thread.join();
+}
+
+void hwc2_dev::wake_vsync_thread()
+{
+    std::lock_guard<std::mutex> lock(vsync_mutex);
+    vsync_cond.notify_one();
+}
+
+void hwc2_dev::vsync_loop()
+{
+    std::unique_lock<std::mutex> lock(vsync_mutex);
+    std::vector<std::pair<hwc2_display_t, nsecs_t>> vsyncs;
+
+    while (!vsync_exit) {
+        nsecs_t now = systemTime(SYSTEM_TIME_MONOTONIC);
+        nsecs_t deadline = INT64_MAX;
+
+        vsyncs.clear();
+        for (auto &dpy: displays) {
+            hwc2_vsync_model &model = dpy.second.get_vsync_model();
+
+            bool hw_enabled = model.needs_hw_vsync(now);
+            if (hw_enabled != model.is_hw_enabled()) {
+                int ret = adf_eventControl(adf_helper, dpy.first,
+                        HWC_EVENT_VSYNC, hw_enabled);
+                if (ret < 0)
+                    ALOGW("dpy %" PRIu64 ": failed to set hardware vsync"
+                            " enabled: %s", dpy.first, strerror(ret));
+                else
+                    model.set_hw_enabled(hw_enabled);
+            }
+
+            nsecs_t vsync = model.get_next_vsync(now);
+            if (vsync <= now) {
+                if (model.deliver(vsync))
+                    vsyncs.emplace_back(dpy.first, vsync);
+                vsync = model.get_next_vsync(now);
+            }
+
+            deadline = std::min(deadline, vsync);
+        }
+
+        /* Like hardware vsync, predicted vsyncs are delivered without any
+         * lock held */
+        if (!vsyncs.empty()) {
+            lock.unlock();
+            for (auto &vsync: vsyncs) {
+                trace.record(HWC2_TRACE_CALLBACK + HWC2_CALLBACK_VSYNC,
+                        vsync.second, HWC2_ERROR_NONE, vsync.first, 0, {});
+                callback_handler.call_vsync(vsync.first, vsync.second);
+            }
+            lock.lock();
+            continue;
+        }
+
+        if (deadline == INT64_MAX)
+            vsync_cond.wait(lock);
+        else
+            vsync_cond.wait_for(lock, std::chrono::nanoseconds(deadline - now));
+    }
+}
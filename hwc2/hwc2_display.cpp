@@ -15,50 +15,257 @@
  */
 
 #include <cutils/log.h>
+#include <sync/sync.h>
 #include <tegra_adf.h>
+#include <tegra_dc_ext.h>
+#include <fcntl.h>
+#include <sys/ioctl.h>
+#include <unistd.h>
 #include <inttypes.h>
 
 #include <sstream>
 #include <cstdlib>
-#include <map>
+#include <cstddef>
+#include <cstring>
+#include <cerrno>
 #include <vector>
 #include <array>
+#include <algorithm>
+#include <cmath>
 
 #include "hwc2.h"
 
+#define ATRACE_TAG ATRACE_TAG_GRAPHICS
+#include "cutils/trace.h"
+
 uint64_t hwc2_display::display_cnt = 0;
 
+static float get_cmu_coeff(uint16_t csc)
+{
+    int32_t coeff = csc & HWC2_CMU_CSC_MASK;
+    if (coeff > HWC2_CMU_CSC_MAX)
+        coeff -= HWC2_CMU_CSC_MASK + 1;
+    return static_cast<float>(coeff) / HWC2_CMU_CSC_ONE;
+}
+
+/* The color matrix is column major and applied to the row vector
+ * [R, G, B, 1]. The cmu csc is row major by output channel */
+bool hwc2_get_cmu_csc(const std::array<float, 16> &matrix,
+        const std::array<uint16_t, 9> &default_csc,
+        std::array<uint16_t, 9> *out_csc)
+{
+    if (matrix[12] != 0.0 || matrix[13] != 0.0 || matrix[14] != 0.0)
+        return false;
+
+    for (size_t out = 0; out < 3; out++) {
+        for (size_t in = 0; in < 3; in++) {
+            float sum = 0.0f;
+            for (size_t mid = 0; mid < 3; mid++)
+                sum += get_cmu_coeff(default_csc[out * 3 + mid])
+                        * matrix[in * 4 + mid];
+
+            float coeff = std::round(sum * HWC2_CMU_CSC_ONE);
+            if (coeff < HWC2_CMU_CSC_MIN || coeff > HWC2_CMU_CSC_MAX)
+                return false;
+
+            (*out_csc)[out * 3 + in] = static_cast<int32_t>(coeff)
+                    & HWC2_CMU_CSC_MASK;
+        }
+    }
+
+    return true;
+}
+
+/* Region commands carry any number of rects. The others have a fixed number
+ * of argument words */
+static bool is_valid_layer_command(uint32_t command, uint32_t length)
+{
+    switch (command) {
+    case HWC2_LAYER_COMMAND_COMPOSITION_TYPE:
+    case HWC2_LAYER_COMMAND_DATASPACE:
+    case HWC2_LAYER_COMMAND_Z_ORDER:
+    case HWC2_LAYER_COMMAND_BLEND_MODE:
+    case HWC2_LAYER_COMMAND_PLANE_ALPHA:
+    case HWC2_LAYER_COMMAND_TRANSFORM:
+    case HWC2_LAYER_COMMAND_COLOR:
+        return length == 1;
+    case HWC2_LAYER_COMMAND_SELECT_LAYER:
+    case HWC2_LAYER_COMMAND_CURSOR_POSITION:
+        return length == 2;
+    case HWC2_LAYER_COMMAND_BUFFER:
+        return length == 3;
+    case HWC2_LAYER_COMMAND_DISPLAY_FRAME:
+    case HWC2_LAYER_COMMAND_SOURCE_CROP:
+        return length == 4;
+    case HWC2_LAYER_COMMAND_SURFACE_DAMAGE:
+    case HWC2_LAYER_COMMAND_VISIBLE_REGION:
+        return length % 4 == 0;
+    default:
+        return false;
+    }
+}
+
+/* Closes the acquire fences of the buffer commands left in a stream that
+ * was stopped at offset. The headers are followed as far as their lengths
+ * stay inside the stream, past that there is no telling commands from
+ * arguments */
+static void close_layer_command_fences(uint32_t num_words,
+        const uint32_t *commands, uint32_t offset)
+{
+    while (offset < num_words) {
+        uint32_t command = commands[offset] >> 16;
+        uint32_t length = commands[offset] & 0xffff;
+
+        if (length > num_words - offset - 1)
+            return;
+
+        if (command == HWC2_LAYER_COMMAND_BUFFER && length == 3
+                && static_cast<int32_t>(commands[offset + 3]) >= 0)
+            close(static_cast<int32_t>(commands[offset + 3]));
+
+        offset += length + 1;
+    }
+}
+
 hwc2_display::hwc2_display(hwc2_display_t id, int adf_intf_fd,
         const struct adf_device &adf_dev, hwc2_connection_t connection,
         hwc2_display_type_t type, hwc2_power_mode_t power_mode)
-    : id(id),
+    : state_mutex(),
+      id(id),
       name(),
       connection(connection),
       type(type),
       display_state(modified),
+      validated(false),
       client_target_used(false),
+      cursor_mode(false),
+      window_caps(),
       windows(),
       client_target(),
       layers(),
+      ordered_layers(),
+      plan_signature(),
+      overlap_covered(),
+      opaque_region(),
+      frame_region(),
+      visible_region(),
+      plan_cache(),
+      client_cost(),
+      slots(),
+      client_holes(),
+      hole_candidates(),
+      layer_bandwidth(),
+      client_target_bandwidth(0),
       vsync_enabled(HWC2_VSYNC_DISABLE),
       changed_comp_types(),
+      layer_requests(),
       configs(),
       active_config(0),
       power_mode(power_mode),
       color_matrix(),
       color_hint(HAL_COLOR_TRANSFORM_IDENTITY),
+      dc_fd(-1),
+      cmu(nullptr),
+      default_csc(),
+      transform_csc(),
+      cmu_transform(false),
+      bandwidth_budget(0),
+      plan_bandwidth(0),
+      proposed_bandwidth(0),
+      vsync_model(),
+      stats(),
+      present_fence_pending(false),
+      proposed_bw(nullptr),
+      proposed_bw_size(sizeof(*proposed_bw)
+            + HWC2_WINDOW_COUNT * sizeof(proposed_bw->win[0])),
+      over_budget_cnt(0),
+      renegotiate_cnt(0),
       release_fence(-1),
+      scanned_out(),
+      scanning_out(),
+      released_layers(),
+      sw_composer(),
+      output_buffer(nullptr),
+      output_fence(-1),
       adf_intf_fd(adf_intf_fd),
-      adf_dev(adf_dev)
+      adf_dev(adf_dev),
+      adf_bufs(),
+      flip_args(nullptr),
+      flip_args_size(sizeof(*flip_args)
+            + HWC2_WINDOW_COUNT * sizeof(flip_args->win[0])),
+      post_worker(id),
+      early_decompress_cnt(0),
+      early_decompress_time(0),
+      late_decompress_cnt(0),
+      late_decompress_time(0),
+      idle_frames(0),
+      idle_state(awake),
+      last_post_time(0),
+      idle_start(0),
+      idle_cnt(0),
+      idle_time(0),
+      last_flip_args(nullptr),
+      last_adf_bufs(),
+      last_buf_cnt(0),
+      last_post_valid(false),
+      skipped_post_cnt(0),
+      present_cnt(0),
+      skipped_validate_cnt(0),
+      culled_layer_cnt(0),
+      freed_window_cnt(0),
+      overlapped_window_cnt(0)
 {
     init_name();
+    if (type == HWC2_DISPLAY_TYPE_PHYSICAL)
+        init_window_caps();
     init_windows();
+
+    scanned_out.reserve(HWC2_WINDOW_COUNT);
+    scanning_out.reserve(HWC2_WINDOW_COUNT);
+    released_layers.reserve(HWC2_WINDOW_COUNT);
+
+    flip_args = static_cast<tegra_adf_flip *>(calloc(1, flip_args_size));
+    LOG_ALWAYS_FATAL_IF(!flip_args, "dpy %" PRIu64 ": failed to alloc"
+            " tegra_adf_flip", id);
+
+    last_flip_args = static_cast<tegra_adf_flip *>(calloc(1, flip_args_size));
+    LOG_ALWAYS_FATAL_IF(!last_flip_args, "dpy %" PRIu64 ": failed to alloc"
+            " tegra_adf_flip", id);
+
+    proposed_bw = static_cast<tegra_adf_proposed_bw *>(calloc(1,
+            proposed_bw_size));
+    LOG_ALWAYS_FATAL_IF(!proposed_bw, "dpy %" PRIu64 ": failed to alloc"
+            " tegra_adf_proposed_bw", id);
+
+    if (type == HWC2_DISPLAY_TYPE_PHYSICAL)
+        post_worker.start(&this->adf_dev, flip_args_size);
 }
 
 hwc2_display::~hwc2_display()
 {
-    close(adf_intf_fd);
-    adf_device_close(&adf_dev);
+    for (auto &lyr: layers)
+        lyr.release_dma_bufs();
+    client_target.release_dma_bufs();
+
+    /* The worker releases what its posts held once it has drained. Without
+     * it, holding nothing releases what the last post held */
+    bool async_post = post_worker.is_running();
+    post_worker.stop();
+    if (!async_post)
+        hold_posted_dma_bufs(0);
+
+    free(flip_args);
+    free(last_flip_args);
+    free(proposed_bw);
+    free(cmu);
+    if (dc_fd >= 0)
+        close(dc_fd);
+
+    /* Virtual displays have no adf device */
+    if (type == HWC2_DISPLAY_TYPE_PHYSICAL) {
+        close(adf_intf_fd);
+        adf_device_close(&adf_dev);
+    }
 }
 
 std::string hwc2_display::dump() const
@@ -80,13 +287,62 @@ std::string hwc2_display::dump() const
     if (power_mode == HWC2_POWER_MODE_OFF)
         return dmp.str();
 
+    dmp << window_caps.dump();
+    dmp << plan_cache.dump();
+
+    dmp << "  Color Transform: " << color_hint;
+    if (color_hint != HAL_COLOR_TRANSFORM_IDENTITY)
+        dmp << ((cmu_transform)? " (cmu)": " (client)");
+    dmp << "\n";
+
+    dmp << "  Decompress: " << early_decompress_cnt << " early ("
+            << early_decompress_time / 1000 << "us kept out of present), "
+            << late_decompress_cnt << " in present ("
+            << late_decompress_time / 1000 << "us)\n";
+
+    dmp << "  Present: " << present_cnt << " presents, "
+            << skipped_validate_cnt << " without validate ("
+            << (present_cnt? skipped_validate_cnt * 100 / present_cnt: 0)
+            << "%)\n";
+
+    nsecs_t idle_total = idle_time;
+    if (idle_state != awake)
+        idle_total += systemTime(SYSTEM_TIME_MONOTONIC) - idle_start;
+
+    dmp << "  Idle: " << ((idle_state == awake)? "no": "yes") << ", "
+            << idle_cnt << " times for " << idle_total / 1000000 << "ms, "
+            << skipped_post_cnt << " identical posts skipped\n";
+
+    dmp << "  Occlusion: " << culled_layer_cnt << " layers culled, "
+            << freed_window_cnt << " windows freed, " << overlapped_window_cnt
+            << " overlapped layers in windows\n";
+
+    dmp << vsync_model.dump();
+    dmp << stats.dump();
+
+    if (type == HWC2_DISPLAY_TYPE_VIRTUAL)
+        dmp << sw_composer.dump();
+    else
+        dmp << post_worker.dump();
+
+    dmp << "  Bandwidth: " << plan_bandwidth << " KB/s predicted, ";
+    if (bandwidth_budget)
+        dmp << bandwidth_budget << " KB/s available, ";
+    else
+        dmp << "no budget, ";
+    dmp << over_budget_cnt << " frames cut back, " << renegotiate_cnt
+            << " renegotiations\n";
+
     size_t idx = 0;
     for (auto &win: windows) {
         dmp << "  Window [" << idx << "]:";
 
         if (win.contains_layer()) {
+            const hwc2_layer *lyr = layers.find(win.get_layer());
+
             dmp << " Layer\n";
-            dmp << layers.at(win.get_layer()).dump();
+            if (lyr)
+                dmp << lyr->dump();
 
         } else if (win.contains_client_target()) {
             dmp << " Client Target\n";
@@ -130,13 +386,19 @@ hwc2_error_t hwc2_display::get_name(uint32_t *out_size, char *out_name) const
 void hwc2_display::init_name()
 {
     name.append("dpy-");
-    if (HWC2_DISPLAY_TYPE_PHYSICAL)
+    if (type == HWC2_DISPLAY_TYPE_PHYSICAL)
         name.append("phys-");
     else
         name.append("virt-");
     name.append(std::to_string(id));
 }
 
+void hwc2_display::init_window_caps()
+{
+    window_caps.query(id, &adf_dev);
+    cursor_mode = window_caps.get_cursor_mode();
+}
+
 hwc2_error_t hwc2_display::set_power_mode(hwc2_power_mode_t mode)
 {
     int drm_mode;
@@ -157,7 +419,13 @@ hwc2_error_t hwc2_display::set_power_mode(hwc2_power_mode_t mode)
         return HWC2_ERROR_BAD_PARAMETER;
     }
 
-    adf_interface_blank(adf_intf_fd, drm_mode);
+    /* Queued posts must not land on a blanked display */
+    if (type == HWC2_DISPLAY_TYPE_PHYSICAL) {
+        post_worker.flush();
+        adf_interface_blank(adf_intf_fd, drm_mode);
+    }
+    if (mode != power_mode)
+        display_state = modified;
     power_mode = mode;
 
     return HWC2_ERROR_NONE;
@@ -183,25 +451,47 @@ hwc2_error_t hwc2_display::set_vsync_enabled(hwc2_vsync_t enabled)
 hwc2_error_t hwc2_display::validate_display(uint32_t *out_num_types,
         uint32_t *out_num_requests)
 {
+    validated = true;
+
+    /* The client started a new frame after the folded one */
+    if (idle_state == folded) {
+        exit_idle();
+        display_state = modified;
+    }
+
     if (display_state == valid) {
         *out_num_types = 0;
-        *out_num_requests = 0;
+        *out_num_requests = layer_requests.size();
         return HWC2_ERROR_NONE;
     }
 
     clear_windows();
     changed_comp_types.clear();
+    layer_requests.clear();
 
-    if (color_hint != HAL_COLOR_TRANSFORM_IDENTITY)
+    if (idle_state == fold_pending) {
         force_client_composition();
-    else
+        idle_state = folding;
+    } else if (color_hint != HAL_COLOR_TRANSFORM_IDENTITY && !cmu_transform) {
+        force_client_composition();
+    } else if (type == HWC2_DISPLAY_TYPE_VIRTUAL) {
+        assign_sw_composition();
+    } else {
         assign_composition();
+    }
 
-    *out_num_requests = 0;
+    for (auto &win: windows)
+        if (win.contains_layer() && layers.find(win.get_layer())->is_overlapped())
+            overlapped_window_cnt++;
+
+    plan_bandwidth = get_windows_bandwidth();
+    ATRACE_INT64("HWC2 bandwidth", plan_bandwidth);
+
+    *out_num_requests = layer_requests.size();
     *out_num_types = changed_comp_types.size();
 
     for (auto &lyr: layers)
-        lyr.second.set_modified(false);
+        lyr.set_modified(false);
 
     if (*out_num_types > 0) {
         display_state = invalid;
@@ -214,95 +504,384 @@ hwc2_error_t hwc2_display::validate_display(uint32_t *out_num_types,
 
 void hwc2_display::force_client_composition()
 {
+    hwc2_error_t ret = assign_client_target_window(0);
+    ALOG_ASSERT(ret == HWC2_ERROR_NONE, "No valid client target window");
+
+    client_target_used = true;
+
     for (auto &lyr: layers) {
-        hwc2_composition_t comp_type = lyr.second.get_comp_type();
+        hwc2_composition_t comp_type = lyr.get_comp_type();
         if (comp_type != HWC2_COMPOSITION_CLIENT)
-            changed_comp_types.emplace(lyr.second.get_id(), comp_type);
+            changed_comp_types.emplace_back(lyr.get_id(),
+                    HWC2_COMPOSITION_CLIENT);
     }
 }
 
 void hwc2_display::assign_composition()
 {
-    hwc2_error_t ret;
+    ATRACE_BEGIN(__func__);
 
-    std::map<uint32_t, hwc2_layer_t> ordered_layers;
-    for (auto &lyr: layers)
-        ordered_layers.emplace(lyr.second.get_z_order(), lyr.second.get_id());
+    order_layers();
 
-    bool client_target_assigned = false;
+    bool over_budget;
+    if (plan_cache.find(plan_signature, &windows, &changed_comp_types,
+            &layer_requests, &client_target_used, &over_budget)) {
+        over_budget_cnt += over_budget;
+        ATRACE_END();
+        return;
+    }
 
-    /* If there will definitely be a client target, assign it to the front most
-     * window */
-    if (layers.size() > windows.size()) {
-        ret = assign_client_target_window(0);
-        ALOG_ASSERT(ret == HWC2_ERROR_NONE, "No valid client target window");
+    size_t layer_cnt = ordered_layers.size();
 
-        client_target_assigned = true;
+    /* Prefix sums of the cost of composing each layer with the client. Layers
+     * that cannot be placed in a window must be composed by the client and
+     * bound the z range the client target has to cover */
+    client_cost.assign(layer_cnt + 1, 0);
+    client_holes.assign(layer_cnt, false);
+    size_t first_client = layer_cnt, last_client = 0;
+
+    int32_t display_height, vsync_period;
+    get_bandwidth_mode(&display_height, &vsync_period);
+
+    layer_bandwidth.assign(layer_cnt + 1, 0);
+    client_target_bandwidth = client_target.get_bandwidth(display_height,
+            vsync_period);
+
+    for (size_t idx = 0; idx < layer_cnt; idx++) {
+        const hwc2_layer &lyr = *ordered_layers[idx];
+
+        client_cost[idx + 1] = client_cost[idx] + get_client_cost(lyr);
+        layer_bandwidth[idx + 1] = layer_bandwidth[idx]
+                + lyr.get_bandwidth(display_height, vsync_period);
+
+        if (!is_window_composition(lyr) || !window_caps.is_supported(lyr)
+                || !overlap_covered[idx]) {
+            if (first_client == layer_cnt)
+                first_client = idx;
+            last_client = idx;
+        }
     }
 
-    bool retry_assignment;
+    /* Search every contiguous z range [begin, end) the client target could
+     * cover. Layers outside the range must each get a window that meets their
+     * requirements. Keep the feasible plan with the cheapest client
+     * composition */
+    uint64_t best_cost = UINT64_MAX, over_budget_cost = UINT64_MAX;
+    size_t best_begin = 0, best_end = 0;
+    std::array<hwc2_window, HWC2_WINDOW_COUNT> best_windows;
 
-    do {
-        retry_assignment = false;
-        /* The display controller uses a different z order than SurfaceFlinger */
-        uint32_t z_order = windows.size() - 1;
-        client_target_used = false;
+    for (size_t begin = 0; begin <= layer_cnt; begin++) {
+        for (size_t end = begin; end <= layer_cnt; end++) {
+            bool use_client = end > begin;
 
-        /* Iterate over the layers from the back to the front.
-         * assign windows to device layers. Upon reaching a layer that must
-         * be composed by the client all subsequent layers will be assigned
-         * client composition */
-        for (auto &ordered_layer: ordered_layers) {
-            hwc2_layer_t lyr_id = ordered_layer.second;
-            hwc2_composition_t comp_type = layers.find(
-                    lyr_id)->second.get_comp_type();
+            if (!use_client && (begin > 0 || first_client < layer_cnt))
+                continue;
 
-            if (comp_type == HWC2_COMPOSITION_INVALID) {
-                ALOGW("dpy %" PRIu64 " lyr %" PRIu64 ": invalid composition"
-                        " type %u", id, lyr_id, comp_type);
+            if (use_client && first_client < layer_cnt
+                    && (first_client < begin || last_client >= end))
+                continue;
+
+            if (layer_cnt - (end - begin) + use_client > windows.size())
+                continue;
+
+            uint64_t cost = client_cost[end] - client_cost[begin] + use_client;
+            if (cost >= best_cost)
                 continue;
-            }
 
-            /* If the layer is not overlapped and can be assigned a window,
-               assign it and continue to the next layer */
-            if (comp_type == HWC2_COMPOSITION_DEVICE && !client_target_used
-                    && assign_layer_window(z_order, lyr_id) == HWC2_ERROR_NONE) {
-                z_order--;
+            /* The windows outside the range fetch their layers, the client
+             * target fetches a full screen in place of the range */
+            uint64_t bandwidth = layer_bandwidth[layer_cnt]
+                    - (layer_bandwidth[end] - layer_bandwidth[begin])
+                    + (use_client? client_target_bandwidth: 0);
+            if (is_over_budget(bandwidth)) {
+                over_budget_cost = std::min(over_budget_cost, cost);
                 continue;
             }
 
-            /* The layer will be composited into a client target buffer so
-             * find a window for the client target */
-            if (!client_target_assigned) {
+            get_slots(begin, end);
+
+            clear_windows();
+            if (!assign_windows(slots, 0))
+                continue;
+
+            best_cost = cost;
+            best_begin = begin;
+            best_end = end;
+            best_windows = windows;
+        }
+    }
+
+    /* The plan was cut back if the budget ruled out a cheaper one */
+    over_budget = over_budget_cost < best_cost;
+
+    if (best_cost == UINT64_MAX) {
+        /* No plan fits the windows. Compose everything with the client */
+        clear_windows();
+        hwc2_error_t ret = assign_client_target_window(0);
+        ALOG_ASSERT(ret == HWC2_ERROR_NONE, "No valid client target window");
 
-                ret = assign_client_target_window(0);
-                if (ret != HWC2_ERROR_NONE) {
-                    /* If no client target can be assigned, clear all the
-                     * windows, assign a client target and retry assigning
-                     * windows */
-                    retry_assignment = true;
+        best_begin = 0;
+        best_end = layer_cnt;
+    } else {
+        windows = best_windows;
+        over_budget |= assign_client_holes(best_begin, best_end);
+    }
 
-                    changed_comp_types.clear();
-                    clear_windows();
+    client_target_used = best_end > best_begin;
 
-                    ret = assign_client_target_window(0);
-                    ALOG_ASSERT(ret == HWC2_ERROR_NONE, "No valid client target"
-                            " window");
+    for (size_t idx = best_begin; idx < best_end; idx++) {
+        const hwc2_layer &lyr = *ordered_layers[idx];
+        if (client_holes[idx])
+            layer_requests.emplace_back(lyr.get_id(),
+                    HWC2_LAYER_REQUEST_CLEAR_CLIENT_TARGET);
+        else if (lyr.get_comp_type() != HWC2_COMPOSITION_CLIENT)
+            changed_comp_types.emplace_back(lyr.get_id(),
+                    HWC2_COMPOSITION_CLIENT);
+    }
 
-                    client_target_assigned = true;
-                    break;
-                }
+    plan_cache.insert(plan_signature, windows, changed_comp_types,
+            layer_requests, client_target_used, over_budget);
+    over_budget_cnt += over_budget;
 
-                client_target_assigned = true;
-            }
+    ATRACE_INT("HWC2 client layers", best_end - best_begin);
+    ATRACE_END();
+}
+
+/* Returns whether a hole was left out for exceeding the bandwidth budget */
+bool hwc2_display::assign_client_holes(size_t begin, size_t end)
+{
+    /* An opaque layer inside the client range can still be scanned out from
+     * a window below the client target, if the client clears its target to
+     * transparent where the layer is. Client layers above it are blended over
+     * the cleared area, the ones below it are hidden by it anyway. Cursor
+     * layers move without revalidating, so their hole could not follow */
+    if (end == begin)
+        return false;
+
+    hole_candidates.clear();
+    for (size_t idx = begin; idx < end; idx++) {
+        const hwc2_layer &lyr = *ordered_layers[idx];
+        if (lyr.get_comp_type() != HWC2_COMPOSITION_CURSOR
+                && is_window_composition(lyr) && overlap_covered[idx]
+                && lyr.is_opaque() && window_caps.is_supported(lyr))
+            hole_candidates.push_back(idx);
+    }
+
+    /* Try the layers that are the most work for the client first */
+    std::stable_sort(hole_candidates.begin(), hole_candidates.end(),
+            [this] (size_t idx1, size_t idx2) {
+                return client_cost[idx1 + 1] - client_cost[idx1]
+                        > client_cost[idx2 + 1] - client_cost[idx2];
+            });
+
+    std::array<hwc2_window, HWC2_WINDOW_COUNT> best_windows = windows;
+    size_t layer_cnt = ordered_layers.size();
+    size_t free_windows = windows.size() - (layer_cnt - (end - begin) + 1);
+    size_t hole_cnt = 0;
+    bool over_budget = false;
+
+    uint64_t bandwidth = layer_bandwidth[layer_cnt]
+            - (layer_bandwidth[end] - layer_bandwidth[begin])
+            + client_target_bandwidth;
+
+    for (size_t idx: hole_candidates) {
+        /* At least one layer is left for the client target to cover */
+        if (hole_cnt == free_windows || hole_cnt + 1 == end - begin)
+            break;
+
+        /* The client target is fetched in full anyway, so a hole adds its
+         * whole layer on top */
+        uint64_t hole_bandwidth = layer_bandwidth[idx + 1]
+                - layer_bandwidth[idx];
+        if (is_over_budget(bandwidth + hole_bandwidth)) {
+            over_budget = true;
+            continue;
+        }
+
+        client_holes[idx] = true;
+        get_slots(begin, end);
+
+        clear_windows();
+        if (assign_windows(slots, 0)) {
+            best_windows = windows;
+            bandwidth += hole_bandwidth;
+            hole_cnt++;
+        } else {
+            client_holes[idx] = false;
+        }
+    }
+
+    windows = best_windows;
+    return over_budget;
+}
+
+void hwc2_display::get_slots(size_t begin, size_t end)
+{
+    size_t layer_cnt = ordered_layers.size();
+
+    slots.clear();
+    for (size_t idx = 0; idx < begin; idx++)
+        slots.push_back(ordered_layers[idx]);
+    for (size_t idx = begin; idx < end; idx++)
+        if (client_holes[idx])
+            slots.push_back(ordered_layers[idx]);
+    if (end > begin)
+        slots.push_back(nullptr);
+    for (size_t idx = end; idx < layer_cnt; idx++)
+        slots.push_back(ordered_layers[idx]);
+}
+
+bool hwc2_display::is_over_budget(uint64_t bandwidth) const
+{
+    return bandwidth_budget && bandwidth > bandwidth_budget;
+}
+
+bool hwc2_display::is_window_composition(const hwc2_layer &lyr) const
+{
+    switch (lyr.get_comp_type()) {
+    case HWC2_COMPOSITION_DEVICE:
+    case HWC2_COMPOSITION_SOLID_COLOR:
+        return true;
+    case HWC2_COMPOSITION_CURSOR:
+        /* A cursor window is moved without revalidating, which only works
+         * while the whole cursor is on screen */
+        return cursor_mode && is_inside_display(lyr.get_display_frame());
+    default:
+        return false;
+    }
+}
+
+bool hwc2_display::is_inside_display(const hwc_rect_t &rect) const
+{
+    auto it = configs.find(active_config);
+    if (it == configs.end())
+        return false;
+
+    return rect.left >= 0 && rect.top >= 0
+            && rect.right <= it->second.get_attribute(HWC2_ATTRIBUTE_WIDTH)
+            && rect.bottom <= it->second.get_attribute(HWC2_ATTRIBUTE_HEIGHT);
+}
+
+void hwc2_display::order_layers()
+{
+    layers.get_z_order(&ordered_layers);
+
+    ordered_layers.erase(std::remove_if(ordered_layers.begin(),
+            ordered_layers.end(), [this] (const hwc2_layer *lyr) {
+                if (lyr->get_comp_type() != HWC2_COMPOSITION_INVALID)
+                    return false;
+                ALOGW("dpy %" PRIu64 " lyr %" PRIu64 ": invalid composition"
+                        " type", id, lyr->get_id());
+                return true;
+            }), ordered_layers.end());
+
+    cull_layers();
+
+    plan_signature.clear();
+    for (size_t idx = 0; idx < ordered_layers.size(); idx++) {
+        ordered_layers[idx]->get_signature(&plan_signature);
+        plan_signature.push_back(overlap_covered[idx]);
+    }
+}
+
+void hwc2_display::cull_layers()
+{
+    size_t layer_cnt = ordered_layers.size();
+
+    opaque_region.clear();
+    overlap_covered.assign(layer_cnt, true);
+
+    /* Walk from front to back, collecting the area covered by opaque layers.
+     * A layer with a window composition type that lies entirely under that
+     * area does not need a window. The client is not asked to draw it.
+     * Cursors are never culled: they move without a validate and need their
+     * window once they leave the covered area */
+    for (size_t idx = layer_cnt; idx-- > 0; ) {
+        const hwc2_layer *lyr = ordered_layers[idx];
+
+        frame_region.set(lyr->get_display_frame());
+
+        if (is_window_composition(*lyr)
+                && lyr->get_comp_type() != HWC2_COMPOSITION_CURSOR
+                && opaque_region.contains(frame_region)) {
+            ordered_layers[idx] = nullptr;
+            culled_layer_cnt++;
+            freed_window_cnt += window_caps.is_supported(*lyr);
+            continue;
+        }
+
+        if (lyr->is_overlapped()) {
+            const std::vector<hwc_rect_t> &visible = lyr->get_visible_region();
+            visible_region.set(visible.data(), visible.size());
 
-            /* Assign the layer to client composition */
-            if (comp_type != HWC2_COMPOSITION_CLIENT)
-                changed_comp_types.emplace(lyr_id, HWC2_COMPOSITION_CLIENT);
+            frame_region.subtract(visible_region);
+            overlap_covered[idx] = opaque_region.contains(frame_region);
 
-            client_target_used = true;
+            frame_region.set(lyr->get_display_frame());
         }
-    } while (retry_assignment);
+
+        if (lyr->is_opaque())
+            opaque_region.unite(frame_region);
+    }
+
+    size_t kept = 0;
+    for (size_t idx = 0; idx < layer_cnt; idx++) {
+        if (!ordered_layers[idx])
+            continue;
+
+        ordered_layers[kept] = ordered_layers[idx];
+        overlap_covered[kept] = overlap_covered[idx];
+        kept++;
+    }
+
+    ordered_layers.resize(kept);
+    overlap_covered.resize(kept);
+}
+
+bool hwc2_display::assign_windows(const std::vector<const hwc2_layer *> &slots,
+        size_t slot_idx)
+{
+    if (slot_idx == slots.size())
+        return true;
+
+    /* Slots are ordered from back to front. The display controller z order is
+     * the reverse of the SurfaceFlinger z order */
+    uint32_t z_order = windows.size() - 1 - slot_idx;
+    const hwc2_layer *lyr = slots[slot_idx];
+
+    for (auto &window: windows) {
+        hwc2_error_t ret = (lyr)? window.assign_layer(z_order, *lyr):
+                window.assign_client_target(z_order,
+                window_caps.get_layouts());
+        if (ret != HWC2_ERROR_NONE)
+            continue;
+
+        if (assign_windows(slots, slot_idx + 1))
+            return true;
+
+        window.clear();
+    }
+
+    return false;
+}
+
+uint64_t hwc2_display::get_client_cost(const hwc2_layer &lyr)
+{
+    int width = lyr.get_display_frame_width();
+    int height = lyr.get_display_frame_height();
+    if (width <= 0 || height <= 0)
+        return 1;
+
+    uint64_t area = static_cast<uint64_t>(width) * height;
+    uint64_t cost = area + 1;
+
+    if (lyr.get_scale_width() != 1 || lyr.get_scale_height() != 1)
+        cost += area * HWC2_CLIENT_COST_SCALE_PERCENT / 100;
+
+    if (lyr.get_transform() & HWC_TRANSFORM_ROT_90)
+        cost += area * HWC2_CLIENT_COST_ROTATE_PERCENT / 100;
+
+    return cost;
 }
 
 hwc2_error_t hwc2_display::get_changed_composition_types(
@@ -333,8 +912,8 @@ hwc2_error_t hwc2_display::get_changed_composition_types(
 
 hwc2_error_t hwc2_display::get_display_requests(
         hwc2_display_request_t *out_display_requests,
-        uint32_t *out_num_elements, hwc2_layer_t* /*out_layers*/,
-        hwc2_layer_request_t* /*out_layer_requests*/) const
+        uint32_t *out_num_elements, hwc2_layer_t *out_layers,
+        hwc2_layer_request_t *out_layer_requests) const
 {
     if (display_state == modified) {
         ALOGE("dpy %" PRIu64 ": display has been modified since last call to"
@@ -343,8 +922,20 @@ hwc2_error_t hwc2_display::get_display_requests(
     }
 
     *out_display_requests = static_cast<hwc2_display_request_t>(0);
-    *out_num_elements = 0;
 
+    if (!out_layers || !out_layer_requests) {
+        *out_num_elements = layer_requests.size();
+        return HWC2_ERROR_NONE;
+    }
+
+    size_t idx = 0;
+    for (auto &request: layer_requests) {
+        out_layers[idx] = request.first;
+        out_layer_requests[idx] = request.second;
+        idx++;
+    }
+
+    *out_num_elements = layer_requests.size();
     return HWC2_ERROR_NONE;
 }
 
@@ -357,7 +948,7 @@ hwc2_error_t hwc2_display::accept_display_changes()
     }
 
     for (auto &changed: changed_comp_types)
-        layers.find(changed.first)->second.set_comp_type(changed.second);
+        layers.find(changed.first)->set_comp_type(changed.second);
 
     display_state = valid;
 
@@ -366,8 +957,6 @@ hwc2_error_t hwc2_display::accept_display_changes()
 
 hwc2_error_t hwc2_display::present_display(int32_t *out_present_fence)
 {
-    std::vector<struct adf_buffer_config> adf_bufs(windows.size());
-    std::array<adf_id_t, 1> interfaces = {{0}};
     int new_release_fence = -1, err;
 
     hwc2_error_t ret = prepare_present_display();
@@ -377,19 +966,23 @@ hwc2_error_t hwc2_display::present_display(int32_t *out_present_fence)
         return ret;
     }
 
-    tegra_adf_flip *args;
-    size_t args_size = sizeof(*args) + windows.size() * sizeof(args->win[0]);
+    if (type == HWC2_DISPLAY_TYPE_VIRTUAL)
+        return present_virtual_display(out_present_fence);
 
-    args = static_cast<tegra_adf_flip *>(calloc(1, args_size));
-    if (!args) {
-        ALOGE("dpy %" PRIu64 ": failed to alloc tegra_adf_flip", id);
-        *out_present_fence = -1;
-        return HWC2_ERROR_NO_RESOURCES;
-    }
+    update_cmu();
+    sample_present_fence();
+
+    /* A failed asynchronous post left whatever was on screen before it */
+    if (post_worker.take_failed())
+        last_post_valid = false;
+
+    tegra_adf_flip *args = flip_args;
+    memset(args, 0, flip_args_size);
 
     args->win_num = windows.size();
 
     size_t win_idx = 0, buf_idx = 0;
+    bool damaged = false;
     for (auto &win: windows) {
         if (win.contains_client_target()) {
 
@@ -399,19 +992,22 @@ hwc2_error_t hwc2_display::present_display(int32_t *out_present_fence)
                 ALOGE("dpy %" PRIu64 ": failed to get client target adf props", id);
                 goto done;
             }
+            damaged = damaged || client_target.is_damaged();
             buf_idx++;
 
         } else if (win.contains_layer()) {
             hwc2_layer_t lyr_id = win.get_layer();
+            const hwc2_layer *lyr = layers.find(lyr_id);
 
-            ret = layers.find(lyr_id)->second.get_adf_post_props(
-                    &args->win[win_idx], &adf_bufs[buf_idx], win_idx,
-                    buf_idx, win.get_z_order());
+            ret = lyr->get_adf_post_props(&args->win[win_idx],
+                    &adf_bufs[buf_idx], win_idx, buf_idx, win.get_z_order());
             if (ret != HWC2_ERROR_NONE) {
                 ALOGE("dpy %" PRIu64 " lyr %" PRIu64 ": failed to get layer adf"
                         " props", id, lyr_id);
                 goto done;
             }
+            damaged = damaged || (lyr->get_comp_type()
+                    != HWC2_COMPOSITION_SOLID_COLOR && lyr->is_damaged());
             buf_idx++;
 
         } else {
@@ -426,29 +1022,119 @@ hwc2_error_t hwc2_display::present_display(int32_t *out_present_fence)
         win_idx++;
     }
 
-    err = adf_device_post_v2(&adf_dev, interfaces.data(), interfaces.size(),
-            adf_bufs.data(), buf_idx, args, args_size, ADF_COMPLETE_FENCE_PRESENT,
-            &new_release_fence);
+    /* A client may render into the same buffer again, so a post is only
+     * skipped if every buffer in it reports no damage */
+    if (!damaged && is_same_post(buf_idx)) {
+        skipped_post_cnt++;
+        released_layers.clear();
+        merge_acquire_fences();
+        count_present();
+        goto done;
+    }
+
+    /* A skipped post composed nothing, so only frames that are posted count
+     * toward the composition mix */
+    record_mix();
+    propose_bandwidth(buf_idx);
+
+    err = post(buf_idx, &new_release_fence);
     if (err < 0) {
         ALOGE("dpy %" PRIu64 ": adf_device_post_v2 failed %s", id, strerror(err));
         err = HWC2_ERROR_NO_RESOURCES;
         new_release_fence = -1;
+        released_layers.clear();
+        last_post_valid = false;
+    } else {
+        update_released_layers();
+
+        memcpy(last_flip_args, flip_args, flip_args_size);
+        std::copy_n(adf_bufs.begin(), buf_idx, last_adf_bufs.begin());
+        last_buf_cnt = buf_idx;
+        last_post_valid = true;
+        last_post_time = systemTime(SYSTEM_TIME_MONOTONIC);
+        present_fence_pending = true;
+
+        /* A frame presented after the folded one means the screen is
+         * changing again. Replan it with windows next time */
+        if (idle_state == folding) {
+            idle_state = folded;
+        } else if (idle_state == folded) {
+            exit_idle();
+            display_state = modified;
+        }
+
+        count_present();
     }
 
     release_fence.reset(new_release_fence);
 
     close_acquire_fences();
 
-    for (size_t idx = 0; idx < buf_idx; idx++)
-        if (adf_bufs[idx].fd[0] >= 0)
-            close(adf_bufs[idx].fd[0]);
-
 done:
-    free(args);
     *out_present_fence = dup(release_fence.get());
     return ret;
 }
 
+bool hwc2_display::is_same_post(size_t buf_cnt) const
+{
+    if (!last_post_valid || buf_cnt != last_buf_cnt)
+        return false;
+
+    if (memcmp(last_flip_args, flip_args, flip_args_size))
+        return false;
+
+    /* The buffer fds come from the dma-buf cache, so the same buffer has the
+     * same fd. Acquire fences differ every frame and are not compared */
+    for (size_t idx = 0; idx < buf_cnt; idx++)
+        if (memcmp(&last_adf_bufs[idx], &adf_bufs[idx],
+                offsetof(struct adf_buffer_config, acquire_fence)))
+            return false;
+
+    return true;
+}
+
+/* Posts the flip built in flip_args and adf_bufs. With the post worker
+ * running the flip is only queued and the present fence is the worker's
+ * placeholder, so a slow flip on another adf device or on this one does not
+ * hold up present_display */
+int hwc2_display::post(size_t buf_cnt, int *out_present_fence)
+{
+    if (post_worker.is_running()) {
+        hold_posted_dma_bufs(buf_cnt);
+        *out_present_fence = post_worker.queue_post(flip_args,
+                adf_bufs.data(), buf_cnt);
+        return 0;
+    }
+
+    std::array<adf_id_t, 1> interfaces = {{0}};
+
+    ATRACE_BEGIN("adf_device_post_v2");
+    int err = adf_device_post_v2(&adf_dev, interfaces.data(),
+            interfaces.size(), adf_bufs.data(), buf_cnt, flip_args,
+            flip_args_size, ADF_COMPLETE_FENCE_PRESENT, out_present_fence);
+    ATRACE_END();
+
+    if (err >= 0)
+        hold_posted_dma_bufs(buf_cnt);
+    return err;
+}
+
+/* The fds of the last post stay open while the display scans them out. This
+ * also keeps is_same_post from matching an fd number that was reused. The
+ * post worker releases the fds of a post itself once a later one is on
+ * screen */
+void hwc2_display::hold_posted_dma_bufs(size_t buf_cnt)
+{
+    const hwc2_gralloc &gralloc = hwc2_gralloc::get_instance();
+
+    for (size_t idx = 0; idx < buf_cnt; idx++)
+        gralloc.hold_posted_dma_buf(adf_bufs[idx].fd[0]);
+    if (post_worker.is_running())
+        return;
+    for (size_t idx = 0; idx < last_buf_cnt; idx++)
+        gralloc.release_posted_dma_buf(last_adf_bufs[idx].fd[0]);
+}
+
 hwc2_error_t hwc2_display::prepare_present_display()
 {
     if (display_state != valid) {
@@ -466,7 +1152,9 @@ hwc2_error_t hwc2_display::prepare_present_display()
         return HWC2_ERROR_BAD_DISPLAY;
     }
 
+    ATRACE_BEGIN("decompress_window_buffers");
     hwc2_error_t ret = decompress_window_buffers();
+    ATRACE_END();
     if (ret != HWC2_ERROR_NONE) {
         ALOGE("dpy %" PRIu64 ": failed to decompress buffers", id);
         return ret;
@@ -479,12 +1167,50 @@ hwc2_error_t hwc2_display::prepare_present_display()
 void hwc2_display::close_acquire_fences()
 {
     for (auto &lyr: layers)
-        lyr.second.close_acquire_fence();
+        lyr.close_acquire_fence();
 
     if (client_target_used)
         client_target.close_acquire_fence();
 }
 
+/* The kernel waits for the acquire fences of a post before showing it. A
+ * skipped post merges them into the present fence instead, so that fence
+ * does not signal before the client has finished with the buffers, and
+ * present_display does not block on a slow client */
+void hwc2_display::merge_acquire_fences()
+{
+    for (auto &win: windows) {
+        int fence = -1;
+        if (win.contains_client_target())
+            fence = client_target.get_acquire_fence();
+        else if (win.contains_layer())
+            fence = layers.find(win.get_layer())->get_acquire_fence();
+        if (fence < 0)
+            continue;
+
+        int merged = (release_fence.get() < 0)? dup(fence):
+                sync_merge("hwc2_skipped_post", release_fence.get(), fence);
+        if (merged < 0) {
+            ALOGW("dpy %" PRIu64 ": failed to merge acquire fence: %s", id,
+                    strerror(errno));
+            continue;
+        }
+        release_fence.reset(merged);
+    }
+
+    close_acquire_fences();
+}
+
+void hwc2_display::count_present()
+{
+    present_cnt++;
+    if (!validated) {
+        ALOGV("dpy %" PRIu64 ": presented without validate", id);
+        skipped_validate_cnt++;
+    }
+    validated = false;
+}
+
 hwc2_error_t hwc2_display::get_release_fences(uint32_t *out_num_elements,
         hwc2_layer_t *out_layers, int32_t *out_fences) const
 {
@@ -493,79 +1219,302 @@ hwc2_error_t hwc2_display::get_release_fences(uint32_t *out_num_elements,
         return HWC2_ERROR_NONE;
     }
 
-    size_t num = 0;
-
     if (!out_layers || !out_fences) {
-        for (auto &window: windows)
-            if (window.contains_layer())
-                num++;
-        *out_num_elements = num;
+        *out_num_elements = released_layers.size();
         return HWC2_ERROR_NONE;
     }
 
-    for (auto it = windows.begin(); num < *out_num_elements,
-            it != windows.end(); it++) {
-        if (it->contains_layer()) {
-            out_layers[num] = it->get_layer();
-            out_fences[num] = dup(release_fence.get());
-            num++;
-        }
+    size_t num = 0;
+    for (; num < *out_num_elements && num < released_layers.size(); num++) {
+        out_layers[num] = released_layers[num];
+        out_fences[num] = dup(release_fence.get());
     }
 
     *out_num_elements = num;
     return HWC2_ERROR_NONE;
 }
 
-void hwc2_display::init_windows()
+void hwc2_display::update_released_layers()
 {
-    for (auto it = windows.begin(); it != windows.end(); it++)
-        it->set_capabilities(window_capabilities[it - windows.begin()]);
+    scanning_out.clear();
+    for (auto &win: windows) {
+        if (!win.contains_layer())
+            continue;
+
+        hwc2_layer_t lyr_id = win.get_layer();
+        scanning_out.emplace_back(lyr_id,
+                layers.find(lyr_id)->get_buffer_handle());
+    }
+
+    /* The present fence of this post signals when the buffers of the previous
+     * post stop being scanned out. Only layers whose previous buffer was on a
+     * window and has now left it need that fence. Any other layer's previous
+     * buffer was never read by the display and is free already */
+    released_layers.clear();
+    for (auto &prev: scanned_out) {
+        if (std::find(scanning_out.begin(), scanning_out.end(), prev)
+                != scanning_out.end())
+            continue;
+
+        if (layers.find(prev.first))
+            released_layers.push_back(prev.first);
+    }
+
+    scanned_out.swap(scanning_out);
 }
 
-void hwc2_display::clear_windows()
+hwc2_error_t hwc2_display::connect_virtual(uint32_t width, uint32_t height)
 {
-    for (auto &window: windows)
-        window.clear();
+    if (connection == HWC2_CONNECTION_CONNECTED) {
+        ALOGE("dpy %" PRIu64 ": virtual display already in use", id);
+        return HWC2_ERROR_NO_RESOURCES;
+    }
+
+    /* A virtual display has a single config matching its output buffers */
+    configs.clear();
+    configs.emplace(0, hwc2_config());
+    configs[0].set_attribute(HWC2_ATTRIBUTE_WIDTH, width);
+    configs[0].set_attribute(HWC2_ATTRIBUTE_HEIGHT, height);
+    configs[0].set_attribute(HWC2_ATTRIBUTE_VSYNC_PERIOD,
+            HWC2_VIRTUAL_DISPLAY_VSYNC_PERIOD);
+
+    active_config = 0;
+    set_client_target_properties();
+    reset_vsync_model();
+    plan_cache.clear();
+
+    connection = HWC2_CONNECTION_CONNECTED;
+    power_mode = HWC2_POWER_MODE_ON;
+    display_state = modified;
+    return HWC2_ERROR_NONE;
 }
 
-hwc2_error_t hwc2_display::assign_client_target_window(uint32_t z_order)
+void hwc2_display::disconnect_virtual()
 {
-    for (auto &window: windows)
-        if (window.assign_client_target(z_order) == HWC2_ERROR_NONE)
-            return HWC2_ERROR_NONE;
+    /* The next create_virtual_display starts from an empty display */
+    std::vector<hwc2_layer_t> lyr_ids;
+    for (auto &lyr: layers)
+        lyr_ids.push_back(lyr.get_id());
+    for (auto lyr_id: lyr_ids) {
+        layers.find(lyr_id)->release_dma_bufs();
+        layers.erase(lyr_id);
+    }
 
-    return HWC2_ERROR_NO_RESOURCES;
+    client_target.set_buffer(nullptr, -1);
+    client_target.release_dma_bufs();
+    output_buffer = nullptr;
+    output_fence.reset();
+    color_hint = HAL_COLOR_TRANSFORM_IDENTITY;
+    vsync_enabled = HWC2_VSYNC_DISABLE;
+
+    configs.clear();
+    connection = HWC2_CONNECTION_DISCONNECTED;
+    power_mode = HWC2_POWER_MODE_OFF;
+    display_state = modified;
 }
 
-hwc2_error_t hwc2_display::assign_layer_window(uint32_t z_order,
-        hwc2_layer_t lyr_id)
+hwc2_error_t hwc2_display::set_output_buffer(buffer_handle_t buffer,
+        int32_t release_fence)
 {
-    auto& lyr = layers.find(lyr_id)->second;
+    output_fence.reset(release_fence);
 
-    if (!hwc2_window::is_supported(lyr))
-        return HWC2_ERROR_UNSUPPORTED;
-
-    for (auto &window: windows)
-        if (window.assign_layer(z_order, lyr) == HWC2_ERROR_NONE)
-            return HWC2_ERROR_NONE;
+    if (!buffer) {
+        ALOGE("dpy %" PRIu64 ": invalid output buffer", id);
+        return HWC2_ERROR_BAD_PARAMETER;
+    }
 
-    return HWC2_ERROR_NO_RESOURCES;
+    output_buffer = buffer;
+    return HWC2_ERROR_NONE;
 }
 
-hwc2_error_t hwc2_display::decompress_window_buffers()
+void hwc2_display::assign_sw_composition()
 {
-    hwc2_error_t ret;
+    order_layers();
 
-    for (auto &win: windows) {
-        if (win.contains_client_target()) {
-            ret = client_target.decompress();
-            if (ret != HWC2_ERROR_NONE) {
-                ALOGE("dpy %" PRIu64 ": failed to decompress client target"
-                        " buffer", id);
+    auto it = configs.find(active_config);
+    if (it == configs.end()) {
+        force_client_composition();
+        return;
+    }
+
+    int32_t width = it->second.get_attribute(HWC2_ATTRIBUTE_WIDTH);
+    int32_t height = it->second.get_attribute(HWC2_ATTRIBUTE_HEIGHT);
+
+    /* The cpu composes either every layer or none, so a frame it cannot
+     * compose, or would take too long on, goes to the client whole */
+    uint64_t pixels = 0;
+    for (auto lyr: ordered_layers) {
+        if (!hwc2_sw_composer::is_supported(*lyr)) {
+            force_client_composition();
+            return;
+        }
+
+        pixels += static_cast<uint64_t>(std::max(
+                lyr->get_display_frame_width(), 0)) * std::max(
+                lyr->get_display_frame_height(), 0);
+    }
+
+    if (pixels > static_cast<uint64_t>(HWC2_SW_COMPOSER_MAX_OVERDRAW)
+            * width * height) {
+        force_client_composition();
+        return;
+    }
+
+    client_target_used = false;
+}
+
+hwc2_error_t hwc2_display::present_virtual_display(int32_t *out_present_fence)
+{
+    /* The output is written before this returns, so there is no present
+     * fence and no buffer is held past the frame */
+    *out_present_fence = -1;
+    release_fence.reset();
+    released_layers.clear();
+
+    record_mix();
+
+    if (!output_buffer) {
+        ALOGE("dpy %" PRIu64 ": no output buffer", id);
+        close_acquire_fences();
+        return HWC2_ERROR_NO_RESOURCES;
+    }
+
+    int32_t width = configs.at(active_config).get_attribute(
+            HWC2_ATTRIBUTE_WIDTH);
+    int32_t height = configs.at(active_config).get_attribute(
+            HWC2_ATTRIBUTE_HEIGHT);
+    hwc2_error_t ret = HWC2_ERROR_NONE;
+
+    if (client_target_used) {
+        /* The client usually renders straight into the output buffer */
+        if (client_target.get_buffer_handle() != output_buffer)
+            ret = sw_composer.copy(client_target, output_buffer,
+                    output_fence.get(), width, height);
+    } else {
+        for (auto lyr: ordered_layers) {
+            if (lyr->get_comp_type() == HWC2_COMPOSITION_SOLID_COLOR
+                    || lyr->is_decompressed())
+                continue;
+
+            ret = layers.find(lyr->get_id())->decompress_buffer();
+            if (ret != HWC2_ERROR_NONE) {
+                ALOGE("dpy %" PRIu64 " lyr %" PRIu64 ": failed to decompress"
+                        " layer buffer", id, lyr->get_id());
+                break;
+            }
+        }
+
+        if (ret == HWC2_ERROR_NONE)
+            ret = sw_composer.compose(ordered_layers, output_buffer,
+                    output_fence.get(), width, height);
+    }
+
+    output_fence.reset();
+    close_acquire_fences();
+
+    if (ret != HWC2_ERROR_NONE) {
+        ALOGE("dpy %" PRIu64 ": failed to compose output buffer", id);
+        return ret;
+    }
+
+    count_present();
+
+    return HWC2_ERROR_NONE;
+}
+
+void hwc2_display::set_idle_frames(int32_t idle_frames)
+{
+    this->idle_frames = idle_frames;
+}
+
+nsecs_t hwc2_display::get_idle_deadline() const
+{
+    if (idle_frames <= 0 || idle_state != awake || !last_post_valid
+            || power_mode != HWC2_POWER_MODE_ON
+            || connection != HWC2_CONNECTION_CONNECTED)
+        return INT64_MAX;
+
+    /* Folding a single window saves no bandwidth */
+    if (std::count_if(windows.begin(), windows.end(),
+            [] (const hwc2_window &win) { return !win.is_empty(); }) < 2)
+        return INT64_MAX;
+
+    auto it = configs.find(active_config);
+    if (it == configs.end())
+        return INT64_MAX;
+
+    return last_post_time + static_cast<nsecs_t>(idle_frames)
+            * it->second.get_attribute(HWC2_ATTRIBUTE_VSYNC_PERIOD);
+}
+
+void hwc2_display::enter_idle()
+{
+    ATRACE_INT("HWC2 idle", 1);
+
+    idle_state = fold_pending;
+    idle_start = systemTime(SYSTEM_TIME_MONOTONIC);
+    idle_cnt++;
+    display_state = modified;
+}
+
+void hwc2_display::exit_idle()
+{
+    if (idle_state == awake)
+        return;
+
+    ATRACE_INT("HWC2 idle", 0);
+
+    idle_time += systemTime(SYSTEM_TIME_MONOTONIC) - idle_start;
+    idle_state = awake;
+}
+
+void hwc2_display::init_windows()
+{
+    for (auto it = windows.begin(); it != windows.end(); it++)
+        it->set_capabilities(window_caps.get_capabilities(
+                it - windows.begin()));
+}
+
+void hwc2_display::clear_windows()
+{
+    for (auto &window: windows)
+        window.clear();
+}
+
+hwc2_error_t hwc2_display::assign_client_target_window(uint32_t z_order)
+{
+    for (auto &window: windows)
+        if (window.assign_client_target(z_order, window_caps.get_layouts())
+                == HWC2_ERROR_NONE)
+            return HWC2_ERROR_NONE;
+
+    return HWC2_ERROR_NO_RESOURCES;
+}
+
+hwc2_error_t hwc2_display::decompress_window_buffers()
+{
+    nsecs_t start = systemTime(SYSTEM_TIME_MONOTONIC);
+    hwc2_error_t ret;
+
+    for (auto &win: windows) {
+        if (win.contains_client_target()) {
+            if (client_target.is_decompressed())
+                continue;
+
+            late_decompress_cnt++;
+            ret = client_target.decompress();
+            if (ret != HWC2_ERROR_NONE) {
+                ALOGE("dpy %" PRIu64 ": failed to decompress client target"
+                        " buffer", id);
                 return ret;
             }
         } else if (win.contains_layer()) {
-            ret = layers.at(win.get_layer()).decompress_buffer();
+            hwc2_layer *lyr = layers.find(win.get_layer());
+            if (lyr->is_decompressed())
+                continue;
+
+            late_decompress_cnt++;
+            ret = lyr->decompress_buffer();
             if (ret != HWC2_ERROR_NONE) {
                 ALOGE("dpy %" PRIu64 " lyr %" PRIu64 ": failed to decompress"
                         " layer buffer", id, win.get_layer());
@@ -573,9 +1522,20 @@ hwc2_error_t hwc2_display::decompress_window_buffers()
             }
         }
     }
+
+    late_decompress_time += systemTime(SYSTEM_TIME_MONOTONIC) - start;
     return HWC2_ERROR_NONE;
 }
 
+bool hwc2_display::holds_window(hwc2_layer_t lyr_id) const
+{
+    for (auto &win: windows)
+        if (win.contains_layer() && win.get_layer() == lyr_id)
+            return true;
+
+    return false;
+}
+
 int hwc2_display::retrieve_display_configs(struct adf_hwc_helper *adf_helper)
 {
     size_t num_configs = 0;
@@ -628,9 +1588,18 @@ int hwc2_display::retrieve_display_configs(struct adf_hwc_helper *adf_helper)
         }
     }
 
+    reset_vsync_model();
+
     return ret;
 }
 
+void hwc2_display::reset_vsync_model()
+{
+    auto it = configs.find(active_config);
+    vsync_model.reset((it != configs.end())?
+            it->second.get_attribute(HWC2_ATTRIBUTE_VSYNC_PERIOD): 0);
+}
+
 hwc2_error_t hwc2_display::get_display_attribute(hwc2_config_t config,
         hwc2_attribute_t attribute, int32_t *out_value) const
 {
@@ -681,14 +1650,20 @@ hwc2_error_t hwc2_display::set_active_config(
         return HWC2_ERROR_BAD_CONFIG;
     }
 
-    int ret = adf_set_active_config_hwc2(adf_helper, id, config);
-    if (ret < 0) {
-        ALOGE("dpy %" PRIu64 ": failed to set mode: %s", id, strerror(ret));
-        return HWC2_ERROR_BAD_CONFIG;
+    if (type == HWC2_DISPLAY_TYPE_PHYSICAL) {
+        post_worker.flush();
+        int ret = adf_set_active_config_hwc2(adf_helper, id, config);
+        if (ret < 0) {
+            ALOGE("dpy %" PRIu64 ": failed to set mode: %s", id, strerror(ret));
+            return HWC2_ERROR_BAD_CONFIG;
+        }
     }
 
     active_config = config;
     set_client_target_properties();
+    reset_vsync_model();
+    plan_cache.clear();
+    display_state = modified;
 
     return HWC2_ERROR_NONE;
 }
@@ -745,9 +1720,15 @@ hwc2_error_t hwc2_display::set_color_transform(const float *color_matrix,
     case HAL_COLOR_TRANSFORM_CORRECT_PROTANOPIA:
     case HAL_COLOR_TRANSFORM_CORRECT_DEUTERANOPIA:
     case HAL_COLOR_TRANSFORM_CORRECT_TRITANOPIA:
-        memcpy(this->color_matrix.data(), color_matrix,
-                this->color_matrix.size());
+        if (color_hint != this->color_hint || !std::equal(
+                this->color_matrix.begin(), this->color_matrix.end(),
+                color_matrix))
+            display_state = modified;
+        std::copy_n(color_matrix, this->color_matrix.size(),
+                this->color_matrix.begin());
         this->color_hint = color_hint;
+        cmu_transform = cmu && hwc2_get_cmu_csc(this->color_matrix,
+                default_csc, &transform_csc);
         return HWC2_ERROR_NONE;
     default:
         ALOGE("dpy %" PRIu64 ": invalid color transform hint", id);
@@ -755,6 +1736,196 @@ hwc2_error_t hwc2_display::set_color_transform(const float *color_matrix,
     }
 }
 
+void hwc2_display::init_cmu(uint32_t dc_idx)
+{
+    std::string path = "/dev/tegra_dc_" + std::to_string(dc_idx);
+
+    dc_fd = open(path.c_str(), O_RDWR);
+    if (dc_fd < 0) {
+        ALOGW("dpy %" PRIu64 ": failed to open %s: %s", id, path.c_str(),
+                strerror(errno));
+        return;
+    }
+
+    cmu = static_cast<tegra_dc_ext_cmu *>(calloc(1, sizeof(*cmu)));
+    LOG_ALWAYS_FATAL_IF(!cmu, "dpy %" PRIu64 ": failed to alloc"
+            " tegra_dc_ext_cmu", id);
+
+    /* The luts are kept as the kernel programmed them. Without them the csc
+     * cannot be enabled on its own */
+    if (ioctl(dc_fd, TEGRA_DC_EXT_GET_CMU, cmu) < 0 || !cmu->cmu_enable) {
+        ALOGW("dpy %" PRIu64 ": cmu unavailable, color transforms fall back to"
+                " the client", id);
+        free(cmu);
+        cmu = nullptr;
+        return;
+    }
+
+    std::copy_n(cmu->csc, default_csc.size(), default_csc.begin());
+}
+
+void hwc2_display::update_cmu()
+{
+    if (!cmu)
+        return;
+
+    /* The client applies the color transform itself when nothing is device
+     * composited, so the cmu must not apply it a second time */
+    bool device_layers = std::any_of(windows.begin(), windows.end(),
+            [] (const hwc2_window &win) { return win.contains_layer(); });
+
+    const std::array<uint16_t, 9> &csc = (color_hint
+            != HAL_COLOR_TRANSFORM_IDENTITY && cmu_transform
+            && device_layers)? transform_csc: default_csc;
+
+    if (std::equal(csc.begin(), csc.end(), cmu->csc))
+        return;
+
+    /* Frames still queued are posted first so they keep the old csc. The
+     * csc is not latched with the flip though: it takes effect at the next
+     * vsync, while the flip waits for its acquire fences. The frame on
+     * screen can show with the new csc for a vsync or more until this one
+     * replaces it */
+    post_worker.flush();
+
+    std::copy(csc.begin(), csc.end(), cmu->csc);
+    if (ioctl(dc_fd, TEGRA_DC_EXT_SET_CMU, cmu) < 0)
+        ALOGE("dpy %" PRIu64 ": failed to set cmu: %s", id, strerror(errno));
+}
+
+bool hwc2_display::set_bandwidth_budget(uint64_t avail_bw)
+{
+    renegotiate_cnt++;
+
+    if (avail_bw == bandwidth_budget)
+        return false;
+
+    ALOGI("dpy %" PRIu64 ": bandwidth budget %" PRIu64 " KB/s", id, avail_bw);
+
+    /* Every cached plan was checked against the old budget */
+    bandwidth_budget = avail_bw;
+    plan_cache.clear();
+    display_state = modified;
+    return true;
+}
+
+uint64_t hwc2_display::get_windows_bandwidth() const
+{
+    int32_t display_height, vsync_period;
+    get_bandwidth_mode(&display_height, &vsync_period);
+
+    uint64_t bandwidth = 0;
+    for (auto &win: windows) {
+        if (win.contains_client_target())
+            bandwidth += client_target.get_bandwidth(display_height,
+                    vsync_period);
+        else if (win.contains_layer())
+            bandwidth += layers.find(win.get_layer())->get_bandwidth(
+                    display_height, vsync_period);
+    }
+
+    return bandwidth;
+}
+
+void hwc2_display::get_bandwidth_mode(int32_t *out_height,
+        int32_t *out_vsync_period) const
+{
+    auto it = configs.find(active_config);
+    if (it == configs.end()) {
+        *out_height = 0;
+        *out_vsync_period = 0;
+        return;
+    }
+
+    *out_height = it->second.get_attribute(HWC2_ATTRIBUTE_HEIGHT);
+    *out_vsync_period = it->second.get_attribute(HWC2_ATTRIBUTE_VSYNC_PERIOD);
+}
+
+void hwc2_display::sample_present_fence()
+{
+    /* The fence of the previous post has usually signaled by the time the
+     * next frame is presented, so sampling it here never waits */
+    if (!present_fence_pending)
+        return;
+
+    /* A placeholder fence signals after the post's own fence, which is
+     * sampled instead. It is not there until the worker posted the frame */
+    android::base::unique_fd worker_fence;
+    nsecs_t post_time = last_post_time;
+    int fence = release_fence.get();
+    if (post_worker.is_running()) {
+        worker_fence.reset(post_worker.take_present_fence(&post_time));
+        fence = worker_fence.get();
+    }
+    if (fence < 0)
+        return;
+
+    int32_t display_height, vsync_period;
+    get_bandwidth_mode(&display_height, &vsync_period);
+
+    nsecs_t signal_time = stats.record_present_fence(fence, post_time,
+            vsync_period);
+    present_fence_pending = false;
+
+    /* The fence signaled on a real vsync, which also tells how far the vsync
+     * model has drifted */
+    if (signal_time >= 0 && !vsync_model.check_sample(signal_time))
+        ALOGV("dpy %" PRIu64 ": vsync model lost lock", id);
+}
+
+void hwc2_display::record_mix()
+{
+    size_t window_cnt = std::count_if(windows.begin(), windows.end(),
+            [] (const hwc2_window &win) { return win.contains_layer(); });
+
+    hwc2_stats_mix_t mix = HWC2_STATS_MIX_MIXED;
+    if (!client_target_used)
+        mix = HWC2_STATS_MIX_DEVICE;
+    else if (window_cnt == 0)
+        mix = HWC2_STATS_MIX_CLIENT;
+
+    stats.record_mix(layers.size(), mix);
+}
+
+void hwc2_display::propose_bandwidth(size_t buf_cnt)
+{
+    /* The kernel raises the memory clock for a flip only once it is queued.
+     * Proposing a heavier configuration ahead of the flip gives the clock
+     * time to ramp up before the new windows are fetched. The kernel lowers
+     * the clock again by itself after a lighter flip */
+    if (plan_bandwidth <= proposed_bandwidth) {
+        proposed_bandwidth = plan_bandwidth;
+        return;
+    }
+
+    memset(proposed_bw, 0, proposed_bw_size);
+
+    size_t win_cnt = 0;
+    for (size_t win_idx = 0; win_idx < flip_args->win_num; win_idx++) {
+        const tegra_adf_flip_windowattr &attr = flip_args->win[win_idx];
+        if (attr.buf_index < 0
+                || static_cast<size_t>(attr.buf_index) >= buf_cnt)
+            continue;
+
+        const adf_buffer_config &buf = adf_bufs[attr.buf_index];
+        proposed_bw->win[win_cnt].format = buf.format;
+        proposed_bw->win[win_cnt].w = buf.w;
+        proposed_bw->win[win_cnt].h = buf.h;
+        proposed_bw->win[win_cnt].attr = attr;
+        win_cnt++;
+    }
+
+    proposed_bw->win_num = win_cnt;
+
+    if (ioctl(adf_dev.fd, TEGRA_ADF_SET_PROPOSED_BW, proposed_bw) < 0) {
+        ALOGW("dpy %" PRIu64 ": failed to propose %" PRIu64 " KB/s: %s", id,
+                plan_bandwidth, strerror(errno));
+        return;
+    }
+
+    proposed_bandwidth = plan_bandwidth;
+}
+
 hwc2_error_t hwc2_display::get_client_target_support(uint32_t width,
         uint32_t height, android_pixel_format_t format,
         android_dataspace_t dataspace)
@@ -800,6 +1971,16 @@ hwc2_error_t hwc2_display::set_client_target(buffer_handle_t handle,
     if (ret != HWC2_ERROR_NONE)
         return ret;
 
+    /* The client target is set after validate, so its window is known */
+    if (handle && client_target_used) {
+        nsecs_t start = systemTime(SYSTEM_TIME_MONOTONIC);
+
+        if (client_target.decompress() == HWC2_ERROR_NONE) {
+            early_decompress_cnt++;
+            early_decompress_time += systemTime(SYSTEM_TIME_MONOTONIC) - start;
+        }
+    }
+
     ret = client_target.set_dataspace(dataspace);
     if (ret != HWC2_ERROR_NONE)
         return ret;
@@ -836,23 +2017,20 @@ hwc2_error_t hwc2_display::create_layer(hwc2_layer_t *out_layer)
 {
     display_state = modified;
 
-    hwc2_layer_t lyr_id = hwc2_layer::get_next_id();
-    layers.emplace(std::piecewise_construct, std::forward_as_tuple(lyr_id),
-            std::forward_as_tuple(lyr_id));
-
-    *out_layer = lyr_id;
+    *out_layer = layers.emplace();
     return HWC2_ERROR_NONE;
 }
 
 hwc2_error_t hwc2_display::destroy_layer(hwc2_layer_t lyr_id)
 {
-    auto it = layers.find(lyr_id);
-    if (it == layers.end()) {
+    hwc2_layer *lyr = layers.find(lyr_id);
+    if (!lyr) {
         ALOGE("dpy %" PRIu64 ": lyr %" PRIu64 ": bad layer handle", id, lyr_id);
         return HWC2_ERROR_BAD_LAYER;
     }
 
     display_state = modified;
+    lyr->release_dma_bufs();
     layers.erase(lyr_id);
     return HWC2_ERROR_NONE;
 }
@@ -860,211 +2038,411 @@ hwc2_error_t hwc2_display::destroy_layer(hwc2_layer_t lyr_id)
 hwc2_error_t hwc2_display::set_layer_composition_type(hwc2_layer_t lyr_id,
         hwc2_composition_t comp_type)
 {
-    auto it = layers.find(lyr_id);
-    if (it == layers.end()) {
-        ALOGE("dpy %" PRIu64 ": lyr %" PRIu64 ": bad layer handle", id, lyr_id);
+    hwc2_layer *lyr = find_layer(lyr_id);
+    if (!lyr)
         return HWC2_ERROR_BAD_LAYER;
-    }
-
-    hwc2_error_t ret = it->second.set_comp_type(comp_type);
 
-    if (it->second.get_modified())
-        display_state = modified;
-
-    return ret;
+    return set_layer_composition_type(*lyr, comp_type);
 }
 
 hwc2_error_t hwc2_display::set_layer_buffer(hwc2_layer_t lyr_id,
         buffer_handle_t handle, int32_t acquire_fence)
 {
-    auto it = layers.find(lyr_id);
-    if (it == layers.end()) {
-        ALOGE("dpy %" PRIu64 ": lyr %" PRIu64 ": bad layer handle", id, lyr_id);
+    hwc2_layer *lyr = find_layer(lyr_id);
+    if (!lyr)
         return HWC2_ERROR_BAD_LAYER;
-    }
-
-    hwc2_error_t ret = it->second.set_buffer(handle, acquire_fence);
-
-    if (it->second.get_modified())
-        display_state = modified;
 
-    return ret;
+    return set_layer_buffer(*lyr, handle, acquire_fence);
 }
 
 hwc2_error_t hwc2_display::set_layer_dataspace(hwc2_layer_t lyr_id,
         android_dataspace_t dataspace)
 {
-    auto it = layers.find(lyr_id);
-    if (it == layers.end()) {
-        ALOGE("dpy %" PRIu64 ": lyr %" PRIu64 ": bad layer handle", id, lyr_id);
+    hwc2_layer *lyr = find_layer(lyr_id);
+    if (!lyr)
         return HWC2_ERROR_BAD_LAYER;
-    }
-
-    hwc2_error_t ret = it->second.set_dataspace(dataspace);
-
-    if (it->second.get_modified())
-        display_state = modified;
 
-    return ret;
+    return set_layer_dataspace(*lyr, dataspace);
 }
 
 hwc2_error_t hwc2_display::set_layer_display_frame(hwc2_layer_t lyr_id,
         const hwc_rect_t &display_frame)
 {
-    auto it = layers.find(lyr_id);
-    if (it == layers.end()) {
-        ALOGE("dpy %" PRIu64 ": lyr %" PRIu64 ": bad layer handle", id, lyr_id);
+    hwc2_layer *lyr = find_layer(lyr_id);
+    if (!lyr)
         return HWC2_ERROR_BAD_LAYER;
-    }
-
-    hwc2_error_t ret = it->second.set_display_frame(display_frame);
-
-    if (it->second.get_modified())
-        display_state = modified;
 
-    return ret;
+    return set_layer_display_frame(*lyr, display_frame);
 }
 
 hwc2_error_t hwc2_display::set_layer_source_crop(hwc2_layer_t lyr_id,
         const hwc_frect_t &source_crop)
 {
-    auto it = layers.find(lyr_id);
-    if (it == layers.end()) {
-        ALOGE("dpy %" PRIu64 ": lyr %" PRIu64 ": bad layer handle", id, lyr_id);
+    hwc2_layer *lyr = find_layer(lyr_id);
+    if (!lyr)
         return HWC2_ERROR_BAD_LAYER;
-    }
-
-    hwc2_error_t ret = it->second.set_source_crop(source_crop);
 
-    if (it->second.get_modified())
-        display_state = modified;
-
-    return ret;
+    return set_layer_source_crop(*lyr, source_crop);
 }
 
 hwc2_error_t hwc2_display::set_layer_z_order(hwc2_layer_t lyr_id, uint32_t z_order)
 {
-    auto it = layers.find(lyr_id);
-    if (it == layers.end()) {
-        ALOGE("dpy %" PRIu64 ": lyr %" PRIu64 ": bad layer handle", id, lyr_id);
+    hwc2_layer *lyr = find_layer(lyr_id);
+    if (!lyr)
         return HWC2_ERROR_BAD_LAYER;
-    }
-
-    hwc2_error_t ret = it->second.set_z_order(z_order);
 
-    if (it->second.get_modified())
-        display_state = modified;
-
-    return ret;
+    return set_layer_z_order(*lyr, z_order);
 }
 
 hwc2_error_t hwc2_display::set_layer_surface_damage(hwc2_layer_t lyr_id,
         const hwc_region_t &surface_damage)
 {
-    auto it = layers.find(lyr_id);
-    if (it == layers.end()) {
-        ALOGE("dpy %" PRIu64 ": lyr %" PRIu64 ": bad layer handle", id, lyr_id);
+    hwc2_layer *lyr = find_layer(lyr_id);
+    if (!lyr)
         return HWC2_ERROR_BAD_LAYER;
-    }
 
-    return it->second.set_surface_damage(surface_damage);
+    return lyr->set_surface_damage(surface_damage);
 }
 
 hwc2_error_t hwc2_display::set_layer_blend_mode(hwc2_layer_t lyr_id,
         hwc2_blend_mode_t blend_mode)
 {
-    auto it = layers.find(lyr_id);
-    if (it == layers.end()) {
-        ALOGE("dpy %" PRIu64 ": lyr %" PRIu64 ": bad layer handle", id, lyr_id);
+    hwc2_layer *lyr = find_layer(lyr_id);
+    if (!lyr)
+        return HWC2_ERROR_BAD_LAYER;
+
+    return set_layer_blend_mode(*lyr, blend_mode);
+}
+
+hwc2_error_t hwc2_display::set_layer_plane_alpha(hwc2_layer_t lyr_id, float plane_alpha)
+{
+    hwc2_layer *lyr = find_layer(lyr_id);
+    if (!lyr)
+        return HWC2_ERROR_BAD_LAYER;
+
+    return set_layer_plane_alpha(*lyr, plane_alpha);
+}
+
+hwc2_error_t hwc2_display::set_layer_transform(hwc2_layer_t lyr_id,
+        const hwc_transform_t transform)
+{
+    hwc2_layer *lyr = find_layer(lyr_id);
+    if (!lyr)
+        return HWC2_ERROR_BAD_LAYER;
+
+    return set_layer_transform(*lyr, transform);
+}
+
+hwc2_error_t hwc2_display::set_layer_visible_region(hwc2_layer_t lyr_id,
+        const hwc_region_t &visible_region)
+{
+    hwc2_layer *lyr = find_layer(lyr_id);
+    if (!lyr)
+        return HWC2_ERROR_BAD_LAYER;
+
+    return set_layer_visible_region(*lyr, visible_region);
+}
+
+hwc2_error_t hwc2_display::set_layer_color(hwc2_layer_t lyr_id,
+        const hwc_color_t &color)
+{
+    hwc2_layer *lyr = find_layer(lyr_id);
+    if (!lyr)
+        return HWC2_ERROR_BAD_LAYER;
+
+    return set_layer_color(*lyr, color);
+}
+
+hwc2_error_t hwc2_display::set_cursor_position(hwc2_layer_t lyr_id,
+        int32_t x, int32_t y)
+{
+    hwc2_layer *lyr = find_layer(lyr_id);
+    if (!lyr)
         return HWC2_ERROR_BAD_LAYER;
+
+    return set_cursor_position(*lyr, x, y);
+}
+
+hwc2_error_t hwc2_display::set_layer_commands(uint32_t num_words,
+        const uint32_t *commands, uint32_t *out_error_offset)
+{
+    hwc2_error_t ret = HWC2_ERROR_NONE;
+    hwc2_layer *lyr = nullptr;
+    uint32_t offset = 0;
+
+    while (offset < num_words) {
+        uint32_t command = commands[offset] >> 16;
+        uint32_t length = commands[offset] & 0xffff;
+        const uint32_t *args = &commands[offset + 1];
+
+        if (length > num_words - offset - 1
+                || !is_valid_layer_command(command, length)) {
+            ALOGE("dpy %" PRIu64 ": bad layer command %u of length %u at %u",
+                    id, command, length, offset);
+            close_layer_command_fences(num_words, commands, offset);
+            *out_error_offset = offset;
+            return HWC2_ERROR_BAD_PARAMETER;
+        }
+
+        hwc2_error_t err;
+        if (command == HWC2_LAYER_COMMAND_SELECT_LAYER) {
+            /* Look the layer up once for all of the commands that follow */
+            lyr = find_layer(static_cast<hwc2_layer_t>(args[1]) << 32
+                    | args[0]);
+            err = (lyr)? HWC2_ERROR_NONE: HWC2_ERROR_BAD_LAYER;
+        } else if (!lyr) {
+            if (command == HWC2_LAYER_COMMAND_BUFFER
+                    && static_cast<int32_t>(args[2]) >= 0)
+                close(static_cast<int32_t>(args[2]));
+            err = HWC2_ERROR_BAD_LAYER;
+        } else {
+            err = set_layer_command(*lyr, command, length, args);
+        }
+
+        if (err != HWC2_ERROR_NONE && ret == HWC2_ERROR_NONE) {
+            ret = err;
+            *out_error_offset = offset;
+        }
+
+        offset += length + 1;
     }
 
-    hwc2_error_t ret = it->second.set_blend_mode(blend_mode);
+    return ret;
+}
+
+hwc2_layer *hwc2_display::find_layer(hwc2_layer_t lyr_id)
+{
+    hwc2_layer *lyr = layers.find(lyr_id);
+    if (!lyr)
+        ALOGE("dpy %" PRIu64 ": lyr %" PRIu64 ": bad layer handle", id, lyr_id);
+
+    return lyr;
+}
+
+hwc2_error_t hwc2_display::set_layer_composition_type(hwc2_layer &lyr,
+        hwc2_composition_t comp_type)
+{
+    hwc2_error_t ret = lyr.set_comp_type(comp_type);
 
-    if (it->second.get_modified())
+    if (lyr.get_modified())
         display_state = modified;
 
     return ret;
 }
 
-hwc2_error_t hwc2_display::set_layer_plane_alpha(hwc2_layer_t lyr_id, float plane_alpha)
+hwc2_error_t hwc2_display::set_layer_buffer(hwc2_layer &lyr,
+        buffer_handle_t handle, int32_t acquire_fence)
 {
-    auto it = layers.find(lyr_id);
-    if (it == layers.end()) {
-        ALOGE("dpy %" PRIu64 ": lyr %" PRIu64 ": bad layer handle", id, lyr_id);
-        return HWC2_ERROR_BAD_LAYER;
+    hwc2_error_t ret = lyr.set_buffer(handle, acquire_fence);
+
+    if (lyr.get_modified())
+        display_state = modified;
+
+    /* A layer that held a window last frame will most likely keep it. Start
+     * decompressing now so present only has to pass the fence along */
+    if (ret == HWC2_ERROR_NONE && handle && holds_window(lyr.get_id())) {
+        nsecs_t start = systemTime(SYSTEM_TIME_MONOTONIC);
+
+        if (lyr.decompress_buffer() == HWC2_ERROR_NONE) {
+            early_decompress_cnt++;
+            early_decompress_time += systemTime(SYSTEM_TIME_MONOTONIC) - start;
+        }
     }
 
-    hwc2_error_t ret = it->second.set_plane_alpha(plane_alpha);
+    return ret;
+}
 
-    if (it->second.get_modified())
+hwc2_error_t hwc2_display::set_layer_dataspace(hwc2_layer &lyr,
+        android_dataspace_t dataspace)
+{
+    hwc2_error_t ret = lyr.set_dataspace(dataspace);
+
+    if (lyr.get_modified())
         display_state = modified;
 
     return ret;
 }
 
-hwc2_error_t hwc2_display::set_layer_transform(hwc2_layer_t lyr_id,
-        const hwc_transform_t transform)
+hwc2_error_t hwc2_display::set_layer_display_frame(hwc2_layer &lyr,
+        const hwc_rect_t &display_frame)
 {
-    auto it = layers.find(lyr_id);
-    if (it == layers.end()) {
-        ALOGE("dpy %" PRIu64 ": lyr %" PRIu64 ": bad layer handle", id, lyr_id);
-        return HWC2_ERROR_BAD_LAYER;
-    }
+    hwc2_error_t ret = lyr.set_display_frame(display_frame);
+
+    if (lyr.get_modified() || (holds_window(lyr.get_id())
+            && !is_inside_display(lyr.get_display_frame())))
+        display_state = modified;
 
-    hwc2_error_t ret = it->second.set_transform(transform);
+    return ret;
+}
 
-    if (it->second.get_modified())
+hwc2_error_t hwc2_display::set_layer_source_crop(hwc2_layer &lyr,
+        const hwc_frect_t &source_crop)
+{
+    hwc2_error_t ret = lyr.set_source_crop(source_crop);
+
+    if (lyr.get_modified())
         display_state = modified;
 
     return ret;
 }
 
-hwc2_error_t hwc2_display::set_layer_visible_region(hwc2_layer_t lyr_id,
+hwc2_error_t hwc2_display::set_layer_z_order(hwc2_layer &lyr, uint32_t z_order)
+{
+    hwc2_error_t ret = lyr.set_z_order(z_order);
+    layers.invalidate_z_order();
+
+    if (lyr.get_modified())
+        display_state = modified;
+
+    return ret;
+}
+
+hwc2_error_t hwc2_display::set_layer_blend_mode(hwc2_layer &lyr,
+        hwc2_blend_mode_t blend_mode)
+{
+    hwc2_error_t ret = lyr.set_blend_mode(blend_mode);
+
+    if (lyr.get_modified())
+        display_state = modified;
+
+    return ret;
+}
+
+hwc2_error_t hwc2_display::set_layer_plane_alpha(hwc2_layer &lyr,
+        float plane_alpha)
+{
+    hwc2_error_t ret = lyr.set_plane_alpha(plane_alpha);
+
+    if (lyr.get_modified())
+        display_state = modified;
+
+    return ret;
+}
+
+hwc2_error_t hwc2_display::set_layer_transform(hwc2_layer &lyr,
+        hwc_transform_t transform)
+{
+    hwc2_error_t ret = lyr.set_transform(transform);
+
+    if (lyr.get_modified())
+        display_state = modified;
+
+    return ret;
+}
+
+hwc2_error_t hwc2_display::set_layer_visible_region(hwc2_layer &lyr,
         const hwc_region_t &visible_region)
 {
-    auto it = layers.find(lyr_id);
-    if (it == layers.end()) {
-        ALOGE("dpy %" PRIu64 ": lyr %" PRIu64 ": bad layer handle", id, lyr_id);
-        return HWC2_ERROR_BAD_LAYER;
-    }
+    hwc2_error_t ret = lyr.set_visible_region(visible_region);
+
+    if (lyr.get_modified())
+        display_state = modified;
 
-    hwc2_error_t ret = it->second.set_visible_region(visible_region);
+    return ret;
+}
+
+hwc2_error_t hwc2_display::set_layer_color(hwc2_layer &lyr,
+        const hwc_color_t &color)
+{
+    /* A new color reuses the window of the old one unless the fill buffer
+     * could not be allocated */
+    hwc2_error_t ret = lyr.set_color(color);
 
-    if (it->second.get_modified())
+    if (lyr.get_modified())
         display_state = modified;
 
     return ret;
 }
 
-hwc2_error_t hwc2_display::set_layer_color(hwc2_layer_t lyr_id,
-        const hwc_color_t& /*color*/)
+hwc2_error_t hwc2_display::set_cursor_position(hwc2_layer &lyr,
+        int32_t x, int32_t y)
 {
-    auto it = layers.find(lyr_id);
-    if (it == layers.end()) {
-        ALOGE("dpy %" PRIu64 ": lyr %" PRIu64 ": bad layer handle", id, lyr_id);
-        return HWC2_ERROR_BAD_LAYER;
-    }
+    hwc2_error_t ret = lyr.set_cursor_position(x, y);
+    if (ret != HWC2_ERROR_NONE)
+        return ret;
+
+    /* A cursor in a window only moves the window on the next present. A
+     * cursor the client composes is redrawn by the client anyway. Only a
+     * cursor window that leaves the screen needs a new plan */
+    if (holds_window(lyr.get_id())
+            && !is_inside_display(lyr.get_display_frame()))
+        display_state = modified;
 
-    /* Layer colors are not supported on flounder. During validate, any layers
-     * marked HWC2_COMPOSITION_SOLID_COLOR will be changed to
-     * HWC2_COMPOSITION_CLIENT. No need to store the layer color. */
     return HWC2_ERROR_NONE;
 }
 
-hwc2_error_t hwc2_display::set_cursor_position(hwc2_layer_t lyr_id,
-        int32_t /*x*/, int32_t /*y*/)
+hwc2_error_t hwc2_display::set_layer_command(hwc2_layer &lyr, uint32_t command,
+        uint32_t length, const uint32_t *args)
 {
-    auto it = layers.find(lyr_id);
-    if (it == layers.end()) {
-        ALOGE("dpy %" PRIu64 ": lyr %" PRIu64 ": bad layer handle", id, lyr_id);
-        return HWC2_ERROR_BAD_LAYER;
+    switch (command) {
+    case HWC2_LAYER_COMMAND_COMPOSITION_TYPE:
+        return set_layer_composition_type(lyr,
+                static_cast<hwc2_composition_t>(args[0]));
+
+    case HWC2_LAYER_COMMAND_BUFFER: {
+        uintptr_t handle = static_cast<uintptr_t>(
+                static_cast<uint64_t>(args[1]) << 32 | args[0]);
+        return set_layer_buffer(lyr, reinterpret_cast<buffer_handle_t>(handle),
+                static_cast<int32_t>(args[2]));
     }
 
-    /* Cursors are not supported on flounder. During validate, any layers marked
-     * HWC2_COMPOSITION_CURSOR will be changed to HWC2_COMPOSITION_CLIENT.
-     * No need to store the cursor position. */
-    return HWC2_ERROR_NONE;
+    case HWC2_LAYER_COMMAND_DATASPACE:
+        return set_layer_dataspace(lyr,
+                static_cast<android_dataspace_t>(args[0]));
+
+    case HWC2_LAYER_COMMAND_DISPLAY_FRAME: {
+        hwc_rect_t display_frame;
+        memcpy(&display_frame, args, sizeof(display_frame));
+        return set_layer_display_frame(lyr, display_frame);
+    }
+
+    case HWC2_LAYER_COMMAND_SOURCE_CROP: {
+        hwc_frect_t source_crop;
+        memcpy(&source_crop, args, sizeof(source_crop));
+        return set_layer_source_crop(lyr, source_crop);
+    }
+
+    case HWC2_LAYER_COMMAND_Z_ORDER:
+        return set_layer_z_order(lyr, args[0]);
+
+    case HWC2_LAYER_COMMAND_SURFACE_DAMAGE:
+    case HWC2_LAYER_COMMAND_VISIBLE_REGION: {
+        /* hwc_rect_t is four int32_t, so the rects are read in place */
+        hwc_region_t region = {length / 4,
+                reinterpret_cast<const hwc_rect_t *>(args)};
+        if (command == HWC2_LAYER_COMMAND_SURFACE_DAMAGE)
+            return lyr.set_surface_damage(region);
+        return set_layer_visible_region(lyr, region);
+    }
+
+    case HWC2_LAYER_COMMAND_BLEND_MODE:
+        return set_layer_blend_mode(lyr,
+                static_cast<hwc2_blend_mode_t>(args[0]));
+
+    case HWC2_LAYER_COMMAND_PLANE_ALPHA: {
+        float plane_alpha;
+        memcpy(&plane_alpha, args, sizeof(plane_alpha));
+        return set_layer_plane_alpha(lyr, plane_alpha);
+    }
+
+    case HWC2_LAYER_COMMAND_TRANSFORM:
+        return set_layer_transform(lyr, static_cast<hwc_transform_t>(args[0]));
+
+    case HWC2_LAYER_COMMAND_COLOR: {
+        hwc_color_t color = {static_cast<uint8_t>(args[0]),
+                static_cast<uint8_t>(args[0] >> 8),
+                static_cast<uint8_t>(args[0] >> 16),
+                static_cast<uint8_t>(args[0] >> 24)};
+        return set_layer_color(lyr, color);
+    }
+
+    case HWC2_LAYER_COMMAND_CURSOR_POSITION:
+        return set_cursor_position(lyr, static_cast<int32_t>(args[0]),
+                static_cast<int32_t>(args[1]));
+
+    default:
+        return HWC2_ERROR_BAD_PARAMETER;
+    }
 }
 
 hwc2_display_t hwc2_display::get_next_id()
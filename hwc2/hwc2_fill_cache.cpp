@@ -0,0 +1,151 @@
+/*
+ * Copyright (C) 2016 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <cutils/log.h>
+#include <sstream>
+
+#include "hwc2.h"
+
+hwc2_fill_cache::hwc2_fill_cache()
+    : gralloc_module(nullptr),
+      alloc_dev(nullptr),
+      cache_mutex(),
+      cache(),
+      cache_hits(0),
+      cache_allocs(0)
+{
+    const hw_module_t *module;
+
+    int ret = hw_get_module(GRALLOC_HARDWARE_MODULE_ID, &module);
+    if (ret < 0) {
+        ALOGE("failed to get gralloc module: %s", strerror(-ret));
+        return;
+    }
+
+    ret = gralloc_open(module, &alloc_dev);
+    if (ret < 0) {
+        ALOGE("failed to open gralloc alloc device: %s", strerror(-ret));
+        alloc_dev = nullptr;
+        return;
+    }
+
+    gralloc_module = reinterpret_cast<const gralloc_module_t *>(module);
+}
+
+hwc2_fill_cache::~hwc2_fill_cache()
+{
+    cache.clear();
+
+    if (alloc_dev)
+        gralloc_close(alloc_dev);
+}
+
+hwc2_fill_cache &hwc2_fill_cache::get_instance()
+{
+    static hwc2_fill_cache instance;
+    return instance;
+}
+
+std::string hwc2_fill_cache::dump() const
+{
+    std::lock_guard<std::mutex> lock(cache_mutex);
+    std::stringstream dmp;
+
+    dmp << "Fill Cache: " << cache.size() << "/" << HWC2_FILL_CACHE_SIZE
+            << " colors, " << cache_hits << " hits, " << cache_allocs
+            << " allocations\n";
+
+    return dmp.str();
+}
+
+std::shared_ptr<const native_handle_t> hwc2_fill_cache::get(
+        const hwc_color_t &color, bool premultiplied)
+{
+    std::lock_guard<std::mutex> lock(cache_mutex);
+
+    uint8_t r = color.r, g = color.g, b = color.b;
+    if (premultiplied) {
+        r = r * color.a / 0xFF;
+        g = g * color.a / 0xFF;
+        b = b * color.a / 0xFF;
+    }
+
+    /* RGBA_8888 stores the channels in memory order r, g, b, a */
+    uint32_t pixel = r | g << 8 | b << 16 | color.a << 24;
+
+    for (auto it = cache.begin(); it != cache.end(); it++) {
+        if (it->first != pixel)
+            continue;
+
+        cache_hits++;
+        cache.splice(cache.begin(), cache, it);
+        return cache.front().second;
+    }
+
+    std::shared_ptr<const native_handle_t> handle = allocate(pixel);
+    if (!handle)
+        return handle;
+
+    /* Evicted buffers are freed once the last layer using them lets go. Any
+     * post still scanning one out holds its own dma-buf reference */
+    cache.emplace_front(pixel, handle);
+    if (cache.size() > HWC2_FILL_CACHE_SIZE)
+        cache.pop_back();
+
+    return handle;
+}
+
+std::shared_ptr<const native_handle_t> hwc2_fill_cache::allocate(
+        uint32_t pixel)
+{
+    if (!alloc_dev)
+        return nullptr;
+
+    buffer_handle_t handle;
+    int stride;
+
+    int ret = alloc_dev->alloc(alloc_dev, HWC2_FILL_BUFFER_SIZE,
+            HWC2_FILL_BUFFER_SIZE, HAL_PIXEL_FORMAT_RGBA_8888,
+            GRALLOC_USAGE_SW_WRITE_OFTEN | GRALLOC_USAGE_HW_COMPOSER,
+            &handle, &stride);
+    if (ret < 0) {
+        ALOGE("failed to allocate fill buffer: %s", strerror(-ret));
+        return nullptr;
+    }
+
+    alloc_device_t *dev = alloc_dev;
+    std::shared_ptr<const native_handle_t> buffer(handle,
+            [dev] (const native_handle_t *handle) { dev->free(dev, handle); });
+
+    void *vaddr;
+    ret = gralloc_module->lock(gralloc_module, handle,
+            GRALLOC_USAGE_SW_WRITE_OFTEN, 0, 0, HWC2_FILL_BUFFER_SIZE,
+            HWC2_FILL_BUFFER_SIZE, &vaddr);
+    if (ret < 0) {
+        ALOGE("failed to lock fill buffer: %s", strerror(-ret));
+        return nullptr;
+    }
+
+    for (int y = 0; y < HWC2_FILL_BUFFER_SIZE; y++) {
+        uint32_t *row = static_cast<uint32_t *>(vaddr) + y * stride;
+        std::fill_n(row, HWC2_FILL_BUFFER_SIZE, pixel);
+    }
+
+    gralloc_module->unlock(gralloc_module, handle);
+
+    cache_allocs++;
+    return buffer;
+}
@@ -16,7 +16,10 @@
 
 #include <cutils/log.h>
 #include <dlfcn.h>
+#include <unistd.h>
 #include <tegra_adf.h>
+#include <algorithm>
+#include <sstream>
 
 #include "hwc2.h"
 
@@ -47,6 +50,16 @@
 #define NVGR_SURFACE_OFFSET_BLOCK_HEIGHT_LOG2 32
 
 hwc2_gralloc::hwc2_gralloc()
+    : cache_mutex(),
+      cache(),
+      cache_index(),
+      cache_hits(0),
+      cache_misses(0),
+      dma_bufs(),
+      dma_buf_index(),
+      dma_buf_hits(0),
+      dma_buf_exports(0),
+      dma_buf_closes(0)
 {
     nvgr = dlopen("gralloc.tegra132.so", RTLD_LOCAL | RTLD_LAZY);
     LOG_ALWAYS_FATAL_IF(!nvgr, "failed to find module");
@@ -81,6 +94,10 @@ hwc2_gralloc::hwc2_gralloc()
 
 hwc2_gralloc::~hwc2_gralloc()
 {
+    for (auto &dma_buf: dma_bufs)
+        if (dma_buf.fd >= 0)
+            close(dma_buf.fd);
+
     dlclose(nvgr);
 }
 
@@ -90,19 +107,130 @@ const hwc2_gralloc &hwc2_gralloc::get_instance()
     return instance;
 }
 
+std::string hwc2_gralloc::dump() const
+{
+    std::lock_guard<std::mutex> lock(cache_mutex);
+    std::stringstream dmp;
+    uint64_t lookups = cache_hits + cache_misses;
+
+    dmp << "Gralloc Cache: " << cache.size() << "/" << HWC2_GRALLOC_CACHE_SIZE
+            << " handles, " << cache_hits << " hits, " << cache_misses
+            << " misses";
+
+    if (lookups > 0)
+        dmp << " (" << cache_hits * 100 / lookups << "% hit rate)";
+
+    size_t held = std::count_if(dma_bufs.begin(), dma_bufs.end(),
+            [] (const hwc2_dma_buf &dma_buf) { return dma_buf.holds > 0; });
+
+    dmp << "\nDma-buf Cache: " << dma_bufs.size() << " fds (" << held
+            << " held), " << dma_buf_hits << " hits, " << dma_buf_exports
+            << " exports, " << dma_buf_closes << " closes\n";
+
+    return dmp.str();
+}
+
 bool hwc2_gralloc::is_valid(buffer_handle_t handle) const
 {
     return nvgr_is_valid(handle);
 }
 
-bool hwc2_gralloc::is_stereo(buffer_handle_t handle) const
+bool hwc2_gralloc::get_metadata(buffer_handle_t handle,
+        hwc2_gralloc_metadata *out_metadata) const
+{
+    std::lock_guard<std::mutex> lock(cache_mutex);
+
+    auto it = cache_index.find(handle);
+    if (it != cache_index.end()) {
+        auto entry = it->second;
+
+        if (is_current(*entry, handle)) {
+            cache.splice(cache.begin(), cache, entry);
+            *out_metadata = entry->metadata;
+            cache_hits++;
+            return true;
+        }
+
+        /* The handle was freed and its address reused by another buffer */
+        release_dma_bufs(entry->metadata);
+        cache.erase(entry);
+        cache_index.erase(it);
+    }
+
+    cache_misses++;
+
+    hwc2_gralloc_metadata metadata;
+    if (!read_metadata(handle, &metadata))
+        return false;
+
+    if (cache.size() >= HWC2_GRALLOC_CACHE_SIZE) {
+        release_dma_bufs(cache.back().metadata);
+        cache_index.erase(cache.back().handle);
+        cache.pop_back();
+    }
+
+    cache.emplace_front();
+
+    hwc2_gralloc_entry &entry = cache.front();
+    entry.handle = handle;
+    entry.num_fds = handle->numFds;
+    entry.num_ints = handle->numInts;
+    entry.data.assign(handle->data,
+            handle->data + handle->numFds + handle->numInts);
+    entry.metadata = metadata;
+
+    cache_index.emplace(handle, cache.begin());
+
+    *out_metadata = metadata;
+    return true;
+}
+
+bool hwc2_gralloc::read_metadata(buffer_handle_t handle,
+        hwc2_gralloc_metadata *out_metadata) const
+{
+    const void *surf;
+    size_t surf_cnt;
+
+    nvgr_get_surfaces(handle, &surf, &surf_cnt);
+    if (!surf || surf_cnt == 0 || surf_cnt > HWC2_GRALLOC_MAX_SURFACES) {
+        ALOGE("failed to get surfaces");
+        return false;
+    }
+
+    out_metadata->format = get_format(handle);
+    out_metadata->yuv = nvgr_is_yuv(handle);
+    out_metadata->stereo = nvgr_is_stereo(handle);
+    out_metadata->surf_cnt = surf_cnt;
+
+    for (uint32_t idx = 0; idx < HWC2_GRALLOC_MAX_SURFACES; idx++) {
+        hwc2_gralloc_surface &surface = out_metadata->surfaces[idx];
+
+        if (idx >= surf_cnt) {
+            surface = hwc2_gralloc_surface();
+            continue;
+        }
+
+        surface.layout = get_layout(surf, idx);
+        surface.pitch = get_pitch(surf, idx);
+        surface.hmem = get_hmem(surf, idx);
+        surface.offset = get_offset(surf, idx);
+        surface.block_height_log2 = get_block_height_log2(surf, idx);
+    }
+
+    return true;
+}
+
+bool hwc2_gralloc::is_current(const hwc2_gralloc_entry &entry,
+        buffer_handle_t handle) const
 {
-    return nvgr_is_stereo(handle);
+    return entry.num_fds == handle->numFds
+            && entry.num_ints == handle->numInts
+            && std::equal(entry.data.begin(), entry.data.end(), handle->data);
 }
 
-bool hwc2_gralloc::is_yuv(buffer_handle_t handle) const
+int hwc2_gralloc::get_pixel_format(buffer_handle_t handle) const
 {
-    return nvgr_is_yuv(handle);
+    return nvgr_get_format(handle);
 }
 
 int hwc2_gralloc::get_format(buffer_handle_t handle) const
@@ -127,16 +255,128 @@ int hwc2_gralloc::get_format(buffer_handle_t handle) const
     }
 }
 
-void hwc2_gralloc::get_surfaces(buffer_handle_t handle,
-        const void **surf, size_t *surf_cnt) const
+/* Called when the metadata of a buffer is dropped. Held fds belong to buffers
+ * that may still be posted and are left to their holders */
+void hwc2_gralloc::release_dma_bufs(const hwc2_gralloc_metadata &metadata) const
+{
+    for (size_t idx = 0; idx < metadata.surf_cnt; idx++) {
+        auto it = dma_buf_index.find(metadata.surfaces[idx].hmem);
+        if (it != dma_buf_index.end() && it->second->holds == 0)
+            close_dma_buf(it->second);
+    }
+}
+
+void hwc2_gralloc::close_dma_buf(std::list<hwc2_dma_buf>::iterator it) const
 {
-    nvgr_get_surfaces(handle, surf, surf_cnt);
+    if (it->fd >= 0) {
+        close(it->fd);
+        dma_buf_closes++;
+    }
+
+    dma_buf_index.erase(it->hmem);
+    dma_bufs.erase(it);
+}
+
+/* Closes the least recently used fds that nothing holds until at most
+ * HWC2_DMA_BUF_CACHE_SIZE of them are left */
+void hwc2_gralloc::evict_dma_bufs() const
+{
+    size_t unheld = std::count_if(dma_bufs.begin(), dma_bufs.end(),
+            [] (const hwc2_dma_buf &dma_buf) { return dma_buf.holds == 0; });
+
+    for (auto it = dma_bufs.end(); unheld > HWC2_DMA_BUF_CACHE_SIZE
+            && it != dma_bufs.begin(); ) {
+        --it;
+        if (it->holds > 0)
+            continue;
+
+        close_dma_buf(it++);
+        unheld--;
+    }
+}
+
+void hwc2_gralloc::get_dma_buf(uint32_t hmem, int *out_fd) const
+{
+    std::lock_guard<std::mutex> lock(cache_mutex);
+
+    auto it = dma_buf_index.find(hmem);
+    if (it != dma_buf_index.end() && it->second->fd >= 0) {
+        dma_bufs.splice(dma_bufs.begin(), dma_bufs, it->second);
+        *out_fd = it->second->fd;
+        dma_buf_hits++;
+        return;
+    }
+
+    int fd = -1;
+    NvRmMemDmaBufFdFromHandle(hmem, &fd);
+    dma_buf_exports++;
+
+    *out_fd = fd;
+    if (fd < 0)
+        return;
+
+    if (it != dma_buf_index.end()) {
+        it->second->fd = fd;
+        dma_bufs.splice(dma_bufs.begin(), dma_bufs, it->second);
+        return;
+    }
+
+    dma_bufs.push_front({hmem, fd, 0});
+    dma_buf_index.emplace(hmem, dma_bufs.begin());
+    evict_dma_bufs();
+}
+
+void hwc2_gralloc::hold_dma_buf(uint32_t hmem) const
+{
+    std::lock_guard<std::mutex> lock(cache_mutex);
+
+    auto it = dma_buf_index.find(hmem);
+    if (it != dma_buf_index.end()) {
+        it->second->holds++;
+        return;
+    }
+
+    dma_bufs.push_front({hmem, -1, 1});
+    dma_buf_index.emplace(hmem, dma_bufs.begin());
+}
+
+void hwc2_gralloc::release_dma_buf(uint32_t hmem) const
+{
+    std::lock_guard<std::mutex> lock(cache_mutex);
+
+    auto it = dma_buf_index.find(hmem);
+    if (it == dma_buf_index.end() || it->second->holds == 0) {
+        ALOGE("released an unheld dma-buf");
+        return;
+    }
+
+    if (--it->second->holds == 0)
+        close_dma_buf(it->second);
 }
 
-void hwc2_gralloc::get_dma_buf(const void *surf, uint32_t surf_idx,
-        int *out_fd) const
+void hwc2_gralloc::hold_posted_dma_buf(int fd) const
 {
-    NvRmMemDmaBufFdFromHandle(get_hmem(surf, surf_idx), out_fd);
+    std::lock_guard<std::mutex> lock(cache_mutex);
+
+    auto it = std::find_if(dma_bufs.begin(), dma_bufs.end(),
+            [fd] (const hwc2_dma_buf &dma_buf) { return dma_buf.fd == fd; });
+    if (it != dma_bufs.end())
+        it->holds++;
+}
+
+void hwc2_gralloc::release_posted_dma_buf(int fd) const
+{
+    std::lock_guard<std::mutex> lock(cache_mutex);
+
+    auto it = std::find_if(dma_bufs.begin(), dma_bufs.end(),
+            [fd] (const hwc2_dma_buf &dma_buf) { return dma_buf.fd == fd; });
+    if (it == dma_bufs.end() || it->holds == 0) {
+        ALOGE("released an unheld posted dma-buf");
+        return;
+    }
+
+    if (--it->holds == 0)
+        close_dma_buf(it);
 }
 
 int32_t hwc2_gralloc::get_layout(const void *surf, uint32_t surf_idx) const
@@ -15,18 +15,21 @@
  */
 
 #include <inttypes.h>
+#include <unistd.h>
 #include <cutils/log.h>
+#include <tegra_adf.h>
 
 #include <sstream>
 
 #include "hwc2.h"
 
-uint64_t hwc2_layer::layer_cnt = 0;
-
 hwc2_layer::hwc2_layer(hwc2_layer_t id)
     : id(id),
       buffer(),
       comp_type(HWC2_COMPOSITION_INVALID),
+      source_crop(),
+      color(),
+      fill_buffer(),
       modified(true) { }
 
 std::string hwc2_layer::dump() const
@@ -49,7 +52,13 @@ hwc2_error_t hwc2_layer::get_adf_post_props(
         struct adf_buffer_config *adf_buf, size_t win_idx,
         size_t buf_idx, uint32_t z_order) const
 {
-    return buffer.get_adf_post_props(win_attr, adf_buf, win_idx, buf_idx, z_order);
+    hwc2_error_t ret = buffer.get_adf_post_props(win_attr, adf_buf, win_idx,
+            buf_idx, z_order);
+
+    if (ret == HWC2_ERROR_NONE && comp_type == HWC2_COMPOSITION_CURSOR)
+        win_attr->flags |= TEGRA_ADF_FLIP_FLAG_CURSOR;
+
+    return ret;
 }
 
 buffer_handle_t hwc2_layer::get_buffer_handle() const
@@ -102,9 +111,9 @@ float hwc2_layer::get_scale_height() const
     return buffer.get_scale_height();
 }
 
-void hwc2_layer::get_surfaces(const void **surf, size_t *surf_cnt) const
+size_t hwc2_layer::get_surface_count() const
 {
-    buffer.get_surfaces(surf, surf_cnt);
+    return buffer.get_surface_count();
 }
 
 bool hwc2_layer::is_source_crop_int_aligned() const
@@ -127,6 +136,14 @@ bool hwc2_layer::is_overlapped() const
     return buffer.is_overlapped();
 }
 
+void hwc2_layer::get_signature(std::vector<uint32_t> *signature) const
+{
+    signature->push_back(static_cast<uint32_t>(id));
+    signature->push_back(static_cast<uint32_t>(id >> 32));
+    signature->push_back(comp_type);
+    buffer.get_signature(signature);
+}
+
 hwc2_error_t hwc2_layer::set_comp_type(hwc2_composition_t comp_type)
 {
     hwc2_error_t ret = HWC2_ERROR_NONE;
@@ -149,7 +166,20 @@ hwc2_error_t hwc2_layer::set_comp_type(hwc2_composition_t comp_type)
     }
 
     modified = modified || comp_type != this->comp_type;
-    this->comp_type = comp_type;
+
+    if (comp_type != this->comp_type) {
+        bool was_solid_color = this->comp_type == HWC2_COMPOSITION_SOLID_COLOR;
+        this->comp_type = comp_type;
+
+        if (comp_type == HWC2_COMPOSITION_SOLID_COLOR) {
+            update_fill_buffer();
+        } else if (was_solid_color) {
+            fill_buffer.reset();
+            buffer.set_buffer(nullptr, -1);
+            buffer.set_source_crop(source_crop);
+        }
+    }
+
     return ret;
 }
 
@@ -158,6 +188,9 @@ hwc2_error_t hwc2_layer::set_buffer(buffer_handle_t handle, int32_t acquire_fenc
     if (comp_type == HWC2_COMPOSITION_SOLID_COLOR
             || comp_type == HWC2_COMPOSITION_SIDEBAND
             || comp_type == HWC2_COMPOSITION_CLIENT) {
+        /* The fence is ours to close even if the buffer is not used */
+        if (acquire_fence >= 0)
+            close(acquire_fence);
         return HWC2_ERROR_NONE;
     }
 
@@ -176,14 +209,67 @@ hwc2_error_t hwc2_layer::set_dataspace(android_dataspace_t dataspace)
 
 hwc2_error_t hwc2_layer::set_display_frame(const hwc_rect_t &display_frame)
 {
+    /* A cursor that only moved keeps its window. It does not need to be
+     * validated again */
+    const hwc_rect_t &current = buffer.get_display_frame();
+    if (comp_type == HWC2_COMPOSITION_CURSOR
+            && display_frame.right - display_frame.left
+                    == current.right - current.left
+            && display_frame.bottom - display_frame.top
+                    == current.bottom - current.top)
+        return set_cursor_position(display_frame.left, display_frame.top);
+
     return buffer.set_display_frame(display_frame);
 }
 
+hwc2_error_t hwc2_layer::set_cursor_position(int32_t x, int32_t y)
+{
+    if (comp_type != HWC2_COMPOSITION_CURSOR) {
+        ALOGE("lyr %" PRIu64 ": not a cursor layer", id);
+        return HWC2_ERROR_BAD_LAYER;
+    }
+
+    buffer.move_display_frame(x, y);
+    return HWC2_ERROR_NONE;
+}
+
 hwc2_error_t hwc2_layer::set_source_crop(const hwc_frect_t &source_crop)
 {
+    this->source_crop = source_crop;
+
+    if (comp_type == HWC2_COMPOSITION_SOLID_COLOR)
+        return HWC2_ERROR_NONE;
+
     return buffer.set_source_crop(source_crop);
 }
 
+hwc2_error_t hwc2_layer::set_color(const hwc_color_t &color)
+{
+    this->color = color;
+
+    if (comp_type != HWC2_COMPOSITION_SOLID_COLOR)
+        return HWC2_ERROR_NONE;
+
+    return update_fill_buffer();
+}
+
+hwc2_error_t hwc2_layer::update_fill_buffer()
+{
+    /* If no fill buffer is available the layer has no buffer and is composed
+     * by the client */
+    fill_buffer = hwc2_fill_cache::get_instance().get(color,
+            buffer.get_blend_mode() == HWC2_BLEND_MODE_PREMULTIPLIED);
+
+    hwc_frect_t crop;
+    crop.left = HWC2_FILL_BUFFER_BORDER;
+    crop.top = HWC2_FILL_BUFFER_BORDER;
+    crop.right = HWC2_FILL_BUFFER_SIZE - HWC2_FILL_BUFFER_BORDER;
+    crop.bottom = HWC2_FILL_BUFFER_SIZE - HWC2_FILL_BUFFER_BORDER;
+    buffer.set_source_crop(crop);
+
+    return buffer.set_buffer(fill_buffer.get(), -1);
+}
+
 hwc2_error_t hwc2_layer::set_z_order(uint32_t z_order)
 {
     return buffer.set_z_order(z_order);
@@ -196,7 +282,18 @@ hwc2_error_t hwc2_layer::set_surface_damage(const hwc_region_t &surface_damage)
 
 hwc2_error_t hwc2_layer::set_blend_mode(hwc2_blend_mode_t blend_mode)
 {
-    return buffer.set_blend_mode(blend_mode);
+    bool premultiplied = buffer.get_blend_mode()
+            == HWC2_BLEND_MODE_PREMULTIPLIED;
+
+    hwc2_error_t ret = buffer.set_blend_mode(blend_mode);
+    if (ret != HWC2_ERROR_NONE || comp_type != HWC2_COMPOSITION_SOLID_COLOR)
+        return ret;
+
+    /* The fill color is premultiplied for premultiplied blending only */
+    if (premultiplied != (blend_mode == HWC2_BLEND_MODE_PREMULTIPLIED))
+        return update_fill_buffer();
+
+    return HWC2_ERROR_NONE;
 }
 
 hwc2_error_t hwc2_layer::set_plane_alpha(float plane_alpha)
@@ -213,8 +310,3 @@ hwc2_error_t hwc2_layer::set_visible_region(const hwc_region_t &visible_region)
 {
     return buffer.set_visible_region(visible_region);
 }
-
-hwc2_layer_t hwc2_layer::get_next_id()
-{
-    return layer_cnt++;
-}
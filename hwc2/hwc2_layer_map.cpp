@@ -0,0 +1,136 @@
+/*
+ * Copyright (C) 2016 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <algorithm>
+
+#include "hwc2.h"
+
+#define HWC2_LAYER_SLOT_FREE UINT32_MAX
+
+hwc2_layer_map::hwc2_layer_map(uint32_t initial_generation)
+    : layers(),
+      layer_slots(),
+      slots(),
+      free_slots(),
+      initial_generation((initial_generation)? initial_generation: 1),
+      z_order(),
+      z_order_valid(true) { }
+
+hwc2_layer_t hwc2_layer_map::emplace()
+{
+    uint32_t slot;
+
+    if (free_slots.empty()) {
+        slot = slots.size();
+        slots.push_back({initial_generation, HWC2_LAYER_SLOT_FREE});
+    } else {
+        slot = free_slots.back();
+        free_slots.pop_back();
+    }
+
+    hwc2_layer_t lyr_id = static_cast<hwc2_layer_t>(slots[slot].generation)
+            << 32 | slot;
+
+    slots[slot].index = layers.size();
+    layers.emplace_back(lyr_id);
+    layer_slots.push_back(slot);
+
+    z_order.push_back(slot);
+    z_order_valid = false;
+
+    return lyr_id;
+}
+
+bool hwc2_layer_map::erase(hwc2_layer_t lyr_id)
+{
+    uint32_t slot = get_slot(lyr_id);
+    if (slot == HWC2_LAYER_SLOT_FREE)
+        return false;
+
+    uint32_t index = slots[slot].index;
+    uint32_t last = layers.size() - 1;
+
+    if (index != last) {
+        layers[index] = std::move(layers[last]);
+        layer_slots[index] = layer_slots[last];
+        slots[layer_slots[index]].index = index;
+    }
+
+    layers.pop_back();
+    layer_slots.pop_back();
+
+    /* Skip generation 0 on wrap around so an id of 0 is never valid */
+    slots[slot].index = HWC2_LAYER_SLOT_FREE;
+    if (++slots[slot].generation == 0)
+        slots[slot].generation = 1;
+    free_slots.push_back(slot);
+
+    /* Removing an element keeps the remaining slots sorted */
+    z_order.erase(std::find(z_order.begin(), z_order.end(), slot));
+
+    return true;
+}
+
+hwc2_layer *hwc2_layer_map::find(hwc2_layer_t lyr_id)
+{
+    uint32_t slot = get_slot(lyr_id);
+    if (slot == HWC2_LAYER_SLOT_FREE)
+        return nullptr;
+
+    return &layers[slots[slot].index];
+}
+
+const hwc2_layer *hwc2_layer_map::find(hwc2_layer_t lyr_id) const
+{
+    uint32_t slot = get_slot(lyr_id);
+    if (slot == HWC2_LAYER_SLOT_FREE)
+        return nullptr;
+
+    return &layers[slots[slot].index];
+}
+
+void hwc2_layer_map::get_z_order(std::vector<const hwc2_layer *> *out_layers)
+{
+    if (!z_order_valid) {
+        /* Break z order ties with the layer id so the order is stable */
+        std::sort(z_order.begin(), z_order.end(),
+                [this] (uint32_t lhs, uint32_t rhs) {
+                    const hwc2_layer &l = layers[slots[lhs].index];
+                    const hwc2_layer &r = layers[slots[rhs].index];
+
+                    if (l.get_z_order() != r.get_z_order())
+                        return l.get_z_order() < r.get_z_order();
+                    return l.get_id() < r.get_id();
+                });
+        z_order_valid = true;
+    }
+
+    out_layers->clear();
+    for (uint32_t slot: z_order)
+        out_layers->push_back(&layers[slots[slot].index]);
+}
+
+uint32_t hwc2_layer_map::get_slot(hwc2_layer_t lyr_id) const
+{
+    uint32_t slot = static_cast<uint32_t>(lyr_id);
+    uint32_t generation = static_cast<uint32_t>(lyr_id >> 32);
+
+    if (slot >= slots.size() || slots[slot].generation != generation
+            || slots[slot].index == HWC2_LAYER_SLOT_FREE)
+        return HWC2_LAYER_SLOT_FREE;
+
+    return slot;
+}
@@ -0,0 +1,115 @@
+/*
+ * Copyright (C) 2016 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <iterator>
+#include <sstream>
+
+#include "hwc2.h"
+
+hwc2_plan_cache::hwc2_plan_cache()
+    : entries(),
+      hits(0),
+      misses(0) { }
+
+std::string hwc2_plan_cache::dump() const
+{
+    std::stringstream dmp;
+    uint64_t lookups = hits + misses;
+
+    dmp << "  Plan Cache: " << entries.size() << "/" << HWC2_PLAN_CACHE_SIZE
+            << " entries, " << hits << " hits, " << misses << " misses";
+
+    if (lookups > 0)
+        dmp << " (" << hits * 100 / lookups << "% hit rate)";
+
+    dmp << "\n";
+
+    return dmp.str();
+}
+
+bool hwc2_plan_cache::find(const std::vector<uint32_t> &signature,
+        std::array<hwc2_window, HWC2_WINDOW_COUNT> *out_windows,
+        std::vector<std::pair<hwc2_layer_t, hwc2_composition_t>>
+        *out_comp_types,
+        std::vector<std::pair<hwc2_layer_t, hwc2_layer_request_t>>
+        *out_layer_requests,
+        bool *out_client_target_used, bool *out_over_budget)
+{
+    uint64_t hash = get_hash(signature);
+
+    for (auto it = entries.begin(); it != entries.end(); it++) {
+        if (it->hash != hash || it->signature != signature)
+            continue;
+
+        /* Move the entry to the front so it is the last to be evicted */
+        entries.splice(entries.begin(), entries, it);
+
+        *out_windows = it->windows;
+        *out_comp_types = it->changed_comp_types;
+        *out_layer_requests = it->layer_requests;
+        *out_client_target_used = it->client_target_used;
+        *out_over_budget = it->over_budget;
+
+        hits++;
+        return true;
+    }
+
+    misses++;
+    return false;
+}
+
+void hwc2_plan_cache::insert(const std::vector<uint32_t> &signature,
+        const std::array<hwc2_window, HWC2_WINDOW_COUNT> &windows,
+        const std::vector<std::pair<hwc2_layer_t, hwc2_composition_t>>
+        &comp_types,
+        const std::vector<std::pair<hwc2_layer_t, hwc2_layer_request_t>>
+        &layer_requests,
+        bool client_target_used, bool over_budget)
+{
+    /* Recycle the least recently used entry once the cache is full. Assigning
+     * over its members reuses their storage */
+    if (entries.size() >= HWC2_PLAN_CACHE_SIZE)
+        entries.splice(entries.begin(), entries, std::prev(entries.end()));
+    else
+        entries.emplace_front();
+
+    hwc2_plan &plan = entries.front();
+    plan.hash = get_hash(signature);
+    plan.signature = signature;
+    plan.windows = windows;
+    plan.changed_comp_types = comp_types;
+    plan.layer_requests = layer_requests;
+    plan.client_target_used = client_target_used;
+    plan.over_budget = over_budget;
+}
+
+void hwc2_plan_cache::clear()
+{
+    entries.clear();
+}
+
+uint64_t hwc2_plan_cache::get_hash(const std::vector<uint32_t> &signature)
+{
+    /* 64 bit FNV-1a */
+    uint64_t hash = 0xcbf29ce484222325ULL;
+
+    for (uint32_t word: signature) {
+        hash ^= word;
+        hash *= 0x100000001b3ULL;
+    }
+
+    return hash;
+}
@@ -0,0 +1,317 @@
+/*
+ * Copyright (C) 2016 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <cutils/log.h>
+#include <cutils/properties.h>
+#include <sync/sync.h>
+#include <tegra_adf.h>
+#include <unistd.h>
+#include <inttypes.h>
+
+#include <sstream>
+#include <cstdlib>
+#include <cstring>
+#include <cerrno>
+#include <algorithm>
+
+#include "hwc2.h"
+
+#define ATRACE_TAG ATRACE_TAG_GRAPHICS
+#include "cutils/trace.h"
+
+hwc2_post_worker::hwc2_post_worker(hwc2_display_t id)
+    : id(id),
+      adf_dev(nullptr),
+      flip_args_size(0),
+      post_mutex(),
+      post_cond(),
+      jobs(),
+      job_head(0),
+      job_cnt(0),
+      posting(false),
+      post_exit(false),
+      timeline(-1),
+      queued_point(0),
+      unsignaled_points(0),
+      posted_fds(),
+      posted_cnt(0),
+      present_fence(-1),
+      present_time(0),
+      failed(false),
+      post_cnt(0),
+      failed_cnt(0),
+      replaced_cnt(0),
+      post_time(0),
+      worker_thread() { }
+
+hwc2_post_worker::~hwc2_post_worker()
+{
+    stop();
+
+    for (auto &job: jobs)
+        free(job.flip_args);
+}
+
+std::string hwc2_post_worker::dump() const
+{
+    std::lock_guard<std::mutex> lock(post_mutex);
+    std::stringstream dmp;
+
+    if (!is_running()) {
+        dmp << "  Post worker: off, posts are synchronous\n";
+        return dmp.str();
+    }
+
+    dmp << "  Post worker: " << post_cnt << " posts, " << failed_cnt
+            << " failed, " << replaced_cnt << " replaced while queued";
+    if (post_cnt)
+        dmp << ", avg " << post_time / post_cnt / 1000 << "us per flip";
+    dmp << "\n";
+
+    return dmp.str();
+}
+
+bool hwc2_post_worker::start(struct adf_device *adf_dev,
+        size_t flip_args_size)
+{
+    if (!property_get_int32("debug.hwc2.async_post", 1))
+        return false;
+
+    int fd = sw_sync_timeline_create();
+    if (fd < 0) {
+        ALOGW("dpy %" PRIu64 ": no sw_sync timeline, posting synchronously:"
+                " %s", id, strerror(errno));
+        return false;
+    }
+
+    for (auto &job: jobs) {
+        job.flip_args = static_cast<tegra_adf_flip *>(calloc(1,
+                flip_args_size));
+        LOG_ALWAYS_FATAL_IF(!job.flip_args, "dpy %" PRIu64 ": failed to"
+                " alloc tegra_adf_flip", id);
+        job.buf_cnt = 0;
+        job.points = 0;
+    }
+
+    timeline.reset(fd);
+    queued_point = 0;
+    unsignaled_points = 0;
+    this->adf_dev = adf_dev;
+    this->flip_args_size = flip_args_size;
+    post_exit = false;
+
+    worker_thread = std::thread(&hwc2_post_worker::post_loop, this);
+    return true;
+}
+
+void hwc2_post_worker::stop()
+{
+    if (!worker_thread.joinable())
+        return;
+
+    /* The worker posts what is still queued before it exits, so every
+     * placeholder fence handed out signals */
+    {
+        std::lock_guard<std::mutex> lock(post_mutex);
+        post_exit = true;
+    }
+
+    post_cond.notify_all();
+    worker_thread.join();
+
+    /* Nothing is posted after this, so fences held back by failed posts
+     * signal now rather than never */
+    if (unsignaled_points)
+        sw_sync_timeline_inc(timeline.get(), unsignaled_points);
+    unsignaled_points = 0;
+
+    const hwc2_gralloc &gralloc = hwc2_gralloc::get_instance();
+    for (size_t idx = 0; idx < posted_cnt; idx++)
+        gralloc.release_posted_dma_buf(posted_fds[idx]);
+    posted_cnt = 0;
+
+    present_fence.reset();
+    timeline.reset();
+}
+
+int hwc2_post_worker::queue_post(const struct tegra_adf_flip *flip_args,
+        const struct adf_buffer_config *adf_bufs, size_t buf_cnt)
+{
+    std::lock_guard<std::mutex> lock(post_mutex);
+    uint32_t points = 1;
+    hwc2_post_job *job;
+
+    /* Only the newest frame is worth posting once the flip before it is
+     * done. A replaced frame's fence signals with the one replacing it */
+    if (job_cnt > 1 || (job_cnt == 1 && !posting)) {
+        job = &jobs[(job_head + job_cnt - 1) % jobs.size()];
+        points += job->points;
+        release_job(*job);
+        replaced_cnt++;
+        ALOGV("dpy %" PRIu64 ": replaced a queued post, %" PRIu64 " so far",
+                id, replaced_cnt);
+        ATRACE_INT("hwc2_post_replaced", static_cast<int32_t>(replaced_cnt));
+    } else {
+        job = &jobs[(job_head + job_cnt) % jobs.size()];
+        job_cnt++;
+    }
+
+    memcpy(job->flip_args, flip_args, flip_args_size);
+    std::copy_n(adf_bufs, buf_cnt, job->adf_bufs.begin());
+    for (size_t idx = 0; idx < buf_cnt; idx++) {
+        int fence = adf_bufs[idx].acquire_fence;
+        job->adf_bufs[idx].acquire_fence = (fence >= 0)? dup(fence): -1;
+    }
+    job->buf_cnt = buf_cnt;
+    job->points = points;
+
+    queued_point++;
+    int fence = sw_sync_fence_create(timeline.get(), "hwc2_present",
+            queued_point);
+    if (fence < 0)
+        ALOGE("dpy %" PRIu64 ": failed to create present fence: %s", id,
+                strerror(errno));
+
+    post_cond.notify_all();
+    return fence;
+}
+
+void hwc2_post_worker::flush()
+{
+    std::unique_lock<std::mutex> lock(post_mutex);
+    post_cond.wait(lock, [this] { return job_cnt == 0; });
+}
+
+bool hwc2_post_worker::take_failed()
+{
+    std::lock_guard<std::mutex> lock(post_mutex);
+    bool ret = failed;
+    failed = false;
+    return ret;
+}
+
+int hwc2_post_worker::take_present_fence(nsecs_t *out_post_time)
+{
+    std::lock_guard<std::mutex> lock(post_mutex);
+    *out_post_time = present_time;
+    return present_fence.release();
+}
+
+/* Closes the acquire fence dups of a job that will not be posted and
+ * releases its buffer fds */
+void hwc2_post_worker::release_job(hwc2_post_job &job)
+{
+    const hwc2_gralloc &gralloc = hwc2_gralloc::get_instance();
+
+    for (size_t idx = 0; idx < job.buf_cnt; idx++) {
+        if (job.adf_bufs[idx].acquire_fence >= 0)
+            close(job.adf_bufs[idx].acquire_fence);
+        gralloc.release_posted_dma_buf(job.adf_bufs[idx].fd[0]);
+    }
+
+    job.buf_cnt = 0;
+}
+
+void hwc2_post_worker::post_loop()
+{
+    const hwc2_gralloc &gralloc = hwc2_gralloc::get_instance();
+    std::array<adf_id_t, 1> interfaces = {{0}};
+    std::unique_lock<std::mutex> lock(post_mutex);
+
+    while (true) {
+        post_cond.wait(lock, [this] { return job_cnt || post_exit; });
+        if (!job_cnt)
+            break;
+
+        /* The job at the head is not touched by queue_post while posting is
+         * set, so it is posted without the lock */
+        hwc2_post_job &job = jobs[job_head];
+        posting = true;
+        lock.unlock();
+
+        int fence = -1;
+        nsecs_t start = systemTime(SYSTEM_TIME_MONOTONIC);
+
+        ATRACE_BEGIN("adf_device_post_v2");
+        int err = adf_device_post_v2(adf_dev, interfaces.data(),
+                interfaces.size(), job.adf_bufs.data(), job.buf_cnt,
+                job.flip_args, flip_args_size, ADF_COMPLETE_FENCE_PRESENT,
+                &fence);
+        ATRACE_END();
+
+        nsecs_t end = systemTime(SYSTEM_TIME_MONOTONIC);
+
+        if (err < 0) {
+            ALOGE("dpy %" PRIu64 ": adf_device_post_v2 failed %s", id,
+                    strerror(-err));
+            release_job(job);
+            fence = -1;
+        } else {
+            for (size_t idx = 0; idx < job.buf_cnt; idx++)
+                if (job.adf_bufs[idx].acquire_fence >= 0)
+                    close(job.adf_bufs[idx].acquire_fence);
+
+            /* The placeholder must not signal before the frame is on
+             * screen, and the buffers it replaced are only free then, so
+             * a late present fence is waited for however long it takes */
+            while (sync_wait(fence, HWC2_POST_FENCE_TIMEOUT) < 0) {
+                if (errno != ETIME && errno != EINTR) {
+                    ALOGE("dpy %" PRIu64 ": failed to wait for present"
+                            " fence: %s", id, strerror(errno));
+                    break;
+                }
+                if (errno == ETIME)
+                    ALOGW("dpy %" PRIu64 ": present fence not signaled"
+                            " after %d ms", id, HWC2_POST_FENCE_TIMEOUT);
+            }
+        }
+
+        lock.lock();
+
+        /* A failed post leaves the previous frame on screen, so its fence
+         * and the release fences handed out with it wait for the next post
+         * that succeeds */
+        if (err < 0) {
+            failed = true;
+            failed_cnt++;
+            unsignaled_points += job.points;
+        } else {
+            for (size_t idx = 0; idx < posted_cnt; idx++)
+                gralloc.release_posted_dma_buf(posted_fds[idx]);
+            for (size_t idx = 0; idx < job.buf_cnt; idx++)
+                posted_fds[idx] = job.adf_bufs[idx].fd[0];
+            posted_cnt = job.buf_cnt;
+
+            present_fence.reset(fence);
+            present_time = start;
+            post_cnt++;
+        }
+        post_time += end - start;
+
+        if (err >= 0) {
+            sw_sync_timeline_inc(timeline.get(),
+                    unsignaled_points + job.points);
+            unsignaled_points = 0;
+        }
+
+        job.buf_cnt = 0;
+        job_head = (job_head + 1) % jobs.size();
+        job_cnt--;
+        posting = false;
+
+        post_cond.notify_all();
+    }
+}
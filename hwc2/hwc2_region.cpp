@@ -0,0 +1,226 @@
+/*
+ * Copyright (C) 2016 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <algorithm>
+
+#include "hwc2.h"
+
+static bool is_empty(const hwc_rect_t &rect)
+{
+    return rect.left >= rect.right || rect.top >= rect.bottom;
+}
+
+static bool intersects(const hwc_rect_t &r1, const hwc_rect_t &r2)
+{
+    return r1.left < r2.right && r2.left < r1.right && r1.top < r2.bottom
+            && r2.top < r1.bottom;
+}
+
+static hwc_rect_t get_intersection(const hwc_rect_t &r1, const hwc_rect_t &r2)
+{
+    hwc_rect_t rect;
+    rect.left = std::max(r1.left, r2.left);
+    rect.top = std::max(r1.top, r2.top);
+    rect.right = std::min(r1.right, r2.right);
+    rect.bottom = std::min(r1.bottom, r2.bottom);
+    return rect;
+}
+
+hwc2_region::hwc2_region()
+    : rects(),
+      bounds(),
+      scratch() { }
+
+hwc2_region::hwc2_region(const hwc_rect_t &rect)
+    : hwc2_region()
+{
+    set(rect);
+}
+
+void hwc2_region::clear()
+{
+    rects.clear();
+    bounds = hwc_rect_t();
+}
+
+void hwc2_region::set(const hwc_rect_t &rect)
+{
+    clear();
+    if (::is_empty(rect))
+        return;
+
+    rects.push_back(rect);
+    bounds = rect;
+}
+
+void hwc2_region::set(const hwc_rect_t *in_rects, size_t rect_cnt)
+{
+    clear();
+    for (size_t idx = 0; idx < rect_cnt; idx++)
+        unite(in_rects[idx]);
+}
+
+uint64_t hwc2_region::get_area() const
+{
+    uint64_t area = 0;
+    for (auto &rect: rects)
+        area += static_cast<uint64_t>(rect.right - rect.left)
+                * (rect.bottom - rect.top);
+    return area;
+}
+
+bool hwc2_region::contains(const hwc2_region &other) const
+{
+    if (other.is_empty())
+        return true;
+
+    if (!intersects(bounds, other.bounds))
+        return false;
+
+    /* Every rect is removed from a copy of the other region. It is contained
+     * if nothing is left */
+    scratch.assign(other.rects.begin(), other.rects.end());
+    for (auto &cut: rects) {
+        if (scratch.empty())
+            break;
+        subtract_rect(cut, &scratch);
+    }
+
+    return scratch.empty();
+}
+
+hwc2_region &hwc2_region::unite(const hwc_rect_t &rect)
+{
+    if (::is_empty(rect))
+        return *this;
+
+    /* Only the parts of the rect not already covered are added so the rects
+     * never overlap */
+    scratch.clear();
+    scratch.push_back(rect);
+    for (auto &cut: rects)
+        if (intersects(cut, rect))
+            subtract_rect(cut, &scratch);
+
+    rects.insert(rects.end(), scratch.begin(), scratch.end());
+    update_bounds();
+    return *this;
+}
+
+hwc2_region &hwc2_region::unite(const hwc2_region &other)
+{
+    if (&other == this)
+        return *this;
+
+    for (auto &rect: other.rects)
+        unite(rect);
+    return *this;
+}
+
+hwc2_region &hwc2_region::intersect(const hwc2_region &other)
+{
+    if (!intersects(bounds, other.bounds)) {
+        clear();
+        return *this;
+    }
+
+    /* Both regions are made of disjoint rects, so are their pairwise
+     * intersections */
+    scratch.clear();
+    for (auto &r1: rects) {
+        if (!intersects(r1, other.bounds))
+            continue;
+
+        for (auto &r2: other.rects)
+            if (intersects(r1, r2))
+                scratch.push_back(get_intersection(r1, r2));
+    }
+
+    rects.swap(scratch);
+    update_bounds();
+    return *this;
+}
+
+hwc2_region &hwc2_region::subtract(const hwc2_region &other)
+{
+    if (!intersects(bounds, other.bounds))
+        return *this;
+
+    for (auto &cut: other.rects) {
+        if (rects.empty())
+            break;
+
+        if (intersects(cut, bounds))
+            subtract_rect(cut, &rects);
+    }
+
+    update_bounds();
+    return *this;
+}
+
+/* Removes cut from every rect in out_rects. A rect split by the cut leaves at
+ * most four pieces: the bands above and below the cut, and the parts left and
+ * right of it in between */
+void hwc2_region::subtract_rect(const hwc_rect_t &cut,
+        std::vector<hwc_rect_t> *out_rects)
+{
+    size_t cnt = out_rects->size();
+
+    for (size_t idx = 0; idx < cnt; ) {
+        hwc_rect_t rect = (*out_rects)[idx];
+
+        if (!intersects(rect, cut)) {
+            idx++;
+            continue;
+        }
+
+        /* Replace the rect with the last one so the pieces can be appended
+         * without revisiting them */
+        (*out_rects)[idx] = (*out_rects)[cnt - 1];
+        (*out_rects)[cnt - 1] = out_rects->back();
+        out_rects->pop_back();
+        cnt--;
+
+        int32_t top = std::max(rect.top, cut.top);
+        int32_t bottom = std::min(rect.bottom, cut.bottom);
+
+        if (rect.top < cut.top)
+            out_rects->push_back({rect.left, rect.top, rect.right, cut.top});
+        if (cut.bottom < rect.bottom)
+            out_rects->push_back({rect.left, cut.bottom, rect.right,
+                    rect.bottom});
+        if (rect.left < cut.left)
+            out_rects->push_back({rect.left, top, cut.left, bottom});
+        if (cut.right < rect.right)
+            out_rects->push_back({cut.right, top, rect.right, bottom});
+    }
+}
+
+void hwc2_region::update_bounds()
+{
+    if (rects.empty()) {
+        bounds = hwc_rect_t();
+        return;
+    }
+
+    bounds = rects.front();
+    for (auto &rect: rects) {
+        bounds.left = std::min(bounds.left, rect.left);
+        bounds.top = std::min(bounds.top, rect.top);
+        bounds.right = std::max(bounds.right, rect.right);
+        bounds.bottom = std::max(bounds.bottom, rect.bottom);
+    }
+}
@@ -0,0 +1,207 @@
+/*
+ * Copyright (C) 2016 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <sync/sync.h>
+#include <algorithm>
+#include <sstream>
+
+#include "hwc2.h"
+
+static const char *latency_names[HWC2_STATS_LATENCY_COUNT] = {
+    "Validate",
+    "Accept",
+    "Present",
+    "Present fence",
+};
+
+hwc2_stats::hwc2_stats()
+    : latency(),
+      latency_total(),
+      latency_max(),
+      mix(),
+      missed_vsync_cnt(0),
+      unsignaled_fence_cnt(0)
+{
+    for (size_t idx = 0; idx < HWC2_STATS_LATENCY_COUNT; idx++) {
+        for (auto &bucket: latency[idx])
+            bucket.store(0);
+        latency_total[idx].store(0);
+        latency_max[idx].store(0);
+    }
+
+    for (auto &counts: mix)
+        for (auto &count: counts)
+            count.store(0);
+}
+
+std::string hwc2_stats::dump() const
+{
+    std::stringstream dmp;
+
+    for (size_t idx = 0; idx < HWC2_STATS_LATENCY_COUNT; idx++) {
+        uint64_t cnt = 0;
+        for (auto &bucket: latency[idx])
+            cnt += bucket.load(std::memory_order_relaxed);
+
+        dmp << "  " << latency_names[idx] << " latency: " << cnt
+                << " samples";
+        if (cnt == 0) {
+            dmp << "\n";
+            continue;
+        }
+
+        dmp << ", avg " << latency_total[idx].load(std::memory_order_relaxed)
+                / cnt / 1000 << "us, max "
+                << latency_max[idx].load(std::memory_order_relaxed) / 1000
+                << "us\n   ";
+
+        /* Bucket b counts durations below 2^b us */
+        for (size_t bucket = 0; bucket < HWC2_STATS_BUCKETS; bucket++) {
+            uint64_t bucket_cnt = latency[idx][bucket].load(
+                    std::memory_order_relaxed);
+            if (bucket_cnt == 0)
+                continue;
+
+            if (bucket == HWC2_STATS_BUCKETS - 1)
+                dmp << " >=" << (1 << (bucket - 1)) << "us:" << bucket_cnt;
+            else
+                dmp << " <" << (1 << bucket) << "us:" << bucket_cnt;
+        }
+        dmp << "\n";
+    }
+
+    dmp << "  Missed vsyncs: " << missed_vsync_cnt.load(
+            std::memory_order_relaxed) << ", present fences pending at the"
+            " next present: " << unsignaled_fence_cnt.load(
+            std::memory_order_relaxed) << "\n";
+
+    dmp << "  Composition mix (layers: device/mixed/client):";
+    for (size_t layer_cnt = 0; layer_cnt <= HWC2_STATS_LAYER_COUNTS;
+            layer_cnt++) {
+        uint64_t device = mix[layer_cnt][HWC2_STATS_MIX_DEVICE].load(
+                std::memory_order_relaxed);
+        uint64_t mixed = mix[layer_cnt][HWC2_STATS_MIX_MIXED].load(
+                std::memory_order_relaxed);
+        uint64_t client = mix[layer_cnt][HWC2_STATS_MIX_CLIENT].load(
+                std::memory_order_relaxed);
+        if (device + mixed + client == 0)
+            continue;
+
+        dmp << " " << layer_cnt
+                << ((layer_cnt == HWC2_STATS_LAYER_COUNTS)? "+": "") << ": "
+                << device << "/" << mixed << "/" << client;
+    }
+    dmp << "\n";
+
+    return dmp.str();
+}
+
+void hwc2_stats::get_data(hwc2_display_t dpy_id,
+        struct hwc2_stats_data *out_data) const
+{
+    out_data->display = dpy_id;
+
+    for (size_t idx = 0; idx < HWC2_STATS_LATENCY_COUNT; idx++) {
+        for (size_t bucket = 0; bucket < HWC2_STATS_BUCKETS; bucket++)
+            out_data->latency[idx][bucket] = latency[idx][bucket].load(
+                    std::memory_order_relaxed);
+        out_data->latency_total[idx] = latency_total[idx].load(
+                std::memory_order_relaxed);
+        out_data->latency_max[idx] = latency_max[idx].load(
+                std::memory_order_relaxed);
+    }
+
+    for (size_t layer_cnt = 0; layer_cnt <= HWC2_STATS_LAYER_COUNTS;
+            layer_cnt++)
+        for (size_t idx = 0; idx < HWC2_STATS_MIX_COUNT; idx++)
+            out_data->mix[layer_cnt][idx] = mix[layer_cnt][idx].load(
+                    std::memory_order_relaxed);
+
+    out_data->missed_vsync_cnt = missed_vsync_cnt.load(
+            std::memory_order_relaxed);
+    out_data->unsignaled_fence_cnt = unsignaled_fence_cnt.load(
+            std::memory_order_relaxed);
+}
+
+void hwc2_stats::record_latency(hwc2_stats_latency_t idx, nsecs_t duration)
+{
+    if (duration < 0)
+        duration = 0;
+
+    latency[idx][get_bucket(duration)].fetch_add(1, std::memory_order_relaxed);
+    latency_total[idx].fetch_add(duration, std::memory_order_relaxed);
+
+    /* Only the calls on one display race here, so the loop rarely retries */
+    uint64_t max = latency_max[idx].load(std::memory_order_relaxed);
+    while (static_cast<uint64_t>(duration) > max
+            && !latency_max[idx].compare_exchange_weak(max, duration,
+            std::memory_order_relaxed)) { }
+}
+
+void hwc2_stats::record_mix(size_t layer_cnt, hwc2_stats_mix_t idx)
+{
+    layer_cnt = std::min<size_t>(layer_cnt, HWC2_STATS_LAYER_COUNTS);
+    mix[layer_cnt][idx].fetch_add(1, std::memory_order_relaxed);
+}
+
+nsecs_t hwc2_stats::record_present_fence(int fence, nsecs_t post_time,
+        nsecs_t vsync_period)
+{
+    nsecs_t signal_time = get_signal_time(fence);
+    if (signal_time < 0) {
+        unsignaled_fence_cnt.fetch_add(1, std::memory_order_relaxed);
+        return signal_time;
+    }
+
+    nsecs_t duration = signal_time - post_time;
+    record_latency(HWC2_STATS_PRESENT_FENCE, duration);
+
+    /* A post flips on the next vsync. Every further vsync before the fence
+     * signaled was missed */
+    if (vsync_period > 0 && duration > vsync_period)
+        missed_vsync_cnt.fetch_add(duration / vsync_period,
+                std::memory_order_relaxed);
+
+    return signal_time;
+}
+
+size_t hwc2_stats::get_bucket(nsecs_t duration)
+{
+    uint64_t us = duration / 1000;
+    if (us == 0)
+        return 0;
+
+    size_t bucket = 64 - __builtin_clzll(us);
+    return std::min<size_t>(bucket, HWC2_STATS_BUCKETS - 1);
+}
+
+nsecs_t hwc2_stats::get_signal_time(int fence)
+{
+    struct sync_fence_info_data *info = sync_fence_info(fence);
+    if (!info)
+        return -1;
+
+    /* The fence signaled when its last sync point did */
+    nsecs_t signal_time = -1;
+    if (info->status == 1) {
+        struct sync_pt_info *pt = nullptr;
+        while ((pt = sync_pt_info(info, pt)))
+            signal_time = std::max<nsecs_t>(signal_time, pt->timestamp_ns);
+    }
+
+    sync_fence_info_free(info);
+    return signal_time;
+}
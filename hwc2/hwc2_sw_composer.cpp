@@ -0,0 +1,592 @@
+/*
+ * Copyright (C) 2016 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <cutils/log.h>
+#include <sync/sync.h>
+#include <tegra_adf.h>
+#include <algorithm>
+#include <cerrno>
+#include <cmath>
+#include <cstring>
+#include <sstream>
+
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#define HWC2_SW_COMPOSER_NEON
+#endif
+
+#include "hwc2.h"
+
+#define ATRACE_TAG ATRACE_TAG_GRAPHICS
+#include "cutils/trace.h"
+
+/* Pixels are stored in memory order r, g, b, a, so a little endian word holds
+ * r in its low byte and a in its high byte. All blending is done on
+ * premultiplied pixels: out = src + dst * (255 - src_a) / 255 */
+
+/* x * y / 255 rounded to nearest, exact for 8 bit x and y */
+static inline uint32_t mul_div255(uint32_t x, uint32_t y)
+{
+    uint32_t t = x * y + 0x80;
+    return (t + (t >> 8)) >> 8;
+}
+
+/* mul_div255 of every channel of px by y. Two channels share each multiply,
+ * in 16 bit lanes that cannot carry into each other */
+static inline uint32_t mul_div255_px(uint32_t px, uint32_t y)
+{
+    uint32_t rb = (px & 0x00ff00ff) * y + 0x00800080;
+    rb = ((rb + ((rb >> 8) & 0x00ff00ff)) >> 8) & 0x00ff00ff;
+
+    uint32_t ga = ((px >> 8) & 0x00ff00ff) * y + 0x00800080;
+    ga = (ga + ((ga >> 8) & 0x00ff00ff)) & 0xff00ff00;
+
+    return rb | ga;
+}
+
+/* Adds every channel, saturating at 255. Premultiplied sources with a color
+ * channel above their alpha would otherwise carry into the next channel */
+static inline uint32_t add_sat_px(uint32_t x, uint32_t y)
+{
+    uint32_t signs = (x ^ y) & 0x80808080;
+    uint32_t carries = x & y & 0x80808080;
+
+    uint32_t sum = (x & 0x7f7f7f7f) + (y & 0x7f7f7f7f);
+    carries |= signs & sum;
+
+    return (sum ^ signs) | ((carries << 1) - (carries >> 7));
+}
+
+/* Converts a pixel to premultiplied alpha and applies the plane alpha */
+static inline uint32_t premultiply_px(uint32_t px,
+        hwc2_blend_mode_t blend_mode, uint32_t plane_alpha)
+{
+    switch (blend_mode) {
+    case HWC2_BLEND_MODE_NONE:
+        return mul_div255_px(px | 0xff000000, plane_alpha);
+    case HWC2_BLEND_MODE_COVERAGE: {
+        uint32_t alpha = mul_div255(px >> 24, plane_alpha);
+        return (mul_div255_px(px, alpha) & 0x00ffffff) | alpha << 24;
+    }
+    default:
+        return mul_div255_px(px, plane_alpha);
+    }
+}
+
+static inline uint32_t blend_px(uint32_t src, uint32_t dst)
+{
+    return add_sat_px(src, mul_div255_px(dst, 0xff - (src >> 24)));
+}
+
+void hwc2_sw_composer::premultiply_row_scalar(uint32_t *px, size_t cnt,
+        hwc2_blend_mode_t blend_mode, uint8_t plane_alpha)
+{
+    for (size_t idx = 0; idx < cnt; idx++)
+        px[idx] = premultiply_px(px[idx], blend_mode, plane_alpha);
+}
+
+void hwc2_sw_composer::blend_row_scalar(const uint32_t *src, uint32_t *dst,
+        size_t cnt)
+{
+    for (size_t idx = 0; idx < cnt; idx++)
+        dst[idx] = blend_px(src[idx], dst[idx]);
+}
+
+#ifdef HWC2_SW_COMPOSER_NEON
+
+/* mul_div255 of eight 16 bit products: (t + ((t + 128) >> 8) + 128) >> 8 */
+static inline uint8x8_t div255_u16(uint16x8_t t)
+{
+    return vrshrn_n_u16(vrsraq_n_u16(t, t, 8), 8);
+}
+
+void hwc2_sw_composer::premultiply_row(uint32_t *px, size_t cnt,
+        hwc2_blend_mode_t blend_mode, uint8_t plane_alpha)
+{
+    uint8x8_t alpha = vdup_n_u8(plane_alpha);
+    size_t idx = 0;
+
+    for (; idx + 8 <= cnt; idx += 8) {
+        uint8x8x4_t p = vld4_u8(reinterpret_cast<uint8_t *>(px + idx));
+
+        switch (blend_mode) {
+        case HWC2_BLEND_MODE_NONE:
+            p.val[0] = div255_u16(vmull_u8(p.val[0], alpha));
+            p.val[1] = div255_u16(vmull_u8(p.val[1], alpha));
+            p.val[2] = div255_u16(vmull_u8(p.val[2], alpha));
+            p.val[3] = alpha;
+            break;
+        case HWC2_BLEND_MODE_COVERAGE:
+            p.val[3] = div255_u16(vmull_u8(p.val[3], alpha));
+            p.val[0] = div255_u16(vmull_u8(p.val[0], p.val[3]));
+            p.val[1] = div255_u16(vmull_u8(p.val[1], p.val[3]));
+            p.val[2] = div255_u16(vmull_u8(p.val[2], p.val[3]));
+            break;
+        default:
+            p.val[0] = div255_u16(vmull_u8(p.val[0], alpha));
+            p.val[1] = div255_u16(vmull_u8(p.val[1], alpha));
+            p.val[2] = div255_u16(vmull_u8(p.val[2], alpha));
+            p.val[3] = div255_u16(vmull_u8(p.val[3], alpha));
+            break;
+        }
+
+        vst4_u8(reinterpret_cast<uint8_t *>(px + idx), p);
+    }
+
+    for (; idx < cnt; idx++)
+        px[idx] = premultiply_px(px[idx], blend_mode, plane_alpha);
+}
+
+void hwc2_sw_composer::blend_row(const uint32_t *src, uint32_t *dst,
+        size_t cnt)
+{
+    size_t idx = 0;
+
+    for (; idx + 8 <= cnt; idx += 8) {
+        uint8x8x4_t s = vld4_u8(reinterpret_cast<const uint8_t *>(src + idx));
+        uint8x8x4_t d = vld4_u8(reinterpret_cast<uint8_t *>(dst + idx));
+        uint8x8_t inv_alpha = vmvn_u8(s.val[3]);
+
+        for (size_t ch = 0; ch < 4; ch++)
+            d.val[ch] = vqadd_u8(s.val[ch],
+                    div255_u16(vmull_u8(d.val[ch], inv_alpha)));
+
+        vst4_u8(reinterpret_cast<uint8_t *>(dst + idx), d);
+    }
+
+    for (; idx < cnt; idx++)
+        dst[idx] = blend_px(src[idx], dst[idx]);
+}
+
+#else
+
+void hwc2_sw_composer::premultiply_row(uint32_t *px, size_t cnt,
+        hwc2_blend_mode_t blend_mode, uint8_t plane_alpha)
+{
+    premultiply_row_scalar(px, cnt, blend_mode, plane_alpha);
+}
+
+void hwc2_sw_composer::blend_row(const uint32_t *src, uint32_t *dst,
+        size_t cnt)
+{
+    blend_row_scalar(src, dst, cnt);
+}
+
+#endif
+
+/* The source pixel under the center of pixel idx of a cnt pixel long span of
+ * the display frame, mapped onto size source pixels from start */
+static int32_t get_sample(int32_t idx, int32_t cnt, float start, float size,
+        bool flip)
+{
+    float pos = (idx + 0.5f) / cnt;
+    if (flip)
+        pos = 1.0f - pos;
+
+    int32_t first = static_cast<int32_t>(std::floor(start));
+    int32_t last = std::max(first,
+            static_cast<int32_t>(std::ceil(start + size)) - 1);
+
+    return std::min(std::max(static_cast<int32_t>(
+            std::floor(start + pos * size)), first), last);
+}
+
+static bool intersect(const hwc_rect_t &r1, const hwc_rect_t &r2,
+        hwc_rect_t *out_rect)
+{
+    out_rect->left = std::max(r1.left, r2.left);
+    out_rect->top = std::max(r1.top, r2.top);
+    out_rect->right = std::min(r1.right, r2.right);
+    out_rect->bottom = std::min(r1.bottom, r2.bottom);
+
+    return out_rect->left < out_rect->right && out_rect->top < out_rect->bottom;
+}
+
+static hwc2_error_t wait_fence(int fence)
+{
+    if (fence < 0)
+        return HWC2_ERROR_NONE;
+
+    int ret = sync_wait(fence, HWC2_SW_COMPOSER_FENCE_TIMEOUT);
+    if (ret < 0) {
+        ALOGE("failed to wait for fence: %s", strerror(errno));
+        return HWC2_ERROR_NO_RESOURCES;
+    }
+
+    return HWC2_ERROR_NONE;
+}
+
+hwc2_sw_composer::hwc2_sw_composer()
+    : gralloc_module(nullptr),
+      output(nullptr),
+      output_px(nullptr),
+      output_stride(0),
+      output_width(0),
+      output_height(0),
+      col_offsets(),
+      row_offsets(),
+      row(),
+      frame_cnt(0),
+      layer_cnt(0),
+      failed_cnt(0),
+      compose_time(0)
+{
+    const hw_module_t *module;
+
+    int ret = hw_get_module(GRALLOC_HARDWARE_MODULE_ID, &module);
+    if (ret < 0) {
+        ALOGE("failed to get gralloc module: %s", strerror(-ret));
+        return;
+    }
+
+    gralloc_module = reinterpret_cast<const gralloc_module_t *>(module);
+}
+
+std::string hwc2_sw_composer::dump() const
+{
+    std::stringstream dmp;
+
+    dmp << "  Cpu composition: " << frame_cnt << " frames, " << layer_cnt
+            << " layers, " << failed_cnt << " failed";
+    if (frame_cnt)
+        dmp << ", avg " << compose_time / frame_cnt / 1000 << "us";
+    dmp << "\n";
+
+    return dmp.str();
+}
+
+bool hwc2_sw_composer::is_supported(const hwc2_layer &lyr)
+{
+    switch (lyr.get_comp_type()) {
+    case HWC2_COMPOSITION_SOLID_COLOR:
+        return true;
+    case HWC2_COMPOSITION_DEVICE:
+    case HWC2_COMPOSITION_CURSOR:
+        break;
+    default:
+        return false;
+    }
+
+    if (!lyr.get_buffer_handle())
+        return false;
+
+    switch (lyr.get_adf_buffer_format()) {
+    case DRM_FORMAT_RGBA8888:
+    case DRM_FORMAT_RGBX8888:
+        break;
+    default:
+        return false;
+    }
+
+    return lyr.get_layout() == HWC2_WINDOW_CAP_PITCH
+            && lyr.get_source_crop_width() > 0
+            && lyr.get_source_crop_height() > 0;
+}
+
+hwc2_error_t hwc2_sw_composer::compose(
+        const std::vector<const hwc2_layer *> &layers, buffer_handle_t output,
+        int output_fence, int32_t width, int32_t height)
+{
+    ATRACE_BEGIN(__func__);
+    nsecs_t start = systemTime(SYSTEM_TIME_MONOTONIC);
+
+    hwc2_error_t ret = lock_output(output, output_fence, width, height);
+    if (ret != HWC2_ERROR_NONE) {
+        failed_cnt++;
+        ATRACE_END();
+        return ret;
+    }
+
+    /* An opaque bottom layer covering the output overwrites every pixel */
+    hwc2_sw_source src;
+    if (layers.empty() || !layers[0]->is_opaque()
+            || layers[0]->get_display_frame().left > 0
+            || layers[0]->get_display_frame().top > 0
+            || layers[0]->get_display_frame().right < width
+            || layers[0]->get_display_frame().bottom < height)
+        clear_output();
+
+    for (auto lyr: layers) {
+        get_source(*lyr, &src);
+
+        ret = draw(src);
+        if (ret != HWC2_ERROR_NONE)
+            break;
+    }
+
+    unlock_output();
+
+    if (ret != HWC2_ERROR_NONE) {
+        failed_cnt++;
+    } else {
+        frame_cnt++;
+        layer_cnt += layers.size();
+        compose_time += systemTime(SYSTEM_TIME_MONOTONIC) - start;
+    }
+
+    ATRACE_END();
+    return ret;
+}
+
+hwc2_error_t hwc2_sw_composer::copy(const hwc2_buffer &client_target,
+        buffer_handle_t output, int output_fence, int32_t width,
+        int32_t height)
+{
+    ATRACE_BEGIN(__func__);
+    nsecs_t start = systemTime(SYSTEM_TIME_MONOTONIC);
+
+    hwc2_error_t ret = lock_output(output, output_fence, width, height);
+    if (ret != HWC2_ERROR_NONE) {
+        failed_cnt++;
+        ATRACE_END();
+        return ret;
+    }
+
+    /* The client target is premultiplied and drawn over nothing, so it is
+     * copied as if it were opaque */
+    hwc2_sw_source src;
+    src.handle = client_target.get_buffer_handle();
+    src.acquire_fence = client_target.get_acquire_fence();
+    src.source_crop = client_target.get_source_crop();
+    src.display_frame = client_target.get_display_frame();
+    src.transform = static_cast<hwc_transform_t>(0);
+    src.blend_mode = HWC2_BLEND_MODE_NONE;
+    src.plane_alpha = 0xff;
+    src.color = hwc_color_t();
+
+    ret = draw(src);
+
+    unlock_output();
+
+    if (ret != HWC2_ERROR_NONE) {
+        failed_cnt++;
+    } else {
+        frame_cnt++;
+        layer_cnt++;
+        compose_time += systemTime(SYSTEM_TIME_MONOTONIC) - start;
+    }
+
+    ATRACE_END();
+    return ret;
+}
+
+hwc2_error_t hwc2_sw_composer::lock_output(buffer_handle_t output,
+        int output_fence, int32_t width, int32_t height)
+{
+    if (!gralloc_module) {
+        ALOGE("no gralloc module to map the output buffer");
+        return HWC2_ERROR_NO_RESOURCES;
+    }
+
+    hwc2_gralloc_metadata metadata;
+    if (!hwc2_gralloc::get_instance().get_metadata(output, &metadata)
+            || metadata.surf_cnt == 0
+            || metadata.surfaces[0].layout != HWC2_WINDOW_CAP_PITCH) {
+        ALOGE("unsupported output buffer");
+        return HWC2_ERROR_NO_RESOURCES;
+    }
+
+    switch (metadata.format) {
+    case DRM_FORMAT_RGBA8888:
+    case DRM_FORMAT_RGBX8888:
+        break;
+    default:
+        ALOGE("unsupported output buffer format 0x%x", metadata.format);
+        return HWC2_ERROR_NO_RESOURCES;
+    }
+
+    hwc2_error_t ret = wait_fence(output_fence);
+    if (ret != HWC2_ERROR_NONE)
+        return ret;
+
+    void *vaddr;
+    int err = gralloc_module->lock(gralloc_module, output,
+            GRALLOC_USAGE_SW_READ_OFTEN | GRALLOC_USAGE_SW_WRITE_OFTEN, 0, 0,
+            width, height, &vaddr);
+    if (err < 0) {
+        ALOGE("failed to lock output buffer: %s", strerror(-err));
+        return HWC2_ERROR_NO_RESOURCES;
+    }
+
+    this->output = output;
+    output_px = static_cast<uint32_t *>(vaddr);
+    output_stride = metadata.surfaces[0].pitch / sizeof(uint32_t);
+    output_width = width;
+    output_height = height;
+
+    return HWC2_ERROR_NONE;
+}
+
+void hwc2_sw_composer::unlock_output()
+{
+    gralloc_module->unlock(gralloc_module, output);
+
+    output = nullptr;
+    output_px = nullptr;
+}
+
+void hwc2_sw_composer::clear_output()
+{
+    for (int32_t y = 0; y < output_height; y++)
+        memset(output_px + y * output_stride, 0,
+                output_width * sizeof(uint32_t));
+}
+
+hwc2_error_t hwc2_sw_composer::draw(const hwc2_sw_source &src)
+{
+    hwc_rect_t clip;
+    hwc_rect_t output_rect = {0, 0, output_width, output_height};
+    if (!intersect(src.display_frame, output_rect, &clip))
+        return HWC2_ERROR_NONE;
+
+    size_t width = clip.right - clip.left;
+    bool opaque = src.blend_mode == HWC2_BLEND_MODE_NONE
+            && src.plane_alpha == 0xff;
+    bool premultiplied = src.blend_mode == HWC2_BLEND_MODE_PREMULTIPLIED
+            && src.plane_alpha == 0xff;
+
+    if (!src.handle) {
+        uint32_t px = premultiply_px(src.color.r | src.color.g << 8
+                | src.color.b << 16 | static_cast<uint32_t>(src.color.a) << 24,
+                src.blend_mode, src.plane_alpha);
+
+        row.assign(width, px);
+        for (int32_t y = clip.top; y < clip.bottom; y++) {
+            uint32_t *dst = output_px + y * output_stride + clip.left;
+            if (opaque)
+                std::fill_n(dst, width, px);
+            else
+                blend_row(row.data(), dst, width);
+        }
+
+        return HWC2_ERROR_NONE;
+    }
+
+    hwc2_gralloc_metadata metadata;
+    if (!hwc2_gralloc::get_instance().get_metadata(src.handle, &metadata)
+            || metadata.surf_cnt == 0) {
+        ALOGE("invalid source buffer handle");
+        return HWC2_ERROR_NO_RESOURCES;
+    }
+
+    hwc2_error_t ret = wait_fence(src.acquire_fence);
+    if (ret != HWC2_ERROR_NONE)
+        return ret;
+
+    void *vaddr;
+    int err = gralloc_module->lock(gralloc_module, src.handle,
+            GRALLOC_USAGE_SW_READ_OFTEN, 0, 0,
+            static_cast<int>(std::ceil(src.source_crop.right)),
+            static_cast<int>(std::ceil(src.source_crop.bottom)), &vaddr);
+    if (err < 0) {
+        ALOGE("failed to lock source buffer: %s", strerror(-err));
+        return HWC2_ERROR_NO_RESOURCES;
+    }
+
+    const uint32_t *src_px = static_cast<const uint32_t *>(vaddr);
+    get_sample_offsets(src, clip, metadata.surfaces[0].pitch
+            / sizeof(uint32_t));
+
+    /* Unscaled sources without flips or rotation are read a row at a time */
+    bool contiguous = std::adjacent_find(col_offsets.begin(),
+            col_offsets.end(), [] (int32_t off, int32_t next) {
+                return next != off + 1; }) == col_offsets.end();
+
+    row.resize(width);
+    for (int32_t y = clip.top; y < clip.bottom; y++) {
+        const uint32_t *src_row = src_px + row_offsets[y - clip.top];
+        uint32_t *dst = output_px + y * output_stride + clip.left;
+
+        /* Opaque sources go straight into the output and only need their
+         * alpha set. The rest are premultiplied in the scratch row first */
+        uint32_t *px = (opaque)? dst: row.data();
+        if (contiguous)
+            memcpy(px, src_row + col_offsets[0], width * sizeof(uint32_t));
+        else
+            for (size_t x = 0; x < width; x++)
+                px[x] = src_row[col_offsets[x]];
+
+        if (opaque) {
+            for (size_t x = 0; x < width; x++)
+                px[x] |= 0xff000000;
+            continue;
+        }
+
+        if (!premultiplied)
+            premultiply_row(px, width, src.blend_mode, src.plane_alpha);
+        blend_row(px, dst, width);
+    }
+
+    gralloc_module->unlock(gralloc_module, src.handle);
+    return HWC2_ERROR_NONE;
+}
+
+void hwc2_sw_composer::get_sample_offsets(const hwc2_sw_source &src,
+        const hwc_rect_t &clip, uint32_t src_stride)
+{
+    const hwc_frect_t &crop = src.source_crop;
+    const hwc_rect_t &frame = src.display_frame;
+
+    int32_t frame_w = frame.right - frame.left;
+    int32_t frame_h = frame.bottom - frame.top;
+    float crop_w = crop.right - crop.left;
+    float crop_h = crop.bottom - crop.top;
+
+    /* The source is flipped, then rotated 90 degrees clockwise. Undone, a
+     * rotated frame's columns walk the source rows bottom up and its rows
+     * walk the source columns */
+    bool flip_h = src.transform & HWC_TRANSFORM_FLIP_H;
+    bool flip_v = src.transform & HWC_TRANSFORM_FLIP_V;
+    bool rot_90 = src.transform & HWC_TRANSFORM_ROT_90;
+
+    col_offsets.resize(clip.right - clip.left);
+    for (int32_t x = clip.left; x < clip.right; x++) {
+        int32_t idx = x - frame.left;
+        col_offsets[x - clip.left] = (rot_90)?
+                get_sample(idx, frame_w, crop.top, crop_h, !flip_v)
+                * static_cast<int32_t>(src_stride):
+                get_sample(idx, frame_w, crop.left, crop_w, flip_h);
+    }
+
+    row_offsets.resize(clip.bottom - clip.top);
+    for (int32_t y = clip.top; y < clip.bottom; y++) {
+        int32_t idx = y - frame.top;
+        row_offsets[y - clip.top] = (rot_90)?
+                get_sample(idx, frame_h, crop.left, crop_w, flip_h):
+                get_sample(idx, frame_h, crop.top, crop_h, flip_v)
+                * static_cast<int32_t>(src_stride);
+    }
+}
+
+void hwc2_sw_composer::get_source(const hwc2_layer &lyr,
+        hwc2_sw_source *out_src)
+{
+    bool solid_color = lyr.get_comp_type() == HWC2_COMPOSITION_SOLID_COLOR;
+
+    out_src->handle = (solid_color)? nullptr: lyr.get_buffer_handle();
+    out_src->acquire_fence = lyr.get_acquire_fence();
+    out_src->source_crop = lyr.get_source_crop();
+    out_src->display_frame = lyr.get_display_frame();
+    out_src->transform = lyr.get_transform();
+    out_src->plane_alpha = static_cast<uint8_t>(std::round(
+            std::min(std::max(lyr.get_plane_alpha(), 0.0f), 1.0f) * 0xff));
+    out_src->color = lyr.get_color();
+
+    /* RGBX sources carry no alpha, and blend as if they were opaque */
+    out_src->blend_mode = lyr.get_blend_mode();
+    if (!solid_color && lyr.get_adf_buffer_format() == DRM_FORMAT_RGBX8888)
+        out_src->blend_mode = HWC2_BLEND_MODE_NONE;
+}
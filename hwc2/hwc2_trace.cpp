@@ -0,0 +1,302 @@
+/*
+ * Copyright (C) 2016 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <cutils/log.h>
+#include <cutils/properties.h>
+#include <algorithm>
+#include <sstream>
+
+#include "hwc2.h"
+
+uint64_t hwc2_trace_pair(int32_t high, int32_t low)
+{
+    return static_cast<uint64_t>(static_cast<uint32_t>(high)) << 32
+            | static_cast<uint32_t>(low);
+}
+
+bool hwc2_trace_is_callback(int32_t event)
+{
+    return event >= HWC2_TRACE_CALLBACK
+            && event < HWC2_VENDOR_FUNCTION_GET_PREDICTED_PRESENT_TIMES;
+}
+
+const char *hwc2_trace_get_event_name(int32_t event)
+{
+    if (hwc2_trace_is_callback(event))
+        return getCallbackDescriptorName(static_cast<
+                hwc2_callback_descriptor_t>(event - HWC2_TRACE_CALLBACK));
+
+    switch (event) {
+    case HWC2_VENDOR_FUNCTION_GET_PREDICTED_PRESENT_TIMES:
+        return "GetPredictedPresentTimes";
+    case HWC2_VENDOR_FUNCTION_SET_LAYER_COMMANDS:
+        return "SetLayerCommands";
+    default:
+        return getFunctionDescriptorName(
+                static_cast<hwc2_function_descriptor_t>(event));
+    }
+}
+
+hwc2_trace::hwc2_trace()
+    : records_mutex(),
+      records(),
+      next(0),
+      data(),
+      data_next(0)
+{
+    int32_t size = property_get_int32("debug.hwc2.trace", 0);
+    if (size <= 0)
+        return;
+
+    if (size > HWC2_TRACE_MAX_RECORDS) {
+        ALOGW("limiting trace to %d records", HWC2_TRACE_MAX_RECORDS);
+        size = HWC2_TRACE_MAX_RECORDS;
+    }
+
+    records.resize(size);
+    data.resize(size * HWC2_TRACE_DATA_WORDS);
+}
+
+std::string hwc2_trace::dump() const
+{
+    std::stringstream dmp;
+
+    if (!is_enabled())
+        return dmp.str();
+
+    /* Formatting is slow, so the records are copied out first and calls
+     * are only held up for the copy */
+    std::vector<hwc2_trace_record> snapshot;
+    std::vector<uint64_t> snapshot_data;
+    uint64_t total;
+    get_records(&snapshot, &snapshot_data, &total);
+
+    dmp << "Trace: " << snapshot.size() << " of " << total << " records\n";
+
+    for (auto &rec: snapshot) {
+
+        dmp << "  " << rec.timestamp << " +" << rec.duration / 1000 << "us "
+                << hwc2_trace_get_event_name(rec.event);
+
+        dmp << " dpy " << rec.display << " lyr " << rec.layer << " [";
+
+        for (uint32_t arg = 0; arg < rec.arg_cnt; arg++)
+            dmp << ((arg > 0)? " ": "") << rec.args[arg];
+
+        if (rec.data_cnt) {
+            dmp << " {" << std::hex;
+            for (uint32_t idx = 0; idx < rec.data_cnt; idx++)
+                dmp << ((idx > 0)? " ": "")
+                        << snapshot_data[rec.data_pos + idx];
+            dmp << std::dec << "}";
+        }
+
+        dmp << "] " << getErrorName(static_cast<hwc2_error_t>(rec.error))
+                << "\n";
+    }
+
+    return dmp.str();
+}
+
+void hwc2_trace::record(int32_t event, nsecs_t timestamp, hwc2_error_t error,
+        uint64_t display, uint64_t layer, std::initializer_list<uint64_t> args)
+{
+    if (!is_enabled())
+        return;
+
+    hwc2_trace_record rec;
+    rec.timestamp = timestamp;
+    rec.duration = 0;
+    rec.event = event;
+    rec.error = error;
+    rec.display = display;
+    rec.layer = layer;
+    rec.arg_cnt = std::min<size_t>(args.size(), HWC2_TRACE_ARG_COUNT);
+    std::copy_n(args.begin(), rec.arg_cnt, rec.args.begin());
+    rec.data_cnt = 0;
+
+    record(rec, {});
+}
+
+void hwc2_trace::record(const hwc2_trace_record &rec,
+        const std::vector<uint64_t> &rec_data)
+{
+    std::lock_guard<std::mutex> lock(records_mutex);
+    hwc2_trace_record &slot = records[next++ % records.size()];
+
+    slot = rec;
+    slot.data_pos = data_next;
+    slot.data_cnt = rec_data.size();
+
+    /* Data larger than the whole ring is dropped along with its record
+     * when the records are copied out */
+    if (rec_data.size() > data.size()) {
+        data_next += rec_data.size();
+        return;
+    }
+
+    for (uint64_t word: rec_data)
+        data[data_next++ % data.size()] = word;
+}
+
+void hwc2_trace::get_records(std::vector<hwc2_trace_record> *out_records,
+        std::vector<uint64_t> *out_data, uint64_t *out_total) const
+{
+    std::lock_guard<std::mutex> lock(records_mutex);
+    uint64_t count = std::min<uint64_t>(next, records.size());
+
+    /* Data is written in record order, so the records whose data was
+     * overwritten are the oldest ones */
+    uint64_t idx = next - count;
+    for (; idx < next; idx++) {
+        const hwc2_trace_record &rec = records[idx % records.size()];
+        if (rec.data_pos + data.size() >= data_next)
+            break;
+    }
+
+    out_records->clear();
+    out_records->reserve(next - idx);
+    out_data->clear();
+
+    for (; idx < next; idx++) {
+        hwc2_trace_record rec = records[idx % records.size()];
+
+        uint64_t pos = rec.data_pos;
+        rec.data_pos = out_data->size();
+        for (uint32_t word = 0; word < rec.data_cnt; word++)
+            out_data->push_back(data[(pos + word) % data.size()]);
+
+        out_records->push_back(rec);
+    }
+
+    *out_total = next;
+}
+
+void hwc2_trace::dump_file() const
+{
+    /* Set debug.hwc2.trace_file, run dumpsys SurfaceFlinger and feed the
+     * file to hwc2_replay on the host */
+    char path[PROPERTY_VALUE_MAX];
+    if (!is_enabled() || property_get("debug.hwc2.trace_file", path, "") <= 0)
+        return;
+
+    std::vector<hwc2_trace_record> snapshot;
+    std::vector<uint64_t> snapshot_data;
+    uint64_t total;
+    get_records(&snapshot, &snapshot_data, &total);
+
+    struct hwc2_trace_header header;
+    header.magic = HWC2_TRACE_MAGIC;
+    header.version = HWC2_TRACE_VERSION;
+    header.record_size = sizeof(hwc2_trace_record);
+    header.record_cnt = snapshot.size();
+
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        ALOGE("failed to open %s: %s", path, strerror(errno));
+        return;
+    }
+
+    bool ret = write(fd, &header, sizeof(header)) == sizeof(header);
+    for (auto &rec: snapshot) {
+        if (!ret)
+            break;
+
+        ssize_t size = rec.data_cnt * sizeof(snapshot_data[0]);
+        ret = write(fd, &rec, sizeof(rec)) == sizeof(rec)
+                && write(fd, snapshot_data.data() + rec.data_pos, size) == size;
+    }
+    if (!ret)
+        ALOGE("failed to write %s: %s", path, strerror(errno));
+
+    close(fd);
+}
+
+hwc2_trace_call::hwc2_trace_call(hwc2_trace &trace,
+        hwc2_function_descriptor_t function, hwc2_display_t display,
+        hwc2_layer_t layer, std::initializer_list<uint64_t> args)
+    : trace(trace),
+      rec(),
+      rec_data()
+{
+    if (!trace.is_enabled())
+        return;
+
+    rec.timestamp = systemTime(SYSTEM_TIME_MONOTONIC);
+    rec.event = function;
+    rec.display = display;
+    rec.layer = layer;
+    rec.arg_cnt = std::min<size_t>(args.size(), HWC2_TRACE_ARG_COUNT);
+    std::copy_n(args.begin(), rec.arg_cnt, rec.args.begin());
+}
+
+void hwc2_trace_call::add_data(uint64_t word)
+{
+    if (trace.is_enabled())
+        rec_data.push_back(word);
+}
+
+/* Each rect takes two words: left and top, then right and bottom */
+void hwc2_trace_call::add_rects(const hwc_rect_t *rects, size_t rect_cnt)
+{
+    if (!trace.is_enabled() || !rects)
+        return;
+
+    for (size_t idx = 0; idx < rect_cnt; idx++) {
+        rec_data.push_back(hwc2_trace_pair(rects[idx].left, rects[idx].top));
+        rec_data.push_back(hwc2_trace_pair(rects[idx].right,
+                rects[idx].bottom));
+    }
+}
+
+/* Two words, the gralloc pixel format and the HWC2_WINDOW_CAP layout bit of
+ * the first surface, which are 0 for a null or unknown buffer */
+void hwc2_trace_call::add_buffer(buffer_handle_t buffer)
+{
+    if (!trace.is_enabled())
+        return;
+
+    const hwc2_gralloc &gralloc = hwc2_gralloc::get_instance();
+    hwc2_gralloc_metadata metadata;
+    if (!buffer || !gralloc.get_metadata(buffer, &metadata)
+            || metadata.surf_cnt == 0) {
+        rec_data.insert(rec_data.end(), {0, 0});
+        return;
+    }
+
+    rec_data.push_back(static_cast<uint32_t>(
+            gralloc.get_pixel_format(buffer)));
+    rec_data.push_back(static_cast<uint32_t>(metadata.surfaces[0].layout));
+}
+
+hwc2_error_t hwc2_trace_call::end(hwc2_error_t error,
+        std::initializer_list<uint64_t> results)
+{
+    if (!trace.is_enabled())
+        return error;
+
+    rec.duration = systemTime(SYSTEM_TIME_MONOTONIC) - rec.timestamp;
+    rec.error = error;
+
+    for (uint64_t result: results)
+        if (rec.arg_cnt < HWC2_TRACE_ARG_COUNT)
+            rec.args[rec.arg_cnt++] = result;
+
+    trace.record(rec, rec_data);
+    return error;
+}
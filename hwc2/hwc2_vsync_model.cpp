@@ -0,0 +1,259 @@
+/*
+ * Copyright (C) 2016 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <cmath>
+#include <cstdlib>
+#include <sstream>
+
+#include "hwc2.h"
+
+hwc2_vsync_model::hwc2_vsync_model()
+    : model_mutex(),
+      samples(),
+      sample_cnt(0),
+      next_sample(0),
+      nominal_period(0),
+      period(0),
+      reference(0),
+      locked(false),
+      enabled(false),
+      hw_enabled(false),
+      last_delivered(0),
+      lock_cnt(0),
+      resync_cnt(0),
+      hw_vsync_cnt(0),
+      sw_vsync_cnt(0) { }
+
+std::string hwc2_vsync_model::dump() const
+{
+    std::lock_guard<std::mutex> lock(model_mutex);
+    std::stringstream dmp;
+
+    dmp << "  Vsync: period " << period << "ns (nominal " << nominal_period
+            << "ns), " << ((locked)? "locked": "unlocked") << ", hardware "
+            << ((hw_enabled)? "on": "off") << ", " << lock_cnt << " locks, "
+            << resync_cnt << " resyncs, " << hw_vsync_cnt << " hardware/"
+            << sw_vsync_cnt << " predicted callbacks\n";
+
+    return dmp.str();
+}
+
+void hwc2_vsync_model::reset(nsecs_t nominal_period)
+{
+    std::lock_guard<std::mutex> lock(model_mutex);
+
+    this->nominal_period = nominal_period;
+    period = nominal_period;
+    clear_samples();
+}
+
+void hwc2_vsync_model::set_enabled(bool enabled)
+{
+    std::lock_guard<std::mutex> lock(model_mutex);
+    this->enabled = enabled;
+}
+
+void hwc2_vsync_model::set_hw_enabled(bool hw_enabled)
+{
+    std::lock_guard<std::mutex> lock(model_mutex);
+    this->hw_enabled = hw_enabled;
+}
+
+bool hwc2_vsync_model::is_hw_enabled() const
+{
+    std::lock_guard<std::mutex> lock(model_mutex);
+    return hw_enabled;
+}
+
+bool hwc2_vsync_model::needs_hw_vsync(nsecs_t now) const
+{
+    std::lock_guard<std::mutex> lock(model_mutex);
+
+    /* Even a locked model drifts away from the hardware. After a while one
+     * more sample is taken to check it */
+    return enabled && (!locked
+            || now - get_newest_sample() > HWC2_VSYNC_MAX_AGE);
+}
+
+bool hwc2_vsync_model::add_sample(nsecs_t timestamp)
+{
+    std::lock_guard<std::mutex> lock(model_mutex);
+
+    if (locked && std::abs(get_error(timestamp)) > HWC2_VSYNC_MAX_ERROR) {
+        resync_cnt++;
+        clear_samples();
+    }
+
+    samples[next_sample] = timestamp;
+    next_sample = (next_sample + 1) % samples.size();
+    sample_cnt = std::min(sample_cnt + 1, samples.size());
+
+    fit();
+
+    /* The predicted callback for this vsync may already have gone out */
+    if (!enabled || timestamp <= last_delivered + period / 2)
+        return false;
+
+    last_delivered = timestamp;
+    hw_vsync_cnt++;
+    return true;
+}
+
+bool hwc2_vsync_model::check_sample(nsecs_t timestamp)
+{
+    std::lock_guard<std::mutex> lock(model_mutex);
+
+    if (!locked || std::abs(get_error(timestamp)) <= HWC2_VSYNC_MAX_ERROR)
+        return true;
+
+    resync_cnt++;
+    clear_samples();
+    return false;
+}
+
+nsecs_t hwc2_vsync_model::get_next_vsync(nsecs_t now) const
+{
+    std::lock_guard<std::mutex> lock(model_mutex);
+
+    if (!enabled || !locked)
+        return INT64_MAX;
+
+    /* Skip the vsync already delivered and any that are too far in the past
+     * to still be useful to the client */
+    return get_next_vsync_locked(std::max(last_delivered, now - period)
+            + period / 2);
+}
+
+bool hwc2_vsync_model::deliver(nsecs_t timestamp)
+{
+    std::lock_guard<std::mutex> lock(model_mutex);
+
+    if (!enabled || timestamp <= last_delivered + period / 2)
+        return false;
+
+    last_delivered = timestamp;
+    sw_vsync_cnt++;
+    return true;
+}
+
+size_t hwc2_vsync_model::predict(nsecs_t after, size_t cnt,
+        int64_t *out_times) const
+{
+    std::lock_guard<std::mutex> lock(model_mutex);
+
+    if (sample_cnt == 0 || period <= 0)
+        return 0;
+
+    if (!out_times)
+        return cnt;
+
+    nsecs_t vsync = get_next_vsync_locked(after);
+    for (size_t idx = 0; idx < cnt; idx++)
+        out_times[idx] = vsync + idx * period;
+
+    return cnt;
+}
+
+void hwc2_vsync_model::clear_samples()
+{
+    sample_cnt = 0;
+    next_sample = 0;
+    locked = false;
+}
+
+void hwc2_vsync_model::fit()
+{
+    if (nominal_period <= 0)
+        return;
+
+    size_t oldest = (next_sample + samples.size() - sample_cnt)
+            % samples.size();
+    nsecs_t base = samples[oldest];
+
+    if (sample_cnt < 2) {
+        period = nominal_period;
+        reference = base;
+        return;
+    }
+
+    /* Number each sample by the vsync it belongs to, so missed events do not
+     * skew the fit, then fit time = reference + n * period by least squares.
+     * Times are taken relative to the oldest sample to keep the precision */
+    double sum_n = 0, sum_t = 0, sum_nn = 0, sum_nt = 0;
+    for (size_t cnt = 0; cnt < sample_cnt; cnt++) {
+        double t = samples[(oldest + cnt) % samples.size()] - base;
+        double n = std::round(t / nominal_period);
+
+        sum_n += n;
+        sum_t += t;
+        sum_nn += n * n;
+        sum_nt += n * t;
+    }
+
+    double denom = sample_cnt * sum_nn - sum_n * sum_n;
+    if (denom <= 0)
+        return;
+
+    double fit_period = (sample_cnt * sum_nt - sum_n * sum_t) / denom;
+    double fit_offset = (sum_t - fit_period * sum_n) / sample_cnt;
+
+    /* A fit far from the mode's period comes from bad samples. Start over
+     * from the newest one */
+    if (std::abs(fit_period - nominal_period) > nominal_period / 10) {
+        nsecs_t newest = get_newest_sample();
+        clear_samples();
+        samples[0] = newest;
+        sample_cnt = 1;
+        next_sample = 1;
+        period = nominal_period;
+        reference = newest;
+        return;
+    }
+
+    period = std::llround(fit_period);
+    reference = base + std::llround(fit_offset);
+
+    nsecs_t max_error = 0;
+    for (size_t cnt = 0; cnt < sample_cnt; cnt++)
+        max_error = std::max(max_error, std::abs(get_error(
+                samples[(oldest + cnt) % samples.size()])));
+
+    bool was_locked = locked;
+    locked = sample_cnt >= HWC2_VSYNC_MIN_SAMPLES
+            && max_error <= HWC2_VSYNC_MAX_ERROR;
+    if (locked && !was_locked)
+        lock_cnt++;
+}
+
+nsecs_t hwc2_vsync_model::get_error(nsecs_t timestamp) const
+{
+    double n = std::round(static_cast<double>(timestamp - reference) / period);
+    return timestamp - (reference + static_cast<nsecs_t>(n) * period);
+}
+
+nsecs_t hwc2_vsync_model::get_newest_sample() const
+{
+    if (sample_cnt == 0)
+        return 0;
+
+    return samples[(next_sample + samples.size() - 1) % samples.size()];
+}
+
+nsecs_t hwc2_vsync_model::get_next_vsync_locked(nsecs_t after) const
+{
+    double n = std::floor(static_cast<double>(after - reference) / period) + 1;
+    return reference + static_cast<nsecs_t>(n) * period;
+}
@@ -28,12 +28,13 @@ void hwc2_window::clear()
     content = HWC2_WINDOW_CONTENT_EMPTY;
 }
 
-hwc2_error_t hwc2_window::assign_client_target(uint32_t z_order)
+hwc2_error_t hwc2_window::assign_client_target(uint32_t z_order,
+        uint32_t layouts)
 {
     /* The client target will never rotate, scale or flip. Its buffer layout
-     * could be changed before present display, so the window must support all
-     * layouts. */
-    if (!is_empty() || !has_requirements(HWC2_WINDOW_CAP_LAYOUTS))
+     * could be changed before present display, so the window must support
+     * every layout the display controller can scan out. */
+    if (!is_empty() || !has_requirements(layouts))
         return HWC2_ERROR_UNSUPPORTED;
 
     content = HWC2_WINDOW_CONTENT_CLIENT_TARGET;
@@ -80,13 +81,11 @@ bool hwc2_window::has_layer_requirements(const hwc2_layer &lyr) const
         return false;
 
     reqs |= layout;
+    reqs |= hwc2_window_caps::get_format_capability(
+            lyr.get_adf_buffer_format());
 
     if (transform & HWC_TRANSFORM_ROT_90) {
-        const void *surf;
-        size_t surf_cnt;
-        lyr.get_surfaces(&surf, &surf_cnt);
-
-        if (surf_cnt > 1)
+        if (lyr.get_surface_count() > 1)
            reqs |= HWC2_WINDOW_CAP_ROTATE_PLANAR;
         else
            reqs |= HWC2_WINDOW_CAP_ROTATE_PACKED;
@@ -113,51 +112,3 @@ void hwc2_window::set_capabilities(uint32_t capabilities)
 {
     this->capabilities = capabilities;
 }
-
-bool hwc2_window::is_supported(const hwc2_layer &lyr)
-{
-    float source_crop_height = lyr.get_source_crop_height();
-    float scale_width = lyr.get_scale_width();
-    float scale_height = lyr.get_scale_height();
-
-    if (!lyr.get_buffer_handle())
-        return false;
-
-    if (!lyr.get_adf_buffer_format())
-        return false;
-
-    if (lyr.is_stereo())
-        return false;
-
-    if (lyr.is_overlapped())
-        return false;
-
-    if (lyr.get_display_frame_width() < HWC2_WINDOW_MIN_DISPLAY_FRAME_WIDTH
-            || lyr.get_display_frame_height() < HWC2_WINDOW_MIN_DISPLAY_FRAME_HEIGHT)
-        return false;
-
-    if (lyr.get_source_crop_width() < HWC2_WINDOW_MIN_SOURCE_CROP_WIDTH
-            || source_crop_height < HWC2_WINDOW_MIN_SOURCE_CROP_HEIGHT)
-        return false;
-
-    if (scale_width < HWC2_WINDOW_MIN_DISPLAY_FRAME_SCALE
-            || scale_height < HWC2_WINDOW_MIN_DISPLAY_FRAME_SCALE)
-        return false;
-
-    const void *surf;
-    size_t surf_cnt;
-    lyr.get_surfaces(&surf, &surf_cnt);
-
-    if (lyr.get_transform() & HWC_TRANSFORM_ROT_90) {
-        if (surf_cnt == 1 && scale_width == 1 && scale_height == 1
-                && source_crop_height > HWC2_WINDOW_MAX_ROT_SRC_HEIGHT_NO_SCALE)
-            return false;
-        else if (source_crop_height > HWC2_WINDOW_MAX_ROT_SRC_HEIGHT)
-            return false;
-    }
-
-    if (!lyr.is_source_crop_int_aligned())
-        return false;
-
-    return true;
-}
@@ -0,0 +1,242 @@
+/*
+ * Copyright (C) 2016 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <cutils/log.h>
+#include <tegra_adf.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <inttypes.h>
+#include <sstream>
+#include <cstdlib>
+#include <cstring>
+
+#include "hwc2.h"
+
+struct hwc2_window_format {
+    uint32_t format;
+    bool yuv;
+};
+
+/* The formats gralloc buffers can have. Entry idx is the window capability
+ * bit HWC2_WINDOW_CAP_FORMAT_SHIFT + idx */
+static const std::array<hwc2_window_format, HWC2_WINDOW_FORMAT_COUNT>
+        window_formats = {{
+    {DRM_FORMAT_RGBA8888, false},
+    {DRM_FORMAT_RGBX8888, false},
+    {DRM_FORMAT_BGRA8888, false},
+    {DRM_FORMAT_RGB888, false},
+    {DRM_FORMAT_RGB565, false},
+    {DRM_FORMAT_BGR565, false},
+    {DRM_FORMAT_YUV420, true},
+    {DRM_FORMAT_YVU420, true},
+    {DRM_FORMAT_NV12, true},
+    {DRM_FORMAT_NV21, true},
+    {DRM_FORMAT_YUV422, true},
+    {DRM_FORMAT_NV16, true},
+    {DRM_FORMAT_UYVY, true},
+    {DRM_FORMAT_YUYV, true},
+    {TEGRA_ADF_FORMAT_YCbCr422R, true},
+}};
+
+/* What the windows are assumed to support when the kernel does not say */
+static const std::array<uint32_t, HWC2_WINDOW_COUNT> default_capabilities = {{
+    HWC2_WINDOW_CAP_COMMON | HWC2_WINDOW_CAP_ROTATE_PLANAR
+            | HWC2_WINDOW_CAP_FORMATS,
+    HWC2_WINDOW_CAP_COMMON | HWC2_WINDOW_CAP_FORMATS,
+    HWC2_WINDOW_CAP_COMMON | HWC2_WINDOW_CAP_FORMATS,
+    HWC2_WINDOW_CAP_PITCH | HWC2_WINDOW_CAP_FORMATS
+}};
+
+hwc2_window_caps::hwc2_window_caps()
+    : capabilities(default_capabilities),
+      layouts(HWC2_WINDOW_CAP_LAYOUTS),
+      min_source_crop_width(HWC2_WINDOW_MIN_SOURCE_CROP_WIDTH),
+      min_source_crop_height(HWC2_WINDOW_MIN_SOURCE_CROP_HEIGHT),
+      min_display_frame_width(HWC2_WINDOW_MIN_DISPLAY_FRAME_WIDTH),
+      min_display_frame_height(HWC2_WINDOW_MIN_DISPLAY_FRAME_HEIGHT),
+      min_scale(HWC2_WINDOW_MIN_DISPLAY_FRAME_SCALE),
+      max_rot_src_height(HWC2_WINDOW_MAX_ROT_SRC_HEIGHT),
+      max_rot_src_height_no_scale(HWC2_WINDOW_MAX_ROT_SRC_HEIGHT_NO_SCALE),
+      cursor_mode(false),
+      queried_formats(false) { }
+
+std::string hwc2_window_caps::dump() const
+{
+    std::stringstream dmp;
+
+    dmp << "  Windows:" << std::hex;
+    for (uint32_t caps: capabilities)
+        dmp << " 0x" << caps;
+    dmp << std::dec << ", formats "
+            << ((queried_formats)? "from the kernel": "assumed")
+            << ", cursor mode " << ((cursor_mode)? "yes": "no") << "\n";
+
+    return dmp.str();
+}
+
+void hwc2_window_caps::query(hwc2_display_t dpy_id, struct adf_device *adf_dev)
+{
+    query_device(dpy_id, adf_dev);
+    query_overlay_engines(dpy_id, adf_dev);
+}
+
+bool hwc2_window_caps::is_supported(const hwc2_layer &lyr) const
+{
+    float source_crop_height = lyr.get_source_crop_height();
+    float scale_width = lyr.get_scale_width();
+    float scale_height = lyr.get_scale_height();
+
+    if (!lyr.get_buffer_handle())
+        return false;
+
+    if (!lyr.get_adf_buffer_format())
+        return false;
+
+    if (lyr.is_stereo())
+        return false;
+
+    if (lyr.get_display_frame_width() < min_display_frame_width
+            || lyr.get_display_frame_height() < min_display_frame_height)
+        return false;
+
+    if (lyr.get_source_crop_width() < min_source_crop_width
+            || source_crop_height < min_source_crop_height)
+        return false;
+
+    if (scale_width < min_scale || scale_height < min_scale)
+        return false;
+
+    /* Unscaled packed layers may be taller than other rotated layers */
+    if (lyr.get_transform() & HWC_TRANSFORM_ROT_90) {
+        bool no_scale = lyr.get_surface_count() == 1 && scale_width == 1
+                && scale_height == 1;
+        if (source_crop_height > ((no_scale)? max_rot_src_height_no_scale:
+                max_rot_src_height))
+            return false;
+    }
+
+    if (!lyr.is_source_crop_int_aligned())
+        return false;
+
+    return true;
+}
+
+uint32_t hwc2_window_caps::get_format_capability(uint32_t format)
+{
+    /* Formats outside of the table are left to the driver, as before the
+     * windows knew their formats */
+    for (size_t idx = 0; idx < window_formats.size(); idx++)
+        if (window_formats[idx].format == format)
+            return 1 << (HWC2_WINDOW_CAP_FORMAT_SHIFT + idx);
+
+    return 0;
+}
+
+void hwc2_window_caps::query_device(hwc2_display_t dpy_id,
+        struct adf_device *adf_dev)
+{
+    struct adf_device_data data;
+
+    int ret = adf_get_device_data(adf_dev, &data);
+    if (ret < 0) {
+        ALOGW("dpy %" PRIu64 ": failed to get adf device data: %s", dpy_id,
+                strerror(ret));
+        return;
+    }
+
+    if (data.custom_data_size >= sizeof(struct tegra_adf_capabilities)) {
+        const struct tegra_adf_capabilities *caps =
+                static_cast<const struct tegra_adf_capabilities *>(
+                data.custom_data);
+        cursor_mode = caps->caps & TEGRA_ADF_CAPABILITIES_CURSOR_MODE;
+
+        if (!(caps->caps & TEGRA_ADF_CAPABILITIES_BLOCKLINEAR)) {
+            layouts &= ~HWC2_WINDOW_CAP_BLOCK_LINEAR;
+            for (uint32_t &win_caps: capabilities)
+                win_caps &= ~HWC2_WINDOW_CAP_BLOCK_LINEAR;
+        }
+    }
+
+    adf_free_device_data(&data);
+}
+
+void hwc2_window_caps::query_overlay_engines(hwc2_display_t dpy_id,
+        struct adf_device *adf_dev)
+{
+    adf_id_t *engine_ids = nullptr;
+
+    ssize_t n_engines = adf_overlay_engines(adf_dev, &engine_ids);
+    if (n_engines < 0) {
+        ALOGW("dpy %" PRIu64 ": failed to enumerate adf overlay engines: %s",
+                dpy_id, strerror(n_engines));
+        return;
+    }
+
+    /* Tegra registers one overlay engine per window, in window order. Any
+     * other count cannot be matched to the windows */
+    if (n_engines != HWC2_WINDOW_COUNT) {
+        ALOGW("dpy %" PRIu64 ": %zd adf overlay engines for %u windows", dpy_id,
+                n_engines, HWC2_WINDOW_COUNT);
+        free(engine_ids);
+        return;
+    }
+
+    std::array<uint32_t, HWC2_WINDOW_COUNT> formats;
+
+    for (size_t idx = 0; idx < HWC2_WINDOW_COUNT; idx++) {
+        int fd = adf_overlay_engine_open(adf_dev, engine_ids[idx], O_RDONLY);
+        if (fd < 0) {
+            ALOGW("dpy %" PRIu64 ": failed to open adf overlay engine %u: %s",
+                    dpy_id, engine_ids[idx], strerror(fd));
+            free(engine_ids);
+            return;
+        }
+
+        struct adf_overlay_engine_data data;
+        int ret = adf_get_overlay_engine_data(fd, &data);
+        close(fd);
+        if (ret < 0) {
+            ALOGW("dpy %" PRIu64 ": failed to get adf overlay engine %u data:"
+                    " %s", dpy_id, engine_ids[idx], strerror(ret));
+            free(engine_ids);
+            return;
+        }
+
+        formats[idx] = 0;
+        for (size_t fmt = 0; fmt < data.n_supported_formats; fmt++)
+            formats[idx] |= get_format_capability(data.supported_formats[fmt]);
+
+        adf_free_overlay_engine_data(&data);
+    }
+
+    free(engine_ids);
+
+    /* A window that lists a yuv format can scan out yuv layers, whatever was
+     * assumed for it */
+    uint32_t yuv_formats = 0;
+    for (size_t idx = 0; idx < window_formats.size(); idx++)
+        if (window_formats[idx].yuv)
+            yuv_formats |= 1 << (HWC2_WINDOW_CAP_FORMAT_SHIFT + idx);
+
+    for (size_t idx = 0; idx < HWC2_WINDOW_COUNT; idx++) {
+        capabilities[idx] &= ~(HWC2_WINDOW_CAP_FORMATS | HWC2_WINDOW_CAP_YUV);
+        capabilities[idx] |= formats[idx];
+        if (formats[idx] & yuv_formats)
+            capabilities[idx] |= HWC2_WINDOW_CAP_YUV;
+    }
+
+    queried_formats = true;
+}
@@ -0,0 +1,133 @@
+# Copyright (C) 2016 The Android Open Source Project
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+#      http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+
+
+# Host builds of the hwc2 HAL. libadf, libadfhwc, libsync, the properties
+# and gralloc.tegra132.so are replaced by the fakes in this directory so the
+# HAL can be driven without a device.
+
+LOCAL_PATH := $(call my-dir)
+
+hwc2_test_c_includes := \
+	$(LOCAL_PATH)/.. \
+	$(LOCAL_PATH)/../include \
+	system/core/adf/libadf/include \
+	system/core/adf/libadfhwc/include \
+	system/core/libsync/include \
+	hardware/libhardware/include \
+	external/libdrm/include
+
+hwc2_test_cflags := \
+	-DLOG_TAG=\"hwcomposer\" \
+	-Wall \
+	-Wextra \
+	-Wno-unused-parameter
+
+include $(CLEAR_VARS)
+
+# Stands in for the nvgr_* exports of the tegra gralloc, which the HAL
+# dlopens by name
+LOCAL_MODULE := hwc2_fake_gralloc
+LOCAL_MODULE_STEM := gralloc.tegra132
+LOCAL_MODULE_HOST_OS := linux
+LOCAL_SRC_FILES := hwc2_fake_gralloc.cpp
+LOCAL_C_INCLUDES := $(hwc2_test_c_includes)
+LOCAL_CFLAGS := $(hwc2_test_cflags)
+LOCAL_SHARED_LIBRARIES := liblog libcutils
+include $(BUILD_HOST_SHARED_LIBRARY)
+
+include $(CLEAR_VARS)
+
+LOCAL_MODULE := libhwc2_host
+LOCAL_MODULE_HOST_OS := linux
+LOCAL_SRC_FILES := \
+	$(addprefix ../,$(hwc2_src_files)) \
+	hwc2_fake_adf.cpp \
+	hwc2_fake_properties.cpp \
+	hwc2_fake_sync.cpp \
+	hwc2_test_alloc.cpp \
+	hwc2_test_device.cpp \
+	hwc2_test_replay.cpp
+LOCAL_C_INCLUDES := $(hwc2_test_c_includes)
+LOCAL_CFLAGS := $(hwc2_test_cflags)
+include $(BUILD_HOST_STATIC_LIBRARY)
+
+include $(CLEAR_VARS)
+
+LOCAL_MODULE := hwc2_benchmark
+LOCAL_MODULE_HOST_OS := linux
+LOCAL_SRC_FILES := \
+	hwc2_benchmark.cpp \
+	hwc2_layer_commands_benchmark.cpp \
+	hwc2_layer_map_benchmark.cpp \
+	hwc2_sw_composer_benchmark.cpp
+LOCAL_C_INCLUDES := $(hwc2_test_c_includes)
+LOCAL_CFLAGS := $(hwc2_test_cflags)
+LOCAL_WHOLE_STATIC_LIBRARIES := libhwc2_host
+LOCAL_SHARED_LIBRARIES := \
+	hwc2_fake_gralloc \
+	liblog \
+	libcutils \
+	libutils \
+	libbase
+LOCAL_LDLIBS := -ldl -lpthread
+include $(BUILD_HOST_NATIVE_BENCHMARK)
+
+include $(CLEAR_VARS)
+
+LOCAL_MODULE := hwc2_tests
+LOCAL_MODULE_HOST_OS := linux
+LOCAL_SRC_FILES := \
+	hwc2_alloc_test.cpp \
+	hwc2_cmu_test.cpp \
+	hwc2_display_test.cpp \
+	hwc2_dma_buf_test.cpp \
+	hwc2_fill_cache_test.cpp \
+	hwc2_gralloc_test.cpp \
+	hwc2_layer_map_test.cpp \
+	hwc2_post_worker_test.cpp \
+	hwc2_region_test.cpp \
+	hwc2_replay_test.cpp \
+	hwc2_sw_composer_test.cpp \
+	hwc2_vsync_model_test.cpp \
+	hwc2_window_caps_test.cpp
+LOCAL_C_INCLUDES := $(hwc2_test_c_includes)
+LOCAL_CFLAGS := $(hwc2_test_cflags)
+LOCAL_WHOLE_STATIC_LIBRARIES := libhwc2_host
+LOCAL_SHARED_LIBRARIES := \
+	hwc2_fake_gralloc \
+	liblog \
+	libcutils \
+	libutils \
+	libbase
+LOCAL_LDLIBS := -ldl -lpthread
+include $(BUILD_HOST_NATIVE_TEST)
+
+include $(CLEAR_VARS)
+
+# Replays a trace written through debug.hwc2.trace_file
+LOCAL_MODULE := hwc2_replay
+LOCAL_MODULE_HOST_OS := linux
+LOCAL_SRC_FILES := hwc2_replay.cpp
+LOCAL_C_INCLUDES := $(hwc2_test_c_includes)
+LOCAL_CFLAGS := $(hwc2_test_cflags)
+LOCAL_WHOLE_STATIC_LIBRARIES := libhwc2_host
+LOCAL_SHARED_LIBRARIES := \
+	hwc2_fake_gralloc \
+	liblog \
+	libcutils \
+	libutils \
+	libbase
+LOCAL_LDLIBS := -ldl -lpthread
+include $(BUILD_HOST_EXECUTABLE)
@@ -0,0 +1,100 @@
+/*
+ * Copyright (C) 2016 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <gtest/gtest.h>
+
+#include "hwc2_test_device.h"
+
+/* Long enough for the plan cache to cycle through every position of a
+ * moving layer and for each buffer of every layer to be posted */
+#define HWC2_ALLOC_TEST_WARMUP_FRAMES   64
+#define HWC2_ALLOC_TEST_FRAMES          256
+
+struct hwc2_alloc_test_param {
+    hwc2_test_scene_type type;
+    size_t layer_cnt;
+    bool moving;
+};
+
+static void PrintTo(const hwc2_alloc_test_param &param, std::ostream *os)
+{
+    *os << hwc2_test_get_scene_name(param.type) << "/" << param.layer_cnt
+            << ((param.moving)? "/moving": "");
+}
+
+class hwc2_alloc_test: public testing::TestWithParam<hwc2_alloc_test_param> {
+protected:
+    void SetUp() override
+    {
+        hwc2_fake_property_clear();
+        hwc2_fake_property_set("debug.hwc2.idle_frames", "0");
+        hwc2_fake_adf_reset(hwc2_test_get_displays(1));
+    }
+};
+
+/* SurfaceFlinger sets the damage and the visible region of every layer every
+ * frame. Both are copied into vectors the layer keeps */
+static void set_regions(hwc2_test_device &device, hwc2_test_scene &scene,
+        int32_t width, int32_t height)
+{
+    hwc_rect_t rects[2] = {{0, 0, width / 2, height / 2},
+            {width / 2, height / 2, width, height}};
+    hwc_region_t region = {2, rects};
+
+    for (size_t idx = 0; idx < scene.get_layer_count(); idx++) {
+        device.set_layer_surface_damage(0, scene.get_layer(idx), region);
+        device.set_layer_visible_region(0, scene.get_layer(idx), region);
+    }
+}
+
+TEST_P(hwc2_alloc_test, steady_state_frames_do_not_allocate)
+{
+    const hwc2_alloc_test_param &param = GetParam();
+    hwc2_fake_config config = hwc2_test_get_panel_config();
+
+    hwc2_test_device device;
+    ASSERT_TRUE(device.is_open());
+
+    hwc2_test_scene scene(device, 0, config.width, config.height);
+    scene.generate(param.type, param.layer_cnt);
+    if (param.moving)
+        scene.set_moving_layer(param.layer_cnt - 1);
+
+    for (size_t idx = 0; idx < HWC2_ALLOC_TEST_WARMUP_FRAMES; idx++) {
+        set_regions(device, scene, config.width, config.height);
+        ASSERT_EQ(scene.frame(nullptr), HWC2_ERROR_NONE);
+    }
+
+    for (size_t idx = 0; idx < HWC2_ALLOC_TEST_FRAMES; idx++) {
+        uint64_t allocs = hwc2_test_get_alloc_count();
+        set_regions(device, scene, config.width, config.height);
+
+        hwc2_test_frame_times times;
+        ASSERT_EQ(scene.frame(&times), HWC2_ERROR_NONE);
+
+        ASSERT_EQ(hwc2_test_get_alloc_count() - allocs, 0u)
+                << "frame " << scene.get_frame_count() << " allocated";
+    }
+}
+
+INSTANTIATE_TEST_CASE_P(scenes, hwc2_alloc_test, testing::Values(
+        hwc2_alloc_test_param{HWC2_TEST_SCENE_RGB, 1, false},
+        hwc2_alloc_test_param{HWC2_TEST_SCENE_RGB, 4, false},
+        hwc2_alloc_test_param{HWC2_TEST_SCENE_RGB, 4, true},
+        hwc2_alloc_test_param{HWC2_TEST_SCENE_YUV_MIX, 8, false},
+        hwc2_alloc_test_param{HWC2_TEST_SCENE_ROTATED, 8, true},
+        hwc2_alloc_test_param{HWC2_TEST_SCENE_SCALED, 8, false},
+        hwc2_alloc_test_param{HWC2_TEST_SCENE_OVERLAPPING, 16, true}));
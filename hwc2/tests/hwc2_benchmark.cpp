@@ -0,0 +1,150 @@
+/*
+ * Copyright (C) 2016 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <benchmark/benchmark.h>
+
+#include <algorithm>
+#include <vector>
+
+#include "hwc2_test_device.h"
+
+/* Frames run before measuring, so that the plan cache, the gralloc cache
+ * and the dma-buf cache are warm */
+#define HWC2_BENCHMARK_WARMUP_FRAMES   32
+
+/* Per call latencies kept for the percentiles */
+#define HWC2_BENCHMARK_MAX_SAMPLES     65536
+
+enum hwc2_benchmark_call {
+    HWC2_BENCHMARK_VALIDATE,
+    HWC2_BENCHMARK_PRESENT,
+};
+
+static void report_latency(benchmark::State &state,
+        std::vector<nsecs_t> &samples)
+{
+    if (samples.empty())
+        return;
+
+    std::sort(samples.begin(), samples.end());
+
+    for (int pct: {50, 90, 99}) {
+        nsecs_t sample = samples[(samples.size() - 1) * pct / 100];
+        state.counters["p" + std::to_string(pct) + "_us"] = sample / 1000.0;
+    }
+}
+
+/* Runs frames of a scene on the panel and reports the latency percentiles
+ * of one call together with the heap allocations of a whole frame */
+static void run_scene(benchmark::State &state, hwc2_test_scene_type type,
+        hwc2_benchmark_call call, bool moving)
+{
+    size_t layer_cnt = state.range(0);
+
+    /* Idle folding would turn the scene into client composition */
+    hwc2_fake_property_clear();
+    hwc2_fake_property_set("debug.hwc2.idle_frames", "0");
+    hwc2_fake_adf_reset(hwc2_test_get_displays(1));
+
+    hwc2_test_device device;
+    if (!device.is_open()) {
+        state.SkipWithError("failed to open the hwc2 device");
+        return;
+    }
+
+    hwc2_fake_config config = hwc2_test_get_panel_config();
+    hwc2_test_scene scene(device, 0, config.width, config.height);
+    scene.generate(type, layer_cnt);
+
+    /* Plans are cached per layer geometry. A layer that moves every frame
+     * makes each validate go through assign_composition */
+    if (moving)
+        scene.set_moving_layer(layer_cnt - 1);
+
+    for (size_t idx = 0; idx < HWC2_BENCHMARK_WARMUP_FRAMES; idx++)
+        scene.frame(nullptr);
+
+    std::vector<nsecs_t> samples;
+    samples.reserve(HWC2_BENCHMARK_MAX_SAMPLES);
+    uint64_t allocs = 0, frames = 0;
+
+    uint64_t exports = hwc2_fake_gralloc_get_dma_buf_exports();
+    size_t open_dma_bufs = hwc2_fake_gralloc_get_open_dma_bufs();
+
+    for (auto _: state) {
+        hwc2_test_frame_times times;
+        if (scene.frame(&times) != HWC2_ERROR_NONE) {
+            state.SkipWithError("present_display failed");
+            break;
+        }
+
+        if (samples.size() < samples.capacity())
+            samples.push_back((call == HWC2_BENCHMARK_VALIDATE)?
+                    times.validate: times.present);
+
+        allocs += times.allocs;
+        frames++;
+    }
+
+    /* Every fd exported while measuring and not open at the end was closed */
+    exports = hwc2_fake_gralloc_get_dma_buf_exports() - exports;
+    uint64_t closes = exports + open_dma_bufs
+            - hwc2_fake_gralloc_get_open_dma_bufs();
+
+    report_latency(state, samples);
+    state.counters["allocs_per_frame"] = (frames)?
+            static_cast<double>(allocs) / frames: 0.0;
+    state.counters["dma_buf_exports_per_frame"] = (frames)?
+            static_cast<double>(exports) / frames: 0.0;
+    state.counters["dma_buf_closes_per_frame"] = (frames)?
+            static_cast<double>(closes) / frames: 0.0;
+}
+
+static void BM_validate_display(benchmark::State &state,
+        hwc2_test_scene_type type)
+{
+    run_scene(state, type, HWC2_BENCHMARK_VALIDATE, false);
+}
+
+static void BM_assign_composition(benchmark::State &state,
+        hwc2_test_scene_type type)
+{
+    run_scene(state, type, HWC2_BENCHMARK_VALIDATE, true);
+}
+
+static void BM_present_display(benchmark::State &state,
+        hwc2_test_scene_type type)
+{
+    run_scene(state, type, HWC2_BENCHMARK_PRESENT, false);
+}
+
+#define HWC2_BENCHMARK_SCENES(function) \
+    BENCHMARK_CAPTURE(function, rgb, HWC2_TEST_SCENE_RGB) \
+            ->Arg(1)->Arg(4)->Arg(8)->Arg(16); \
+    BENCHMARK_CAPTURE(function, yuv_mix, HWC2_TEST_SCENE_YUV_MIX) \
+            ->Arg(4)->Arg(8)->Arg(16); \
+    BENCHMARK_CAPTURE(function, rotated, HWC2_TEST_SCENE_ROTATED) \
+            ->Arg(4)->Arg(8)->Arg(16); \
+    BENCHMARK_CAPTURE(function, scaled, HWC2_TEST_SCENE_SCALED) \
+            ->Arg(4)->Arg(8)->Arg(16); \
+    BENCHMARK_CAPTURE(function, overlapping, HWC2_TEST_SCENE_OVERLAPPING) \
+            ->Arg(4)->Arg(8)->Arg(16)
+
+HWC2_BENCHMARK_SCENES(BM_validate_display);
+HWC2_BENCHMARK_SCENES(BM_assign_composition);
+HWC2_BENCHMARK_SCENES(BM_present_display);
+
+BENCHMARK_MAIN();
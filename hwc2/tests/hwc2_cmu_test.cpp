@@ -0,0 +1,119 @@
+/*
+ * Copyright (C) 2016 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <gtest/gtest.h>
+
+#include "hwc2.h"
+
+static const std::array<uint16_t, 9> identity_csc = {{
+    0x100, 0, 0,
+    0, 0x100, 0,
+    0, 0, 0x100,
+}};
+
+static std::array<float, 16> get_identity_matrix()
+{
+    return {{1, 0, 0, 0, 0, 1, 0, 0, 0, 0, 1, 0, 0, 0, 0, 1}};
+}
+
+TEST(hwc2_cmu_test, identity_matrix_keeps_the_default_csc)
+{
+    std::array<uint16_t, 9> calibration = {{
+        0x0f0, 0x008, 0xff8,
+        0x000, 0x100, 0x000,
+        0xffc, 0x004, 0x0fc,
+    }};
+    std::array<uint16_t, 9> csc;
+
+    ASSERT_TRUE(hwc2_get_cmu_csc(get_identity_matrix(), identity_csc, &csc));
+    EXPECT_EQ(csc, identity_csc);
+
+    ASSERT_TRUE(hwc2_get_cmu_csc(get_identity_matrix(), calibration, &csc));
+    EXPECT_EQ(csc, calibration);
+}
+
+/* Coefficients are rounded to S3.8 and negative ones are stored as 12 bit
+ * two's complement */
+TEST(hwc2_cmu_test, coefficients_are_s3_8_fixed_point)
+{
+    std::array<float, 16> matrix = get_identity_matrix();
+    matrix[0] = 0.299f;     /* R from R: 76.54 rounds to 77 */
+    matrix[4] = -0.5f;      /* R from G */
+    matrix[8] = 7.99f;      /* R from B: the largest that fits */
+    matrix[5] = -8.0f;      /* G from G: the smallest that fits */
+    matrix[10] = 1.0f / 512;
+
+    std::array<uint16_t, 9> csc;
+    ASSERT_TRUE(hwc2_get_cmu_csc(matrix, identity_csc, &csc));
+
+    EXPECT_EQ(csc[0], 0x04d);
+    EXPECT_EQ(csc[1], 0xf80);
+    EXPECT_EQ(csc[2], 0x7fd);
+    EXPECT_EQ(csc[4], 0x800);
+    EXPECT_EQ(csc[8], 0x001);
+    EXPECT_EQ(csc[3], 0x000);
+}
+
+TEST(hwc2_cmu_test, unrepresentable_matrices_are_rejected)
+{
+    std::array<uint16_t, 9> csc;
+
+    std::array<float, 16> matrix = get_identity_matrix();
+    matrix[0] = 8.0f;
+    EXPECT_FALSE(hwc2_get_cmu_csc(matrix, identity_csc, &csc));
+
+    matrix = get_identity_matrix();
+    matrix[6] = -8.01f;
+    EXPECT_FALSE(hwc2_get_cmu_csc(matrix, identity_csc, &csc));
+
+    /* The cmu has no offsets */
+    matrix = get_identity_matrix();
+    matrix[13] = 0.1f;
+    EXPECT_FALSE(hwc2_get_cmu_csc(matrix, identity_csc, &csc));
+}
+
+/* The matrix applies first and the kernel's csc after it, so a product
+ * that leaves the range fails even if both fit on their own */
+TEST(hwc2_cmu_test, matrix_is_composed_with_the_default_csc)
+{
+    std::array<uint16_t, 9> calibration = {{
+        0x080, 0x000, 0x000,
+        0x000, 0x200, 0x000,
+        0x000, 0x000, 0x100,
+    }};
+
+    /* Swaps red and green */
+    std::array<float, 16> matrix = get_identity_matrix();
+    matrix[0] = 0.0f;
+    matrix[5] = 0.0f;
+    matrix[1] = 1.0f;
+    matrix[4] = 1.0f;
+
+    std::array<uint16_t, 9> csc;
+    ASSERT_TRUE(hwc2_get_cmu_csc(matrix, calibration, &csc));
+
+    std::array<uint16_t, 9> expected = {{
+        0x000, 0x080, 0x000,
+        0x200, 0x000, 0x000,
+        0x000, 0x000, 0x100,
+    }};
+    EXPECT_EQ(csc, expected);
+
+    matrix = get_identity_matrix();
+    matrix[5] = 4.0f;
+    EXPECT_FALSE(hwc2_get_cmu_csc(matrix, calibration, &csc));
+    EXPECT_TRUE(hwc2_get_cmu_csc(matrix, identity_csc, &csc));
+}
@@ -0,0 +1,780 @@
+/*
+ * Copyright (C) 2016 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <gtest/gtest.h>
+#include <sync/sync.h>
+#include <tegra_adf.h>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <algorithm>
+
+#include "hwc2_test_device.h"
+
+class hwc2_display_test: public testing::Test {
+protected:
+    void SetUp() override
+    {
+        hwc2_fake_property_clear();
+        hwc2_fake_property_set("debug.hwc2.idle_frames", "0");
+        hwc2_fake_adf_reset(hwc2_test_get_displays(1));
+
+        hwc2_fake_config config = hwc2_test_get_panel_config();
+        width = config.width;
+        height = config.height;
+    }
+
+    void TearDown() override
+    {
+        for (auto buffer: buffers)
+            hwc2_fake_gralloc_free(buffer);
+    }
+
+    /* Creates a layer showing a new buffer as large as its frame */
+    hwc2_layer_t add_layer(hwc2_test_device &device, const hwc_rect_t &frame,
+            hwc2_composition_t type, hwc2_blend_mode_t blend, uint32_t z_order)
+    {
+        int32_t frame_width = frame.right - frame.left;
+        int32_t frame_height = frame.bottom - frame.top;
+        hwc_frect_t crop = {0.0f, 0.0f, static_cast<float>(frame_width),
+                static_cast<float>(frame_height)};
+
+        buffer_handle_t buffer = hwc2_fake_gralloc_alloc(frame_width,
+                frame_height, HAL_PIXEL_FORMAT_RGBA_8888,
+                HWC2_FAKE_LAYOUT_PITCH);
+        buffers.push_back(buffer);
+
+        hwc2_layer_t lyr_id;
+        EXPECT_EQ(device.create_layer(0, &lyr_id), HWC2_ERROR_NONE);
+        EXPECT_EQ(device.set_layer_composition_type(0, lyr_id, type),
+                HWC2_ERROR_NONE);
+        EXPECT_EQ(device.set_layer_blend_mode(0, lyr_id, blend),
+                HWC2_ERROR_NONE);
+        EXPECT_EQ(device.set_layer_display_frame(0, lyr_id, frame),
+                HWC2_ERROR_NONE);
+        EXPECT_EQ(device.set_layer_source_crop(0, lyr_id, crop),
+                HWC2_ERROR_NONE);
+        EXPECT_EQ(device.set_layer_plane_alpha(0, lyr_id, 1.0f),
+                HWC2_ERROR_NONE);
+        EXPECT_EQ(device.set_layer_z_order(0, lyr_id, z_order),
+                HWC2_ERROR_NONE);
+
+        hwc_region_t visible = {1, &frame};
+        EXPECT_EQ(device.set_layer_visible_region(0, lyr_id, visible),
+                HWC2_ERROR_NONE);
+        EXPECT_EQ(device.set_layer_buffer(0, lyr_id, buffer, -1),
+                HWC2_ERROR_NONE);
+        return lyr_id;
+    }
+
+    /* Gives the display a new full screen client target */
+    void set_client_target(hwc2_test_device &device)
+    {
+        buffer_handle_t target = hwc2_fake_gralloc_alloc(width, height,
+                HAL_PIXEL_FORMAT_RGBA_8888, HWC2_FAKE_LAYOUT_PITCH);
+        buffers.push_back(target);
+
+        hwc_region_t damage = {0, nullptr};
+        EXPECT_EQ(device.set_client_target(0, target, -1, damage),
+                HWC2_ERROR_NONE);
+    }
+
+    /* Validates and returns the layers that were changed to client
+     * composition, in the order the display reports them */
+    std::vector<hwc2_layer_t> get_client_layers(hwc2_test_device &device)
+    {
+        std::vector<hwc2_layer_t> client_layers;
+        uint32_t num_types, num_requests;
+        int32_t ret = device.validate_display(0, &num_types, &num_requests);
+        EXPECT_TRUE(ret == HWC2_ERROR_NONE || ret == HWC2_ERROR_HAS_CHANGES);
+        if (num_types == 0)
+            return client_layers;
+
+        std::vector<hwc2_layer_t> layers(num_types);
+        std::vector<int32_t> types(num_types);
+        EXPECT_EQ(device.get_changed_composition_types(0, &num_types,
+                layers.data(), types.data()), HWC2_ERROR_NONE);
+
+        for (uint32_t idx = 0; idx < num_types; idx++)
+            if (types[idx] == HWC2_COMPOSITION_CLIENT)
+                client_layers.push_back(layers[idx]);
+        return client_layers;
+    }
+
+    /* Validates, accepts the changes, presents and waits until the post
+     * worker has posted the frame */
+    int32_t present(hwc2_test_device &device)
+    {
+        uint32_t num_types, num_requests;
+        int32_t ret = device.validate_display(0, &num_types, &num_requests);
+        if (ret == HWC2_ERROR_HAS_CHANGES)
+            ret = device.accept_display_changes(0);
+        if (ret != HWC2_ERROR_NONE)
+            return ret;
+
+        int32_t present_fence = -1;
+        ret = device.present_display(0, &present_fence);
+        if (present_fence >= 0) {
+            sync_wait(present_fence, -1);
+            close(present_fence);
+        }
+        return ret;
+    }
+
+    int32_t width;
+    int32_t height;
+    std::vector<buffer_handle_t> buffers;
+};
+
+/* A cursor under an opaque layer keeps its window, so that it shows up as
+ * soon as it is moved out from under the layer without a validate */
+TEST_F(hwc2_display_test, cursor_is_not_culled)
+{
+    hwc2_test_device device;
+    ASSERT_TRUE(device.is_open());
+
+    add_layer(device, {0, 0, width / 2, height}, HWC2_COMPOSITION_DEVICE,
+            HWC2_BLEND_MODE_NONE, 1);
+    hwc2_layer_t cursor = add_layer(device, {0, 0, 64, 64},
+            HWC2_COMPOSITION_CURSOR, HWC2_BLEND_MODE_PREMULTIPLIED, 0);
+
+    ASSERT_EQ(present(device), HWC2_ERROR_NONE);
+
+    hwc2_fake_post post;
+    ASSERT_TRUE(hwc2_fake_adf_get_last_post(0, &post));
+    EXPECT_EQ(post.bufs.size(), 2u);
+
+    ASSERT_EQ(device.set_cursor_position(0, cursor, width - 64, 0),
+            HWC2_ERROR_NONE);
+    int32_t present_fence = -1;
+    ASSERT_EQ(device.present_display(0, &present_fence), HWC2_ERROR_NONE);
+    if (present_fence >= 0) {
+        sync_wait(present_fence, -1);
+        close(present_fence);
+    }
+
+    ASSERT_TRUE(hwc2_fake_adf_get_last_post(0, &post));
+    EXPECT_EQ(post.bufs.size(), 2u);
+}
+
+/* The same buffers are only posted again if the client damaged them. A
+ * skipped post counts as a present and does not wait for the buffers, but
+ * its present fence does */
+TEST_F(hwc2_display_test, undamaged_frames_are_not_posted)
+{
+    hwc2_test_device device;
+    ASSERT_TRUE(device.is_open());
+
+    hwc_rect_t frame = {0, 0, width, height};
+    hwc2_layer_t lyr_id = add_layer(device, frame, HWC2_COMPOSITION_DEVICE,
+            HWC2_BLEND_MODE_NONE, 0);
+    buffer_handle_t buffer = buffers.back();
+
+    ASSERT_EQ(present(device), HWC2_ERROR_NONE);
+    EXPECT_EQ(hwc2_fake_adf_get_post_count(0), 1u);
+
+    /* No damage rects means the whole buffer was redrawn */
+    hwc_region_t damage = {0, nullptr};
+    ASSERT_EQ(device.set_layer_buffer(0, lyr_id, buffer, -1),
+            HWC2_ERROR_NONE);
+    ASSERT_EQ(device.set_layer_surface_damage(0, lyr_id, damage),
+            HWC2_ERROR_NONE);
+    ASSERT_EQ(present(device), HWC2_ERROR_NONE);
+    EXPECT_EQ(hwc2_fake_adf_get_post_count(0), 2u);
+
+    hwc_rect_t empty = {0, 0, 0, 0};
+    damage = {1, &empty};
+    int fence = hwc2_fake_fence_create(false);
+    ASSERT_EQ(device.set_layer_buffer(0, lyr_id, buffer, dup(fence)),
+            HWC2_ERROR_NONE);
+    ASSERT_EQ(device.set_layer_surface_damage(0, lyr_id, damage),
+            HWC2_ERROR_NONE);
+
+    uint32_t num_types, num_requests;
+    ASSERT_EQ(device.validate_display(0, &num_types, &num_requests),
+            HWC2_ERROR_NONE);
+    int32_t present_fence = -1;
+    ASSERT_EQ(device.present_display(0, &present_fence), HWC2_ERROR_NONE);
+    ASSERT_GE(present_fence, 0);
+
+    EXPECT_EQ(hwc2_fake_adf_get_post_count(0), 2u);
+    EXPECT_LT(sync_wait(present_fence, 0), 0);
+
+    hwc2_fake_fence_signal(fence);
+    EXPECT_EQ(sync_wait(present_fence, 1000), 0);
+    close(present_fence);
+    close(fence);
+
+    std::string dump;
+    device.dump(&dump);
+    EXPECT_NE(dump.find("Present: 3 presents, 0 without validate"),
+            std::string::npos) << dump;
+    EXPECT_NE(dump.find("1 identical posts skipped"), std::string::npos)
+            << dump;
+}
+
+/* Without an array only the number of times is returned, and there are none
+ * before the first hardware vsync */
+TEST_F(hwc2_display_test, predicted_present_time_count)
+{
+    hwc2_test_device device;
+    ASSERT_TRUE(device.is_open());
+
+    int64_t times[HWC2_VSYNC_MAX_PREDICTIONS + 1];
+    uint32_t count = 0;
+    EXPECT_EQ(device.get_predicted_present_times(0, nullptr, times),
+            HWC2_ERROR_BAD_PARAMETER);
+    EXPECT_EQ(device.get_predicted_present_times(0, &count, nullptr),
+            HWC2_ERROR_NONE);
+    EXPECT_EQ(count, 0u);
+
+    ASSERT_EQ(device.set_vsync_enabled(0, HWC2_VSYNC_ENABLE), HWC2_ERROR_NONE);
+    int32_t period = hwc2_test_get_panel_config().vsync_period;
+    nsecs_t now = systemTime(SYSTEM_TIME_MONOTONIC);
+    for (int32_t idx = HWC2_VSYNC_MIN_SAMPLES; idx > 0; idx--)
+        hwc2_fake_adf_vsync(0, now - idx * period);
+
+    EXPECT_EQ(device.get_predicted_present_times(0, &count, nullptr),
+            HWC2_ERROR_NONE);
+    EXPECT_EQ(count, static_cast<uint32_t>(HWC2_VSYNC_MAX_PREDICTIONS));
+
+    count = HWC2_VSYNC_MAX_PREDICTIONS + 1;
+    EXPECT_EQ(device.get_predicted_present_times(0, &count, times),
+            HWC2_ERROR_NONE);
+    ASSERT_EQ(count, static_cast<uint32_t>(HWC2_VSYNC_MAX_PREDICTIONS));
+    EXPECT_GE(times[0], now);
+    for (uint32_t idx = 1; idx < count; idx++)
+        EXPECT_EQ(times[idx] - times[idx - 1], period);
+}
+
+/* A malformed command stops the stream, but the fences of the buffer
+ * commands after it are still closed */
+TEST_F(hwc2_display_test, malformed_layer_command_closes_later_fences)
+{
+    hwc2_test_device device;
+    ASSERT_TRUE(device.is_open());
+
+    hwc2_layer_t lyr_id = add_layer(device, {0, 0, width, height},
+            HWC2_COMPOSITION_DEVICE, HWC2_BLEND_MODE_NONE, 0);
+    uint64_t handle = reinterpret_cast<uintptr_t>(buffers.back());
+    int fence = hwc2_fake_fence_create(true);
+
+    uint32_t commands[] = {
+        HWC2_LAYER_COMMAND_HEADER(HWC2_LAYER_COMMAND_SELECT_LAYER, 2),
+        static_cast<uint32_t>(lyr_id), static_cast<uint32_t>(lyr_id >> 32),
+        HWC2_LAYER_COMMAND_HEADER(HWC2_LAYER_COMMAND_Z_ORDER, 2), 1, 1,
+        HWC2_LAYER_COMMAND_HEADER(HWC2_LAYER_COMMAND_BUFFER, 3),
+        static_cast<uint32_t>(handle), static_cast<uint32_t>(handle >> 32),
+        static_cast<uint32_t>(fence),
+    };
+    uint32_t error_offset = 0;
+
+    EXPECT_EQ(device.set_layer_commands(0, sizeof(commands) / sizeof(*commands),
+            commands, &error_offset), HWC2_ERROR_BAD_PARAMETER);
+    EXPECT_EQ(error_offset, 3u);
+    EXPECT_EQ(fcntl(fence, F_GETFD), -1);
+}
+
+/* A renegotiated budget drops the cached plans and asks for a refresh. A
+ * frame counts as cut back once however many plans the budget ruled out,
+ * including frames whose plan came from the cache */
+TEST_F(hwc2_display_test, bandwidth_renegotiation_replans)
+{
+    hwc2_test_device device;
+    ASSERT_TRUE(device.is_open());
+
+    hwc2_test_scene scene(device, 0, width, height);
+    scene.generate(HWC2_TEST_SCENE_RGB, 3);
+
+    /* The client asks for device composition every frame, as
+     * SurfaceFlinger does */
+    auto frame = [&] () {
+        for (size_t idx = 0; idx < scene.get_layer_count(); idx++)
+            device.set_layer_composition_type(0, scene.get_layer(idx),
+                    HWC2_COMPOSITION_DEVICE);
+        return scene.frame(nullptr);
+    };
+
+    ASSERT_EQ(frame(), HWC2_ERROR_NONE);
+
+    hwc2_fake_post post;
+    ASSERT_TRUE(hwc2_fake_adf_get_last_post(0, &post));
+    EXPECT_EQ(post.bufs.size(), 3u);
+
+    /* Not even the client target fits, so everything goes to the client
+     * as the least bad plan */
+    uint64_t refresh_cnt = device.get_refresh_count();
+    hwc2_fake_adf_renegotiate_bandwidth(0, 1);
+    EXPECT_EQ(device.get_refresh_count(), refresh_cnt + 1);
+
+    std::string dump;
+    device.dump(&dump);
+    EXPECT_NE(dump.find("Plan Cache: 0/"), std::string::npos) << dump;
+    EXPECT_NE(dump.find("1 KB/s available, 0 frames cut back"),
+            std::string::npos) << dump;
+
+    for (size_t idx = 0; idx < 3; idx++)
+        ASSERT_EQ(frame(), HWC2_ERROR_NONE);
+    ASSERT_TRUE(hwc2_fake_adf_get_last_post(0, &post));
+    EXPECT_EQ(post.bufs.size(), 1u);
+
+    /* The same budget again changes nothing */
+    hwc2_fake_adf_renegotiate_bandwidth(0, 1);
+    EXPECT_EQ(device.get_refresh_count(), refresh_cnt + 1);
+
+    dump.clear();
+    device.dump(&dump);
+    EXPECT_NE(dump.find("3 frames cut back, 2 renegotiations"),
+            std::string::npos) << dump;
+
+    hwc2_fake_adf_renegotiate_bandwidth(0, UINT32_MAX);
+    EXPECT_EQ(device.get_refresh_count(), refresh_cnt + 2);
+
+    ASSERT_EQ(frame(), HWC2_ERROR_NONE);
+    ASSERT_TRUE(hwc2_fake_adf_get_last_post(0, &post));
+    EXPECT_EQ(post.bufs.size(), 3u);
+
+    dump.clear();
+    device.dump(&dump);
+    EXPECT_NE(dump.find("3 frames cut back, 3 renegotiations"),
+            std::string::npos) << dump;
+}
+
+/* A layer hidden under an opaque one is left out of the plan, which frees
+ * the window it would have taken */
+TEST_F(hwc2_display_test, hidden_layer_frees_its_window)
+{
+    hwc2_test_device device;
+    ASSERT_TRUE(device.is_open());
+
+    add_layer(device, {0, 0, width / 2, height / 2}, HWC2_COMPOSITION_DEVICE,
+            HWC2_BLEND_MODE_NONE, 0);
+    add_layer(device, {0, 0, width, height}, HWC2_COMPOSITION_DEVICE,
+            HWC2_BLEND_MODE_NONE, 1);
+
+    ASSERT_EQ(present(device), HWC2_ERROR_NONE);
+
+    hwc2_fake_post post;
+    ASSERT_TRUE(hwc2_fake_adf_get_last_post(0, &post));
+    EXPECT_EQ(post.bufs.size(), 1u);
+
+    std::string dump;
+    device.dump(&dump);
+    EXPECT_NE(dump.find("1 layers culled, 1 windows freed"),
+            std::string::npos) << dump;
+}
+
+/* Six overlapping layers need seven windows. The client target takes three
+ * of them in one contiguous z range, leaving three layers and the target in
+ * the four windows */
+TEST_F(hwc2_display_test, solver_sends_a_contiguous_range_to_the_client)
+{
+    hwc2_test_device device;
+    ASSERT_TRUE(device.is_open());
+
+    std::vector<hwc2_layer_t> layers;
+    for (uint32_t z = 0; z < 6; z++)
+        layers.push_back(add_layer(device, {0, 0, width, height},
+                HWC2_COMPOSITION_DEVICE, HWC2_BLEND_MODE_PREMULTIPLIED, z));
+
+    std::vector<hwc2_layer_t> client_layers = get_client_layers(device);
+    ASSERT_EQ(client_layers.size(), 3u);
+
+    std::vector<size_t> z_orders;
+    for (hwc2_layer_t lyr_id: client_layers)
+        z_orders.push_back(std::find(layers.begin(), layers.end(), lyr_id)
+                - layers.begin());
+    std::sort(z_orders.begin(), z_orders.end());
+    EXPECT_EQ(z_orders[1], z_orders[0] + 1);
+    EXPECT_EQ(z_orders[2], z_orders[1] + 1);
+
+    ASSERT_EQ(device.accept_display_changes(0), HWC2_ERROR_NONE);
+    set_client_target(device);
+    ASSERT_EQ(present(device), HWC2_ERROR_NONE);
+
+    hwc2_fake_post post;
+    ASSERT_TRUE(hwc2_fake_adf_get_last_post(0, &post));
+    EXPECT_EQ(post.bufs.size(), 4u);
+}
+
+/* The last window can neither scale nor take the client target, so of four
+ * scaled layers two go to the client. An unscaled layer can take the last
+ * window and leave the others to the scaled ones. When the client has to
+ * compose layers of the same area, it takes the ones that need no scaling */
+TEST_F(hwc2_display_test, solver_places_scaled_layers)
+{
+    hwc2_test_device device;
+    ASSERT_TRUE(device.is_open());
+
+    int32_t half_width = width / 2, half_height = height / 2;
+    hwc_frect_t half_crop = {0.0f, 0.0f, half_width / 2.0f,
+            half_height / 2.0f};
+    std::array<hwc_rect_t, 4> quadrants = {{
+        {0, 0, half_width, half_height},
+        {half_width, 0, width, half_height},
+        {0, half_height, half_width, height},
+        {half_width, half_height, width, height},
+    }};
+
+    std::vector<hwc2_layer_t> layers;
+    for (uint32_t idx = 0; idx < quadrants.size(); idx++) {
+        layers.push_back(add_layer(device, quadrants[idx],
+                HWC2_COMPOSITION_DEVICE, HWC2_BLEND_MODE_NONE, idx));
+        ASSERT_EQ(device.set_layer_source_crop(0, layers.back(), half_crop),
+                HWC2_ERROR_NONE);
+    }
+
+    EXPECT_EQ(get_client_layers(device).size(), 2u);
+
+    /* The bottom layer is no longer scaled */
+    hwc_frect_t full_crop = {0.0f, 0.0f, static_cast<float>(half_width),
+            static_cast<float>(half_height)};
+    for (hwc2_layer_t lyr_id: layers)
+        ASSERT_EQ(device.set_layer_composition_type(0, lyr_id,
+                HWC2_COMPOSITION_DEVICE), HWC2_ERROR_NONE);
+    ASSERT_EQ(device.set_layer_source_crop(0, layers[0], full_crop),
+            HWC2_ERROR_NONE);
+
+    EXPECT_TRUE(get_client_layers(device).empty());
+    ASSERT_EQ(present(device), HWC2_ERROR_NONE);
+
+    hwc2_fake_post post;
+    ASSERT_TRUE(hwc2_fake_adf_get_last_post(0, &post));
+    EXPECT_EQ(post.bufs.size(), 4u);
+
+    /* Under a full screen layer, two of the quadrants have to go to the
+     * client. Every pair covers the same area, but the unscaled pair is
+     * the cheapest to compose */
+    for (hwc2_layer_t lyr_id: layers)
+        ASSERT_EQ(device.set_layer_composition_type(0, lyr_id,
+                HWC2_COMPOSITION_DEVICE), HWC2_ERROR_NONE);
+    ASSERT_EQ(device.set_layer_source_crop(0, layers[0], half_crop),
+            HWC2_ERROR_NONE);
+    ASSERT_EQ(device.set_layer_source_crop(0, layers[2], full_crop),
+            HWC2_ERROR_NONE);
+    ASSERT_EQ(device.set_layer_source_crop(0, layers[3], full_crop),
+            HWC2_ERROR_NONE);
+    add_layer(device, {0, 0, width, height}, HWC2_COMPOSITION_DEVICE,
+            HWC2_BLEND_MODE_PREMULTIPLIED, 4);
+
+    std::vector<hwc2_layer_t> client_layers = get_client_layers(device);
+    std::sort(client_layers.begin(), client_layers.end());
+    std::vector<hwc2_layer_t> expected = {layers[2], layers[3]};
+    std::sort(expected.begin(), expected.end());
+    EXPECT_EQ(client_layers, expected);
+}
+
+/* Each layout is planned once. Going back to a layout reuses its plan, and
+ * once the cache is full the least recently used plan is dropped */
+TEST_F(hwc2_display_test, plan_cache_hits_misses_and_evicts)
+{
+    hwc2_test_device device;
+    ASSERT_TRUE(device.is_open());
+
+    hwc2_layer_t lyr_id = add_layer(device, {0, 0, width / 2, height / 2},
+            HWC2_COMPOSITION_DEVICE, HWC2_BLEND_MODE_NONE, 0);
+
+    auto validate_at = [&] (int32_t left) {
+        hwc_rect_t frame = {left, 0, left + width / 2, height / 2};
+        hwc_region_t visible = {1, &frame};
+        ASSERT_EQ(device.set_layer_display_frame(0, lyr_id, frame),
+                HWC2_ERROR_NONE);
+        ASSERT_EQ(device.set_layer_visible_region(0, lyr_id, visible),
+                HWC2_ERROR_NONE);
+
+        uint32_t num_types, num_requests;
+        ASSERT_EQ(device.validate_display(0, &num_types, &num_requests),
+                HWC2_ERROR_NONE);
+    };
+    auto expect_dump = [&] (const std::string &line) {
+        std::string dump;
+        device.dump(&dump);
+        EXPECT_NE(dump.find(line), std::string::npos) << dump;
+    };
+
+    validate_at(0);
+    validate_at(4);
+    validate_at(0);
+    expect_dump("Plan Cache: 2/8 entries, 1 hits, 2 misses");
+
+    /* The layout at 4 is now the least recently used */
+    for (int32_t left = 8; left < 8 + 4 * (HWC2_PLAN_CACHE_SIZE - 1);
+            left += 4)
+        validate_at(left);
+    expect_dump("Plan Cache: 8/8 entries, 1 hits, 9 misses");
+
+    validate_at(0);
+    validate_at(4);
+    expect_dump("Plan Cache: 8/8 entries, 2 hits, 10 misses");
+}
+
+/* Plans only hold for the config and bandwidth budget they were made for */
+TEST_F(hwc2_display_test, plan_cache_is_dropped_on_config_and_budget_change)
+{
+    hwc2_test_device device;
+    ASSERT_TRUE(device.is_open());
+
+    add_layer(device, {0, 0, width, height}, HWC2_COMPOSITION_DEVICE,
+            HWC2_BLEND_MODE_NONE, 0);
+
+    auto expect_dump = [&] (const std::string &line) {
+        std::string dump;
+        device.dump(&dump);
+        EXPECT_NE(dump.find(line), std::string::npos) << dump;
+    };
+
+    ASSERT_EQ(present(device), HWC2_ERROR_NONE);
+    expect_dump("Plan Cache: 1/8 entries, 0 hits, 1 misses");
+
+    ASSERT_EQ(device.set_active_config(0, 0), HWC2_ERROR_NONE);
+    expect_dump("Plan Cache: 0/8 entries, 0 hits, 1 misses");
+
+    ASSERT_EQ(present(device), HWC2_ERROR_NONE);
+    expect_dump("Plan Cache: 1/8 entries, 0 hits, 2 misses");
+
+    hwc2_fake_adf_renegotiate_bandwidth(0, UINT32_MAX);
+    expect_dump("Plan Cache: 0/8 entries, 0 hits, 2 misses");
+
+    ASSERT_EQ(present(device), HWC2_ERROR_NONE);
+    expect_dump("Plan Cache: 1/8 entries, 0 hits, 3 misses");
+}
+
+/* Only a layer whose previously posted buffer left its window gets a
+ * release fence, one per layer */
+TEST_F(hwc2_display_test, release_fences_for_previously_posted_buffers)
+{
+    hwc2_test_device device;
+    ASSERT_TRUE(device.is_open());
+
+    hwc2_layer_t lyr_a = add_layer(device, {0, 0, width / 2, height},
+            HWC2_COMPOSITION_DEVICE, HWC2_BLEND_MODE_NONE, 0);
+    hwc2_layer_t lyr_b = add_layer(device, {width / 2, 0, width, height},
+            HWC2_COMPOSITION_DEVICE, HWC2_BLEND_MODE_NONE, 1);
+
+    auto get_released = [&] () {
+        uint32_t num_elements = 0;
+        EXPECT_EQ(device.get_release_fences(0, &num_elements, nullptr,
+                nullptr), HWC2_ERROR_NONE);
+
+        std::vector<hwc2_layer_t> layers(num_elements);
+        std::vector<int32_t> fences(num_elements);
+        EXPECT_EQ(device.get_release_fences(0, &num_elements, layers.data(),
+                fences.data()), HWC2_ERROR_NONE);
+
+        for (int32_t fence: fences) {
+            EXPECT_GE(fence, 0);
+            close(fence);
+        }
+        return layers;
+    };
+
+    /* Nothing was posted before the first frame */
+    ASSERT_EQ(present(device), HWC2_ERROR_NONE);
+    EXPECT_TRUE(get_released().empty());
+
+    /* Only the layer with a new buffer releases the old one */
+    buffer_handle_t buffer = hwc2_fake_gralloc_alloc(width / 2, height,
+            HAL_PIXEL_FORMAT_RGBA_8888, HWC2_FAKE_LAYOUT_PITCH);
+    buffers.push_back(buffer);
+    ASSERT_EQ(device.set_layer_buffer(0, lyr_a, buffer, -1), HWC2_ERROR_NONE);
+
+    ASSERT_EQ(present(device), HWC2_ERROR_NONE);
+    EXPECT_EQ(get_released(), std::vector<hwc2_layer_t>({lyr_a}));
+
+    /* A buffer that goes to the client leaves its window. A new layer had no
+     * buffer on a window before */
+    ASSERT_EQ(device.set_layer_composition_type(0, lyr_b,
+            HWC2_COMPOSITION_CLIENT), HWC2_ERROR_NONE);
+    add_layer(device, {0, 0, 64, 64}, HWC2_COMPOSITION_DEVICE,
+            HWC2_BLEND_MODE_PREMULTIPLIED, 2);
+    set_client_target(device);
+
+    ASSERT_EQ(present(device), HWC2_ERROR_NONE);
+    EXPECT_EQ(get_released(), std::vector<hwc2_layer_t>({lyr_b}));
+}
+
+/* A client that skips validate can present a new buffer of the same kind,
+ * but not one with another surface layout or a layer that moved */
+TEST_F(hwc2_display_test, present_without_validate)
+{
+    hwc2_test_device device;
+    ASSERT_TRUE(device.is_open());
+
+    hwc2_layer_t lyr_id = add_layer(device, {0, 0, width, height},
+            HWC2_COMPOSITION_DEVICE, HWC2_BLEND_MODE_NONE, 0);
+    ASSERT_EQ(present(device), HWC2_ERROR_NONE);
+
+    auto present_only = [&] () {
+        int32_t present_fence = -1;
+        int32_t ret = device.present_display(0, &present_fence);
+        if (present_fence >= 0) {
+            sync_wait(present_fence, -1);
+            close(present_fence);
+        }
+        return ret;
+    };
+
+    buffer_handle_t buffer = hwc2_fake_gralloc_alloc(width, height,
+            HAL_PIXEL_FORMAT_RGBA_8888, HWC2_FAKE_LAYOUT_PITCH);
+    buffers.push_back(buffer);
+    ASSERT_EQ(device.set_layer_buffer(0, lyr_id, buffer, -1),
+            HWC2_ERROR_NONE);
+    EXPECT_EQ(present_only(), HWC2_ERROR_NONE);
+    EXPECT_EQ(hwc2_fake_adf_get_post_count(0), 2u);
+
+    /* A buffer with another surface layout may need another window */
+    buffer = hwc2_fake_gralloc_alloc(width, height,
+            HAL_PIXEL_FORMAT_RGBA_8888, HWC2_FAKE_LAYOUT_BLOCK_LINEAR);
+    buffers.push_back(buffer);
+    ASSERT_EQ(device.set_layer_buffer(0, lyr_id, buffer, -1),
+            HWC2_ERROR_NONE);
+    EXPECT_EQ(present_only(), HWC2_ERROR_NOT_VALIDATED);
+    EXPECT_EQ(hwc2_fake_adf_get_post_count(0), 2u);
+
+    ASSERT_EQ(present(device), HWC2_ERROR_NONE);
+    EXPECT_EQ(hwc2_fake_adf_get_post_count(0), 3u);
+
+    hwc_rect_t frame = {0, 0, width, height / 2};
+    hwc_region_t visible = {1, &frame};
+    ASSERT_EQ(device.set_layer_display_frame(0, lyr_id, frame),
+            HWC2_ERROR_NONE);
+    ASSERT_EQ(device.set_layer_visible_region(0, lyr_id, visible),
+            HWC2_ERROR_NONE);
+    EXPECT_EQ(present_only(), HWC2_ERROR_NOT_VALIDATED);
+    EXPECT_EQ(hwc2_fake_adf_get_post_count(0), 3u);
+
+    ASSERT_EQ(present(device), HWC2_ERROR_NONE);
+    EXPECT_EQ(hwc2_fake_adf_get_post_count(0), 4u);
+
+    std::string dump;
+    device.dump(&dump);
+    EXPECT_NE(dump.find("Present: 4 presents, 1 without validate"),
+            std::string::npos) << dump;
+}
+
+/* Moving only the cursor is presented without a validate. The cursor window
+ * is flagged so the display controller can move it on its own, and the
+ * other window is posted as it was */
+TEST_F(hwc2_display_test, cursor_moves_without_validate)
+{
+    hwc2_test_device device;
+    ASSERT_TRUE(device.is_open());
+
+    add_layer(device, {0, 0, width, height}, HWC2_COMPOSITION_DEVICE,
+            HWC2_BLEND_MODE_NONE, 0);
+    hwc2_layer_t cursor = add_layer(device, {0, 0, 64, 64},
+            HWC2_COMPOSITION_CURSOR, HWC2_BLEND_MODE_PREMULTIPLIED, 1);
+    ASSERT_EQ(present(device), HWC2_ERROR_NONE);
+
+    auto get_cursor_window = [] (struct tegra_adf_flip_windowattr *out_attr) {
+        hwc2_fake_post post;
+        ASSERT_TRUE(hwc2_fake_adf_get_last_post(0, &post));
+        ASSERT_EQ(post.bufs.size(), 2u);
+
+        const struct tegra_adf_flip *flip =
+                reinterpret_cast<const struct tegra_adf_flip *>(
+                post.custom_data.data());
+        size_t cursor_cnt = 0;
+        for (uint8_t idx = 0; idx < flip->win_num; idx++) {
+            if (!(flip->win[idx].flags & TEGRA_ADF_FLIP_FLAG_CURSOR))
+                continue;
+            *out_attr = flip->win[idx];
+            cursor_cnt++;
+        }
+        ASSERT_EQ(cursor_cnt, 1u);
+    };
+
+    struct tegra_adf_flip_windowattr attr;
+    get_cursor_window(&attr);
+    EXPECT_EQ(attr.out_x, 0u);
+    EXPECT_EQ(attr.out_y, 0u);
+
+    ASSERT_EQ(device.set_cursor_position(0, cursor, width - 64, 32),
+            HWC2_ERROR_NONE);
+    int32_t present_fence = -1;
+    ASSERT_EQ(device.present_display(0, &present_fence), HWC2_ERROR_NONE);
+    if (present_fence >= 0) {
+        sync_wait(present_fence, -1);
+        close(present_fence);
+    }
+
+    EXPECT_EQ(hwc2_fake_adf_get_post_count(0), 2u);
+    get_cursor_window(&attr);
+    EXPECT_EQ(attr.out_x, static_cast<uint32_t>(width - 64));
+    EXPECT_EQ(attr.out_y, 32u);
+
+    /* A cursor partly off screen cannot stay in its window */
+    ASSERT_EQ(device.set_cursor_position(0, cursor, width - 32, 32),
+            HWC2_ERROR_NONE);
+    EXPECT_EQ(device.present_display(0, &present_fence),
+            HWC2_ERROR_NOT_VALIDATED);
+
+    std::string dump;
+    device.dump(&dump);
+    EXPECT_NE(dump.find("Present: 2 presents, 1 without validate"),
+            std::string::npos) << dump;
+}
+
+/* An opaque layer between two client layers stays in a window below the
+ * client target, and the client is asked to clear the target over it. A
+ * translucent one has to be composed by the client */
+TEST_F(hwc2_display_test, opaque_layer_in_the_client_range_is_a_hole)
+{
+    hwc2_test_device device;
+    ASSERT_TRUE(device.is_open());
+
+    add_layer(device, {0, 0, width, height / 4}, HWC2_COMPOSITION_CLIENT,
+            HWC2_BLEND_MODE_NONE, 0);
+    hwc2_layer_t hole = add_layer(device, {0, height / 4, width, height / 2},
+            HWC2_COMPOSITION_DEVICE, HWC2_BLEND_MODE_NONE, 1);
+    add_layer(device, {0, height / 2, width, height}, HWC2_COMPOSITION_CLIENT,
+            HWC2_BLEND_MODE_NONE, 2);
+
+    auto get_requests = [&] () {
+        int32_t display_requests = 0;
+        uint32_t num_elements = 0;
+        EXPECT_EQ(device.get_display_requests(0, &display_requests,
+                &num_elements, nullptr, nullptr), HWC2_ERROR_NONE);
+
+        std::vector<hwc2_layer_t> layers(num_elements);
+        std::vector<int32_t> requests(num_elements);
+        EXPECT_EQ(device.get_display_requests(0, &display_requests,
+                &num_elements, layers.data(), requests.data()),
+                HWC2_ERROR_NONE);
+        EXPECT_EQ(display_requests, 0);
+
+        std::vector<hwc2_layer_t> cleared;
+        for (uint32_t idx = 0; idx < num_elements; idx++)
+            if (requests[idx] == HWC2_LAYER_REQUEST_CLEAR_CLIENT_TARGET)
+                cleared.push_back(layers[idx]);
+        return cleared;
+    };
+
+    EXPECT_TRUE(get_client_layers(device).empty());
+    EXPECT_EQ(get_requests(), std::vector<hwc2_layer_t>({hole}));
+
+    set_client_target(device);
+    ASSERT_EQ(present(device), HWC2_ERROR_NONE);
+
+    hwc2_fake_post post;
+    ASSERT_TRUE(hwc2_fake_adf_get_last_post(0, &post));
+    EXPECT_EQ(post.bufs.size(), 2u);
+
+    ASSERT_EQ(device.set_layer_blend_mode(0, hole,
+            HWC2_BLEND_MODE_PREMULTIPLIED), HWC2_ERROR_NONE);
+    EXPECT_EQ(get_client_layers(device), std::vector<hwc2_layer_t>({hole}));
+    EXPECT_TRUE(get_requests().empty());
+}
@@ -0,0 +1,127 @@
+/*
+ * Copyright (C) 2016 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <gtest/gtest.h>
+
+#include "hwc2_test_device.h"
+
+#define HWC2_DMA_BUF_TEST_WARMUP_FRAMES   16
+
+class hwc2_dma_buf_test: public testing::Test {
+protected:
+    void SetUp() override
+    {
+        hwc2_fake_property_clear();
+        hwc2_fake_property_set("debug.hwc2.idle_frames", "0");
+        hwc2_fake_adf_reset(hwc2_test_get_displays(1));
+
+        hwc2_fake_config config = hwc2_test_get_panel_config();
+        width = config.width;
+        height = config.height;
+    }
+
+    /* An opaque full screen layer, which is always scanned out by a window */
+    size_t add_background(hwc2_test_scene &scene, size_t buffer_cnt)
+    {
+        hwc_rect_t frame = {0, 0, width, height};
+        hwc_frect_t crop = {0.0f, 0.0f, static_cast<float>(width),
+                static_cast<float>(height)};
+        return scene.add_layer(HAL_PIXEL_FORMAT_RGBX_8888,
+                HWC2_FAKE_LAYOUT_PITCH, frame, crop,
+                static_cast<hwc_transform_t>(0), HWC2_BLEND_MODE_NONE,
+                buffer_cnt);
+    }
+
+    int32_t width;
+    int32_t height;
+};
+
+TEST_F(hwc2_dma_buf_test, steady_state_posts_do_not_export)
+{
+    hwc2_test_device device;
+    ASSERT_TRUE(device.is_open());
+
+    hwc2_test_scene scene(device, 0, width, height);
+    scene.generate(HWC2_TEST_SCENE_YUV_MIX, 4);
+
+    for (size_t idx = 0; idx < HWC2_DMA_BUF_TEST_WARMUP_FRAMES; idx++)
+        ASSERT_EQ(scene.frame(nullptr), HWC2_ERROR_NONE);
+
+    uint64_t exports = hwc2_fake_gralloc_get_dma_buf_exports();
+    size_t open_dma_bufs = hwc2_fake_gralloc_get_open_dma_bufs();
+
+    for (size_t idx = 0; idx < HWC2_DMA_BUF_TEST_WARMUP_FRAMES; idx++)
+        ASSERT_EQ(scene.frame(nullptr), HWC2_ERROR_NONE);
+
+    EXPECT_EQ(hwc2_fake_gralloc_get_dma_buf_exports(), exports);
+    EXPECT_EQ(hwc2_fake_gralloc_get_open_dma_bufs(), open_dma_bufs);
+}
+
+/* A BufferQueue with one buffer more than the history pushes out the buffer
+ * it set HWC2_BUFFER_HISTORY_SIZE frames ago every frame */
+TEST_F(hwc2_dma_buf_test, replaced_buffers_are_closed)
+{
+    hwc2_test_device device;
+    ASSERT_TRUE(device.is_open());
+
+    size_t buffer_cnt = HWC2_BUFFER_HISTORY_SIZE + 1;
+    hwc2_test_scene scene(device, 0, width, height);
+    size_t lyr_idx = add_background(scene, buffer_cnt);
+
+    for (size_t idx = 0; idx < HWC2_DMA_BUF_TEST_WARMUP_FRAMES; idx++) {
+        size_t buf_idx = scene.get_frame_count() % buffer_cnt;
+        ASSERT_EQ(scene.frame(nullptr), HWC2_ERROR_NONE);
+
+        EXPECT_TRUE(hwc2_fake_gralloc_is_dma_buf_open(
+                hwc2_fake_gralloc_get_hmem(scene.get_buffer(lyr_idx,
+                buf_idx))));
+        EXPECT_FALSE(hwc2_fake_gralloc_is_dma_buf_open(
+                hwc2_fake_gralloc_get_hmem(scene.get_buffer(lyr_idx,
+                (buf_idx + 1) % buffer_cnt))));
+    }
+}
+
+/* The buffer a destroyed layer showed last stays open until a post replaces
+ * it on the screen */
+TEST_F(hwc2_dma_buf_test, destroyed_layers_are_closed_once_off_screen)
+{
+    hwc2_test_device device;
+    ASSERT_TRUE(device.is_open());
+
+    std::vector<uint32_t> hmems;
+    uint32_t shown_hmem;
+    {
+        hwc2_test_scene scene(device, 0, width, height);
+        size_t lyr_idx = add_background(scene, 3);
+
+        for (size_t idx = 0; idx < HWC2_DMA_BUF_TEST_WARMUP_FRAMES; idx++)
+            ASSERT_EQ(scene.frame(nullptr), HWC2_ERROR_NONE);
+
+        for (size_t buf_idx = 0; buf_idx < 3; buf_idx++)
+            hmems.push_back(hwc2_fake_gralloc_get_hmem(
+                    scene.get_buffer(lyr_idx, buf_idx)));
+        shown_hmem = hmems[(scene.get_frame_count() - 1) % 3];
+    }
+
+    for (auto hmem: hmems)
+        EXPECT_EQ(hwc2_fake_gralloc_is_dma_buf_open(hmem), hmem == shown_hmem);
+
+    hwc2_test_scene scene(device, 0, width, height);
+    add_background(scene, 1);
+    ASSERT_EQ(scene.frame(nullptr), HWC2_ERROR_NONE);
+
+    EXPECT_FALSE(hwc2_fake_gralloc_is_dma_buf_open(shown_hmem));
+}
@@ -0,0 +1,466 @@
+/*
+ * Copyright (C) 2016 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/* libadf and libadfhwc for the host. Every adf device has one interface
+ * and four overlay engines, like a Tegra display controller */
+
+#include <adf/adf.h>
+#include <adfhwc/adfhwc.h>
+#include <tegra_adf.h>
+#include <sys/eventfd.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <cstdlib>
+#include <cstring>
+
+#include <atomic>
+#include <mutex>
+#include <thread>
+#include <chrono>
+#include <array>
+#include <vector>
+
+#include "hwc2_test_fakes.h"
+
+#define FAKE_OVERLAY_ENGINE_COUNT 4
+
+struct adf_hwc_helper {
+    struct adf_hwc_event_callbacks callbacks;
+    void *callback_data;
+};
+
+struct fake_device {
+    hwc2_fake_display display;
+    nsecs_t post_delay;
+    int post_error;
+    uint64_t post_cnt;
+    bool has_post;
+    hwc2_fake_post last_post;
+    bool vsync_enabled;
+};
+
+static std::mutex devices_mutex;
+static std::vector<fake_device> devices;
+static std::atomic<uint64_t> bad_fd_cnt(0);
+static struct adf_hwc_helper helper;
+
+static const std::array<uint32_t, 13> supported_formats = {{
+    DRM_FORMAT_RGBA8888,
+    DRM_FORMAT_RGBX8888,
+    DRM_FORMAT_BGRA8888,
+    DRM_FORMAT_RGB888,
+    DRM_FORMAT_RGB565,
+    DRM_FORMAT_BGR565,
+    DRM_FORMAT_YUV420,
+    DRM_FORMAT_YVU420,
+    DRM_FORMAT_NV12,
+    DRM_FORMAT_NV21,
+    DRM_FORMAT_YUV422,
+    DRM_FORMAT_NV16,
+    DRM_FORMAT_UYVY,
+}};
+
+static nsecs_t get_time()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return static_cast<nsecs_t>(ts.tv_sec) * 1000000000 + ts.tv_nsec;
+}
+
+static bool is_open_fd(int fd)
+{
+    return fcntl(fd, F_GETFD) >= 0;
+}
+
+void hwc2_fake_adf_reset(const std::vector<hwc2_fake_display> &displays)
+{
+    std::lock_guard<std::mutex> lock(devices_mutex);
+
+    devices.clear();
+    for (auto &display: displays) {
+        fake_device dev;
+        dev.display = display;
+        dev.post_delay = 0;
+        dev.post_error = 0;
+        dev.post_cnt = 0;
+        dev.has_post = false;
+        dev.last_post.time = 0;
+        dev.vsync_enabled = false;
+        devices.push_back(dev);
+    }
+
+    bad_fd_cnt = 0;
+}
+
+void hwc2_fake_adf_set_post_delay(size_t dev_idx, nsecs_t delay)
+{
+    std::lock_guard<std::mutex> lock(devices_mutex);
+    devices.at(dev_idx).post_delay = delay;
+}
+
+void hwc2_fake_adf_set_post_error(size_t dev_idx, int err)
+{
+    std::lock_guard<std::mutex> lock(devices_mutex);
+    devices.at(dev_idx).post_error = err;
+}
+
+uint64_t hwc2_fake_adf_get_post_count(size_t dev_idx)
+{
+    std::lock_guard<std::mutex> lock(devices_mutex);
+    return devices.at(dev_idx).post_cnt;
+}
+
+bool hwc2_fake_adf_get_last_post(size_t dev_idx, hwc2_fake_post *out_post)
+{
+    std::lock_guard<std::mutex> lock(devices_mutex);
+    const fake_device &dev = devices.at(dev_idx);
+    if (!dev.has_post)
+        return false;
+
+    *out_post = dev.last_post;
+    return true;
+}
+
+uint64_t hwc2_fake_adf_get_bad_fd_count()
+{
+    return bad_fd_cnt;
+}
+
+void hwc2_fake_adf_vsync(size_t dev_idx, int64_t timestamp)
+{
+    if (helper.callbacks.vsync)
+        helper.callbacks.vsync(helper.callback_data, dev_idx, timestamp);
+}
+
+void hwc2_fake_adf_renegotiate_bandwidth(size_t dev_idx, uint32_t avail_bw)
+{
+    struct tegra_adf_event_bandwidth event = {};
+    event.base.type = TEGRA_ADF_EVENT_BANDWIDTH_RENEGOTIATE;
+    event.base.length = sizeof(event);
+    event.avail_bw = avail_bw;
+
+    if (helper.callbacks.custom_event)
+        helper.callbacks.custom_event(helper.callback_data, dev_idx,
+                &event.base);
+}
+
+bool hwc2_fake_adf_get_vsync_enabled(size_t dev_idx)
+{
+    std::lock_guard<std::mutex> lock(devices_mutex);
+    return devices.at(dev_idx).vsync_enabled;
+}
+
+ssize_t adf_devices(adf_id_t **ids)
+{
+    std::lock_guard<std::mutex> lock(devices_mutex);
+
+    *ids = static_cast<adf_id_t *>(malloc(sizeof(adf_id_t)
+            * (devices.size() + 1)));
+    for (size_t idx = 0; idx < devices.size(); idx++)
+        (*ids)[idx] = idx;
+
+    return devices.size();
+}
+
+int adf_device_open(adf_id_t id, int /*flags*/, struct adf_device *dev)
+{
+    dev->id = id;
+    dev->fd = eventfd(0, EFD_CLOEXEC);
+    return (dev->fd < 0)? -errno: 0;
+}
+
+void adf_device_close(struct adf_device *dev)
+{
+    if (dev->fd >= 0)
+        close(dev->fd);
+    dev->fd = -1;
+}
+
+int adf_get_device_data(struct adf_device *dev, struct adf_device_data *data)
+{
+    std::lock_guard<std::mutex> lock(devices_mutex);
+    if (dev->id >= devices.size())
+        return -ENODEV;
+
+    struct tegra_adf_capabilities *caps =
+            static_cast<struct tegra_adf_capabilities *>(calloc(1,
+            sizeof(*caps)));
+    caps->caps = devices[dev->id].display.caps;
+
+    memset(data, 0, sizeof(*data));
+    data->custom_data = caps;
+    data->custom_data_size = sizeof(*caps);
+    return 0;
+}
+
+void adf_free_device_data(struct adf_device_data *data)
+{
+    free(data->custom_data);
+    memset(data, 0, sizeof(*data));
+}
+
+int adf_interface_open(struct adf_device *dev, adf_id_t /*id*/, int /*flags*/)
+{
+    /* The interface fd carries the device index in its counter, so that
+     * adf_get_interface_data can find the device again */
+    int fd = eventfd(dev->id + 1, EFD_CLOEXEC | EFD_NONBLOCK);
+    return (fd < 0)? -errno: fd;
+}
+
+int adf_get_interface_data(int fd, struct adf_interface_data *data)
+{
+    uint64_t value;
+    if (read(fd, &value, sizeof(value)) != sizeof(value))
+        return -errno;
+    write(fd, &value, sizeof(value));
+
+    std::lock_guard<std::mutex> lock(devices_mutex);
+    size_t dev_idx = value - 1;
+    if (dev_idx >= devices.size())
+        return -ENODEV;
+
+    memset(data, 0, sizeof(*data));
+    snprintf(data->name, sizeof(data->name), "fake%zu", dev_idx);
+    data->hotplug_detect = devices[dev_idx].display.connected;
+    data->dpms_state = DRM_MODE_DPMS_ON;
+    return 0;
+}
+
+void adf_free_interface_data(struct adf_interface_data *data)
+{
+    memset(data, 0, sizeof(*data));
+}
+
+int adf_interface_blank(int /*fd*/, __u8 /*mode*/)
+{
+    return 0;
+}
+
+ssize_t adf_overlay_engines(struct adf_device * /*dev*/,
+        adf_id_t **overlay_engines)
+{
+    *overlay_engines = static_cast<adf_id_t *>(malloc(sizeof(adf_id_t)
+            * FAKE_OVERLAY_ENGINE_COUNT));
+    for (size_t idx = 0; idx < FAKE_OVERLAY_ENGINE_COUNT; idx++)
+        (*overlay_engines)[idx] = idx;
+
+    return FAKE_OVERLAY_ENGINE_COUNT;
+}
+
+int adf_overlay_engine_open(struct adf_device * /*dev*/, adf_id_t /*id*/,
+        int /*flags*/)
+{
+    int fd = eventfd(0, EFD_CLOEXEC);
+    return (fd < 0)? -errno: fd;
+}
+
+int adf_get_overlay_engine_data(int /*fd*/,
+        struct adf_overlay_engine_data *data)
+{
+    memset(data, 0, sizeof(*data));
+    data->supported_formats = static_cast<__u32 *>(malloc(
+            sizeof(supported_formats)));
+    memcpy(data->supported_formats, supported_formats.data(),
+            sizeof(supported_formats));
+    data->n_supported_formats = supported_formats.size();
+    return 0;
+}
+
+void adf_free_overlay_engine_data(struct adf_overlay_engine_data *data)
+{
+    free(data->supported_formats);
+    memset(data, 0, sizeof(*data));
+}
+
+int adf_device_post_v2(struct adf_device *dev, adf_id_t * /*interfaces*/,
+        __u32 /*n_interfaces*/, struct adf_buffer_config *bufs, size_t n_bufs,
+        void *custom_data, size_t custom_data_size,
+        enum adf_complete_fence_type /*complete_fence_type*/,
+        int *complete_fence)
+{
+    for (size_t idx = 0; idx < n_bufs; idx++) {
+        const struct adf_buffer_config &buf = bufs[idx];
+        bool bad_fd = buf.acquire_fence >= 0 && !is_open_fd(buf.acquire_fence);
+
+        for (size_t plane = 0; plane < buf.n_planes; plane++)
+            bad_fd = bad_fd || !is_open_fd(buf.fd[plane]);
+
+        if (bad_fd) {
+            bad_fd_cnt++;
+            return -EBADF;
+        }
+    }
+
+    nsecs_t delay;
+    int err;
+    {
+        std::lock_guard<std::mutex> lock(devices_mutex);
+        if (dev->id >= devices.size())
+            return -ENODEV;
+
+        delay = devices[dev->id].post_delay;
+        err = devices[dev->id].post_error;
+    }
+
+    /* The flip ioctl blocks the posting thread, not the fake */
+    if (delay > 0)
+        std::this_thread::sleep_for(std::chrono::nanoseconds(delay));
+
+    if (err)
+        return -err;
+
+    std::lock_guard<std::mutex> lock(devices_mutex);
+    fake_device &fake_dev = devices[dev->id];
+    const uint8_t *data = static_cast<const uint8_t *>(custom_data);
+
+    fake_dev.post_cnt++;
+    fake_dev.has_post = true;
+    fake_dev.last_post.bufs.assign(bufs, bufs + n_bufs);
+    fake_dev.last_post.custom_data.assign(data, data + custom_data_size);
+    fake_dev.last_post.time = get_time();
+
+    /* The fake panel shows the frame as soon as it is posted */
+    *complete_fence = hwc2_fake_fence_create(true);
+    return 0;
+}
+
+bool adf_format_is_rgb(__u32 format)
+{
+    switch (format) {
+    case DRM_FORMAT_RGBA8888:
+    case DRM_FORMAT_RGBX8888:
+    case DRM_FORMAT_BGRA8888:
+    case DRM_FORMAT_RGB888:
+    case DRM_FORMAT_RGB565:
+    case DRM_FORMAT_BGR565:
+        return true;
+    default:
+        return false;
+    }
+}
+
+__u32 adf_fourcc_for_hal_pixel_format(int format)
+{
+    switch (format) {
+    case HAL_PIXEL_FORMAT_RGBA_8888:
+        return DRM_FORMAT_RGBA8888;
+    case HAL_PIXEL_FORMAT_RGBX_8888:
+        return DRM_FORMAT_RGBX8888;
+    case HAL_PIXEL_FORMAT_RGB_888:
+        return DRM_FORMAT_RGB888;
+    case HAL_PIXEL_FORMAT_RGB_565:
+        return DRM_FORMAT_RGB565;
+    case HAL_PIXEL_FORMAT_BGRA_8888:
+        return DRM_FORMAT_BGRA8888;
+    default:
+        return 0;
+    }
+}
+
+int adf_hwc_open(int * /*intf_fds*/, size_t /*n_intfs*/,
+        const struct adf_hwc_event_callbacks *event_cb, void *event_cb_data,
+        struct adf_hwc_helper **dev)
+{
+    helper.callbacks = *event_cb;
+    helper.callback_data = event_cb_data;
+    *dev = &helper;
+    return 0;
+}
+
+void adf_hwc_close(struct adf_hwc_helper *dev)
+{
+    memset(dev, 0, sizeof(*dev));
+}
+
+int adf_eventControl(struct adf_hwc_helper * /*dev*/, int disp, int event,
+        int enabled)
+{
+    if (event != HWC_EVENT_VSYNC)
+        return -EINVAL;
+
+    std::lock_guard<std::mutex> lock(devices_mutex);
+    if (static_cast<size_t>(disp) >= devices.size())
+        return -EINVAL;
+
+    devices[disp].vsync_enabled = enabled;
+    return 0;
+}
+
+int adf_getDisplayConfigs(struct adf_hwc_helper * /*dev*/, int disp,
+        uint32_t *configs, size_t *numConfigs)
+{
+    std::lock_guard<std::mutex> lock(devices_mutex);
+    if (static_cast<size_t>(disp) >= devices.size())
+        return -EINVAL;
+
+    size_t config_cnt = devices[disp].display.configs.size();
+    if (configs) {
+        config_cnt = std::min(config_cnt, *numConfigs);
+        for (size_t idx = 0; idx < config_cnt; idx++)
+            configs[idx] = idx;
+    }
+
+    *numConfigs = config_cnt;
+    return 0;
+}
+
+int adf_getDisplayAttributes_hwc2(struct adf_hwc_helper * /*dev*/, int disp,
+        uint32_t config, const uint32_t *attributes, int32_t *values)
+{
+    std::lock_guard<std::mutex> lock(devices_mutex);
+    if (static_cast<size_t>(disp) >= devices.size()
+            || config >= devices[disp].display.configs.size())
+        return -EINVAL;
+
+    const hwc2_fake_config &cfg = devices[disp].display.configs[config];
+
+    for (size_t idx = 0; attributes[idx] != HWC2_ATTRIBUTE_INVALID; idx++) {
+        switch (attributes[idx]) {
+        case HWC2_ATTRIBUTE_WIDTH:
+            values[idx] = cfg.width;
+            break;
+        case HWC2_ATTRIBUTE_HEIGHT:
+            values[idx] = cfg.height;
+            break;
+        case HWC2_ATTRIBUTE_VSYNC_PERIOD:
+            values[idx] = cfg.vsync_period;
+            break;
+        case HWC2_ATTRIBUTE_DPI_X:
+            values[idx] = cfg.dpi_x;
+            break;
+        case HWC2_ATTRIBUTE_DPI_Y:
+            values[idx] = cfg.dpi_y;
+            break;
+        default:
+            return -EINVAL;
+        }
+    }
+
+    return 0;
+}
+
+int adf_set_active_config_hwc2(struct adf_hwc_helper * /*dev*/, int disp,
+        uint32_t config)
+{
+    std::lock_guard<std::mutex> lock(devices_mutex);
+    if (static_cast<size_t>(disp) >= devices.size()
+            || config >= devices[disp].display.configs.size())
+        return -EINVAL;
+
+    return 0;
+}
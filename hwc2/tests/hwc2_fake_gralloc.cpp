@@ -0,0 +1,391 @@
+/*
+ * Copyright (C) 2016 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/* Stands in for gralloc.tegra132.so. The test binaries link against it, so
+ * the dlopen in hwc2_gralloc finds it already loaded under its soname */
+
+#include <hardware/gralloc.h>
+#include <sys/eventfd.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <cstdlib>
+#include <cstring>
+
+#include <atomic>
+#include <mutex>
+#include <unordered_map>
+#include <map>
+#include <algorithm>
+#include <array>
+#include <vector>
+
+#include "hwc2_test_fakes.h"
+
+#define FAKE_SURFACE_SIZE                     56
+#define FAKE_SURFACE_OFFSET_WIDTH             0
+#define FAKE_SURFACE_OFFSET_HEIGHT            4
+#define FAKE_SURFACE_OFFSET_LAYOUT            12
+#define FAKE_SURFACE_OFFSET_PITCH             16
+#define FAKE_SURFACE_OFFSET_HMEM              20
+#define FAKE_SURFACE_OFFSET_OFFSET            24
+#define FAKE_SURFACE_OFFSET_BLOCK_HEIGHT_LOG2 32
+
+#define FAKE_PITCH_ALIGN    64
+#define FAKE_HANDLE_MAGIC   0x68776332
+#define FAKE_HANDLE_INTS    6
+
+struct fake_buffer {
+    int32_t width;
+    int32_t height;
+    int32_t format;
+    uint32_t hmem;
+    std::vector<uint8_t> surfaces;
+
+    /* Only buffers that are locked get their pixels */
+    size_t size;
+    std::vector<uint8_t> pixels;
+};
+
+static std::mutex buffers_mutex;
+static std::unordered_map<buffer_handle_t, fake_buffer> buffers;
+static uint32_t next_hmem = 1;
+static int32_t next_serial = 1;
+
+static std::mutex dma_bufs_mutex;
+static std::map<int, uint32_t> dma_bufs;
+static uint64_t dma_buf_exports = 0;
+
+struct fake_plane {
+    int32_t width;
+    int32_t height;
+    uint32_t bpp;
+};
+
+static size_t get_planes(int32_t format, int32_t width, int32_t height,
+        fake_plane *planes)
+{
+    switch (format) {
+    case HAL_PIXEL_FORMAT_RGB_565:
+        planes[0] = {width, height, 2};
+        return 1;
+    case HAL_PIXEL_FORMAT_RGB_888:
+        planes[0] = {width, height, 3};
+        return 1;
+    case HWC2_FAKE_FORMAT_YUV420:
+        planes[0] = {width, height, 1};
+        planes[1] = {width / 2, height / 2, 1};
+        planes[2] = {width / 2, height / 2, 1};
+        return 3;
+    case HWC2_FAKE_FORMAT_NV12:
+        planes[0] = {width, height, 1};
+        planes[1] = {width / 2, height / 2, 2};
+        return 2;
+    default:
+        planes[0] = {width, height, 4};
+        return 1;
+    }
+}
+
+static void set_surface_member(std::vector<uint8_t> &surfaces, size_t idx,
+        size_t offset, uint32_t value)
+{
+    memcpy(&surfaces[idx * FAKE_SURFACE_SIZE + offset], &value, sizeof(value));
+}
+
+/* Lays out a buffer and fills in its handle ints. Called with buffers_mutex
+ * held */
+static void init_buffer(native_handle_t *handle, int32_t width, int32_t height,
+        int32_t format, uint32_t layout)
+{
+    fake_buffer &buf = buffers[handle];
+    buf.width = width;
+    buf.height = height;
+    buf.format = format;
+    buf.hmem = next_hmem++;
+
+    std::array<fake_plane, 3> planes;
+    size_t plane_cnt = get_planes(format, width, height, planes.data());
+
+    buf.surfaces.assign(plane_cnt * FAKE_SURFACE_SIZE, 0);
+
+    uint32_t offset = 0;
+    for (size_t idx = 0; idx < plane_cnt; idx++) {
+        uint32_t pitch = (planes[idx].width * planes[idx].bpp
+                + FAKE_PITCH_ALIGN - 1) & ~(FAKE_PITCH_ALIGN - 1);
+
+        set_surface_member(buf.surfaces, idx, FAKE_SURFACE_OFFSET_WIDTH,
+                planes[idx].width);
+        set_surface_member(buf.surfaces, idx, FAKE_SURFACE_OFFSET_HEIGHT,
+                planes[idx].height);
+        set_surface_member(buf.surfaces, idx, FAKE_SURFACE_OFFSET_LAYOUT,
+                layout);
+        set_surface_member(buf.surfaces, idx, FAKE_SURFACE_OFFSET_PITCH, pitch);
+        set_surface_member(buf.surfaces, idx, FAKE_SURFACE_OFFSET_HMEM,
+                buf.hmem);
+        set_surface_member(buf.surfaces, idx, FAKE_SURFACE_OFFSET_OFFSET,
+                offset);
+        set_surface_member(buf.surfaces, idx,
+                FAKE_SURFACE_OFFSET_BLOCK_HEIGHT_LOG2,
+                (layout == HWC2_FAKE_LAYOUT_BLOCK_LINEAR)? 4: 0);
+
+        offset += pitch * planes[idx].height;
+    }
+
+    buf.size = offset;
+    buf.pixels.clear();
+
+    handle->data[0] = eventfd(0, EFD_CLOEXEC);
+    handle->data[1] = FAKE_HANDLE_MAGIC;
+    handle->data[2] = next_serial++;
+    handle->data[3] = width;
+    handle->data[4] = height;
+    handle->data[5] = format;
+    handle->data[6] = buf.hmem;
+}
+
+/* Called with buffers_mutex held */
+static void destroy_buffer(buffer_handle_t handle)
+{
+    close(handle->data[0]);
+    buffers.erase(handle);
+}
+
+static const fake_buffer *find_buffer(buffer_handle_t handle)
+{
+    auto it = buffers.find(handle);
+    if (it == buffers.end() || handle->numFds != 1
+            || handle->numInts != FAKE_HANDLE_INTS
+            || handle->data[1] != FAKE_HANDLE_MAGIC)
+        return nullptr;
+
+    return &it->second;
+}
+
+buffer_handle_t hwc2_fake_gralloc_alloc(int32_t width, int32_t height,
+        int32_t format, uint32_t layout)
+{
+    native_handle_t *handle = static_cast<native_handle_t *>(malloc(
+            sizeof(native_handle_t) + sizeof(int) * (1 + FAKE_HANDLE_INTS)));
+    handle->version = sizeof(native_handle_t);
+    handle->numFds = 1;
+    handle->numInts = FAKE_HANDLE_INTS;
+
+    std::lock_guard<std::mutex> lock(buffers_mutex);
+    init_buffer(handle, width, height, format, layout);
+    return handle;
+}
+
+void hwc2_fake_gralloc_free(buffer_handle_t handle)
+{
+    {
+        std::lock_guard<std::mutex> lock(buffers_mutex);
+        destroy_buffer(handle);
+    }
+
+    free(const_cast<native_handle_t *>(handle));
+}
+
+void hwc2_fake_gralloc_realloc(buffer_handle_t handle, int32_t width,
+        int32_t height, int32_t format, uint32_t layout)
+{
+    std::lock_guard<std::mutex> lock(buffers_mutex);
+    destroy_buffer(handle);
+    init_buffer(const_cast<native_handle_t *>(handle), width, height, format,
+            layout);
+}
+
+uint32_t hwc2_fake_gralloc_get_hmem(buffer_handle_t handle)
+{
+    std::lock_guard<std::mutex> lock(buffers_mutex);
+    const fake_buffer *buf = find_buffer(handle);
+    return (buf)? buf->hmem: 0;
+}
+
+uint64_t hwc2_fake_gralloc_get_dma_buf_exports()
+{
+    std::lock_guard<std::mutex> lock(dma_bufs_mutex);
+    return dma_buf_exports;
+}
+
+/* Exported fds are the only /dev/null fds of the process. A closed fd that was
+ * reused by a later export was replaced in the map. Called with
+ * dma_bufs_mutex held */
+static bool is_dma_buf_open(int fd)
+{
+    struct stat null_stat, fd_stat;
+    if (stat("/dev/null", &null_stat) < 0 || fstat(fd, &fd_stat) < 0)
+        return false;
+
+    return S_ISCHR(fd_stat.st_mode) && fd_stat.st_rdev == null_stat.st_rdev;
+}
+
+size_t hwc2_fake_gralloc_get_open_dma_bufs()
+{
+    std::lock_guard<std::mutex> lock(dma_bufs_mutex);
+    return std::count_if(dma_bufs.begin(), dma_bufs.end(),
+            [] (const std::pair<const int, uint32_t> &dma_buf)
+            { return is_dma_buf_open(dma_buf.first); });
+}
+
+bool hwc2_fake_gralloc_is_dma_buf_open(uint32_t hmem)
+{
+    std::lock_guard<std::mutex> lock(dma_bufs_mutex);
+    return std::any_of(dma_bufs.begin(), dma_bufs.end(),
+            [hmem] (const std::pair<const int, uint32_t> &dma_buf)
+            { return dma_buf.second == hmem && is_dma_buf_open(dma_buf.first); });
+}
+
+extern "C" bool nvgr_is_valid(buffer_handle_t handle)
+{
+    std::lock_guard<std::mutex> lock(buffers_mutex);
+    return find_buffer(handle);
+}
+
+extern "C" bool nvgr_is_stereo(buffer_handle_t /*handle*/)
+{
+    return false;
+}
+
+extern "C" bool nvgr_is_yuv(buffer_handle_t handle)
+{
+    std::lock_guard<std::mutex> lock(buffers_mutex);
+    const fake_buffer *buf = find_buffer(handle);
+    return buf && buf->format >= HWC2_FAKE_FORMAT_YUV420;
+}
+
+extern "C" int nvgr_get_format(buffer_handle_t handle)
+{
+    std::lock_guard<std::mutex> lock(buffers_mutex);
+    const fake_buffer *buf = find_buffer(handle);
+    return (buf)? buf->format: 0;
+}
+
+extern "C" void nvgr_get_surfaces(buffer_handle_t handle, const void **surf,
+        size_t *surf_cnt)
+{
+    std::lock_guard<std::mutex> lock(buffers_mutex);
+    const fake_buffer *buf = find_buffer(handle);
+    *surf = (buf)? buf->surfaces.data(): nullptr;
+    *surf_cnt = (buf)? buf->surfaces.size() / FAKE_SURFACE_SIZE: 0;
+}
+
+extern "C" void NvRmMemDmaBufFdFromHandle(uint32_t hmem, int *fd)
+{
+    *fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+    if (*fd < 0)
+        return;
+
+    std::lock_guard<std::mutex> lock(dma_bufs_mutex);
+    dma_bufs[*fd] = hmem;
+    dma_buf_exports++;
+}
+
+extern "C" int nvgr_decompress(buffer_handle_t /*handle*/, int in_fence,
+        int *out_fence)
+{
+    /* Nothing is compressed. The acquire fence is handed back */
+    *out_fence = in_fence;
+    return 0;
+}
+
+static int fake_alloc(alloc_device_t * /*dev*/, int width, int height,
+        int format, int /*usage*/, buffer_handle_t *handle, int *stride)
+{
+    *handle = hwc2_fake_gralloc_alloc(width, height, format,
+            HWC2_FAKE_LAYOUT_PITCH);
+
+    fake_plane plane;
+    get_planes(format, width, height, &plane);
+    uint32_t pitch = (width * plane.bpp + FAKE_PITCH_ALIGN - 1)
+            & ~(FAKE_PITCH_ALIGN - 1);
+    *stride = pitch / plane.bpp;
+    return 0;
+}
+
+static int fake_free(alloc_device_t * /*dev*/, buffer_handle_t handle)
+{
+    hwc2_fake_gralloc_free(handle);
+    return 0;
+}
+
+static int fake_close(struct hw_device_t * /*dev*/)
+{
+    return 0;
+}
+
+static int fake_lock(struct gralloc_module_t const * /*module*/,
+        buffer_handle_t handle, int /*usage*/, int /*l*/, int /*t*/,
+        int /*w*/, int /*h*/, void **vaddr)
+{
+    std::lock_guard<std::mutex> lock(buffers_mutex);
+    auto it = buffers.find(handle);
+    if (it == buffers.end())
+        return -EINVAL;
+
+    /* The pixels stay put until the buffer is freed */
+    fake_buffer &buf = it->second;
+    if (buf.pixels.empty())
+        buf.pixels.assign(buf.size, 0);
+
+    *vaddr = buf.pixels.data();
+    return 0;
+}
+
+static int fake_unlock(struct gralloc_module_t const * /*module*/,
+        buffer_handle_t /*handle*/)
+{
+    return 0;
+}
+
+static alloc_device_t fake_alloc_dev;
+static gralloc_module_t fake_module;
+static hw_module_methods_t fake_methods;
+
+static int fake_open(const struct hw_module_t * /*module*/,
+        const char * /*name*/, struct hw_device_t **device)
+{
+    *device = &fake_alloc_dev.common;
+    return 0;
+}
+
+int hw_get_module(const char *id, const struct hw_module_t **module)
+{
+    if (strcmp(id, GRALLOC_HARDWARE_MODULE_ID))
+        return -ENOENT;
+
+    static std::once_flag init;
+    std::call_once(init, [] () {
+        fake_methods.open = fake_open;
+
+        fake_module.common.tag = HARDWARE_MODULE_TAG;
+        fake_module.common.id = GRALLOC_HARDWARE_MODULE_ID;
+        fake_module.common.name = "fake NVIDIA gralloc";
+        fake_module.common.methods = &fake_methods;
+        fake_module.lock = fake_lock;
+        fake_module.unlock = fake_unlock;
+
+        fake_alloc_dev.common.tag = HARDWARE_DEVICE_TAG;
+        fake_alloc_dev.common.module = &fake_module.common;
+        fake_alloc_dev.common.close = fake_close;
+        fake_alloc_dev.alloc = fake_alloc;
+        fake_alloc_dev.free = fake_free;
+    });
+
+    *module = &fake_module.common;
+    return 0;
+}
@@ -0,0 +1,88 @@
+/*
+ * Copyright (C) 2016 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+/* System properties for the host. Nothing is set until a test sets it */
+
+#include <cutils/properties.h>
+#include <cstdlib>
+#include <cstring>
+
+#include <mutex>
+#include <map>
+#include <string>
+
+#include "hwc2_test_fakes.h"
+
+static std::mutex properties_mutex;
+static std::map<std::string, std::string> properties;
+
+void hwc2_fake_property_set(const std::string &key, const std::string &value)
+{
+    std::lock_guard<std::mutex> lock(properties_mutex);
+    properties[key] = value;
+}
+
+void hwc2_fake_property_clear()
+{
+    std::lock_guard<std::mutex> lock(properties_mutex);
+    properties.clear();
+}
+
+int property_get(const char *key, char *value, const char *default_value)
+{
+    std::lock_guard<std::mutex> lock(properties_mutex);
+
+    auto it = properties.find(key);
+    const char *src = (it != properties.end())? it->second.c_str():
+            default_value;
+    if (!src)
+        src = "";
+
+    strncpy(value, src, PROPERTY_VALUE_MAX - 1);
+    value[PROPERTY_VALUE_MAX - 1] = '\0';
+    return strlen(value);
+}
+
+int64_t property_get_int64(const char *key, int64_t default_value)
+{
+    char value[PROPERTY_VALUE_MAX];
+    if (property_get(key, value, "") <= 0)
+        return default_value;
+
+    char *end;
+    int64_t result = strtoll(value, &end, 0);
+    return (*end == '\0')? result: default_value;
+}
+
+int32_t property_get_int32(const char *key, int32_t default_value)
+{
+    return static_cast<int32_t>(property_get_int64(key, default_value));
+}
+
+int8_t property_get_bool(const char *key, int8_t default_value)
+{
+    char value[PROPERTY_VALUE_MAX];
+    if (property_get(key, value, "") <= 0)
+        return default_value;
+
+    if (!strcmp(value, "1") || !strcmp(value, "true"))
+        return 1;
+    if (!strcmp(value, "0") || !strcmp(value, "false"))
+        return 0;
+
+    return default_value;
+}
@@ -0,0 +1,294 @@
+/*
+ * Copyright (C) 2016 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/* libsync for the host. A fence is an eventfd that becomes readable when it
+ * signals, so dups of a fence signal together. A sw_sync timeline is the read
+ * end of a pipe, whose inode tells it apart from a later fd with the same
+ * number */
+
+#include <sync/sync.h>
+#include <sys/eventfd.h>
+#include <sys/stat.h>
+#include <poll.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <cstdlib>
+#include <cstring>
+#include <array>
+#include <mutex>
+#include <thread>
+
+#include "hwc2_test_fakes.h"
+
+int hwc2_fake_fence_create(bool signaled)
+{
+    return eventfd((signaled)? 1: 0, EFD_CLOEXEC | EFD_NONBLOCK);
+}
+
+void hwc2_fake_fence_signal(int fence)
+{
+    uint64_t value = 1;
+    write(fence, &value, sizeof(value));
+}
+
+bool hwc2_fake_fence_is_signaled(int fence)
+{
+    struct pollfd pfd = {fence, POLLIN, 0};
+    return poll(&pfd, 1, 0) == 1;
+}
+
+#define FAKE_TIMELINE_COUNT   32
+#define FAKE_TIMELINE_FENCES  16
+
+/* The fake keeps its own dup of every fence that has not signaled yet */
+struct fake_timeline_fence {
+    int fd;
+    unsigned value;
+};
+
+struct fake_timeline {
+    int fd;
+    ino_t ino;
+    unsigned value;
+    std::array<fake_timeline_fence, FAKE_TIMELINE_FENCES> fences;
+    size_t fence_cnt;
+};
+
+/* Fixed arrays, so presenting through a post worker does not allocate */
+static std::mutex timelines_mutex;
+static std::array<fake_timeline, FAKE_TIMELINE_COUNT> timelines;
+
+static bool get_ino(int fd, ino_t *out_ino)
+{
+    struct stat st;
+    if (fstat(fd, &st) < 0)
+        return false;
+
+    *out_ino = st.st_ino;
+    return true;
+}
+
+static bool is_live(const fake_timeline &tl)
+{
+    ino_t ino;
+    return tl.fd >= 0 && get_ino(tl.fd, &ino) && ino == tl.ino;
+}
+
+static void release_timeline(fake_timeline &tl)
+{
+    for (size_t idx = 0; idx < tl.fence_cnt; idx++)
+        close(tl.fences[idx].fd);
+    tl.fd = -1;
+    tl.fence_cnt = 0;
+}
+
+static fake_timeline *find_timeline(int fd)
+{
+    ino_t ino;
+    if (fd < 0 || !get_ino(fd, &ino))
+        return nullptr;
+
+    for (auto &tl: timelines)
+        if (tl.fd == fd && tl.ino == ino)
+            return &tl;
+    return nullptr;
+}
+
+int sw_sync_timeline_create(void)
+{
+    std::lock_guard<std::mutex> lock(timelines_mutex);
+
+    int fds[2];
+    if (pipe(fds) < 0)
+        return -1;
+    close(fds[1]);
+
+    /* Slots of closed timelines are taken over */
+    for (auto &tl: timelines) {
+        if (is_live(tl))
+            continue;
+
+        release_timeline(tl);
+        tl.fd = fds[0];
+        get_ino(tl.fd, &tl.ino);
+        tl.value = 0;
+        return tl.fd;
+    }
+
+    close(fds[0]);
+    errno = ENOMEM;
+    return -1;
+}
+
+int sw_sync_timeline_inc(int fd, unsigned count)
+{
+    std::lock_guard<std::mutex> lock(timelines_mutex);
+
+    fake_timeline *tl = find_timeline(fd);
+    if (!tl) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    tl->value += count;
+
+    size_t kept = 0;
+    for (size_t idx = 0; idx < tl->fence_cnt; idx++) {
+        fake_timeline_fence &fence = tl->fences[idx];
+        if (fence.value <= tl->value) {
+            hwc2_fake_fence_signal(fence.fd);
+            close(fence.fd);
+        } else {
+            tl->fences[kept++] = fence;
+        }
+    }
+    tl->fence_cnt = kept;
+
+    return 0;
+}
+
+int sw_sync_fence_create(int fd, const char * /*name*/, unsigned value)
+{
+    std::lock_guard<std::mutex> lock(timelines_mutex);
+
+    fake_timeline *tl = find_timeline(fd);
+    if (!tl) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    int fence = hwc2_fake_fence_create(value <= tl->value);
+    if (fence < 0 || value <= tl->value)
+        return fence;
+
+    if (tl->fence_cnt == tl->fences.size()) {
+        close(fence);
+        errno = ENOMEM;
+        return -1;
+    }
+
+    int pending = dup(fence);
+    if (pending < 0) {
+        close(fence);
+        return -1;
+    }
+
+    tl->fences[tl->fence_cnt].fd = pending;
+    tl->fences[tl->fence_cnt].value = value;
+    tl->fence_cnt++;
+
+    return fence;
+}
+
+int sync_wait(int fd, int timeout)
+{
+    struct pollfd pfd = {fd, POLLIN, 0};
+
+    /* poll ignores a negative fd, where the sync ioctl fails */
+    if (fd < 0) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    int ret = poll(&pfd, 1, timeout);
+    if (ret == 0) {
+        errno = ETIME;
+        return -1;
+    }
+
+    return (ret < 0)? -1: 0;
+}
+
+/* A merged fence that cannot signal yet is signaled by a thread of its own
+ * once both fences have */
+int sync_merge(const char * /*name*/, int fd1, int fd2)
+{
+    if (fd1 < 0 || fd2 < 0) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    bool signaled = hwc2_fake_fence_is_signaled(fd1)
+            && hwc2_fake_fence_is_signaled(fd2);
+    int fence = hwc2_fake_fence_create(signaled);
+    if (fence < 0 || signaled)
+        return fence;
+
+    int pending = dup(fence), dup1 = dup(fd1), dup2 = dup(fd2);
+    if (pending < 0 || dup1 < 0 || dup2 < 0) {
+        for (int fd: {fence, pending, dup1, dup2})
+            if (fd >= 0)
+                close(fd);
+        return -1;
+    }
+
+    std::thread([pending, dup1, dup2] () {
+        sync_wait(dup1, -1);
+        sync_wait(dup2, -1);
+        hwc2_fake_fence_signal(pending);
+        close(pending);
+        close(dup1);
+        close(dup2);
+    }).detach();
+
+    return fence;
+}
+
+struct sync_fence_info_data *sync_fence_info(int fd)
+{
+    size_t len = sizeof(struct sync_fence_info_data)
+            + sizeof(struct sync_pt_info);
+
+    struct sync_fence_info_data *info =
+            static_cast<struct sync_fence_info_data *>(calloc(1, len));
+    if (!info)
+        return nullptr;
+
+    bool signaled = hwc2_fake_fence_is_signaled(fd);
+    info->len = len;
+    info->status = (signaled)? 1: 0;
+
+    /* The signal time is not kept. A signaled fence reports the time it was
+     * asked about, which is never earlier than the real one */
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    struct sync_pt_info *pt = reinterpret_cast<struct sync_pt_info *>(
+            info->pt_info);
+    pt->len = sizeof(*pt);
+    pt->status = info->status;
+    pt->timestamp_ns = (signaled)?
+            static_cast<uint64_t>(ts.tv_sec) * 1000000000 + ts.tv_nsec: 0;
+
+    return info;
+}
+
+struct sync_pt_info *sync_pt_info(struct sync_fence_info_data *info,
+        struct sync_pt_info *itr)
+{
+    if (!itr)
+        return reinterpret_cast<struct sync_pt_info *>(info->pt_info);
+
+    uint8_t *next = reinterpret_cast<uint8_t *>(itr) + itr->len;
+    uint8_t *end = reinterpret_cast<uint8_t *>(info) + info->len;
+    return (next < end)? reinterpret_cast<struct sync_pt_info *>(next): nullptr;
+}
+
+void sync_fence_info_free(struct sync_fence_info_data *info)
+{
+    free(info);
+}
@@ -0,0 +1,121 @@
+/*
+ * Copyright (C) 2016 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <gtest/gtest.h>
+
+#include "hwc2_test_device.h"
+
+class hwc2_fill_cache_test: public testing::Test {
+protected:
+    void SetUp() override
+    {
+        int err = hw_get_module(GRALLOC_HARDWARE_MODULE_ID,
+                reinterpret_cast<const hw_module_t **>(&gralloc_module));
+        ASSERT_EQ(err, 0);
+    }
+
+    /* Returns the first pixel of a fill buffer */
+    uint32_t get_pixel(buffer_handle_t buffer)
+    {
+        void *vaddr = nullptr;
+        EXPECT_EQ(gralloc_module->lock(gralloc_module, buffer,
+                GRALLOC_USAGE_SW_READ_OFTEN, 0, 0, 1, 1, &vaddr), 0);
+        if (!vaddr)
+            return 0;
+
+        uint32_t pixel = *static_cast<uint32_t *>(vaddr);
+        gralloc_module->unlock(gralloc_module, buffer);
+        return pixel;
+    }
+
+    const gralloc_module_t *gralloc_module;
+};
+
+/* A color is filled once and shared. Premultiplying an opaque color changes
+ * nothing, so it shares the buffer too */
+TEST_F(hwc2_fill_cache_test, same_color_reuses_the_buffer)
+{
+    hwc2_fill_cache &cache = hwc2_fill_cache::get_instance();
+    hwc_color_t color = {10, 20, 30, 0xFF};
+
+    std::shared_ptr<const native_handle_t> buffer = cache.get(color, false);
+    ASSERT_TRUE(buffer);
+    EXPECT_EQ(cache.get(color, false), buffer);
+    EXPECT_EQ(cache.get(color, true), buffer);
+    EXPECT_EQ(get_pixel(buffer.get()), 0xFF1E140Au);
+}
+
+/* A translucent color has one buffer as given and one premultiplied */
+TEST_F(hwc2_fill_cache_test, translucent_colors_are_premultiplied_apart)
+{
+    hwc2_fill_cache &cache = hwc2_fill_cache::get_instance();
+    hwc_color_t color = {200, 100, 50, 0x80};
+
+    std::shared_ptr<const native_handle_t> straight = cache.get(color, false);
+    std::shared_ptr<const native_handle_t> premultiplied = cache.get(color,
+            true);
+    ASSERT_TRUE(straight);
+    ASSERT_TRUE(premultiplied);
+    EXPECT_NE(straight, premultiplied);
+
+    EXPECT_EQ(get_pixel(straight.get()), 0x803264C8u);
+    EXPECT_EQ(get_pixel(premultiplied.get()), 0x80193264u);
+}
+
+/* An evicted buffer stays valid for the layer that holds it. The color is
+ * filled again the next time it is asked for */
+TEST_F(hwc2_fill_cache_test, evicted_buffers_stay_valid)
+{
+    hwc2_fill_cache &cache = hwc2_fill_cache::get_instance();
+    hwc_color_t color = {1, 2, 3, 0xFF};
+
+    std::shared_ptr<const native_handle_t> held = cache.get(color, false);
+    ASSERT_TRUE(held);
+
+    for (uint8_t idx = 0; idx < HWC2_FILL_CACHE_SIZE; idx++)
+        cache.get({idx, 0x40, 0x50, 0xFF}, false);
+
+    std::shared_ptr<const native_handle_t> refilled = cache.get(color, false);
+    ASSERT_TRUE(refilled);
+    EXPECT_NE(refilled, held);
+    EXPECT_EQ(get_pixel(held.get()), 0xFF030201u);
+    EXPECT_EQ(get_pixel(refilled.get()), 0xFF030201u);
+}
+
+/* A solid color layer switches fill buffers with its blend mode, and gives
+ * up its fill buffer when it stops being a solid color */
+TEST_F(hwc2_fill_cache_test, layer_follows_its_blend_mode)
+{
+    hwc2_fill_cache &cache = hwc2_fill_cache::get_instance();
+    hwc_color_t color = {0x60, 0x40, 0x20, 0x80};
+
+    hwc2_layer lyr(1);
+    ASSERT_EQ(lyr.set_blend_mode(HWC2_BLEND_MODE_COVERAGE), HWC2_ERROR_NONE);
+    ASSERT_EQ(lyr.set_comp_type(HWC2_COMPOSITION_SOLID_COLOR),
+            HWC2_ERROR_NONE);
+    ASSERT_EQ(lyr.set_color(color), HWC2_ERROR_NONE);
+    EXPECT_EQ(lyr.get_buffer_handle(), cache.get(color, false).get());
+
+    ASSERT_EQ(lyr.set_blend_mode(HWC2_BLEND_MODE_PREMULTIPLIED),
+            HWC2_ERROR_NONE);
+    EXPECT_EQ(lyr.get_buffer_handle(), cache.get(color, true).get());
+
+    ASSERT_EQ(lyr.set_blend_mode(HWC2_BLEND_MODE_NONE), HWC2_ERROR_NONE);
+    EXPECT_EQ(lyr.get_buffer_handle(), cache.get(color, false).get());
+
+    ASSERT_EQ(lyr.set_comp_type(HWC2_COMPOSITION_DEVICE), HWC2_ERROR_NONE);
+    EXPECT_EQ(lyr.get_buffer_handle(), nullptr);
+}
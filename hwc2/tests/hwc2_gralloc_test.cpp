@@ -0,0 +1,66 @@
+/*
+ * Copyright (C) 2016 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <gtest/gtest.h>
+
+#include "hwc2.h"
+#include "hwc2_test_fakes.h"
+
+TEST(hwc2_gralloc_test, cached_metadata_matches_the_buffer)
+{
+    const hwc2_gralloc &gralloc = hwc2_gralloc::get_instance();
+
+    buffer_handle_t handle = hwc2_fake_gralloc_alloc(64, 64,
+            HAL_PIXEL_FORMAT_RGBA_8888, HWC2_FAKE_LAYOUT_PITCH);
+
+    hwc2_gralloc_metadata first, second;
+    ASSERT_TRUE(gralloc.get_metadata(handle, &first));
+    ASSERT_TRUE(gralloc.get_metadata(handle, &second));
+
+    EXPECT_EQ(first.format, second.format);
+    ASSERT_EQ(first.surf_cnt, 1u);
+    EXPECT_EQ(first.surfaces[0].hmem, hwc2_fake_gralloc_get_hmem(handle));
+    EXPECT_EQ(second.surfaces[0].hmem, first.surfaces[0].hmem);
+
+    hwc2_fake_gralloc_free(handle);
+}
+
+/* A freed handle whose memory is handed out again keeps its address and,
+ * since the lowest free fd is reused, usually its fd too. Only the ints that
+ * follow tell the buffers apart */
+TEST(hwc2_gralloc_test, reused_handle_is_read_again)
+{
+    const hwc2_gralloc &gralloc = hwc2_gralloc::get_instance();
+
+    buffer_handle_t handle = hwc2_fake_gralloc_alloc(64, 64,
+            HAL_PIXEL_FORMAT_RGBA_8888, HWC2_FAKE_LAYOUT_PITCH);
+
+    hwc2_gralloc_metadata metadata;
+    ASSERT_TRUE(gralloc.get_metadata(handle, &metadata));
+    ASSERT_EQ(metadata.surf_cnt, 1u);
+
+    int fd = handle->data[0];
+    hwc2_fake_gralloc_realloc(handle, 128, 64, HWC2_FAKE_FORMAT_NV12,
+            HWC2_FAKE_LAYOUT_BLOCK_LINEAR);
+    ASSERT_EQ(handle->data[0], fd);
+
+    ASSERT_TRUE(gralloc.get_metadata(handle, &metadata));
+    EXPECT_TRUE(metadata.yuv);
+    ASSERT_EQ(metadata.surf_cnt, 2u);
+    EXPECT_EQ(metadata.surfaces[0].hmem, hwc2_fake_gralloc_get_hmem(handle));
+
+    hwc2_fake_gralloc_free(handle);
+}
@@ -0,0 +1,204 @@
+/*
+ * Copyright (C) 2016 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <benchmark/benchmark.h>
+
+#include <cstring>
+#include <vector>
+
+#include "hwc2_test_device.h"
+
+/* What SurfaceFlinger sets on every layer of every frame */
+struct hwc2_benchmark_layer {
+    hwc2_layer_t id;
+    buffer_handle_t buffer;
+    hwc_rect_t frame;
+    hwc_frect_t crop;
+};
+
+static bool create_layers(benchmark::State &state, hwc2_test_device &device,
+        std::vector<hwc2_benchmark_layer> *out_layers)
+{
+    hwc2_fake_config config = hwc2_test_get_panel_config();
+    size_t layer_cnt = state.range(0);
+
+    for (size_t idx = 0; idx < layer_cnt; idx++) {
+        hwc2_benchmark_layer lyr;
+        lyr.frame = {0, 0, config.width, config.height};
+        lyr.crop = {0.0f, 0.0f, static_cast<float>(config.width),
+                static_cast<float>(config.height)};
+        lyr.buffer = hwc2_fake_gralloc_alloc(config.width, config.height,
+                HAL_PIXEL_FORMAT_RGBA_8888, HWC2_FAKE_LAYOUT_PITCH);
+
+        if (device.create_layer(0, &lyr.id) != HWC2_ERROR_NONE) {
+            hwc2_fake_gralloc_free(lyr.buffer);
+            state.SkipWithError("create_layer failed");
+            return false;
+        }
+        out_layers->push_back(lyr);
+    }
+
+    return true;
+}
+
+static void destroy_layers(hwc2_test_device &device,
+        const std::vector<hwc2_benchmark_layer> &layers)
+{
+    for (auto &lyr: layers) {
+        device.destroy_layer(0, lyr.id);
+        hwc2_fake_gralloc_free(lyr.buffer);
+    }
+}
+
+static void reset_fakes()
+{
+    hwc2_fake_property_clear();
+    hwc2_fake_adf_reset(hwc2_test_get_displays(1));
+}
+
+/* One call per property, as the hwc2 functions are used */
+static void BM_layer_properties(benchmark::State &state)
+{
+    reset_fakes();
+
+    hwc2_test_device device;
+    std::vector<hwc2_benchmark_layer> layers;
+    if (!device.is_open()) {
+        state.SkipWithError("failed to open the hwc2 device");
+        return;
+    }
+    if (!create_layers(state, device, &layers))
+        return;
+
+    for (auto _: state) {
+        uint32_t z_order = 0;
+
+        for (auto &lyr: layers) {
+            hwc_region_t region = {1, &lyr.frame};
+
+            device.set_layer_composition_type(0, lyr.id,
+                    HWC2_COMPOSITION_DEVICE);
+            device.set_layer_buffer(0, lyr.id, lyr.buffer, -1);
+            device.set_layer_dataspace(0, lyr.id, HAL_DATASPACE_UNKNOWN);
+            device.set_layer_display_frame(0, lyr.id, lyr.frame);
+            device.set_layer_source_crop(0, lyr.id, lyr.crop);
+            device.set_layer_z_order(0, lyr.id, z_order++);
+            device.set_layer_surface_damage(0, lyr.id, region);
+            device.set_layer_blend_mode(0, lyr.id,
+                    HWC2_BLEND_MODE_PREMULTIPLIED);
+            device.set_layer_plane_alpha(0, lyr.id, 1.0f);
+            device.set_layer_transform(0, lyr.id,
+                    static_cast<hwc_transform_t>(0));
+            device.set_layer_visible_region(0, lyr.id, region);
+        }
+    }
+
+    state.SetItemsProcessed(state.iterations() * layers.size());
+    destroy_layers(device, layers);
+}
+
+static void push_words(std::vector<uint32_t> &commands, const void *data,
+        size_t size)
+{
+    size_t offset = commands.size();
+    commands.resize(offset + size / sizeof(uint32_t));
+    memcpy(&commands[offset], data, size);
+}
+
+/* The same properties in one set_layer_commands stream. Building the stream
+ * is part of the frame, as it would be for the client */
+static void BM_layer_commands(benchmark::State &state)
+{
+    reset_fakes();
+
+    hwc2_test_device device;
+    std::vector<hwc2_benchmark_layer> layers;
+    if (!device.is_open()) {
+        state.SkipWithError("failed to open the hwc2 device");
+        return;
+    }
+    if (!create_layers(state, device, &layers))
+        return;
+
+    std::vector<uint32_t> commands;
+    float plane_alpha = 1.0f;
+
+    for (auto _: state) {
+        uint32_t z_order = 0;
+        commands.clear();
+
+        for (auto &lyr: layers) {
+            uint64_t handle = reinterpret_cast<uintptr_t>(lyr.buffer);
+
+            commands.insert(commands.end(), {
+                HWC2_LAYER_COMMAND_HEADER(HWC2_LAYER_COMMAND_SELECT_LAYER, 2),
+                static_cast<uint32_t>(lyr.id),
+                static_cast<uint32_t>(lyr.id >> 32),
+                HWC2_LAYER_COMMAND_HEADER(
+                        HWC2_LAYER_COMMAND_COMPOSITION_TYPE, 1),
+                HWC2_COMPOSITION_DEVICE,
+                HWC2_LAYER_COMMAND_HEADER(HWC2_LAYER_COMMAND_BUFFER, 3),
+                static_cast<uint32_t>(handle),
+                static_cast<uint32_t>(handle >> 32),
+                static_cast<uint32_t>(-1),
+                HWC2_LAYER_COMMAND_HEADER(HWC2_LAYER_COMMAND_DATASPACE, 1),
+                HAL_DATASPACE_UNKNOWN,
+                HWC2_LAYER_COMMAND_HEADER(HWC2_LAYER_COMMAND_DISPLAY_FRAME, 4),
+            });
+            push_words(commands, &lyr.frame, sizeof(lyr.frame));
+
+            commands.push_back(HWC2_LAYER_COMMAND_HEADER(
+                    HWC2_LAYER_COMMAND_SOURCE_CROP, 4));
+            push_words(commands, &lyr.crop, sizeof(lyr.crop));
+
+            commands.insert(commands.end(), {
+                HWC2_LAYER_COMMAND_HEADER(HWC2_LAYER_COMMAND_Z_ORDER, 1),
+                z_order++,
+                HWC2_LAYER_COMMAND_HEADER(
+                        HWC2_LAYER_COMMAND_SURFACE_DAMAGE, 4),
+            });
+            push_words(commands, &lyr.frame, sizeof(lyr.frame));
+
+            commands.insert(commands.end(), {
+                HWC2_LAYER_COMMAND_HEADER(HWC2_LAYER_COMMAND_BLEND_MODE, 1),
+                HWC2_BLEND_MODE_PREMULTIPLIED,
+                HWC2_LAYER_COMMAND_HEADER(HWC2_LAYER_COMMAND_PLANE_ALPHA, 1),
+            });
+            push_words(commands, &plane_alpha, sizeof(plane_alpha));
+
+            commands.insert(commands.end(), {
+                HWC2_LAYER_COMMAND_HEADER(HWC2_LAYER_COMMAND_TRANSFORM, 1),
+                0,
+                HWC2_LAYER_COMMAND_HEADER(
+                        HWC2_LAYER_COMMAND_VISIBLE_REGION, 4),
+            });
+            push_words(commands, &lyr.frame, sizeof(lyr.frame));
+        }
+
+        uint32_t error_offset;
+        if (device.set_layer_commands(0, commands.size(), commands.data(),
+                &error_offset) != HWC2_ERROR_NONE) {
+            state.SkipWithError("set_layer_commands failed");
+            break;
+        }
+    }
+
+    state.SetItemsProcessed(state.iterations() * layers.size());
+    destroy_layers(device, layers);
+}
+
+BENCHMARK(BM_layer_properties)->Arg(10)->Arg(30);
+BENCHMARK(BM_layer_commands)->Arg(10)->Arg(30);
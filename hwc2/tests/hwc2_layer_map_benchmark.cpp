@@ -0,0 +1,103 @@
+/*
+ * Copyright (C) 2016 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <benchmark/benchmark.h>
+
+#include <vector>
+
+#include "hwc2.h"
+
+static void fill(hwc2_layer_map &layers, size_t layer_cnt,
+        std::vector<hwc2_layer_t> *out_ids)
+{
+    for (size_t idx = 0; idx < layer_cnt; idx++) {
+        hwc2_layer_t lyr_id = layers.emplace();
+        layers.find(lyr_id)->set_z_order(layer_cnt - idx);
+        out_ids->push_back(lyr_id);
+    }
+}
+
+/* Every per-layer call of a frame looks its layer up once */
+static void BM_layer_map_find(benchmark::State &state)
+{
+    hwc2_layer_map layers;
+    std::vector<hwc2_layer_t> ids;
+    fill(layers, state.range(0), &ids);
+
+    for (auto _: state)
+        for (auto lyr_id: ids)
+            benchmark::DoNotOptimize(layers.find(lyr_id));
+
+    state.SetItemsProcessed(state.iterations() * ids.size());
+}
+
+/* validate_display walks the layers in z order. The order is cached until a
+ * z order changes */
+static void BM_layer_map_z_order(benchmark::State &state)
+{
+    hwc2_layer_map layers;
+    std::vector<hwc2_layer_t> ids;
+    fill(layers, state.range(0), &ids);
+
+    std::vector<const hwc2_layer *> ordered;
+    ordered.reserve(ids.size());
+
+    for (auto _: state) {
+        layers.get_z_order(&ordered);
+        benchmark::DoNotOptimize(ordered.data());
+    }
+}
+
+/* As above, with one layer changing its z order every frame */
+static void BM_layer_map_z_order_changed(benchmark::State &state)
+{
+    hwc2_layer_map layers;
+    std::vector<hwc2_layer_t> ids;
+    fill(layers, state.range(0), &ids);
+
+    std::vector<const hwc2_layer *> ordered;
+    ordered.reserve(ids.size());
+    uint32_t frame = 0;
+
+    for (auto _: state) {
+        layers.find(ids[frame % ids.size()])->set_z_order(frame);
+        layers.invalidate_z_order();
+        layers.get_z_order(&ordered);
+        benchmark::DoNotOptimize(ordered.data());
+        frame++;
+    }
+}
+
+/* A layer destroyed and created again, as when an app window is replaced */
+static void BM_layer_map_churn(benchmark::State &state)
+{
+    hwc2_layer_map layers;
+    std::vector<hwc2_layer_t> ids;
+    fill(layers, state.range(0), &ids);
+
+    size_t idx = 0;
+
+    for (auto _: state) {
+        layers.erase(ids[idx]);
+        ids[idx] = layers.emplace();
+        idx = (idx + 1) % ids.size();
+    }
+}
+
+BENCHMARK(BM_layer_map_find)->Arg(5)->Arg(20)->Arg(64);
+BENCHMARK(BM_layer_map_z_order)->Arg(5)->Arg(20)->Arg(64);
+BENCHMARK(BM_layer_map_z_order_changed)->Arg(5)->Arg(20)->Arg(64);
+BENCHMARK(BM_layer_map_churn)->Arg(5)->Arg(20)->Arg(64);
@@ -0,0 +1,154 @@
+/*
+ * Copyright (C) 2016 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <gtest/gtest.h>
+
+#include <vector>
+
+#include "hwc2.h"
+
+static std::vector<hwc2_layer_t> get_z_order_ids(hwc2_layer_map &layers)
+{
+    std::vector<const hwc2_layer *> ordered;
+    layers.get_z_order(&ordered);
+
+    std::vector<hwc2_layer_t> ids;
+    for (auto lyr: ordered)
+        ids.push_back(lyr->get_id());
+    return ids;
+}
+
+TEST(hwc2_layer_map_test, erased_ids_are_rejected)
+{
+    hwc2_layer_map layers;
+
+    hwc2_layer_t first = layers.emplace();
+    hwc2_layer_t second = layers.emplace();
+
+    EXPECT_TRUE(layers.erase(first));
+    EXPECT_EQ(layers.find(first), nullptr);
+    EXPECT_FALSE(layers.erase(first));
+
+    /* The freed slot is reused under a new generation */
+    hwc2_layer_t third = layers.emplace();
+    EXPECT_NE(third, first);
+    EXPECT_EQ(layers.find(first), nullptr);
+    ASSERT_NE(layers.find(third), nullptr);
+    EXPECT_EQ(layers.find(third)->get_id(), third);
+    EXPECT_FALSE(layers.erase(first));
+
+    EXPECT_EQ(layers.size(), 2u);
+    EXPECT_EQ(layers.find(second)->get_id(), second);
+}
+
+/* Erasing a layer moves the last layer into its place. Its id must still find
+ * it there */
+TEST(hwc2_layer_map_test, swap_remove_keeps_ids)
+{
+    hwc2_layer_map layers;
+    std::vector<hwc2_layer_t> ids;
+
+    for (size_t idx = 0; idx < 8; idx++)
+        ids.push_back(layers.emplace());
+
+    ASSERT_TRUE(layers.erase(ids[0]));
+    ASSERT_TRUE(layers.erase(ids[3]));
+
+    for (size_t idx = 0; idx < ids.size(); idx++) {
+        hwc2_layer *lyr = layers.find(ids[idx]);
+        if (idx == 0 || idx == 3) {
+            EXPECT_EQ(lyr, nullptr);
+        } else {
+            ASSERT_NE(lyr, nullptr);
+            EXPECT_EQ(lyr->get_id(), ids[idx]);
+        }
+    }
+
+    EXPECT_EQ(layers.size(), 6u);
+}
+
+TEST(hwc2_layer_map_test, unknown_ids_are_rejected)
+{
+    hwc2_layer_map layers;
+    hwc2_layer_t lyr_id = layers.emplace();
+
+    EXPECT_EQ(layers.find(0), nullptr);
+    EXPECT_EQ(layers.find(lyr_id + 1), nullptr);
+    EXPECT_EQ(layers.find(lyr_id + (static_cast<hwc2_layer_t>(1) << 32)),
+            nullptr);
+    EXPECT_FALSE(layers.erase(0));
+}
+
+/* A slot whose generation wraps skips generation 0, and the ids it handed out
+ * before the wrap stay invalid */
+TEST(hwc2_layer_map_test, generation_wraps_past_zero)
+{
+    hwc2_layer_map layers(UINT32_MAX - 1);
+    std::vector<hwc2_layer_t> ids;
+
+    for (size_t idx = 0; idx < 4; idx++) {
+        hwc2_layer_t lyr_id = layers.emplace();
+        ids.push_back(lyr_id);
+
+        EXPECT_NE(lyr_id >> 32, 0u);
+        EXPECT_EQ(static_cast<uint32_t>(lyr_id), 0u);
+        ASSERT_TRUE(layers.erase(lyr_id));
+    }
+
+    EXPECT_EQ(ids[0] >> 32, UINT32_MAX - 1);
+    EXPECT_EQ(ids[1] >> 32, UINT32_MAX);
+    EXPECT_EQ(ids[2] >> 32, 1u);
+    EXPECT_EQ(ids[3] >> 32, 2u);
+
+    hwc2_layer_t lyr_id = layers.emplace();
+    for (auto stale_id: ids)
+        EXPECT_EQ(layers.find(stale_id), nullptr);
+    EXPECT_NE(layers.find(lyr_id), nullptr);
+}
+
+TEST(hwc2_layer_map_test, z_order_is_stable)
+{
+    hwc2_layer_map layers;
+    std::vector<hwc2_layer_t> ids;
+
+    /* Every other layer shares z order 1. Ties are broken by id */
+    for (size_t idx = 0; idx < 6; idx++) {
+        hwc2_layer_t lyr_id = layers.emplace();
+        layers.find(lyr_id)->set_z_order((idx % 2)? 1: 6 - idx);
+        ids.push_back(lyr_id);
+    }
+
+    std::vector<hwc2_layer_t> expected = {ids[1], ids[3], ids[5], ids[4],
+            ids[2], ids[0]};
+    EXPECT_EQ(get_z_order_ids(layers), expected);
+
+    /* Erasing keeps the order of the remaining layers, even though the last
+     * layer moved into the erased one's place */
+    ASSERT_TRUE(layers.erase(ids[3]));
+    expected = {ids[1], ids[5], ids[4], ids[2], ids[0]};
+    EXPECT_EQ(get_z_order_ids(layers), expected);
+
+    /* A reused slot with a new id is ordered by its z order and id */
+    hwc2_layer_t lyr_id = layers.emplace();
+    layers.find(lyr_id)->set_z_order(1);
+    expected = {ids[1], ids[5], lyr_id, ids[4], ids[2], ids[0]};
+    EXPECT_EQ(get_z_order_ids(layers), expected);
+
+    layers.find(ids[0])->set_z_order(0);
+    layers.invalidate_z_order();
+    expected = {ids[0], ids[1], ids[5], lyr_id, ids[4], ids[2]};
+    EXPECT_EQ(get_z_order_ids(layers), expected);
+}
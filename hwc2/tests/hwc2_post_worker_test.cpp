@@ -0,0 +1,152 @@
+/*
+ * Copyright (C) 2016 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <gtest/gtest.h>
+#include <sync/sync.h>
+#include <unistd.h>
+
+#include "hwc2_test_device.h"
+
+/* Each flip ioctl on the external display blocks for this long */
+#define HWC2_POST_WORKER_TEST_DELAY     100000000
+#define HWC2_POST_WORKER_TEST_FRAMES    10
+
+class hwc2_post_worker_test: public testing::Test {
+protected:
+    void SetUp() override
+    {
+        hwc2_fake_property_clear();
+        hwc2_fake_property_set("debug.hwc2.idle_frames", "0");
+        hwc2_fake_adf_reset(hwc2_test_get_displays(2));
+        hwc2_fake_adf_set_post_delay(1, HWC2_POST_WORKER_TEST_DELAY);
+    }
+};
+
+/* A present to the internal display returns as fast as it would alone while
+ * the external display's flips are stuck in the kernel. Frames queued for
+ * the external display behind a slow flip are replaced by newer ones */
+TEST_F(hwc2_post_worker_test, slow_external_post_does_not_delay_internal)
+{
+    std::vector<hwc2_fake_display> displays = hwc2_test_get_displays(2);
+
+    {
+        hwc2_test_device device;
+        ASSERT_TRUE(device.is_open());
+
+        hwc2_test_scene internal(device, 0, displays[0].configs[0].width,
+                displays[0].configs[0].height);
+        hwc2_test_scene external(device, 1, displays[1].configs[0].width,
+                displays[1].configs[0].height);
+        internal.generate(HWC2_TEST_SCENE_RGB, 4);
+        external.generate(HWC2_TEST_SCENE_RGB, 2);
+        external.set_wait_present(false);
+
+        nsecs_t start = systemTime(SYSTEM_TIME_MONOTONIC);
+
+        for (size_t idx = 0; idx < HWC2_POST_WORKER_TEST_FRAMES; idx++) {
+            hwc2_test_frame_times times;
+
+            ASSERT_EQ(external.frame(&times), HWC2_ERROR_NONE);
+            EXPECT_LT(times.present, HWC2_POST_WORKER_TEST_DELAY / 2)
+                    << "external frame " << idx;
+
+            ASSERT_EQ(internal.frame(&times), HWC2_ERROR_NONE);
+            EXPECT_LT(times.present, HWC2_POST_WORKER_TEST_DELAY / 2)
+                    << "internal frame " << idx;
+        }
+
+        nsecs_t elapsed = systemTime(SYSTEM_TIME_MONOTONIC) - start;
+        EXPECT_LT(elapsed, HWC2_POST_WORKER_TEST_DELAY
+                * HWC2_POST_WORKER_TEST_FRAMES / 2);
+        EXPECT_EQ(hwc2_fake_adf_get_post_count(0),
+                static_cast<uint64_t>(HWC2_POST_WORKER_TEST_FRAMES));
+
+        std::string dump;
+        device.dump(&dump);
+        EXPECT_NE(dump.find("replaced while queued"), std::string::npos)
+                << dump;
+    }
+
+    /* Closing the device posts what was still queued */
+    uint64_t external_posts = hwc2_fake_adf_get_post_count(1);
+    EXPECT_GE(external_posts, 2u);
+    EXPECT_LT(external_posts,
+            static_cast<uint64_t>(HWC2_POST_WORKER_TEST_FRAMES));
+    EXPECT_EQ(hwc2_fake_adf_get_bad_fd_count(), 0u);
+}
+
+/* With async posts off, the post happens inside present_display */
+TEST_F(hwc2_post_worker_test, synchronous_posts_block_present)
+{
+    hwc2_fake_property_set("debug.hwc2.async_post", "0");
+    std::vector<hwc2_fake_display> displays = hwc2_test_get_displays(2);
+
+    hwc2_test_device device;
+    ASSERT_TRUE(device.is_open());
+
+    hwc2_test_scene external(device, 1, displays[1].configs[0].width,
+            displays[1].configs[0].height);
+    external.generate(HWC2_TEST_SCENE_RGB, 2);
+
+    hwc2_test_frame_times times;
+    ASSERT_EQ(external.frame(&times), HWC2_ERROR_NONE);
+    EXPECT_GE(times.present, HWC2_POST_WORKER_TEST_DELAY);
+    EXPECT_EQ(hwc2_fake_adf_get_post_count(1), 1u);
+}
+
+/* A failed post leaves the previous frame on screen, so its present fence
+ * only signals once a later post is on screen */
+TEST_F(hwc2_post_worker_test, failed_post_fence_waits_for_next_post)
+{
+    std::vector<hwc2_fake_display> displays = hwc2_test_get_displays(2);
+    hwc2_fake_adf_set_post_delay(1, 0);
+
+    hwc2_test_device device;
+    ASSERT_TRUE(device.is_open());
+
+    hwc2_test_scene scene(device, 1, displays[1].configs[0].width,
+            displays[1].configs[0].height);
+    scene.generate(HWC2_TEST_SCENE_RGB, 2);
+    ASSERT_EQ(scene.frame(nullptr), HWC2_ERROR_NONE);
+
+    hwc2_fake_adf_set_post_error(1, EIO);
+
+    int32_t failed_fence = -1;
+    ASSERT_EQ(scene.frame(nullptr, &failed_fence), HWC2_ERROR_NONE);
+    ASSERT_GE(failed_fence, 0);
+
+    std::string dump;
+    for (size_t idx = 0; idx < 100; idx++) {
+        dump.clear();
+        device.dump(&dump);
+        if (dump.find(" 1 failed") != std::string::npos)
+            break;
+        usleep(1000);
+    }
+    ASSERT_NE(dump.find(" 1 failed"), std::string::npos) << dump;
+    EXPECT_LT(sync_wait(failed_fence, 0), 0);
+
+    hwc2_fake_adf_set_post_error(1, 0);
+
+    int32_t fence = -1;
+    ASSERT_EQ(scene.frame(nullptr, &fence), HWC2_ERROR_NONE);
+    ASSERT_GE(fence, 0);
+    EXPECT_EQ(sync_wait(fence, 1000), 0);
+    EXPECT_EQ(sync_wait(failed_fence, 0), 0);
+
+    close(fence);
+    close(failed_fence);
+}
@@ -0,0 +1,139 @@
+/*
+ * Copyright (C) 2016 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <gtest/gtest.h>
+
+#include <cstring>
+
+#include "hwc2.h"
+
+static bool intersects(const hwc_rect_t &r1, const hwc_rect_t &r2)
+{
+    return r1.left < r2.right && r2.left < r1.right && r1.top < r2.bottom
+            && r2.top < r1.bottom;
+}
+
+/* Subtracts cut from rect, and checks that the pieces left are disjoint,
+ * inside rect, clear of cut and add up to the area that should be left */
+static hwc2_region subtract(const hwc_rect_t &rect, const hwc_rect_t &cut)
+{
+    hwc2_region region(rect);
+    region.subtract(hwc2_region(cut));
+    bool empty_cut = hwc2_region(cut).is_empty();
+
+    const std::vector<hwc_rect_t> &rects = region.get_rects();
+    for (size_t idx = 0; idx < rects.size(); idx++) {
+        const hwc_rect_t &piece = rects[idx];
+        EXPECT_TRUE(hwc2_region(rect).contains(hwc2_region(piece)));
+        EXPECT_TRUE(empty_cut || !intersects(piece, cut));
+        for (size_t other = idx + 1; other < rects.size(); other++)
+            EXPECT_FALSE(intersects(piece, rects[other]));
+    }
+
+    hwc2_region overlap(rect);
+    overlap.intersect(hwc2_region(cut));
+    EXPECT_EQ(region.get_area(),
+            hwc2_region(rect).get_area() - overlap.get_area());
+
+    return region;
+}
+
+TEST(hwc2_region_test, cut_inside_leaves_four_pieces)
+{
+    hwc2_region region = subtract({0, 0, 100, 100}, {25, 25, 75, 75});
+    EXPECT_EQ(region.get_rects().size(), 4u);
+}
+
+TEST(hwc2_region_test, cut_on_an_edge_leaves_three_pieces)
+{
+    hwc2_region region = subtract({0, 0, 100, 100}, {25, -10, 75, 50});
+    EXPECT_EQ(region.get_rects().size(), 3u);
+}
+
+TEST(hwc2_region_test, cut_across_or_on_a_corner_leaves_two_pieces)
+{
+    EXPECT_EQ(subtract({0, 0, 100, 100}, {-10, 40, 110, 60})
+            .get_rects().size(), 2u);
+    EXPECT_EQ(subtract({0, 0, 100, 100}, {50, 50, 150, 150})
+            .get_rects().size(), 2u);
+}
+
+TEST(hwc2_region_test, cut_over_one_side_leaves_one_piece)
+{
+    hwc2_region region = subtract({0, 0, 100, 100}, {-10, -10, 110, 30});
+    ASSERT_EQ(region.get_rects().size(), 1u);
+
+    hwc_rect_t expected = {0, 30, 100, 100};
+    EXPECT_EQ(memcmp(&region.get_rects()[0], &expected, sizeof(expected)), 0);
+}
+
+TEST(hwc2_region_test, full_cover_leaves_nothing)
+{
+    EXPECT_TRUE(subtract({0, 0, 100, 100}, {0, 0, 100, 100}).is_empty());
+    EXPECT_TRUE(subtract({10, 10, 20, 20}, {0, 0, 100, 100}).is_empty());
+}
+
+/* Rects that only share an edge do not overlap */
+TEST(hwc2_region_test, disjoint_cut_leaves_the_rect)
+{
+    hwc2_region region = subtract({0, 0, 100, 100}, {100, 0, 200, 100});
+    ASSERT_EQ(region.get_rects().size(), 1u);
+    EXPECT_EQ(region.get_area(), 10000u);
+
+    EXPECT_EQ(subtract({0, 0, 100, 100}, {200, 200, 300, 300})
+            .get_rects().size(), 1u);
+}
+
+TEST(hwc2_region_test, empty_regions)
+{
+    EXPECT_EQ(subtract({0, 0, 100, 100}, {50, 50, 50, 80})
+            .get_rects().size(), 1u);
+    EXPECT_TRUE(subtract({50, 50, 50, 80}, {0, 0, 100, 100}).is_empty());
+
+    hwc2_region region;
+    region.set({10, 10, 10, 10});
+    EXPECT_TRUE(region.is_empty());
+    region.subtract(hwc2_region({0, 0, 100, 100}));
+    EXPECT_TRUE(region.is_empty());
+    EXPECT_EQ(region.get_area(), 0u);
+}
+
+TEST(hwc2_region_test, containment)
+{
+    hwc2_region screen({0, 0, 100, 100});
+    hwc2_region empty;
+
+    EXPECT_TRUE(screen.contains(screen));
+    EXPECT_TRUE(screen.contains(hwc2_region({10, 10, 90, 90})));
+    EXPECT_FALSE(screen.contains(hwc2_region({50, 50, 150, 150})));
+    EXPECT_FALSE(screen.contains(hwc2_region({200, 200, 300, 300})));
+
+    EXPECT_TRUE(screen.contains(empty));
+    EXPECT_TRUE(empty.contains(empty));
+    EXPECT_FALSE(empty.contains(screen));
+
+    /* Two halves cover what neither does alone */
+    hwc2_region halves({0, 0, 50, 100});
+    halves.unite({50, 0, 100, 100});
+    EXPECT_TRUE(halves.contains(screen));
+    EXPECT_FALSE(hwc2_region({0, 0, 50, 100}).contains(screen));
+
+    /* A region with a hole does not contain the hole */
+    hwc2_region frame = screen;
+    frame.subtract(hwc2_region({40, 40, 60, 60}));
+    EXPECT_FALSE(frame.contains(screen));
+    EXPECT_TRUE(frame.contains(hwc2_region({0, 0, 100, 40})));
+}
@@ -0,0 +1,85 @@
+/*
+ * Copyright (C) 2016 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/* Replays a trace taken on a device against the host build of the HAL:
+ *
+ *   adb shell setprop debug.hwc2.trace 4096
+ *   adb shell setprop debug.hwc2.trace_file /data/local/tmp/hwc2.trace
+ *   (restart SurfaceFlinger, reproduce the problem)
+ *   adb shell dumpsys SurfaceFlinger > /dev/null
+ *   adb pull /data/local/tmp/hwc2.trace
+ *   hwc2_replay [-p] hwc2.trace
+ *
+ * -p keeps the traced time between calls instead of replaying them back to
+ * back */
+
+#include <inttypes.h>
+#include <unistd.h>
+#include <cstdio>
+
+#include "hwc2_test_replay.h"
+
+int main(int argc, char **argv)
+{
+    bool paced = false;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "p")) != -1) {
+        switch (opt) {
+        case 'p':
+            paced = true;
+            break;
+        default:
+            fprintf(stderr, "usage: %s [-p] <trace file>\n", argv[0]);
+            return 1;
+        }
+    }
+
+    if (optind != argc - 1) {
+        fprintf(stderr, "usage: %s [-p] <trace file>\n", argv[0]);
+        return 1;
+    }
+
+    hwc2_test_replay replay;
+    std::string error;
+
+    if (!replay.load(argv[optind], &error)) {
+        fprintf(stderr, "%s\n", error.c_str());
+        return 1;
+    }
+
+    hwc2_fake_property_clear();
+    hwc2_fake_adf_reset(hwc2_test_get_displays(replay.get_display_count()));
+
+    hwc2_test_device device;
+    if (!device.is_open()) {
+        fprintf(stderr, "failed to open the hwc2 device\n");
+        return 1;
+    }
+
+    bool known = replay.replay(device, paced);
+    printf("%s", replay.dump().c_str());
+
+    /* A trace from a newer HAL would otherwise replay partially and look
+     * like it matched */
+    if (!known) {
+        fprintf(stderr, "%s: %" PRIu64 " records of unknown events\n",
+                argv[optind], replay.get_unknown_count());
+        return 3;
+    }
+
+    return replay.get_diverged_count()? 2: 0;
+}
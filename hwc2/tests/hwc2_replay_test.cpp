@@ -0,0 +1,244 @@
+/*
+ * Copyright (C) 2016 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <gtest/gtest.h>
+#include <sync/sync.h>
+#include <unistd.h>
+
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+
+#include "hwc2_test_replay.h"
+
+#define HWC2_REPLAY_TEST_FRAMES   32
+
+class hwc2_replay_test: public testing::Test {
+protected:
+    void SetUp() override
+    {
+        path = P_tmpdir "/hwc2_replay_test.trace";
+
+        hwc2_fake_property_clear();
+        hwc2_fake_property_set("debug.hwc2.idle_frames", "0");
+        hwc2_fake_adf_reset(hwc2_test_get_displays(1));
+    }
+
+    void TearDown() override
+    {
+        remove(path.c_str());
+    }
+
+    std::string path;
+};
+
+/* A traced scene replays on a fresh device with the same results */
+TEST_F(hwc2_replay_test, trace_replays_without_divergence)
+{
+    hwc2_fake_property_set("debug.hwc2.trace", "4096");
+    hwc2_fake_property_set("debug.hwc2.trace_file", path);
+    {
+        hwc2_test_device device;
+        ASSERT_TRUE(device.is_open());
+
+        hwc2_fake_config config = hwc2_test_get_panel_config();
+        hwc2_test_scene scene(device, 0, config.width, config.height);
+        scene.generate(HWC2_TEST_SCENE_YUV_MIX, 4);
+        scene.set_moving_layer(1);
+
+        for (size_t idx = 0; idx < HWC2_REPLAY_TEST_FRAMES; idx++)
+            ASSERT_EQ(scene.frame(nullptr), HWC2_ERROR_NONE);
+
+        /* Dumping writes the trace file */
+        std::string dump;
+        device.dump(&dump);
+    }
+
+    hwc2_test_replay replay;
+    std::string error;
+    ASSERT_TRUE(replay.load(path, &error)) << error;
+    EXPECT_EQ(replay.get_display_count(), 1u);
+
+    hwc2_fake_property_clear();
+    hwc2_fake_property_set("debug.hwc2.idle_frames", "0");
+    hwc2_fake_adf_reset(hwc2_test_get_displays(1));
+
+    hwc2_test_device device;
+    ASSERT_TRUE(device.is_open());
+    EXPECT_TRUE(replay.replay(device, false)) << replay.dump();
+
+    EXPECT_EQ(replay.get_diverged_count(), 0u) << replay.dump();
+    EXPECT_EQ(replay.get_lazy_layer_count(), 0u);
+    EXPECT_EQ(replay.get_stats().at(HWC2_FUNCTION_PRESENT_DISPLAY).call_cnt,
+            static_cast<uint64_t>(HWC2_REPLAY_TEST_FRAMES));
+    EXPECT_EQ(replay.get_stats().count(
+            HWC2_FUNCTION_GET_CHANGED_COMPOSITION_TYPES), 1u);
+    EXPECT_EQ(replay.get_stats().count(HWC2_FUNCTION_GET_DISPLAY_REQUESTS),
+            1u);
+    EXPECT_EQ(hwc2_fake_adf_get_post_count(0),
+            static_cast<uint64_t>(HWC2_REPLAY_TEST_FRAMES));
+    EXPECT_EQ(hwc2_fake_adf_get_bad_fd_count(), 0u);
+}
+
+/* Layer commands replay with the layers, buffers and fences of the replay
+ * in place of the traced ones */
+TEST_F(hwc2_replay_test, layer_commands_replay_without_divergence)
+{
+    hwc2_fake_config config = hwc2_test_get_panel_config();
+    int32_t width = config.width / 2, height = config.height / 2;
+    std::vector<buffer_handle_t> buffers;
+
+    hwc2_fake_property_set("debug.hwc2.trace", "4096");
+    hwc2_fake_property_set("debug.hwc2.trace_file", path);
+    {
+        hwc2_test_device device;
+        ASSERT_TRUE(device.is_open());
+
+        hwc2_layer_t lyr_id;
+        ASSERT_EQ(device.create_layer(0, &lyr_id), HWC2_ERROR_NONE);
+        for (size_t idx = 0; idx < 2; idx++)
+            buffers.push_back(hwc2_fake_gralloc_alloc(width, height,
+                    HAL_PIXEL_FORMAT_RGBA_8888, HWC2_FAKE_LAYOUT_PITCH));
+
+        for (size_t idx = 0; idx < HWC2_REPLAY_TEST_FRAMES; idx++) {
+            uint64_t handle = reinterpret_cast<uintptr_t>(buffers[idx % 2]);
+            float crop_width = width, crop_height = height, alpha = 1.0f;
+            uint32_t crop_right, crop_bottom, opaque;
+            memcpy(&crop_right, &crop_width, sizeof(crop_right));
+            memcpy(&crop_bottom, &crop_height, sizeof(crop_bottom));
+            memcpy(&opaque, &alpha, sizeof(opaque));
+            int32_t left = idx * 4;
+
+            uint32_t commands[] = {
+                HWC2_LAYER_COMMAND_HEADER(HWC2_LAYER_COMMAND_SELECT_LAYER, 2),
+                static_cast<uint32_t>(lyr_id),
+                static_cast<uint32_t>(lyr_id >> 32),
+                HWC2_LAYER_COMMAND_HEADER(
+                        HWC2_LAYER_COMMAND_COMPOSITION_TYPE, 1),
+                HWC2_COMPOSITION_DEVICE,
+                HWC2_LAYER_COMMAND_HEADER(HWC2_LAYER_COMMAND_BLEND_MODE, 1),
+                HWC2_BLEND_MODE_NONE,
+                HWC2_LAYER_COMMAND_HEADER(HWC2_LAYER_COMMAND_PLANE_ALPHA, 1),
+                opaque,
+                HWC2_LAYER_COMMAND_HEADER(HWC2_LAYER_COMMAND_BUFFER, 3),
+                static_cast<uint32_t>(handle),
+                static_cast<uint32_t>(handle >> 32),
+                static_cast<uint32_t>(hwc2_fake_fence_create(true)),
+                HWC2_LAYER_COMMAND_HEADER(HWC2_LAYER_COMMAND_DISPLAY_FRAME, 4),
+                static_cast<uint32_t>(left), 0,
+                static_cast<uint32_t>(left + width),
+                static_cast<uint32_t>(height),
+                HWC2_LAYER_COMMAND_HEADER(HWC2_LAYER_COMMAND_SOURCE_CROP, 4),
+                0, 0, crop_right, crop_bottom,
+                HWC2_LAYER_COMMAND_HEADER(
+                        HWC2_LAYER_COMMAND_VISIBLE_REGION, 4),
+                static_cast<uint32_t>(left), 0,
+                static_cast<uint32_t>(left + width),
+                static_cast<uint32_t>(height),
+            };
+            uint32_t error_offset = 0;
+            ASSERT_EQ(device.set_layer_commands(0,
+                    sizeof(commands) / sizeof(*commands), commands,
+                    &error_offset), HWC2_ERROR_NONE);
+
+            uint32_t num_types = 0, num_requests = 0;
+            ASSERT_EQ(device.validate_display(0, &num_types, &num_requests),
+                    HWC2_ERROR_NONE);
+
+            int32_t present_fence = -1;
+            ASSERT_EQ(device.present_display(0, &present_fence),
+                    HWC2_ERROR_NONE);
+            if (present_fence >= 0) {
+                sync_wait(present_fence, -1);
+                close(present_fence);
+            }
+
+            uint32_t num_fences = 1;
+            int32_t release_fence = -1;
+            ASSERT_EQ(device.get_release_fences(0, &num_fences, &lyr_id,
+                    &release_fence), HWC2_ERROR_NONE);
+            if (num_fences && release_fence >= 0)
+                close(release_fence);
+        }
+
+        std::string dump;
+        device.dump(&dump);
+    }
+
+    for (auto buffer: buffers)
+        hwc2_fake_gralloc_free(buffer);
+
+    hwc2_test_replay replay;
+    std::string error;
+    ASSERT_TRUE(replay.load(path, &error)) << error;
+
+    hwc2_fake_property_clear();
+    hwc2_fake_property_set("debug.hwc2.idle_frames", "0");
+    hwc2_fake_adf_reset(hwc2_test_get_displays(1));
+
+    hwc2_test_device device;
+    ASSERT_TRUE(device.is_open());
+    EXPECT_TRUE(replay.replay(device, false)) << replay.dump();
+
+    EXPECT_EQ(replay.get_diverged_count(), 0u) << replay.dump();
+    EXPECT_EQ(replay.get_stats().at(
+            HWC2_VENDOR_FUNCTION_SET_LAYER_COMMANDS).call_cnt,
+            static_cast<uint64_t>(HWC2_REPLAY_TEST_FRAMES));
+    EXPECT_EQ(hwc2_fake_adf_get_post_count(0),
+            static_cast<uint64_t>(HWC2_REPLAY_TEST_FRAMES));
+    EXPECT_EQ(hwc2_fake_adf_get_bad_fd_count(), 0u);
+}
+
+/* A trace with events the replay does not know replays what it can and
+ * reports the rest */
+TEST_F(hwc2_replay_test, unknown_events_fail_the_replay)
+{
+    struct hwc2_trace_header header = {HWC2_TRACE_MAGIC, HWC2_TRACE_VERSION,
+            sizeof(hwc2_trace_record), 1};
+    hwc2_trace_record rec = {};
+    rec.event = HWC2_VENDOR_FUNCTION_SET_LAYER_COMMANDS + 0x100;
+
+    std::ofstream file(path, std::ios::binary);
+    file.write(reinterpret_cast<const char *>(&header), sizeof(header));
+    file.write(reinterpret_cast<const char *>(&rec), sizeof(rec));
+    file.close();
+
+    hwc2_test_replay replay;
+    std::string error;
+    ASSERT_TRUE(replay.load(path, &error)) << error;
+
+    hwc2_test_device device;
+    ASSERT_TRUE(device.is_open());
+    EXPECT_FALSE(replay.replay(device, false));
+    EXPECT_EQ(replay.get_unknown_count(), 1u);
+    EXPECT_NE(replay.dump().find("unknown event"), std::string::npos);
+}
+
+TEST_F(hwc2_replay_test, foreign_files_are_rejected)
+{
+    std::ofstream(path) << "not a trace";
+
+    hwc2_test_replay replay;
+    std::string error;
+    EXPECT_FALSE(replay.load(path, &error));
+    EXPECT_FALSE(error.empty());
+
+    struct hwc2_trace_header header = {HWC2_TRACE_MAGIC, HWC2_TRACE_VERSION,
+            sizeof(hwc2_trace_record) + 8, 0};
+    std::ofstream(path, std::ios::binary).write(
+            reinterpret_cast<const char *>(&header), sizeof(header));
+    EXPECT_FALSE(replay.load(path, &error));
+}
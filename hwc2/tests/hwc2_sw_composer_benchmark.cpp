@@ -0,0 +1,142 @@
+/*
+ * Copyright (C) 2016 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <benchmark/benchmark.h>
+
+#include <random>
+#include <vector>
+
+#include "hwc2_test_device.h"
+
+/* A whole frame of rows, so the row kernels stream through memory the way
+ * they do in compose */
+static void run_rows(benchmark::State &state, bool scalar, bool premultiply)
+{
+    size_t width = state.range(0);
+    size_t height = state.range(1);
+    std::mt19937 rng(1);
+
+    std::vector<uint32_t> src(width * height), dst(width * height);
+    for (auto &px: src)
+        px = rng();
+    for (auto &px: dst)
+        px = rng();
+
+    for (auto _: state) {
+        for (size_t y = 0; y < height; y++) {
+            uint32_t *src_row = &src[y * width];
+            uint32_t *dst_row = &dst[y * width];
+
+            if (premultiply && scalar)
+                hwc2_sw_composer::premultiply_row_scalar(src_row, width,
+                        HWC2_BLEND_MODE_COVERAGE, 0xff);
+            else if (premultiply)
+                hwc2_sw_composer::premultiply_row(src_row, width,
+                        HWC2_BLEND_MODE_COVERAGE, 0xff);
+            else if (scalar)
+                hwc2_sw_composer::blend_row_scalar(src_row, dst_row, width);
+            else
+                hwc2_sw_composer::blend_row(src_row, dst_row, width);
+        }
+        benchmark::DoNotOptimize(dst.data());
+    }
+
+    state.SetItemsProcessed(state.iterations() * width * height);
+    state.SetBytesProcessed(state.iterations() * width * height
+            * sizeof(uint32_t) * ((premultiply)? 2: 3));
+}
+
+static void BM_sw_premultiply_row(benchmark::State &state)
+{
+    run_rows(state, false, true);
+}
+
+static void BM_sw_premultiply_row_scalar(benchmark::State &state)
+{
+    run_rows(state, true, true);
+}
+
+static void BM_sw_blend_row(benchmark::State &state)
+{
+    run_rows(state, false, false);
+}
+
+static void BM_sw_blend_row_scalar(benchmark::State &state)
+{
+    run_rows(state, true, false);
+}
+
+/* A virtual display frame as the cpu composer sees it: an opaque wallpaper,
+ * a premultiplied app window and a coverage dialog with plane alpha over
+ * both */
+static void BM_sw_compose(benchmark::State &state)
+{
+    int32_t width = state.range(0);
+    int32_t height = state.range(1);
+
+    hwc2_fake_property_clear();
+    hwc2_fake_adf_reset(hwc2_test_get_displays(1));
+
+    std::vector<buffer_handle_t> buffers;
+    for (size_t idx = 0; idx < 4; idx++)
+        buffers.push_back(hwc2_fake_gralloc_alloc(width, height,
+                HAL_PIXEL_FORMAT_RGBA_8888, HWC2_FAKE_LAYOUT_PITCH));
+
+    const hwc2_blend_mode_t blend_modes[] = {HWC2_BLEND_MODE_NONE,
+            HWC2_BLEND_MODE_PREMULTIPLIED, HWC2_BLEND_MODE_COVERAGE};
+    const float plane_alphas[] = {1.0f, 1.0f, 0.75f};
+
+    std::vector<hwc2_layer> layers;
+    std::vector<const hwc2_layer *> ordered;
+    layers.reserve(3);
+
+    for (size_t idx = 0; idx < 3; idx++) {
+        layers.emplace_back(idx + 1);
+        hwc2_layer &lyr = layers.back();
+
+        lyr.set_comp_type(HWC2_COMPOSITION_DEVICE);
+        lyr.set_buffer(buffers[idx + 1], -1);
+        lyr.set_display_frame({0, 0, width, height});
+        lyr.set_source_crop({0.0f, 0.0f, static_cast<float>(width),
+                static_cast<float>(height)});
+        lyr.set_blend_mode(blend_modes[idx]);
+        lyr.set_plane_alpha(plane_alphas[idx]);
+        ordered.push_back(&lyr);
+    }
+
+    hwc2_sw_composer composer;
+
+    for (auto _: state) {
+        if (composer.compose(ordered, buffers[0], -1, width, height)
+                != HWC2_ERROR_NONE) {
+            state.SkipWithError("compose failed");
+            break;
+        }
+    }
+
+    state.SetItemsProcessed(state.iterations() * width * height);
+
+    for (auto &lyr: layers)
+        lyr.release_dma_bufs();
+    for (auto buffer: buffers)
+        hwc2_fake_gralloc_free(buffer);
+}
+
+BENCHMARK(BM_sw_premultiply_row)->Args({1920, 1080})->Args({1280, 720});
+BENCHMARK(BM_sw_premultiply_row_scalar)->Args({1920, 1080})->Args({1280, 720});
+BENCHMARK(BM_sw_blend_row)->Args({1920, 1080})->Args({1280, 720});
+BENCHMARK(BM_sw_blend_row_scalar)->Args({1920, 1080})->Args({1280, 720});
+BENCHMARK(BM_sw_compose)->Args({1920, 1080})->Args({1280, 720});
@@ -0,0 +1,311 @@
+/*
+ * Copyright (C) 2016 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <gtest/gtest.h>
+
+#include <algorithm>
+#include <cmath>
+#include <random>
+#include <tuple>
+#include <vector>
+
+#include "hwc2_test_device.h"
+
+/* Odd sizes leave a tail after the eight pixel NEON loops */
+#define HWC2_SW_TEST_OUTPUT_WIDTH    64
+#define HWC2_SW_TEST_OUTPUT_HEIGHT   48
+#define HWC2_SW_TEST_SOURCE_WIDTH    37
+#define HWC2_SW_TEST_SOURCE_HEIGHT   23
+#define HWC2_SW_TEST_MAX_ROW         43
+
+/* The integer kernels round once per multiply. Coverage multiplies twice
+ * before the blend does once more */
+#define HWC2_SW_TEST_TOLERANCE       2
+
+static const hwc2_blend_mode_t blend_modes[] = {
+    HWC2_BLEND_MODE_NONE,
+    HWC2_BLEND_MODE_PREMULTIPLIED,
+    HWC2_BLEND_MODE_COVERAGE,
+};
+
+/* Channel ch of a pixel stored r, g, b, a in memory order */
+static float get_channel(uint32_t px, size_t ch)
+{
+    return ((px >> (ch * 8)) & 0xff) / 255.0f;
+}
+
+/* The naive float versions of premultiply_row and blend_row */
+static void premultiply_ref(uint32_t px, hwc2_blend_mode_t blend_mode,
+        uint8_t plane_alpha, float *out_px)
+{
+    float pa = plane_alpha / 255.0f;
+    float a = get_channel(px, 3);
+
+    switch (blend_mode) {
+    case HWC2_BLEND_MODE_NONE:
+        a = pa;
+        for (size_t ch = 0; ch < 3; ch++)
+            out_px[ch] = get_channel(px, ch) * pa;
+        break;
+    case HWC2_BLEND_MODE_COVERAGE:
+        a *= pa;
+        for (size_t ch = 0; ch < 3; ch++)
+            out_px[ch] = get_channel(px, ch) * a;
+        break;
+    default:
+        a *= pa;
+        for (size_t ch = 0; ch < 3; ch++)
+            out_px[ch] = get_channel(px, ch) * pa;
+        break;
+    }
+
+    out_px[3] = a;
+}
+
+static void blend_ref(const float *src, uint32_t dst, float *out_px)
+{
+    for (size_t ch = 0; ch < 4; ch++)
+        out_px[ch] = std::min(src[ch] + get_channel(dst, ch)
+                * (1.0f - src[3]), 1.0f);
+}
+
+static uint32_t get_max_error(uint32_t px, const float *ref)
+{
+    uint32_t error = 0;
+    for (size_t ch = 0; ch < 4; ch++)
+        error = std::max(error, static_cast<uint32_t>(std::abs(
+                static_cast<int32_t>((px >> (ch * 8)) & 0xff)
+                - static_cast<int32_t>(std::lround(ref[ch] * 255.0f)))));
+    return error;
+}
+
+static std::vector<uint32_t> get_random_pixels(std::mt19937 &rng, size_t cnt)
+{
+    std::vector<uint32_t> px(cnt);
+    for (auto &p: px)
+        p = rng();
+    return px;
+}
+
+/* Every row length up to a few NEON loops long, so that each tail length is
+ * covered */
+TEST(hwc2_sw_composer_test, row_kernels_match_scalar_and_float)
+{
+    std::mt19937 rng(1);
+
+    for (auto blend_mode: blend_modes) {
+        for (uint32_t plane_alpha: {0x00, 0x80, 0xff}) {
+            for (size_t cnt = 1; cnt <= HWC2_SW_TEST_MAX_ROW; cnt++) {
+                SCOPED_TRACE(testing::Message() << "blend " << blend_mode
+                        << " plane alpha " << plane_alpha << " cnt " << cnt);
+
+                std::vector<uint32_t> src = get_random_pixels(rng, cnt);
+                std::vector<uint32_t> dst = get_random_pixels(rng, cnt);
+
+                std::vector<uint32_t> premult = src;
+                std::vector<uint32_t> premult_scalar = src;
+                hwc2_sw_composer::premultiply_row(premult.data(), cnt,
+                        blend_mode, plane_alpha);
+                hwc2_sw_composer::premultiply_row_scalar(
+                        premult_scalar.data(), cnt, blend_mode, plane_alpha);
+                ASSERT_EQ(premult, premult_scalar);
+
+                std::vector<uint32_t> blended = dst;
+                std::vector<uint32_t> blended_scalar = dst;
+                hwc2_sw_composer::blend_row(premult.data(), blended.data(),
+                        cnt);
+                hwc2_sw_composer::blend_row_scalar(premult.data(),
+                        blended_scalar.data(), cnt);
+                ASSERT_EQ(blended, blended_scalar);
+
+                for (size_t idx = 0; idx < cnt; idx++) {
+                    float ref[4], ref_blended[4];
+                    premultiply_ref(src[idx], blend_mode, plane_alpha, ref);
+                    blend_ref(ref, dst[idx], ref_blended);
+
+                    EXPECT_LE(get_max_error(premult[idx], ref), 1u);
+                    EXPECT_LE(get_max_error(blended[idx], ref_blended),
+                            static_cast<uint32_t>(HWC2_SW_TEST_TOLERANCE));
+                }
+            }
+        }
+    }
+}
+
+typedef std::tuple<hwc2_blend_mode_t, int32_t, float> hwc2_sw_composer_param;
+
+/* Composes a random layer with a transform over a random opaque one and
+ * compares every output pixel with the float reference */
+class hwc2_sw_composer_test:
+        public testing::TestWithParam<hwc2_sw_composer_param> {
+protected:
+    void SetUp() override
+    {
+        hwc2_fake_property_clear();
+        hwc2_fake_adf_reset(hwc2_test_get_displays(1));
+
+        int err = hw_get_module(GRALLOC_HARDWARE_MODULE_ID,
+                reinterpret_cast<const hw_module_t **>(&gralloc_module));
+        ASSERT_EQ(err, 0);
+    }
+
+    void TearDown() override
+    {
+        for (auto buffer: buffers)
+            hwc2_fake_gralloc_free(buffer);
+    }
+
+    /* Allocates a buffer and returns its pixels, one row every *out_stride
+     * pixels */
+    uint32_t *alloc(int32_t width, int32_t height, buffer_handle_t *out_buffer,
+            uint32_t *out_stride)
+    {
+        buffer_handle_t buffer = hwc2_fake_gralloc_alloc(width, height,
+                HAL_PIXEL_FORMAT_RGBA_8888, HWC2_FAKE_LAYOUT_PITCH);
+        buffers.push_back(buffer);
+
+        hwc2_gralloc_metadata metadata;
+        EXPECT_TRUE(hwc2_gralloc::get_instance().get_metadata(buffer,
+                &metadata));
+
+        void *vaddr = nullptr;
+        EXPECT_EQ(gralloc_module->lock(gralloc_module, buffer,
+                GRALLOC_USAGE_SW_WRITE_OFTEN, 0, 0, width, height, &vaddr), 0);
+
+        *out_buffer = buffer;
+        *out_stride = metadata.surfaces[0].pitch / sizeof(uint32_t);
+        return static_cast<uint32_t *>(vaddr);
+    }
+
+    const gralloc_module_t *gralloc_module;
+    std::vector<buffer_handle_t> buffers;
+};
+
+/* The source pixel under display pixel (x, y) of an unscaled frame. The
+ * source is flipped, then rotated 90 degrees clockwise */
+static void get_source_pixel(hwc_transform_t transform, int32_t x, int32_t y,
+        int32_t *out_x, int32_t *out_y)
+{
+    int32_t sx = x, sy = y;
+    if (transform & HWC_TRANSFORM_ROT_90) {
+        sx = y;
+        sy = HWC2_SW_TEST_SOURCE_HEIGHT - 1 - x;
+    }
+
+    if (transform & HWC_TRANSFORM_FLIP_H)
+        sx = HWC2_SW_TEST_SOURCE_WIDTH - 1 - sx;
+    if (transform & HWC_TRANSFORM_FLIP_V)
+        sy = HWC2_SW_TEST_SOURCE_HEIGHT - 1 - sy;
+
+    *out_x = sx;
+    *out_y = sy;
+}
+
+TEST_P(hwc2_sw_composer_test, compose_matches_float_reference)
+{
+    hwc2_blend_mode_t blend_mode = std::get<0>(GetParam());
+    hwc_transform_t transform = static_cast<hwc_transform_t>(
+            std::get<1>(GetParam()));
+    float plane_alpha = std::get<2>(GetParam());
+    std::mt19937 rng(std::get<1>(GetParam()) + 1);
+
+    buffer_handle_t output, base_buffer, top_buffer;
+    uint32_t output_stride, base_stride, top_stride;
+    uint32_t *output_px = alloc(HWC2_SW_TEST_OUTPUT_WIDTH,
+            HWC2_SW_TEST_OUTPUT_HEIGHT, &output, &output_stride);
+    uint32_t *base_px = alloc(HWC2_SW_TEST_OUTPUT_WIDTH,
+            HWC2_SW_TEST_OUTPUT_HEIGHT, &base_buffer, &base_stride);
+    uint32_t *top_px = alloc(HWC2_SW_TEST_SOURCE_WIDTH,
+            HWC2_SW_TEST_SOURCE_HEIGHT, &top_buffer, &top_stride);
+
+    for (int32_t y = 0; y < HWC2_SW_TEST_OUTPUT_HEIGHT; y++)
+        for (int32_t x = 0; x < HWC2_SW_TEST_OUTPUT_WIDTH; x++)
+            base_px[y * base_stride + x] = rng() | 0xff000000;
+    for (int32_t y = 0; y < HWC2_SW_TEST_SOURCE_HEIGHT; y++)
+        for (int32_t x = 0; x < HWC2_SW_TEST_SOURCE_WIDTH; x++)
+            top_px[y * top_stride + x] = rng();
+
+    bool rot_90 = transform & HWC_TRANSFORM_ROT_90;
+    int32_t frame_width = (rot_90)? HWC2_SW_TEST_SOURCE_HEIGHT:
+            HWC2_SW_TEST_SOURCE_WIDTH;
+    int32_t frame_height = (rot_90)? HWC2_SW_TEST_SOURCE_WIDTH:
+            HWC2_SW_TEST_SOURCE_HEIGHT;
+    hwc_rect_t top_frame = {5, 3, 5 + frame_width, 3 + frame_height};
+
+    hwc2_layer base(1), top(2);
+    ASSERT_EQ(base.set_comp_type(HWC2_COMPOSITION_DEVICE), HWC2_ERROR_NONE);
+    ASSERT_EQ(base.set_buffer(base_buffer, -1), HWC2_ERROR_NONE);
+    ASSERT_EQ(base.set_display_frame({0, 0, HWC2_SW_TEST_OUTPUT_WIDTH,
+            HWC2_SW_TEST_OUTPUT_HEIGHT}), HWC2_ERROR_NONE);
+    ASSERT_EQ(base.set_source_crop({0.0f, 0.0f, HWC2_SW_TEST_OUTPUT_WIDTH,
+            HWC2_SW_TEST_OUTPUT_HEIGHT}), HWC2_ERROR_NONE);
+    ASSERT_EQ(base.set_blend_mode(HWC2_BLEND_MODE_NONE), HWC2_ERROR_NONE);
+    ASSERT_EQ(base.set_plane_alpha(1.0f), HWC2_ERROR_NONE);
+
+    ASSERT_EQ(top.set_comp_type(HWC2_COMPOSITION_DEVICE), HWC2_ERROR_NONE);
+    ASSERT_EQ(top.set_buffer(top_buffer, -1), HWC2_ERROR_NONE);
+    ASSERT_EQ(top.set_display_frame(top_frame), HWC2_ERROR_NONE);
+    ASSERT_EQ(top.set_source_crop({0.0f, 0.0f, HWC2_SW_TEST_SOURCE_WIDTH,
+            HWC2_SW_TEST_SOURCE_HEIGHT}), HWC2_ERROR_NONE);
+    ASSERT_EQ(top.set_blend_mode(blend_mode), HWC2_ERROR_NONE);
+    ASSERT_EQ(top.set_plane_alpha(plane_alpha), HWC2_ERROR_NONE);
+    ASSERT_EQ(top.set_transform(transform), HWC2_ERROR_NONE);
+
+    ASSERT_TRUE(hwc2_sw_composer::is_supported(base));
+    ASSERT_TRUE(hwc2_sw_composer::is_supported(top));
+
+    hwc2_sw_composer composer;
+    ASSERT_EQ(composer.compose({&base, &top}, output, -1,
+            HWC2_SW_TEST_OUTPUT_WIDTH, HWC2_SW_TEST_OUTPUT_HEIGHT),
+            HWC2_ERROR_NONE);
+
+    base.release_dma_bufs();
+    top.release_dma_bufs();
+
+    uint8_t alpha = static_cast<uint8_t>(std::round(plane_alpha * 0xff));
+    uint32_t max_error = 0;
+
+    for (int32_t y = 0; y < HWC2_SW_TEST_OUTPUT_HEIGHT; y++) {
+        for (int32_t x = 0; x < HWC2_SW_TEST_OUTPUT_WIDTH; x++) {
+            uint32_t dst = base_px[y * base_stride + x];
+            float ref[4];
+
+            if (x >= top_frame.left && x < top_frame.right
+                    && y >= top_frame.top && y < top_frame.bottom) {
+                int32_t sx, sy;
+                get_source_pixel(transform, x - top_frame.left,
+                        y - top_frame.top, &sx, &sy);
+
+                float src[4];
+                premultiply_ref(top_px[sy * top_stride + sx], blend_mode,
+                        alpha, src);
+                blend_ref(src, dst, ref);
+            } else {
+                for (size_t ch = 0; ch < 4; ch++)
+                    ref[ch] = get_channel(dst, ch);
+            }
+
+            max_error = std::max(max_error, get_max_error(
+                    output_px[y * output_stride + x], ref));
+        }
+    }
+
+    EXPECT_LE(max_error, static_cast<uint32_t>(HWC2_SW_TEST_TOLERANCE));
+}
+
+INSTANTIATE_TEST_CASE_P(blends, hwc2_sw_composer_test, testing::Combine(
+        testing::ValuesIn(blend_modes), testing::Range(0, 8),
+        testing::Values(1.0f, 0.6f)));
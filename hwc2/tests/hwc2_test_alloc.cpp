@@ -0,0 +1,84 @@
+/*
+ * Copyright (C) 2016 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+/* Replaces the global operator new of the test binaries to count heap
+ * allocations. hwc2 allocates with new only, libc users are not counted */
+
+#include <cstdlib>
+#include <new>
+#include <atomic>
+
+#include "hwc2_test_fakes.h"
+
+static std::atomic<uint64_t> alloc_cnt(0);
+
+uint64_t hwc2_test_get_alloc_count()
+{
+    return alloc_cnt.load(std::memory_order_relaxed);
+}
+
+static void *counted_alloc(size_t size)
+{
+    alloc_cnt.fetch_add(1, std::memory_order_relaxed);
+    return malloc((size)? size: 1);
+}
+
+void *operator new(size_t size)
+{
+    void *ptr = counted_alloc(size);
+    if (!ptr)
+        abort();
+    return ptr;
+}
+
+void *operator new[](size_t size)
+{
+    void *ptr = counted_alloc(size);
+    if (!ptr)
+        abort();
+    return ptr;
+}
+
+void *operator new(size_t size, const std::nothrow_t &) noexcept
+{
+    return counted_alloc(size);
+}
+
+void *operator new[](size_t size, const std::nothrow_t &) noexcept
+{
+    return counted_alloc(size);
+}
+
+void operator delete(void *ptr) noexcept
+{
+    free(ptr);
+}
+
+void operator delete[](void *ptr) noexcept
+{
+    free(ptr);
+}
+
+void operator delete(void *ptr, size_t) noexcept
+{
+    free(ptr);
+}
+
+void operator delete[](void *ptr, size_t) noexcept
+{
+    free(ptr);
+}
@@ -0,0 +1,628 @@
+/*
+ * Copyright (C) 2016 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <tegra_adf.h>
+#include <sync/sync.h>
+#include <unistd.h>
+#include <cmath>
+
+#include "hwc2_test_device.h"
+
+extern hw_module_t HAL_MODULE_INFO_SYM;
+
+std::vector<hwc2_fake_display> hwc2_test_get_displays(size_t display_cnt)
+{
+    std::vector<hwc2_fake_display> displays;
+
+    hwc2_fake_display panel;
+    panel.connected = true;
+    panel.caps = TEGRA_ADF_CAPABILITIES_CURSOR_MODE
+            | TEGRA_ADF_CAPABILITIES_BLOCKLINEAR;
+    panel.configs.push_back({1536, 2048, 16666667, 320000, 320000});
+    displays.push_back(panel);
+
+    if (display_cnt > 1) {
+        hwc2_fake_display hdmi;
+        hdmi.connected = true;
+        hdmi.caps = TEGRA_ADF_CAPABILITIES_BLOCKLINEAR;
+        hdmi.configs.push_back({1920, 1080, 16666667, 160000, 160000});
+        hdmi.configs.push_back({1280, 720, 16666667, 160000, 160000});
+        displays.push_back(hdmi);
+    }
+
+    return displays;
+}
+
+hwc2_fake_config hwc2_test_get_panel_config()
+{
+    return hwc2_test_get_displays(1)[0].configs[0];
+}
+
+hwc2_test_device::hwc2_test_device()
+    : device(nullptr),
+      vsync_cnt(0),
+      refresh_cnt(0),
+      pfn_accept_display_changes(nullptr),
+      pfn_create_layer(nullptr),
+      pfn_destroy_layer(nullptr),
+      pfn_dump(nullptr),
+      pfn_get_changed_composition_types(nullptr),
+      pfn_get_display_requests(nullptr),
+      pfn_get_release_fences(nullptr),
+      pfn_present_display(nullptr),
+      pfn_register_callback(nullptr),
+      pfn_set_active_config(nullptr),
+      pfn_set_client_target(nullptr),
+      pfn_set_color_mode(nullptr),
+      pfn_set_color_transform(nullptr),
+      pfn_set_cursor_position(nullptr),
+      pfn_set_layer_blend_mode(nullptr),
+      pfn_set_layer_buffer(nullptr),
+      pfn_set_layer_color(nullptr),
+      pfn_set_layer_composition_type(nullptr),
+      pfn_set_layer_dataspace(nullptr),
+      pfn_set_layer_display_frame(nullptr),
+      pfn_set_layer_plane_alpha(nullptr),
+      pfn_set_layer_source_crop(nullptr),
+      pfn_set_layer_surface_damage(nullptr),
+      pfn_set_layer_transform(nullptr),
+      pfn_set_layer_visible_region(nullptr),
+      pfn_set_layer_z_order(nullptr),
+      pfn_set_power_mode(nullptr),
+      pfn_set_vsync_enabled(nullptr),
+      pfn_validate_display(nullptr),
+      pfn_get_predicted_present_times(nullptr),
+      pfn_set_layer_commands(nullptr)
+{
+    hw_device_t *hw_device = nullptr;
+
+    int ret = HAL_MODULE_INFO_SYM.methods->open(&HAL_MODULE_INFO_SYM,
+            HWC_HARDWARE_COMPOSER, &hw_device);
+    if (ret < 0 || !hw_device)
+        return;
+
+    device = reinterpret_cast<hwc2_device_t *>(hw_device);
+
+    pfn_accept_display_changes = get_function<HWC2_PFN_ACCEPT_DISPLAY_CHANGES>(
+            HWC2_FUNCTION_ACCEPT_DISPLAY_CHANGES);
+    pfn_create_layer = get_function<HWC2_PFN_CREATE_LAYER>(
+            HWC2_FUNCTION_CREATE_LAYER);
+    pfn_destroy_layer = get_function<HWC2_PFN_DESTROY_LAYER>(
+            HWC2_FUNCTION_DESTROY_LAYER);
+    pfn_dump = get_function<HWC2_PFN_DUMP>(HWC2_FUNCTION_DUMP);
+    pfn_get_changed_composition_types =
+            get_function<HWC2_PFN_GET_CHANGED_COMPOSITION_TYPES>(
+            HWC2_FUNCTION_GET_CHANGED_COMPOSITION_TYPES);
+    pfn_get_display_requests = get_function<HWC2_PFN_GET_DISPLAY_REQUESTS>(
+            HWC2_FUNCTION_GET_DISPLAY_REQUESTS);
+    pfn_get_release_fences = get_function<HWC2_PFN_GET_RELEASE_FENCES>(
+            HWC2_FUNCTION_GET_RELEASE_FENCES);
+    pfn_present_display = get_function<HWC2_PFN_PRESENT_DISPLAY>(
+            HWC2_FUNCTION_PRESENT_DISPLAY);
+    pfn_register_callback = get_function<HWC2_PFN_REGISTER_CALLBACK>(
+            HWC2_FUNCTION_REGISTER_CALLBACK);
+    pfn_set_active_config = get_function<HWC2_PFN_SET_ACTIVE_CONFIG>(
+            HWC2_FUNCTION_SET_ACTIVE_CONFIG);
+    pfn_set_client_target = get_function<HWC2_PFN_SET_CLIENT_TARGET>(
+            HWC2_FUNCTION_SET_CLIENT_TARGET);
+    pfn_set_color_mode = get_function<HWC2_PFN_SET_COLOR_MODE>(
+            HWC2_FUNCTION_SET_COLOR_MODE);
+    pfn_set_color_transform = get_function<HWC2_PFN_SET_COLOR_TRANSFORM>(
+            HWC2_FUNCTION_SET_COLOR_TRANSFORM);
+    pfn_set_cursor_position = get_function<HWC2_PFN_SET_CURSOR_POSITION>(
+            HWC2_FUNCTION_SET_CURSOR_POSITION);
+    pfn_set_layer_blend_mode = get_function<HWC2_PFN_SET_LAYER_BLEND_MODE>(
+            HWC2_FUNCTION_SET_LAYER_BLEND_MODE);
+    pfn_set_layer_buffer = get_function<HWC2_PFN_SET_LAYER_BUFFER>(
+            HWC2_FUNCTION_SET_LAYER_BUFFER);
+    pfn_set_layer_color = get_function<HWC2_PFN_SET_LAYER_COLOR>(
+            HWC2_FUNCTION_SET_LAYER_COLOR);
+    pfn_set_layer_composition_type =
+            get_function<HWC2_PFN_SET_LAYER_COMPOSITION_TYPE>(
+            HWC2_FUNCTION_SET_LAYER_COMPOSITION_TYPE);
+    pfn_set_layer_dataspace = get_function<HWC2_PFN_SET_LAYER_DATASPACE>(
+            HWC2_FUNCTION_SET_LAYER_DATASPACE);
+    pfn_set_layer_display_frame =
+            get_function<HWC2_PFN_SET_LAYER_DISPLAY_FRAME>(
+            HWC2_FUNCTION_SET_LAYER_DISPLAY_FRAME);
+    pfn_set_layer_plane_alpha = get_function<HWC2_PFN_SET_LAYER_PLANE_ALPHA>(
+            HWC2_FUNCTION_SET_LAYER_PLANE_ALPHA);
+    pfn_set_layer_source_crop = get_function<HWC2_PFN_SET_LAYER_SOURCE_CROP>(
+            HWC2_FUNCTION_SET_LAYER_SOURCE_CROP);
+    pfn_set_layer_surface_damage =
+            get_function<HWC2_PFN_SET_LAYER_SURFACE_DAMAGE>(
+            HWC2_FUNCTION_SET_LAYER_SURFACE_DAMAGE);
+    pfn_set_layer_transform = get_function<HWC2_PFN_SET_LAYER_TRANSFORM>(
+            HWC2_FUNCTION_SET_LAYER_TRANSFORM);
+    pfn_set_layer_visible_region =
+            get_function<HWC2_PFN_SET_LAYER_VISIBLE_REGION>(
+            HWC2_FUNCTION_SET_LAYER_VISIBLE_REGION);
+    pfn_set_layer_z_order = get_function<HWC2_PFN_SET_LAYER_Z_ORDER>(
+            HWC2_FUNCTION_SET_LAYER_Z_ORDER);
+    pfn_set_power_mode = get_function<HWC2_PFN_SET_POWER_MODE>(
+            HWC2_FUNCTION_SET_POWER_MODE);
+    pfn_set_vsync_enabled = get_function<HWC2_PFN_SET_VSYNC_ENABLED>(
+            HWC2_FUNCTION_SET_VSYNC_ENABLED);
+    pfn_validate_display = get_function<HWC2_PFN_VALIDATE_DISPLAY>(
+            HWC2_FUNCTION_VALIDATE_DISPLAY);
+    pfn_get_predicted_present_times =
+            get_function<HWC2_VENDOR_PFN_GET_PREDICTED_PRESENT_TIMES>(
+            HWC2_VENDOR_FUNCTION_GET_PREDICTED_PRESENT_TIMES);
+    pfn_set_layer_commands = get_function<HWC2_VENDOR_PFN_SET_LAYER_COMMANDS>(
+            HWC2_VENDOR_FUNCTION_SET_LAYER_COMMANDS);
+
+    pfn_register_callback(device, HWC2_CALLBACK_VSYNC, this,
+            reinterpret_cast<hwc2_function_pointer_t>(vsync_hook));
+    pfn_register_callback(device, HWC2_CALLBACK_REFRESH, this,
+            reinterpret_cast<hwc2_function_pointer_t>(refresh_hook));
+}
+
+hwc2_test_device::~hwc2_test_device()
+{
+    if (device)
+        device->common.close(&device->common);
+}
+
+void hwc2_test_device::vsync_hook(hwc2_callback_data_t callback_data,
+        hwc2_display_t /*display*/, int64_t /*timestamp*/)
+{
+    static_cast<hwc2_test_device *>(callback_data)->vsync_cnt++;
+}
+
+void hwc2_test_device::refresh_hook(hwc2_callback_data_t callback_data,
+        hwc2_display_t /*display*/)
+{
+    static_cast<hwc2_test_device *>(callback_data)->refresh_cnt++;
+}
+
+int32_t hwc2_test_device::accept_display_changes(hwc2_display_t display)
+{
+    return pfn_accept_display_changes(device, display);
+}
+
+int32_t hwc2_test_device::create_layer(hwc2_display_t display,
+        hwc2_layer_t *out_layer)
+{
+    return pfn_create_layer(device, display, out_layer);
+}
+
+int32_t hwc2_test_device::destroy_layer(hwc2_display_t display,
+        hwc2_layer_t layer)
+{
+    return pfn_destroy_layer(device, display, layer);
+}
+
+void hwc2_test_device::dump(std::string *out_dump)
+{
+    uint32_t size = 0;
+    pfn_dump(device, &size, nullptr);
+    if (size == 0) {
+        out_dump->clear();
+        return;
+    }
+
+    std::vector<char> buffer(size);
+    pfn_dump(device, &size, buffer.data());
+    out_dump->assign(buffer.data(), size);
+}
+
+int32_t hwc2_test_device::get_changed_composition_types(
+        hwc2_display_t display, uint32_t *out_num_elements,
+        hwc2_layer_t *out_layers, int32_t *out_types)
+{
+    return pfn_get_changed_composition_types(device, display,
+            out_num_elements, out_layers, out_types);
+}
+
+int32_t hwc2_test_device::get_display_requests(hwc2_display_t display,
+        int32_t *out_display_requests, uint32_t *out_num_elements,
+        hwc2_layer_t *out_layers, int32_t *out_layer_requests)
+{
+    return pfn_get_display_requests(device, display, out_display_requests,
+            out_num_elements, out_layers, out_layer_requests);
+}
+
+int32_t hwc2_test_device::get_release_fences(hwc2_display_t display,
+        uint32_t *out_num_elements, hwc2_layer_t *out_layers,
+        int32_t *out_fences)
+{
+    return pfn_get_release_fences(device, display, out_num_elements,
+            out_layers, out_fences);
+}
+
+int32_t hwc2_test_device::present_display(hwc2_display_t display,
+        int32_t *out_present_fence)
+{
+    return pfn_present_display(device, display, out_present_fence);
+}
+
+int32_t hwc2_test_device::set_active_config(hwc2_display_t display,
+        hwc2_config_t config)
+{
+    return pfn_set_active_config(device, display, config);
+}
+
+int32_t hwc2_test_device::set_client_target(hwc2_display_t display,
+        buffer_handle_t target, int32_t acquire_fence,
+        const hwc_region_t &damage, android_dataspace_t dataspace)
+{
+    return pfn_set_client_target(device, display, target, acquire_fence,
+            dataspace, damage);
+}
+
+int32_t hwc2_test_device::set_color_mode(hwc2_display_t display,
+        android_color_mode_t mode)
+{
+    return pfn_set_color_mode(device, display, mode);
+}
+
+int32_t hwc2_test_device::set_color_transform(hwc2_display_t display,
+        const float *matrix, android_color_transform_t hint)
+{
+    return pfn_set_color_transform(device, display, matrix, hint);
+}
+
+int32_t hwc2_test_device::set_cursor_position(hwc2_display_t display,
+        hwc2_layer_t layer, int32_t x, int32_t y)
+{
+    return pfn_set_cursor_position(device, display, layer, x, y);
+}
+
+int32_t hwc2_test_device::set_layer_blend_mode(hwc2_display_t display,
+        hwc2_layer_t layer, hwc2_blend_mode_t mode)
+{
+    return pfn_set_layer_blend_mode(device, display, layer, mode);
+}
+
+int32_t hwc2_test_device::set_layer_buffer(hwc2_display_t display,
+        hwc2_layer_t layer, buffer_handle_t buffer, int32_t acquire_fence)
+{
+    return pfn_set_layer_buffer(device, display, layer, buffer, acquire_fence);
+}
+
+int32_t hwc2_test_device::set_layer_color(hwc2_display_t display,
+        hwc2_layer_t layer, hwc_color_t color)
+{
+    return pfn_set_layer_color(device, display, layer, color);
+}
+
+int32_t hwc2_test_device::set_layer_composition_type(hwc2_display_t display,
+        hwc2_layer_t layer, hwc2_composition_t type)
+{
+    return pfn_set_layer_composition_type(device, display, layer, type);
+}
+
+int32_t hwc2_test_device::set_layer_dataspace(hwc2_display_t display,
+        hwc2_layer_t layer, android_dataspace_t dataspace)
+{
+    return pfn_set_layer_dataspace(device, display, layer, dataspace);
+}
+
+int32_t hwc2_test_device::set_layer_display_frame(hwc2_display_t display,
+        hwc2_layer_t layer, const hwc_rect_t &frame)
+{
+    return pfn_set_layer_display_frame(device, display, layer, frame);
+}
+
+int32_t hwc2_test_device::set_layer_plane_alpha(hwc2_display_t display,
+        hwc2_layer_t layer, float alpha)
+{
+    return pfn_set_layer_plane_alpha(device, display, layer, alpha);
+}
+
+int32_t hwc2_test_device::set_layer_source_crop(hwc2_display_t display,
+        hwc2_layer_t layer, const hwc_frect_t &crop)
+{
+    return pfn_set_layer_source_crop(device, display, layer, crop);
+}
+
+int32_t hwc2_test_device::set_layer_surface_damage(hwc2_display_t display,
+        hwc2_layer_t layer, const hwc_region_t &damage)
+{
+    return pfn_set_layer_surface_damage(device, display, layer, damage);
+}
+
+int32_t hwc2_test_device::set_layer_transform(hwc2_display_t display,
+        hwc2_layer_t layer, hwc_transform_t transform)
+{
+    return pfn_set_layer_transform(device, display, layer, transform);
+}
+
+int32_t hwc2_test_device::set_layer_visible_region(hwc2_display_t display,
+        hwc2_layer_t layer, const hwc_region_t &visible)
+{
+    return pfn_set_layer_visible_region(device, display, layer, visible);
+}
+
+int32_t hwc2_test_device::set_layer_z_order(hwc2_display_t display,
+        hwc2_layer_t layer, uint32_t z_order)
+{
+    return pfn_set_layer_z_order(device, display, layer, z_order);
+}
+
+int32_t hwc2_test_device::set_power_mode(hwc2_display_t display,
+        hwc2_power_mode_t mode)
+{
+    return pfn_set_power_mode(device, display, mode);
+}
+
+int32_t hwc2_test_device::set_vsync_enabled(hwc2_display_t display,
+        hwc2_vsync_t enabled)
+{
+    return pfn_set_vsync_enabled(device, display, enabled);
+}
+
+int32_t hwc2_test_device::validate_display(hwc2_display_t display,
+        uint32_t *out_num_types, uint32_t *out_num_requests)
+{
+    return pfn_validate_display(device, display, out_num_types,
+            out_num_requests);
+}
+
+int32_t hwc2_test_device::get_predicted_present_times(hwc2_display_t display,
+        uint32_t *out_count, int64_t *out_times)
+{
+    return pfn_get_predicted_present_times(device, display, out_count,
+            out_times);
+}
+
+int32_t hwc2_test_device::set_layer_commands(hwc2_display_t display,
+        uint32_t num_words, const uint32_t *commands,
+        uint32_t *out_error_offset)
+{
+    return pfn_set_layer_commands(device, display, num_words, commands,
+            out_error_offset);
+}
+
+const char *hwc2_test_get_scene_name(hwc2_test_scene_type type)
+{
+    switch (type) {
+    case HWC2_TEST_SCENE_RGB:
+        return "rgb";
+    case HWC2_TEST_SCENE_YUV_MIX:
+        return "yuv_mix";
+    case HWC2_TEST_SCENE_ROTATED:
+        return "rotated";
+    case HWC2_TEST_SCENE_SCALED:
+        return "scaled";
+    case HWC2_TEST_SCENE_OVERLAPPING:
+        return "overlapping";
+    default:
+        return "unknown";
+    }
+}
+
+hwc2_test_scene::hwc2_test_scene(hwc2_test_device &device,
+        hwc2_display_t display, int32_t width, int32_t height)
+    : device(device),
+      display(display),
+      width(width),
+      height(height),
+      layers(),
+      client_targets(),
+      moving_layer(SIZE_MAX),
+      wait_present(true),
+      frame_cnt(0),
+      out_layers(),
+      out_values()
+{
+    for (auto &client_target: client_targets)
+        client_target = hwc2_fake_gralloc_alloc(width, height,
+                HAL_PIXEL_FORMAT_RGBA_8888, HWC2_FAKE_LAYOUT_PITCH);
+}
+
+hwc2_test_scene::~hwc2_test_scene()
+{
+    for (auto &lyr: layers) {
+        device.destroy_layer(display, lyr.id);
+        for (auto buffer: lyr.buffers)
+            hwc2_fake_gralloc_free(buffer);
+    }
+
+    for (auto client_target: client_targets)
+        hwc2_fake_gralloc_free(client_target);
+}
+
+size_t hwc2_test_scene::add_layer(int32_t format, uint32_t layout,
+        const hwc_rect_t &frame, const hwc_frect_t &crop,
+        hwc_transform_t transform, hwc2_blend_mode_t blend, size_t buffer_cnt)
+{
+    hwc2_test_layer lyr;
+    lyr.id = 0;
+    lyr.frame = frame;
+    lyr.comp_type = HWC2_COMPOSITION_DEVICE;
+
+    device.create_layer(display, &lyr.id);
+    device.set_layer_composition_type(display, lyr.id, lyr.comp_type);
+    device.set_layer_display_frame(display, lyr.id, frame);
+    device.set_layer_source_crop(display, lyr.id, crop);
+    device.set_layer_transform(display, lyr.id, transform);
+    device.set_layer_blend_mode(display, lyr.id, blend);
+    device.set_layer_plane_alpha(display, lyr.id, 1.0f);
+    device.set_layer_z_order(display, lyr.id, layers.size());
+
+    hwc_region_t visible = {1, &frame};
+    device.set_layer_visible_region(display, lyr.id, visible);
+
+    int32_t buffer_width = std::ceil(crop.right);
+    int32_t buffer_height = std::ceil(crop.bottom);
+    for (size_t idx = 0; idx < buffer_cnt; idx++)
+        lyr.buffers.push_back(hwc2_fake_gralloc_alloc(buffer_width,
+                buffer_height, format, layout));
+
+    layers.push_back(lyr);
+    out_layers.resize(layers.size());
+    out_values.resize(layers.size());
+
+    return layers.size() - 1;
+}
+
+void hwc2_test_scene::generate(hwc2_test_scene_type type, size_t layer_cnt)
+{
+    static const std::array<hwc_transform_t, 4> transforms = {{
+        HWC_TRANSFORM_ROT_90,
+        HWC_TRANSFORM_ROT_180,
+        HWC_TRANSFORM_ROT_270,
+        HWC_TRANSFORM_FLIP_H,
+    }};
+
+    hwc_rect_t screen = {0, 0, width, height};
+    hwc_frect_t screen_crop = {0.0f, 0.0f, static_cast<float>(width),
+            static_cast<float>(height)};
+
+    add_layer(HAL_PIXEL_FORMAT_RGBX_8888, HWC2_FAKE_LAYOUT_PITCH, screen,
+            screen_crop, static_cast<hwc_transform_t>(0),
+            HWC2_BLEND_MODE_NONE, 3);
+
+    for (size_t idx = 1; idx < layer_cnt; idx++) {
+        /* Three quarters of the display, stepping down and right */
+        int32_t x = (idx * width / 8) % (width / 4);
+        int32_t y = (idx * height / 8) % (height / 4);
+        hwc_rect_t frame = {x, y, x + width * 3 / 4, y + height * 3 / 4};
+
+        if (type == HWC2_TEST_SCENE_OVERLAPPING)
+            frame = screen;
+
+        float frame_width = frame.right - frame.left;
+        float frame_height = frame.bottom - frame.top;
+        hwc_frect_t crop = {0.0f, 0.0f, frame_width, frame_height};
+
+        int32_t format = HAL_PIXEL_FORMAT_RGBA_8888;
+        uint32_t layout = HWC2_FAKE_LAYOUT_PITCH;
+        hwc_transform_t transform = static_cast<hwc_transform_t>(0);
+        hwc2_blend_mode_t blend = HWC2_BLEND_MODE_PREMULTIPLIED;
+
+        switch (type) {
+        case HWC2_TEST_SCENE_YUV_MIX:
+            if (idx % 2) {
+                format = HWC2_FAKE_FORMAT_NV12;
+                layout = HWC2_FAKE_LAYOUT_BLOCK_LINEAR;
+                blend = HWC2_BLEND_MODE_NONE;
+            }
+            break;
+
+        case HWC2_TEST_SCENE_ROTATED:
+            transform = transforms[idx % transforms.size()];
+            if (transform & HWC_TRANSFORM_ROT_90)
+                crop = {0.0f, 0.0f, frame_height, frame_width};
+            break;
+
+        case HWC2_TEST_SCENE_SCALED:
+            crop = {0.0f, 0.0f, frame_width / 2, frame_height / 2};
+            break;
+
+        default:
+            break;
+        }
+
+        add_layer(format, layout, frame, crop, transform, blend, 3);
+    }
+}
+
+int32_t hwc2_test_scene::frame(hwc2_test_frame_times *out_times,
+        int32_t *out_present_fence)
+{
+    uint64_t allocs = hwc2_test_get_alloc_count();
+
+    for (size_t idx = 0; idx < layers.size(); idx++) {
+        const hwc2_test_layer &lyr = layers[idx];
+
+        if (!lyr.buffers.empty())
+            device.set_layer_buffer(display, lyr.id,
+                    lyr.buffers[frame_cnt % lyr.buffers.size()],
+                    hwc2_fake_fence_create(true));
+
+        if (idx == moving_layer) {
+            int32_t dx = (frame_cnt % 16) * 4;
+            hwc_rect_t frame = {lyr.frame.left + dx, lyr.frame.top,
+                    lyr.frame.right + dx, lyr.frame.bottom};
+            device.set_layer_display_frame(display, lyr.id, frame);
+        }
+    }
+
+    uint32_t num_types = 0, num_requests = 0;
+
+    nsecs_t start = systemTime(SYSTEM_TIME_MONOTONIC);
+    int32_t ret = device.validate_display(display, &num_types, &num_requests);
+    nsecs_t validate = systemTime(SYSTEM_TIME_MONOTONIC) - start;
+
+    if (ret == HWC2_ERROR_HAS_CHANGES) {
+        uint32_t num_elements = 0;
+        device.get_changed_composition_types(display, &num_elements, nullptr,
+                nullptr);
+        device.get_changed_composition_types(display, &num_elements,
+                out_layers.data(), out_values.data());
+
+        for (uint32_t idx = 0; idx < num_elements; idx++)
+            for (auto &lyr: layers)
+                if (lyr.id == out_layers[idx])
+                    lyr.comp_type = static_cast<hwc2_composition_t>(
+                            out_values[idx]);
+
+        /* The requests are not acted on, they are read as SurfaceFlinger
+         * does so traces of scenes hold them */
+        int32_t display_requests = 0;
+        device.get_display_requests(display, &display_requests,
+                &num_elements, nullptr, nullptr);
+        device.get_display_requests(display, &display_requests,
+                &num_elements, out_layers.data(), out_values.data());
+
+        device.accept_display_changes(display);
+    } else if (ret != HWC2_ERROR_NONE) {
+        return ret;
+    }
+
+    for (auto &lyr: layers) {
+        if (lyr.comp_type == HWC2_COMPOSITION_CLIENT) {
+            hwc_region_t damage = {0, nullptr};
+            device.set_client_target(display,
+                    client_targets[frame_cnt % client_targets.size()],
+                    hwc2_fake_fence_create(true), damage);
+            break;
+        }
+    }
+
+    int32_t present_fence = -1;
+
+    start = systemTime(SYSTEM_TIME_MONOTONIC);
+    ret = device.present_display(display, &present_fence);
+    nsecs_t present = systemTime(SYSTEM_TIME_MONOTONIC) - start;
+
+    if (out_present_fence) {
+        *out_present_fence = present_fence;
+    } else if (present_fence >= 0) {
+        if (wait_present)
+            sync_wait(present_fence, -1);
+        close(present_fence);
+    }
+
+    uint32_t num_elements = out_layers.size();
+    device.get_release_fences(display, &num_elements, out_layers.data(),
+            out_values.data());
+    for (uint32_t idx = 0; idx < num_elements; idx++)
+        if (out_values[idx] >= 0)
+            close(out_values[idx]);
+
+    frame_cnt++;
+
+    if (out_times) {
+        out_times->validate = validate;
+        out_times->present = present;
+        out_times->allocs = hwc2_test_get_alloc_count() - allocs;
+    }
+
+    return ret;
+}
@@ -0,0 +1,243 @@
+/*
+ * Copyright (C) 2016 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _HWC2_TEST_DEVICE_H
+#define _HWC2_TEST_DEVICE_H
+
+#include <hardware/hwcomposer2.h>
+#include <utils/Timers.h>
+
+#include <atomic>
+#include <array>
+#include <string>
+#include <vector>
+
+#include "hwc2.h"
+#include "hwc2_test_fakes.h"
+
+/* The displays the host tests run on: the flounder panel and a 1080p HDMI
+ * sink */
+std::vector<hwc2_fake_display> hwc2_test_get_displays(size_t display_cnt);
+
+/* The first config of the panel. It is returned by value, so it does not
+ * point into the vector hwc2_test_get_displays returns */
+hwc2_fake_config hwc2_test_get_panel_config();
+
+/* Opens the hwc2 device through its HAL module, the way SurfaceFlinger
+ * does, and calls it through the function pointers it hands out */
+class hwc2_test_device {
+public:
+    hwc2_test_device();
+    ~hwc2_test_device();
+
+    bool is_open() const { return device; }
+    hwc2_device_t *get_device() const { return device; }
+
+    uint64_t get_vsync_count() const { return vsync_cnt; }
+    uint64_t get_refresh_count() const { return refresh_cnt; }
+
+    int32_t accept_display_changes(hwc2_display_t display);
+    int32_t create_layer(hwc2_display_t display, hwc2_layer_t *out_layer);
+    void dump(std::string *out_dump);
+    int32_t destroy_layer(hwc2_display_t display, hwc2_layer_t layer);
+    int32_t get_changed_composition_types(hwc2_display_t display,
+                uint32_t *out_num_elements, hwc2_layer_t *out_layers,
+                int32_t *out_types);
+    int32_t get_display_requests(hwc2_display_t display,
+                int32_t *out_display_requests, uint32_t *out_num_elements,
+                hwc2_layer_t *out_layers, int32_t *out_layer_requests);
+    int32_t get_release_fences(hwc2_display_t display,
+                uint32_t *out_num_elements, hwc2_layer_t *out_layers,
+                int32_t *out_fences);
+    int32_t present_display(hwc2_display_t display,
+                int32_t *out_present_fence);
+    int32_t set_active_config(hwc2_display_t display, hwc2_config_t config);
+    int32_t set_client_target(hwc2_display_t display, buffer_handle_t target,
+                int32_t acquire_fence, const hwc_region_t &damage,
+                android_dataspace_t dataspace = HAL_DATASPACE_UNKNOWN);
+    int32_t set_color_mode(hwc2_display_t display,
+                android_color_mode_t mode);
+    int32_t set_color_transform(hwc2_display_t display, const float *matrix,
+                android_color_transform_t hint);
+    int32_t set_cursor_position(hwc2_display_t display, hwc2_layer_t layer,
+                int32_t x, int32_t y);
+    int32_t set_layer_blend_mode(hwc2_display_t display, hwc2_layer_t layer,
+                hwc2_blend_mode_t mode);
+    int32_t set_layer_buffer(hwc2_display_t display, hwc2_layer_t layer,
+                buffer_handle_t buffer, int32_t acquire_fence);
+    int32_t set_layer_color(hwc2_display_t display, hwc2_layer_t layer,
+                hwc_color_t color);
+    int32_t set_layer_composition_type(hwc2_display_t display,
+                hwc2_layer_t layer, hwc2_composition_t type);
+    int32_t set_layer_dataspace(hwc2_display_t display, hwc2_layer_t layer,
+                android_dataspace_t dataspace);
+    int32_t set_layer_display_frame(hwc2_display_t display,
+                hwc2_layer_t layer, const hwc_rect_t &frame);
+    int32_t set_layer_plane_alpha(hwc2_display_t display, hwc2_layer_t layer,
+                float alpha);
+    int32_t set_layer_source_crop(hwc2_display_t display, hwc2_layer_t layer,
+                const hwc_frect_t &crop);
+    int32_t set_layer_surface_damage(hwc2_display_t display,
+                hwc2_layer_t layer, const hwc_region_t &damage);
+    int32_t set_layer_transform(hwc2_display_t display, hwc2_layer_t layer,
+                hwc_transform_t transform);
+    int32_t set_layer_visible_region(hwc2_display_t display,
+                hwc2_layer_t layer, const hwc_region_t &visible);
+    int32_t set_layer_z_order(hwc2_display_t display, hwc2_layer_t layer,
+                uint32_t z_order);
+    int32_t set_power_mode(hwc2_display_t display, hwc2_power_mode_t mode);
+    int32_t set_vsync_enabled(hwc2_display_t display, hwc2_vsync_t enabled);
+    int32_t validate_display(hwc2_display_t display, uint32_t *out_num_types,
+                uint32_t *out_num_requests);
+
+    int32_t get_predicted_present_times(hwc2_display_t display,
+                uint32_t *out_count, int64_t *out_times);
+    int32_t set_layer_commands(hwc2_display_t display, uint32_t num_words,
+                const uint32_t *commands, uint32_t *out_error_offset);
+
+private:
+    template <typename PFN>
+    PFN get_function(int32_t descriptor) const
+    {
+        return reinterpret_cast<PFN>(device->getFunction(device, descriptor));
+    }
+
+    static void vsync_hook(hwc2_callback_data_t callback_data,
+                hwc2_display_t display, int64_t timestamp);
+    static void refresh_hook(hwc2_callback_data_t callback_data,
+                hwc2_display_t display);
+
+    hwc2_device_t *device;
+
+    std::atomic<uint64_t> vsync_cnt;
+    std::atomic<uint64_t> refresh_cnt;
+
+    HWC2_PFN_ACCEPT_DISPLAY_CHANGES pfn_accept_display_changes;
+    HWC2_PFN_CREATE_LAYER pfn_create_layer;
+    HWC2_PFN_DESTROY_LAYER pfn_destroy_layer;
+    HWC2_PFN_DUMP pfn_dump;
+    HWC2_PFN_GET_CHANGED_COMPOSITION_TYPES pfn_get_changed_composition_types;
+    HWC2_PFN_GET_DISPLAY_REQUESTS pfn_get_display_requests;
+    HWC2_PFN_GET_RELEASE_FENCES pfn_get_release_fences;
+    HWC2_PFN_PRESENT_DISPLAY pfn_present_display;
+    HWC2_PFN_REGISTER_CALLBACK pfn_register_callback;
+    HWC2_PFN_SET_ACTIVE_CONFIG pfn_set_active_config;
+    HWC2_PFN_SET_CLIENT_TARGET pfn_set_client_target;
+    HWC2_PFN_SET_COLOR_MODE pfn_set_color_mode;
+    HWC2_PFN_SET_COLOR_TRANSFORM pfn_set_color_transform;
+    HWC2_PFN_SET_CURSOR_POSITION pfn_set_cursor_position;
+    HWC2_PFN_SET_LAYER_BLEND_MODE pfn_set_layer_blend_mode;
+    HWC2_PFN_SET_LAYER_BUFFER pfn_set_layer_buffer;
+    HWC2_PFN_SET_LAYER_COLOR pfn_set_layer_color;
+    HWC2_PFN_SET_LAYER_COMPOSITION_TYPE pfn_set_layer_composition_type;
+    HWC2_PFN_SET_LAYER_DATASPACE pfn_set_layer_dataspace;
+    HWC2_PFN_SET_LAYER_DISPLAY_FRAME pfn_set_layer_display_frame;
+    HWC2_PFN_SET_LAYER_PLANE_ALPHA pfn_set_layer_plane_alpha;
+    HWC2_PFN_SET_LAYER_SOURCE_CROP pfn_set_layer_source_crop;
+    HWC2_PFN_SET_LAYER_SURFACE_DAMAGE pfn_set_layer_surface_damage;
+    HWC2_PFN_SET_LAYER_TRANSFORM pfn_set_layer_transform;
+    HWC2_PFN_SET_LAYER_VISIBLE_REGION pfn_set_layer_visible_region;
+    HWC2_PFN_SET_LAYER_Z_ORDER pfn_set_layer_z_order;
+    HWC2_PFN_SET_POWER_MODE pfn_set_power_mode;
+    HWC2_PFN_SET_VSYNC_ENABLED pfn_set_vsync_enabled;
+    HWC2_PFN_VALIDATE_DISPLAY pfn_validate_display;
+    HWC2_VENDOR_PFN_GET_PREDICTED_PRESENT_TIMES
+            pfn_get_predicted_present_times;
+    HWC2_VENDOR_PFN_SET_LAYER_COMMANDS pfn_set_layer_commands;
+};
+
+enum hwc2_test_scene_type {
+    /* Translucent rgb layers cascading over an opaque background */
+    HWC2_TEST_SCENE_RGB,
+    /* Every other layer is an opaque nv12 video layer */
+    HWC2_TEST_SCENE_YUV_MIX,
+    /* The layers cycle through the rotations and flips */
+    HWC2_TEST_SCENE_ROTATED,
+    /* The layers upscale buffers of half their size */
+    HWC2_TEST_SCENE_SCALED,
+    /* Every layer covers the whole display */
+    HWC2_TEST_SCENE_OVERLAPPING,
+};
+
+const char *hwc2_test_get_scene_name(hwc2_test_scene_type type);
+
+/* What one frame cost. allocs counts the heap allocations of every thread
+ * while the frame was set up, validated and presented */
+struct hwc2_test_frame_times {
+    nsecs_t validate;
+    nsecs_t present;
+    uint64_t allocs;
+};
+
+/* A stack of layers on one display that is fed new buffers every frame, as
+ * a BufferQueue consumer would. Layers and buffers are created up front so
+ * that frames do not allocate by themselves */
+class hwc2_test_scene {
+public:
+    hwc2_test_scene(hwc2_test_device &device, hwc2_display_t display,
+            int32_t width, int32_t height);
+    ~hwc2_test_scene();
+
+    size_t add_layer(int32_t format, uint32_t layout, const hwc_rect_t &frame,
+            const hwc_frect_t &crop, hwc_transform_t transform,
+            hwc2_blend_mode_t blend, size_t buffer_cnt);
+    void generate(hwc2_test_scene_type type, size_t layer_cnt);
+
+    /* A moving layer changes the composition plan every frame */
+    void set_moving_layer(size_t idx) { moving_layer = idx; }
+
+    /* Whether frame waits for its present fence, so that the post worker
+     * has posted the frame when it returns. On by default */
+    void set_wait_present(bool wait) { wait_present = wait; }
+
+    hwc2_layer_t get_layer(size_t idx) const { return layers[idx].id; }
+    buffer_handle_t get_buffer(size_t idx, size_t buf_idx) const
+            { return layers[idx].buffers[buf_idx]; }
+    size_t get_layer_count() const { return layers.size(); }
+    uint64_t get_frame_count() const { return frame_cnt; }
+
+    /* Sets new buffers, validates, accepts the changes, presents and
+     * closes the fences it gets back. The present time does not include
+     * waiting for the present fence. If out_present_fence is set, the
+     * present fence is returned there instead of waited for and closed */
+    int32_t frame(hwc2_test_frame_times *out_times,
+            int32_t *out_present_fence = nullptr);
+
+private:
+    struct hwc2_test_layer {
+        hwc2_layer_t id;
+        hwc_rect_t frame;
+        hwc2_composition_t comp_type;
+        std::vector<buffer_handle_t> buffers;
+    };
+
+    hwc2_test_device &device;
+    hwc2_display_t display;
+    int32_t width;
+    int32_t height;
+
+    std::vector<hwc2_test_layer> layers;
+    std::array<buffer_handle_t, 3> client_targets;
+    size_t moving_layer;
+    bool wait_present;
+    uint64_t frame_cnt;
+
+    /* Room for what validate and present return */
+    std::vector<hwc2_layer_t> out_layers;
+    std::vector<int32_t> out_values;
+};
+
+#endif /* ifndef _HWC2_TEST_DEVICE_H */
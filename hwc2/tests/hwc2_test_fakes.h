@@ -0,0 +1,115 @@
+/*
+ * Copyright (C) 2016 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _HWC2_TEST_FAKES_H
+#define _HWC2_TEST_FAKES_H
+
+#include <hardware/hwcomposer2.h>
+#include <adf/adf.h>
+#include <utils/Timers.h>
+
+#include <vector>
+#include <string>
+
+/* The host build replaces libadf, libadfhwc, libsync, the system properties
+ * and the NVIDIA gralloc with the fakes declared here. Tests configure them
+ * before opening the hwc2 device */
+
+/* Pixel formats only the NVIDIA gralloc knows */
+#define HWC2_FAKE_FORMAT_YUV420   0x100
+#define HWC2_FAKE_FORMAT_NV12     0x106
+
+/* Surface layouts as stored by the NVIDIA gralloc */
+#define HWC2_FAKE_LAYOUT_PITCH         1
+#define HWC2_FAKE_LAYOUT_BLOCK_LINEAR  3
+
+struct hwc2_fake_config {
+    int32_t width;
+    int32_t height;
+    int32_t vsync_period;
+    int32_t dpi_x;
+    int32_t dpi_y;
+};
+
+struct hwc2_fake_display {
+    bool connected;
+
+    /* Reported as tegra_adf_capabilities::caps */
+    uint32_t caps;
+
+    std::vector<hwc2_fake_config> configs;
+};
+
+/* What the fake kernel received in an adf_device_post_v2 */
+struct hwc2_fake_post {
+    std::vector<struct adf_buffer_config> bufs;
+    std::vector<uint8_t> custom_data;
+    nsecs_t time;
+};
+
+/* Replaces the adf devices. Must be called before the hwc2 device is
+ * opened */
+void hwc2_fake_adf_reset(const std::vector<hwc2_fake_display> &displays);
+
+/* Makes every post to a device sleep for delay before it returns, as a slow
+ * flip ioctl would, or fail with -err */
+void hwc2_fake_adf_set_post_delay(size_t dev_idx, nsecs_t delay);
+void hwc2_fake_adf_set_post_error(size_t dev_idx, int err);
+
+uint64_t hwc2_fake_adf_get_post_count(size_t dev_idx);
+bool hwc2_fake_adf_get_last_post(size_t dev_idx, hwc2_fake_post *out_post);
+
+/* Posts that referenced a closed buffer or fence fd. The kernel would have
+ * rejected them or, worse, scanned out whatever reused the fd */
+uint64_t hwc2_fake_adf_get_bad_fd_count();
+
+/* Delivers a hardware vsync, a hotplug or a bandwidth renegotiation through
+ * the adf helper callbacks */
+void hwc2_fake_adf_vsync(size_t dev_idx, int64_t timestamp);
+void hwc2_fake_adf_renegotiate_bandwidth(size_t dev_idx, uint32_t avail_bw);
+bool hwc2_fake_adf_get_vsync_enabled(size_t dev_idx);
+
+/* Fences are eventfds that are signaled once their count is non zero */
+int hwc2_fake_fence_create(bool signaled);
+void hwc2_fake_fence_signal(int fence);
+bool hwc2_fake_fence_is_signaled(int fence);
+
+/* Fake NVIDIA gralloc buffers. The pixels of surface 0 can be reached
+ * through gralloc_module_t::lock */
+buffer_handle_t hwc2_fake_gralloc_alloc(int32_t width, int32_t height,
+        int32_t format, uint32_t layout);
+void hwc2_fake_gralloc_free(buffer_handle_t handle);
+
+/* Frees a buffer and allocates another one in its native handle, as gralloc
+ * does when a freed handle address is reused */
+void hwc2_fake_gralloc_realloc(buffer_handle_t handle, int32_t width,
+        int32_t height, int32_t format, uint32_t layout);
+
+uint32_t hwc2_fake_gralloc_get_hmem(buffer_handle_t handle);
+
+/* Exported dma-buf fds: how many NvRmMemDmaBufFdFromHandle created, how many
+ * of them are still open and whether one of an hmem is */
+uint64_t hwc2_fake_gralloc_get_dma_buf_exports();
+size_t hwc2_fake_gralloc_get_open_dma_bufs();
+bool hwc2_fake_gralloc_is_dma_buf_open(uint32_t hmem);
+
+void hwc2_fake_property_set(const std::string &key, const std::string &value);
+void hwc2_fake_property_clear();
+
+/* Counts operator new calls on every thread */
+uint64_t hwc2_test_get_alloc_count();
+
+#endif /* ifndef _HWC2_TEST_FAKES_H */
@@ -0,0 +1,883 @@
+/*
+ * Copyright (C) 2016 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <fcntl.h>
+#include <sync/sync.h>
+#include <unistd.h>
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <iomanip>
+#include <sstream>
+
+#include "hwc2_test_replay.h"
+
+/* Displays the fake adf devices can stand in for */
+#define HWC2_TEST_REPLAY_MAX_DISPLAYS   2
+
+/* A record with more data words than this is taken for a corrupt file */
+#define HWC2_TEST_REPLAY_MAX_DATA       (1 << 20)
+
+static float get_float(uint64_t arg)
+{
+    uint32_t bits = arg;
+    float value;
+    memcpy(&value, &bits, sizeof(value));
+    return value;
+}
+
+static int32_t get_high(uint64_t arg)
+{
+    return static_cast<int32_t>(arg >> 32);
+}
+
+static int32_t get_low(uint64_t arg)
+{
+    return static_cast<int32_t>(arg);
+}
+
+/* The rects traced by hwc2_trace_call::add_rects, from data word first */
+static std::vector<hwc_rect_t> get_rects(const std::vector<uint64_t> &data,
+        size_t first)
+{
+    std::vector<hwc_rect_t> rects;
+    for (size_t idx = first; idx + 1 < data.size(); idx += 2)
+        rects.push_back({get_high(data[idx]), get_low(data[idx]),
+                get_high(data[idx + 1]), get_low(data[idx + 1])});
+    return rects;
+}
+
+/* The command words traced by set_layer_commands, or none if they were not
+ * all traced */
+static std::vector<uint32_t> get_commands(const hwc2_trace_record &rec,
+        const std::vector<uint64_t> &data)
+{
+    std::vector<uint32_t> commands;
+    if (rec.arg_cnt < 1 || data.size() < (rec.args[0] + 1) / 2)
+        return commands;
+
+    for (size_t idx = 0; idx < rec.args[0]; idx++)
+        commands.push_back((idx % 2)? get_high(data[idx / 2]):
+                get_low(data[idx / 2]));
+    return commands;
+}
+
+/* Calls fn with every command the device looks at, which includes the ones
+ * after a malformed command that are only scanned for fences */
+template <typename F>
+static void for_each_command(std::vector<uint32_t> &commands, F fn)
+{
+    size_t offset = 0;
+    while (offset < commands.size()) {
+        uint32_t command = commands[offset] >> 16;
+        uint32_t length = commands[offset] & 0xffff;
+        if (length > commands.size() - offset - 1)
+            return;
+
+        fn(command, length, &commands[offset + 1]);
+        offset += length + 1;
+    }
+}
+
+static uint64_t get_command_u64(const uint32_t *args)
+{
+    return static_cast<uint64_t>(args[1]) << 32 | args[0];
+}
+
+/* Times one call into the device */
+template <typename F>
+static int32_t timed(nsecs_t *out_time, F call)
+{
+    nsecs_t start = systemTime(SYSTEM_TIME_MONOTONIC);
+    int32_t ret = call();
+    *out_time = systemTime(SYSTEM_TIME_MONOTONIC) - start;
+    return ret;
+}
+
+hwc2_test_replay::hwc2_test_replay()
+    : records(),
+      records_data(),
+      display_cnt(1),
+      virtual_displays(),
+      buffer_infos(),
+      buffers(),
+      layers(),
+      stats(),
+      unknown_events(),
+      skipped_cnt(0),
+      lazy_layer_cnt(0) { }
+
+hwc2_test_replay::~hwc2_test_replay()
+{
+    free_buffers();
+}
+
+bool hwc2_test_replay::load(const std::string &path, std::string *out_error)
+{
+    int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        *out_error = path + ": " + strerror(errno);
+        return false;
+    }
+
+    struct hwc2_trace_header header;
+    bool ret = read(fd, &header, sizeof(header)) == sizeof(header);
+
+    if (!ret) {
+        *out_error = path + ": truncated header";
+    } else if (header.magic != HWC2_TRACE_MAGIC) {
+        *out_error = path + ": not an hwc2 trace";
+        ret = false;
+    } else if (header.version != HWC2_TRACE_VERSION
+            || header.record_size != sizeof(hwc2_trace_record)) {
+        *out_error = path + ": trace version " + std::to_string(header.version)
+                + " with " + std::to_string(header.record_size)
+                + " byte records is not supported";
+        ret = false;
+    }
+
+    records.clear();
+    records_data.clear();
+    for (uint32_t idx = 0; ret && idx < header.record_cnt; idx++) {
+        hwc2_trace_record rec;
+        ret = read(fd, &rec, sizeof(rec)) == sizeof(rec)
+                && rec.data_cnt <= HWC2_TEST_REPLAY_MAX_DATA;
+
+        std::vector<uint64_t> data(ret? rec.data_cnt: 0);
+        ssize_t size = data.size() * sizeof(data[0]);
+        ret = ret && read(fd, data.data(), size) == size;
+        if (!ret) {
+            *out_error = path + ": truncated records";
+            records.clear();
+            records_data.clear();
+            break;
+        }
+
+        records.push_back(rec);
+        records_data.push_back(std::move(data));
+    }
+
+    close(fd);
+    if (!ret)
+        return false;
+
+    /* Only virtual displays get output buffers. The physical displays are
+     * the adf devices, numbered from 0 */
+    virtual_displays.clear();
+    for (auto &rec: records)
+        if (rec.event == HWC2_FUNCTION_SET_OUTPUT_BUFFER)
+            virtual_displays.insert(rec.display);
+
+    display_cnt = 1;
+    for (auto &rec: records)
+        if (!hwc2_trace_is_callback(rec.event)
+                && !virtual_displays.count(rec.display)
+                && rec.display < HWC2_TEST_REPLAY_MAX_DISPLAYS)
+            display_cnt = std::max<size_t>(display_cnt, rec.display + 1);
+
+    /* A buffer has to hold every crop of every layer it was set on, while
+     * it was set on it */
+    std::map<layer_key, uint64_t> layer_buffers;
+    std::map<layer_key, std::pair<int32_t, int32_t>> layer_crops;
+
+    auto grow = [this] (uint64_t handle, std::pair<int32_t, int32_t> size) {
+        auto &info = buffer_infos[handle];
+        info.width = std::max(info.width, size.first);
+        info.height = std::max(info.height, size.second);
+    };
+
+    /* The layout is traced as an HWC2_WINDOW_CAP layout bit. Buffers of an
+     * unknown format, such as the ones only set by layer commands, are
+     * replayed as pitch linear RGBA_8888, and the fake has no tiled layout */
+    auto set_format = [this] (uint64_t handle,
+            const std::vector<uint64_t> &data) {
+        auto &info = buffer_infos[handle];
+        if (data.size() >= 2 && data[0]) {
+            info.format = data[0];
+            info.layout = (data[1] == HWC2_WINDOW_CAP_BLOCK_LINEAR)?
+                    HWC2_FAKE_LAYOUT_BLOCK_LINEAR: HWC2_FAKE_LAYOUT_PITCH;
+        } else if (!info.format) {
+            info.format = HAL_PIXEL_FORMAT_RGBA_8888;
+            info.layout = HWC2_FAKE_LAYOUT_PITCH;
+        }
+    };
+
+    auto set_buffer = [&] (layer_key key, uint64_t handle,
+            const std::vector<uint64_t> &data) {
+        if (!layer_crops.count(key))
+            layer_crops[key] = get_display_size(key.first);
+        layer_buffers[key] = handle;
+        if (handle) {
+            set_format(handle, data);
+            grow(handle, layer_crops[key]);
+        }
+    };
+
+    auto set_crop = [&] (layer_key key, float right, float bottom) {
+        layer_crops[key] = std::make_pair(
+                std::max(1, static_cast<int32_t>(std::ceil(right))),
+                std::max(1, static_cast<int32_t>(std::ceil(bottom))));
+        if (layer_buffers[key])
+            grow(layer_buffers[key], layer_crops[key]);
+    };
+
+    buffer_infos.clear();
+    for (size_t idx = 0; idx < records.size(); idx++) {
+        const hwc2_trace_record &rec = records[idx];
+        const std::vector<uint64_t> &data = records_data[idx];
+        if (!is_replayed(rec))
+            continue;
+
+        layer_key key(rec.display, rec.layer);
+
+        switch (rec.event) {
+        case HWC2_FUNCTION_SET_CLIENT_TARGET:
+            if (rec.args[0]) {
+                set_format(rec.args[0], data);
+                grow(rec.args[0], get_display_size(rec.display));
+            }
+            break;
+
+        case HWC2_FUNCTION_SET_LAYER_BUFFER:
+            set_buffer(key, rec.args[0], data);
+            break;
+
+        case HWC2_FUNCTION_SET_LAYER_SOURCE_CROP:
+            set_crop(key, get_float(rec.args[2]), get_float(rec.args[3]));
+            break;
+
+        case HWC2_VENDOR_FUNCTION_SET_LAYER_COMMANDS: {
+            std::vector<uint32_t> commands = get_commands(rec, data);
+            bool selected = false;
+
+            for_each_command(commands, [&] (uint32_t command,
+                    uint32_t length, uint32_t *args) {
+                if (command == HWC2_LAYER_COMMAND_SELECT_LAYER
+                        && length == 2) {
+                    key.second = get_command_u64(args);
+                    selected = true;
+                } else if (!selected) {
+                    return;
+                } else if (command == HWC2_LAYER_COMMAND_BUFFER
+                        && length == 3) {
+                    set_buffer(key, get_command_u64(args), {});
+                } else if (command == HWC2_LAYER_COMMAND_SOURCE_CROP
+                        && length == 4) {
+                    set_crop(key, get_float(args[2]), get_float(args[3]));
+                }
+            });
+            break;
+        }
+
+        case HWC2_FUNCTION_DESTROY_LAYER:
+            layer_buffers.erase(key);
+            layer_crops.erase(key);
+            break;
+
+        default:
+            break;
+        }
+    }
+
+    return true;
+}
+
+bool hwc2_test_replay::is_replayed(const hwc2_trace_record &rec) const
+{
+    return !hwc2_trace_is_callback(rec.event) && rec.display < display_cnt
+            && !virtual_displays.count(rec.display);
+}
+
+std::pair<int32_t, int32_t> hwc2_test_replay::get_display_size(
+        hwc2_display_t display) const
+{
+    hwc2_fake_config config =
+            hwc2_test_get_displays(display_cnt).at(display).configs[0];
+    return std::make_pair(config.width, config.height);
+}
+
+void hwc2_test_replay::alloc_buffers()
+{
+    for (auto &it: buffer_infos)
+        if (!buffers.count(it.first))
+            buffers[it.first] = hwc2_fake_gralloc_alloc(it.second.width,
+                    it.second.height, it.second.format, it.second.layout);
+}
+
+void hwc2_test_replay::free_buffers()
+{
+    for (auto &it: buffers)
+        hwc2_fake_gralloc_free(it.second);
+    buffers.clear();
+}
+
+uint64_t hwc2_test_replay::get_unknown_count() const
+{
+    uint64_t unknown_cnt = 0;
+    for (auto &it: unknown_events)
+        unknown_cnt += it.second;
+    return unknown_cnt;
+}
+
+uint64_t hwc2_test_replay::get_diverged_count() const
+{
+    uint64_t diverged_cnt = 0;
+    for (auto &it: stats)
+        diverged_cnt += it.second.diverged_cnt;
+    return diverged_cnt;
+}
+
+bool hwc2_test_replay::replay(hwc2_test_device &device, bool paced)
+{
+    alloc_buffers();
+    layers.clear();
+    stats.clear();
+    unknown_events.clear();
+    skipped_cnt = 0;
+    lazy_layer_cnt = 0;
+
+    nsecs_t start = systemTime(SYSTEM_TIME_MONOTONIC);
+
+    for (size_t idx = 0; idx < records.size(); idx++) {
+        const hwc2_trace_record &rec = records[idx];
+        if (!is_replayed(rec)) {
+            skipped_cnt++;
+            continue;
+        }
+
+        if (paced) {
+            nsecs_t delay = start + rec.timestamp - records[0].timestamp
+                    - systemTime(SYSTEM_TIME_MONOTONIC);
+            if (delay > 0)
+                usleep(delay / 1000);
+        }
+
+        nsecs_t time = 0;
+        bool diverged = false;
+        if (!replay_record(device, rec, records_data[idx], &time,
+                &diverged)) {
+            skipped_cnt++;
+            continue;
+        }
+
+        hwc2_test_replay_stats &stat = stats[rec.event];
+        stat.call_cnt++;
+        stat.diverged_cnt += diverged;
+        stat.traced_time += rec.duration;
+        stat.replay_time += time;
+        stat.replay_max = std::max(stat.replay_max, time);
+    }
+
+    return unknown_events.empty();
+}
+
+hwc2_test_replay::replay_layer *hwc2_test_replay::get_layer(
+        hwc2_test_device &device, hwc2_display_t display, hwc2_layer_t layer)
+{
+    layer_key key(display, layer);
+
+    auto it = layers.find(key);
+    if (it != layers.end())
+        return &it->second;
+
+    /* Created before the ring began */
+    hwc2_layer_t lyr_id;
+    if (device.create_layer(display, &lyr_id) != HWC2_ERROR_NONE)
+        return nullptr;
+
+    std::pair<int32_t, int32_t> size = get_display_size(display);
+    lazy_layer_cnt++;
+    return &(layers[key] = {lyr_id, {0, 0, size.first, size.second}});
+}
+
+hwc2_layer_t hwc2_test_replay::get_traced_layer(hwc2_display_t display,
+        hwc2_layer_t lyr_id) const
+{
+    for (auto &it: layers)
+        if (it.first.first == display && it.second.id == lyr_id)
+            return it.first.second;
+    return 0;
+}
+
+/* Replays get_changed_composition_types or get_display_requests. Both
+ * return the layers they report on with one value each, which are compared
+ * with the traced ones layer by layer */
+bool hwc2_test_replay::replay_layer_getter(hwc2_test_device &device,
+        const hwc2_trace_record &rec, const std::vector<uint64_t> &data,
+        nsecs_t *out_time)
+{
+    hwc2_display_t display = rec.display;
+    bool arrays = rec.arg_cnt >= 1 && rec.args[0];
+    bool requests = rec.event == HWC2_FUNCTION_GET_DISPLAY_REQUESTS;
+
+    auto call = [&] (uint32_t *num_elements, hwc2_layer_t *out_layers,
+            int32_t *out_values, int32_t *display_requests) {
+        if (requests)
+            return device.get_display_requests(display, display_requests,
+                    num_elements, out_layers, out_values);
+        return device.get_changed_composition_types(display, num_elements,
+                out_layers, out_values);
+    };
+
+    uint32_t num_elements = 0;
+    int32_t display_requests = 0;
+    std::vector<hwc2_layer_t> out_layers;
+    std::vector<int32_t> out_values;
+
+    /* The count is asked for first, as the client did */
+    if (arrays) {
+        call(&num_elements, nullptr, nullptr, &display_requests);
+        out_layers.resize(num_elements);
+        out_values.resize(num_elements);
+    }
+
+    int32_t ret = timed(out_time, [&] {
+        return call(&num_elements, (arrays)? out_layers.data(): nullptr,
+                (arrays)? out_values.data(): nullptr, &display_requests);
+    });
+
+    if (ret != rec.error)
+        return true;
+    if (ret != HWC2_ERROR_NONE)
+        return false;
+    if (rec.arg_cnt >= 2 && num_elements != rec.args[1])
+        return true;
+    if (requests && rec.arg_cnt >= 3
+            && static_cast<uint64_t>(display_requests) != rec.args[2])
+        return true;
+    if (!arrays)
+        return false;
+
+    std::vector<std::pair<uint64_t, uint64_t>> traced, replayed;
+    for (size_t idx = 0; idx + 1 < data.size(); idx += 2)
+        traced.emplace_back(data[idx], data[idx + 1]);
+    for (uint32_t idx = 0; idx < num_elements; idx++)
+        replayed.emplace_back(get_traced_layer(display, out_layers[idx]),
+                static_cast<uint64_t>(out_values[idx]));
+
+    std::sort(traced.begin(), traced.end());
+    std::sort(replayed.begin(), replayed.end());
+    return traced != replayed;
+}
+
+/* The traced layer ids, buffer handles and fences are only valid on the
+ * traced device, so they are swapped for the replay's own before the
+ * commands are applied */
+bool hwc2_test_replay::replay_layer_commands(hwc2_test_device &device,
+        const hwc2_trace_record &rec, const std::vector<uint64_t> &data,
+        nsecs_t *out_time, bool *out_diverged)
+{
+    std::vector<uint32_t> commands = get_commands(rec, data);
+    if (rec.arg_cnt < 1 || commands.size() != rec.args[0])
+        return false;
+
+    for_each_command(commands, [&] (uint32_t command, uint32_t length,
+            uint32_t *args) {
+        if (command == HWC2_LAYER_COMMAND_SELECT_LAYER && length == 2) {
+            replay_layer *lyr = get_layer(device, rec.display,
+                    get_command_u64(args));
+            if (lyr) {
+                args[0] = static_cast<uint32_t>(lyr->id);
+                args[1] = static_cast<uint32_t>(lyr->id >> 32);
+            }
+        } else if (command == HWC2_LAYER_COMMAND_BUFFER && length == 3) {
+            uint64_t handle = get_command_u64(args);
+            uint64_t buffer = (handle)?
+                    reinterpret_cast<uintptr_t>(buffers[handle]): 0;
+            args[0] = static_cast<uint32_t>(buffer);
+            args[1] = static_cast<uint32_t>(buffer >> 32);
+            if (static_cast<int32_t>(args[2]) >= 0)
+                args[2] = hwc2_fake_fence_create(true);
+        }
+    });
+
+    uint32_t error_offset = 0;
+    int32_t ret = timed(out_time, [&] {
+        return device.set_layer_commands(rec.display, commands.size(),
+                commands.data(), &error_offset);
+    });
+
+    *out_diverged = ret != rec.error || (ret != HWC2_ERROR_NONE
+            && rec.arg_cnt >= 2 && error_offset != rec.args[1]);
+    return true;
+}
+
+void hwc2_test_replay::release_fences(hwc2_test_device &device,
+        hwc2_display_t display)
+{
+    uint32_t num_elements = 0;
+    if (device.get_release_fences(display, &num_elements, nullptr, nullptr)
+            != HWC2_ERROR_NONE || num_elements == 0)
+        return;
+
+    std::vector<hwc2_layer_t> out_layers(num_elements);
+    std::vector<int32_t> out_fences(num_elements);
+    if (device.get_release_fences(display, &num_elements, out_layers.data(),
+            out_fences.data()) != HWC2_ERROR_NONE)
+        return;
+
+    for (uint32_t idx = 0; idx < num_elements; idx++)
+        if (out_fences[idx] >= 0)
+            close(out_fences[idx]);
+}
+
+bool hwc2_test_replay::replay_record(hwc2_test_device &device,
+        const hwc2_trace_record &rec, const std::vector<uint64_t> &data,
+        nsecs_t *out_time, bool *out_diverged)
+{
+    hwc2_display_t display = rec.display;
+    const std::array<uint64_t, HWC2_TRACE_ARG_COUNT> &args = rec.args;
+    int32_t ret;
+
+    /* Display functions */
+    switch (rec.event) {
+    case HWC2_FUNCTION_ACCEPT_DISPLAY_CHANGES:
+        ret = timed(out_time, [&] {
+            return device.accept_display_changes(display);
+        });
+        *out_diverged = ret != rec.error;
+        return true;
+
+    case HWC2_FUNCTION_CREATE_LAYER: {
+        hwc2_layer_t lyr_id;
+        ret = timed(out_time, [&] {
+            return device.create_layer(display, &lyr_id);
+        });
+        *out_diverged = ret != rec.error;
+
+        if (ret != HWC2_ERROR_NONE)
+            return true;
+        if (rec.error != HWC2_ERROR_NONE || rec.arg_cnt < 1) {
+            device.destroy_layer(display, lyr_id);
+            return true;
+        }
+
+        std::pair<int32_t, int32_t> size = get_display_size(display);
+        layers[layer_key(display, args[0])] = {lyr_id,
+                {0, 0, size.first, size.second}};
+        return true;
+    }
+
+    case HWC2_FUNCTION_DESTROY_LAYER: {
+        auto it = layers.find(layer_key(display, rec.layer));
+        if (it == layers.end())
+            return false;
+
+        ret = timed(out_time, [&] {
+            return device.destroy_layer(display, it->second.id);
+        });
+        *out_diverged = ret != rec.error;
+        layers.erase(it);
+        return true;
+    }
+
+    case HWC2_FUNCTION_GET_CHANGED_COMPOSITION_TYPES:
+    case HWC2_FUNCTION_GET_DISPLAY_REQUESTS:
+        *out_diverged = replay_layer_getter(device, rec, data, out_time);
+        return true;
+
+    case HWC2_VENDOR_FUNCTION_SET_LAYER_COMMANDS:
+        return replay_layer_commands(device, rec, data, out_time,
+                out_diverged);
+
+    case HWC2_VENDOR_FUNCTION_GET_PREDICTED_PRESENT_TIMES: {
+        bool arrays = rec.arg_cnt >= 1 && args[0];
+        uint32_t count = (rec.arg_cnt >= 2)? args[1]: 0;
+        std::vector<int64_t> times(count);
+        ret = timed(out_time, [&] {
+            return device.get_predicted_present_times(display, &count,
+                    (arrays)? times.data(): nullptr);
+        });
+        *out_diverged = ret != rec.error;
+        return true;
+    }
+
+    case HWC2_FUNCTION_PRESENT_DISPLAY: {
+        int32_t present_fence = -1;
+        ret = timed(out_time, [&] {
+            return device.present_display(display, &present_fence);
+        });
+        *out_diverged = ret != rec.error;
+
+        /* Replayed posts reach the fake kernel in order, as traced */
+        if (present_fence >= 0) {
+            sync_wait(present_fence, -1);
+            close(present_fence);
+        }
+        if (ret == HWC2_ERROR_NONE)
+            release_fences(device, display);
+        return true;
+    }
+
+    case HWC2_FUNCTION_SET_ACTIVE_CONFIG:
+        ret = timed(out_time, [&] {
+            return device.set_active_config(display, args[0]);
+        });
+        *out_diverged = ret != rec.error;
+        return true;
+
+    case HWC2_FUNCTION_SET_CLIENT_TARGET: {
+        buffer_handle_t target = args[0]? buffers[args[0]]: nullptr;
+        int32_t acquire_fence = args[1]? hwc2_fake_fence_create(true): -1;
+
+        /* The format and layout come before the damage rects */
+        std::vector<hwc_rect_t> rects = get_rects(data, 2);
+        hwc_region_t damage = {rects.size(), rects.data()};
+
+        ret = timed(out_time, [&] {
+            return device.set_client_target(display, target, acquire_fence,
+                    damage, static_cast<android_dataspace_t>(args[2]));
+        });
+        *out_diverged = ret != rec.error;
+        return true;
+    }
+
+    case HWC2_FUNCTION_SET_COLOR_MODE:
+        ret = timed(out_time, [&] {
+            return device.set_color_mode(display,
+                    static_cast<android_color_mode_t>(args[0]));
+        });
+        *out_diverged = ret != rec.error;
+        return true;
+
+    case HWC2_FUNCTION_SET_COLOR_TRANSFORM: {
+        float matrix[16] = {1, 0, 0, 0, 0, 1, 0, 0, 0, 0, 1, 0, 0, 0, 0, 1};
+        for (size_t idx = 0; idx < data.size() && idx < 16; idx++)
+            matrix[idx] = get_float(data[idx]);
+        bool null_matrix = rec.arg_cnt >= 2 && !args[1];
+        ret = timed(out_time, [&] {
+            return device.set_color_transform(display,
+                    (null_matrix)? nullptr: matrix,
+                    static_cast<android_color_transform_t>(args[0]));
+        });
+        *out_diverged = ret != rec.error;
+        return true;
+    }
+
+    case HWC2_FUNCTION_SET_POWER_MODE:
+        ret = timed(out_time, [&] {
+            return device.set_power_mode(display,
+                    static_cast<hwc2_power_mode_t>(args[0]));
+        });
+        *out_diverged = ret != rec.error;
+        return true;
+
+    case HWC2_FUNCTION_SET_VSYNC_ENABLED:
+        ret = timed(out_time, [&] {
+            return device.set_vsync_enabled(display,
+                    static_cast<hwc2_vsync_t>(args[0]));
+        });
+        *out_diverged = ret != rec.error;
+        return true;
+
+    case HWC2_FUNCTION_VALIDATE_DISPLAY: {
+        uint32_t num_types = 0, num_requests = 0;
+        ret = timed(out_time, [&] {
+            return device.validate_display(display, &num_types,
+                    &num_requests);
+        });
+        *out_diverged = ret != rec.error;
+
+        if (!*out_diverged && rec.arg_cnt >= 2
+                && (ret == HWC2_ERROR_NONE || ret == HWC2_ERROR_HAS_CHANGES))
+            *out_diverged = num_types != args[0]
+                    || num_requests != args[1];
+        return true;
+    }
+
+    default:
+        break;
+    }
+
+    /* Layer functions */
+    replay_layer *lyr;
+    switch (rec.event) {
+    case HWC2_FUNCTION_SET_CURSOR_POSITION:
+    case HWC2_FUNCTION_SET_LAYER_BLEND_MODE:
+    case HWC2_FUNCTION_SET_LAYER_BUFFER:
+    case HWC2_FUNCTION_SET_LAYER_COLOR:
+    case HWC2_FUNCTION_SET_LAYER_COMPOSITION_TYPE:
+    case HWC2_FUNCTION_SET_LAYER_DATASPACE:
+    case HWC2_FUNCTION_SET_LAYER_DISPLAY_FRAME:
+    case HWC2_FUNCTION_SET_LAYER_PLANE_ALPHA:
+    case HWC2_FUNCTION_SET_LAYER_SOURCE_CROP:
+    case HWC2_FUNCTION_SET_LAYER_SURFACE_DAMAGE:
+    case HWC2_FUNCTION_SET_LAYER_TRANSFORM:
+    case HWC2_FUNCTION_SET_LAYER_VISIBLE_REGION:
+    case HWC2_FUNCTION_SET_LAYER_Z_ORDER:
+        lyr = get_layer(device, display, rec.layer);
+        if (!lyr || rec.arg_cnt < 1)
+            return false;
+        break;
+
+    default:
+        unknown_events[rec.event]++;
+        return false;
+    }
+
+    hwc2_layer_t lyr_id = lyr->id;
+
+    switch (rec.event) {
+    case HWC2_FUNCTION_SET_CURSOR_POSITION:
+        ret = timed(out_time, [&] {
+            return device.set_cursor_position(display, lyr_id,
+                    get_high(args[0]), get_low(args[0]));
+        });
+        break;
+
+    case HWC2_FUNCTION_SET_LAYER_BLEND_MODE:
+        ret = timed(out_time, [&] {
+            return device.set_layer_blend_mode(display, lyr_id,
+                    static_cast<hwc2_blend_mode_t>(args[0]));
+        });
+        break;
+
+    case HWC2_FUNCTION_SET_LAYER_BUFFER: {
+        buffer_handle_t buffer = args[0]? buffers[args[0]]: nullptr;
+        int32_t acquire_fence = args[1]? hwc2_fake_fence_create(true): -1;
+        ret = timed(out_time, [&] {
+            return device.set_layer_buffer(display, lyr_id, buffer,
+                    acquire_fence);
+        });
+        break;
+    }
+
+    case HWC2_FUNCTION_SET_LAYER_COLOR: {
+        hwc_color_t color = {static_cast<uint8_t>(args[0] >> 24),
+                static_cast<uint8_t>(args[0] >> 16),
+                static_cast<uint8_t>(args[0] >> 8),
+                static_cast<uint8_t>(args[0])};
+        ret = timed(out_time, [&] {
+            return device.set_layer_color(display, lyr_id, color);
+        });
+        break;
+    }
+
+    case HWC2_FUNCTION_SET_LAYER_COMPOSITION_TYPE:
+        ret = timed(out_time, [&] {
+            return device.set_layer_composition_type(display, lyr_id,
+                    static_cast<hwc2_composition_t>(args[0]));
+        });
+        break;
+
+    case HWC2_FUNCTION_SET_LAYER_DATASPACE:
+        ret = timed(out_time, [&] {
+            return device.set_layer_dataspace(display, lyr_id,
+                    static_cast<android_dataspace_t>(args[0]));
+        });
+        break;
+
+    case HWC2_FUNCTION_SET_LAYER_DISPLAY_FRAME:
+        if (rec.arg_cnt < 2)
+            return false;
+        lyr->frame = {get_high(args[0]), get_low(args[0]), get_high(args[1]),
+                get_low(args[1])};
+        ret = timed(out_time, [&] {
+            return device.set_layer_display_frame(display, lyr_id,
+                    lyr->frame);
+        });
+        break;
+
+    case HWC2_FUNCTION_SET_LAYER_PLANE_ALPHA:
+        ret = timed(out_time, [&] {
+            return device.set_layer_plane_alpha(display, lyr_id,
+                    get_float(args[0]));
+        });
+        break;
+
+    case HWC2_FUNCTION_SET_LAYER_SOURCE_CROP: {
+        if (rec.arg_cnt < 4)
+            return false;
+        hwc_frect_t crop = {get_float(args[0]), get_float(args[1]),
+                get_float(args[2]), get_float(args[3])};
+        ret = timed(out_time, [&] {
+            return device.set_layer_source_crop(display, lyr_id, crop);
+        });
+        break;
+    }
+
+    case HWC2_FUNCTION_SET_LAYER_SURFACE_DAMAGE:
+    case HWC2_FUNCTION_SET_LAYER_VISIBLE_REGION: {
+        std::vector<hwc_rect_t> rects = get_rects(data, 0);
+        hwc_region_t region = {rects.size(), rects.data()};
+        ret = timed(out_time, [&] {
+            if (rec.event == HWC2_FUNCTION_SET_LAYER_SURFACE_DAMAGE)
+                return device.set_layer_surface_damage(display, lyr_id,
+                        region);
+            return device.set_layer_visible_region(display, lyr_id, region);
+        });
+        break;
+    }
+
+    case HWC2_FUNCTION_SET_LAYER_TRANSFORM:
+        ret = timed(out_time, [&] {
+            return device.set_layer_transform(display, lyr_id,
+                    static_cast<hwc_transform_t>(args[0]));
+        });
+        break;
+
+    case HWC2_FUNCTION_SET_LAYER_Z_ORDER:
+        ret = timed(out_time, [&] {
+            return device.set_layer_z_order(display, lyr_id, args[0]);
+        });
+        break;
+
+    default:
+        return false;
+    }
+
+    *out_diverged = ret != rec.error;
+    return true;
+}
+
+std::string hwc2_test_replay::dump() const
+{
+    std::stringstream dmp;
+
+    uint64_t call_cnt = 0;
+    for (auto &it: stats)
+        call_cnt += it.second.call_cnt;
+
+    dmp << "Replayed " << call_cnt << " of " << records.size()
+            << " records on " << display_cnt << " display(s), "
+            << get_diverged_count() << " diverged, " << lazy_layer_cnt
+            << " layers created on first use\n";
+
+    for (auto &it: unknown_events)
+        dmp << "  unknown event 0x" << std::hex << it.first << std::dec
+                << ": " << it.second << " records not replayed\n";
+
+    dmp << std::left << std::setw(36) << "  function" << std::right
+            << std::setw(8) << "calls" << std::setw(10) << "diverged"
+            << std::setw(12) << "traced us" << std::setw(12) << "replay us"
+            << std::setw(10) << "max us" << "\n";
+
+    dmp << std::fixed << std::setprecision(1);
+
+    for (auto &it: stats) {
+        const hwc2_test_replay_stats &stat = it.second;
+
+        dmp << "  " << std::left << std::setw(34)
+                << hwc2_trace_get_event_name(it.first)
+                << std::right << std::setw(8) << stat.call_cnt
+                << std::setw(10) << stat.diverged_cnt
+                << std::setw(12) << stat.traced_time / 1000.0 / stat.call_cnt
+                << std::setw(12) << stat.replay_time / 1000.0 / stat.call_cnt
+                << std::setw(10) << stat.replay_max / 1000.0 << "\n";
+    }
+
+    return dmp.str();
+}
@@ -0,0 +1,137 @@
+/*
+ * Copyright (C) 2016 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _HWC2_TEST_REPLAY_H
+#define _HWC2_TEST_REPLAY_H
+
+#include <map>
+#include <set>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "hwc2_test_device.h"
+
+/* How the replayed calls of one function compared with the traced ones */
+struct hwc2_test_replay_stats {
+    uint64_t call_cnt;
+
+    /* Calls that returned another error, validations that returned other
+     * counts, and getters that returned another type or request for any
+     * layer */
+    uint64_t diverged_cnt;
+
+    nsecs_t traced_time;
+    nsecs_t replay_time;
+    nsecs_t replay_max;
+};
+
+/* Replays a binary trace written by hwc2_trace::dump_file against the fake
+ * adf devices.
+ *
+ * The trace does not keep buffer contents or sizes, so the replay fills in
+ * the rest: buffers are fake allocations of the traced format and layout,
+ * as large as every source crop they were shown with, and fences are
+ * signaled. Layers created before the ring begins are created on first
+ * use. Layer commands are replayed with their layers, buffers and fences
+ * swapped for the replay's own. Virtual displays, recognized by their output
+ * buffers, and callbacks are skipped. Predicted present times depend on the
+ * vsyncs, which are not replayed, so only their errors are compared */
+class hwc2_test_replay {
+public:
+    hwc2_test_replay();
+    ~hwc2_test_replay();
+
+    /* Fails on a trace of another version or architecture */
+    bool load(const std::string &path, std::string *out_error);
+
+    /* The physical displays the trace used. The fake adf devices must be
+     * reset with at least this many before the device is opened */
+    size_t get_display_count() const { return display_cnt; }
+
+    /* Replays every record. A paced replay sleeps to keep the traced time
+     * between calls. Returns false if the trace holds events the replay does
+     * not know, which are listed by dump */
+    bool replay(hwc2_test_device &device, bool paced);
+
+    const std::map<int32_t, hwc2_test_replay_stats> &get_stats() const
+            { return stats; }
+    uint64_t get_diverged_count() const;
+    uint64_t get_skipped_count() const { return skipped_cnt; }
+    uint64_t get_lazy_layer_count() const { return lazy_layer_cnt; }
+    uint64_t get_unknown_count() const;
+
+    std::string dump() const;
+
+private:
+    typedef std::pair<hwc2_display_t, hwc2_layer_t> layer_key;
+
+    struct replay_layer {
+        hwc2_layer_t id;
+        hwc_rect_t frame;
+    };
+
+    struct replay_buffer {
+        int32_t width;
+        int32_t height;
+        int32_t format;
+        uint32_t layout;
+    };
+
+    void alloc_buffers();
+    void free_buffers();
+
+    bool is_replayed(const hwc2_trace_record &rec) const;
+    std::pair<int32_t, int32_t> get_display_size(hwc2_display_t display) const;
+
+    /* Returns false for records that cannot be replayed */
+    bool replay_record(hwc2_test_device &device,
+            const hwc2_trace_record &rec, const std::vector<uint64_t> &data,
+            nsecs_t *out_time, bool *out_diverged);
+    bool replay_layer_getter(hwc2_test_device &device,
+            const hwc2_trace_record &rec, const std::vector<uint64_t> &data,
+            nsecs_t *out_time);
+    bool replay_layer_commands(hwc2_test_device &device,
+            const hwc2_trace_record &rec, const std::vector<uint64_t> &data,
+            nsecs_t *out_time, bool *out_diverged);
+    replay_layer *get_layer(hwc2_test_device &device, hwc2_display_t display,
+            hwc2_layer_t layer);
+    hwc2_layer_t get_traced_layer(hwc2_display_t display,
+            hwc2_layer_t lyr_id) const;
+    void release_fences(hwc2_test_device &device, hwc2_display_t display);
+
+    /* The records and the data words that followed each of them */
+    std::vector<hwc2_trace_record> records;
+    std::vector<std::vector<uint64_t>> records_data;
+    size_t display_cnt;
+    std::set<hwc2_display_t> virtual_displays;
+
+    /* Traced buffer handles, their format and the largest size they were
+     * cropped to */
+    std::map<uint64_t, replay_buffer> buffer_infos;
+    std::map<uint64_t, buffer_handle_t> buffers;
+
+    std::map<layer_key, replay_layer> layers;
+
+    std::map<int32_t, hwc2_test_replay_stats> stats;
+
+    /* Records of events the replay does not know, by event */
+    std::map<int32_t, uint64_t> unknown_events;
+    uint64_t skipped_cnt;
+    uint64_t lazy_layer_cnt;
+};
+
+#endif /* ifndef _HWC2_TEST_REPLAY_H */
@@ -0,0 +1,137 @@
+/*
+ * Copyright (C) 2016 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <gtest/gtest.h>
+
+#include "hwc2.h"
+
+#define HWC2_VSYNC_TEST_PERIOD   16666667
+#define HWC2_VSYNC_TEST_START    1000000000
+
+/* Jitter in ns added to consecutive samples, well within the lock error */
+static const int64_t jitter[] = {40000, -75000, 10000, 90000, -30000, -60000};
+
+class hwc2_vsync_model_test: public testing::Test {
+protected:
+    void SetUp() override
+    {
+        model.reset(HWC2_VSYNC_TEST_PERIOD);
+        model.set_enabled(true);
+        newest = 0;
+    }
+
+    /* Adds the hardware vsyncs n, n + 1, ... of a display running at
+     * period, each moved by the jitter pattern if jittered */
+    void add_samples(int64_t n, size_t cnt, nsecs_t period, bool jittered)
+    {
+        for (size_t idx = 0; idx < cnt; idx++) {
+            newest = HWC2_VSYNC_TEST_START + (n + idx) * period;
+            if (jittered)
+                newest += jitter[(n + idx) % (sizeof(jitter)
+                        / sizeof(*jitter))];
+            model.add_sample(newest);
+        }
+    }
+
+    bool is_locked() const
+    {
+        return !model.needs_hw_vsync(newest);
+    }
+
+    /* The predicted period, from two consecutive predictions */
+    nsecs_t get_period() const
+    {
+        int64_t times[2];
+        EXPECT_EQ(model.predict(newest, 2, times), 2u);
+        return times[1] - times[0];
+    }
+
+    hwc2_vsync_model model;
+    nsecs_t newest;
+};
+
+TEST_F(hwc2_vsync_model_test, locks_on_jittered_samples)
+{
+    add_samples(0, HWC2_VSYNC_MIN_SAMPLES - 1, HWC2_VSYNC_TEST_PERIOD, true);
+    EXPECT_FALSE(is_locked());
+
+    add_samples(HWC2_VSYNC_MIN_SAMPLES - 1, 1, HWC2_VSYNC_TEST_PERIOD, true);
+    EXPECT_TRUE(is_locked());
+    EXPECT_NEAR(get_period(), HWC2_VSYNC_TEST_PERIOD, 20000);
+
+    /* The fit averages the jitter out as samples come in */
+    add_samples(HWC2_VSYNC_MIN_SAMPLES, HWC2_VSYNC_SAMPLES,
+            HWC2_VSYNC_TEST_PERIOD, true);
+    EXPECT_TRUE(is_locked());
+    EXPECT_NEAR(get_period(), HWC2_VSYNC_TEST_PERIOD, 2000);
+    EXPECT_NE(model.dump().find("1 locks, 0 resyncs"), std::string::npos)
+            << model.dump();
+}
+
+/* Missed vsync events leave gaps, which the fit numbers around */
+TEST_F(hwc2_vsync_model_test, missed_vsyncs_keep_the_lock)
+{
+    for (int64_t n = 0; n < 3 * HWC2_VSYNC_MIN_SAMPLES; n += 3)
+        add_samples(n, 1, HWC2_VSYNC_TEST_PERIOD, true);
+
+    EXPECT_TRUE(is_locked());
+    EXPECT_NEAR(get_period(), HWC2_VSYNC_TEST_PERIOD, 20000);
+}
+
+/* A panel a little off its mode's period is followed. One far off it does
+ * not fit at all */
+TEST_F(hwc2_vsync_model_test, fits_the_real_period)
+{
+    nsecs_t period = HWC2_VSYNC_TEST_PERIOD + HWC2_VSYNC_TEST_PERIOD / 100;
+    add_samples(0, HWC2_VSYNC_SAMPLES, period, false);
+    EXPECT_TRUE(is_locked());
+    EXPECT_NEAR(get_period(), period, 1);
+
+    model.reset(HWC2_VSYNC_TEST_PERIOD);
+    add_samples(0, HWC2_VSYNC_SAMPLES, HWC2_VSYNC_TEST_PERIOD * 6 / 5, false);
+    EXPECT_FALSE(is_locked());
+}
+
+/* A sample that jumps away from the fit drops the lock and the samples it
+ * was made from. The model locks again on the new phase */
+TEST_F(hwc2_vsync_model_test, unlocks_when_the_phase_drifts)
+{
+    add_samples(0, HWC2_VSYNC_SAMPLES, HWC2_VSYNC_TEST_PERIOD, true);
+    ASSERT_TRUE(is_locked());
+
+    /* Within the error the lock holds */
+    nsecs_t drift = HWC2_VSYNC_MAX_ERROR / 2;
+    EXPECT_TRUE(model.check_sample(HWC2_VSYNC_TEST_START
+            + HWC2_VSYNC_SAMPLES * HWC2_VSYNC_TEST_PERIOD + drift));
+
+    drift = HWC2_VSYNC_MAX_ERROR * 3;
+    newest = HWC2_VSYNC_TEST_START + HWC2_VSYNC_SAMPLES
+            * HWC2_VSYNC_TEST_PERIOD + drift;
+    model.add_sample(newest);
+    EXPECT_FALSE(is_locked());
+
+    for (int64_t n = HWC2_VSYNC_SAMPLES + 1;
+            n < HWC2_VSYNC_SAMPLES + HWC2_VSYNC_MIN_SAMPLES; n++) {
+        newest = HWC2_VSYNC_TEST_START + n * HWC2_VSYNC_TEST_PERIOD + drift;
+        model.add_sample(newest);
+    }
+    EXPECT_TRUE(is_locked());
+    EXPECT_NE(model.dump().find("2 locks, 1 resyncs"), std::string::npos)
+            << model.dump();
+
+    /* A locked model still checks in with the hardware once in a while */
+    EXPECT_TRUE(model.needs_hw_vsync(newest + HWC2_VSYNC_MAX_AGE + 1));
+}
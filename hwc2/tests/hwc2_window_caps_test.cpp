@@ -0,0 +1,181 @@
+/*
+ * Copyright (C) 2016 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <gtest/gtest.h>
+#include <tegra_adf.h>
+#include <fcntl.h>
+#include <cmath>
+
+#include "hwc2_test_device.h"
+
+/* The fake overlay engines list the first 13 formats of the table, which
+ * include yuv ones */
+#define HWC2_WINDOW_TEST_FORMATS (0x1fff << HWC2_WINDOW_CAP_FORMAT_SHIFT)
+
+static const hwc_transform_t no_transform = static_cast<hwc_transform_t>(0);
+
+class hwc2_window_caps_test: public testing::Test {
+protected:
+    void SetUp() override
+    {
+        hwc2_fake_property_clear();
+        hwc2_fake_adf_reset(hwc2_test_get_displays(1));
+    }
+
+    void TearDown() override
+    {
+        for (auto buffer: buffers)
+            hwc2_fake_gralloc_free(buffer);
+    }
+
+    /* Queries the windows of the panel, with caps as its
+     * tegra_adf_capabilities */
+    void query(uint32_t caps, hwc2_window_caps *out_window_caps)
+    {
+        std::vector<hwc2_fake_display> displays = hwc2_test_get_displays(1);
+        displays[0].caps = caps;
+        hwc2_fake_adf_reset(displays);
+
+        struct adf_device adf_dev;
+        ASSERT_EQ(adf_device_open(0, O_RDWR, &adf_dev), 0);
+        out_window_caps->query(0, &adf_dev);
+        adf_device_close(&adf_dev);
+    }
+
+    /* Sets up lyr to show crop of a new buffer in frame */
+    void set_layer(hwc2_layer &lyr, const hwc_frect_t &crop,
+            const hwc_rect_t &frame, hwc_transform_t transform)
+    {
+        buffer_handle_t buffer = hwc2_fake_gralloc_alloc(
+                std::ceil(crop.right), std::ceil(crop.bottom),
+                HAL_PIXEL_FORMAT_RGBA_8888, HWC2_FAKE_LAYOUT_PITCH);
+        buffers.push_back(buffer);
+
+        EXPECT_EQ(lyr.set_buffer(buffer, -1), HWC2_ERROR_NONE);
+        EXPECT_EQ(lyr.set_source_crop(crop), HWC2_ERROR_NONE);
+        EXPECT_EQ(lyr.set_display_frame(frame), HWC2_ERROR_NONE);
+        EXPECT_EQ(lyr.set_transform(transform), HWC2_ERROR_NONE);
+    }
+
+    std::vector<buffer_handle_t> buffers;
+};
+
+/* Each format in the table has its own bit. Formats outside of it have
+ * none and are left to the driver */
+TEST_F(hwc2_window_caps_test, format_bits)
+{
+    EXPECT_EQ(hwc2_window_caps::get_format_capability(DRM_FORMAT_RGBA8888),
+            1u << HWC2_WINDOW_CAP_FORMAT_SHIFT);
+    EXPECT_EQ(hwc2_window_caps::get_format_capability(DRM_FORMAT_NV12),
+            1u << (HWC2_WINDOW_CAP_FORMAT_SHIFT + 8));
+    EXPECT_EQ(hwc2_window_caps::get_format_capability(
+            TEGRA_ADF_FORMAT_YCbCr422R),
+            1u << (HWC2_WINDOW_CAP_FORMAT_SHIFT + HWC2_WINDOW_FORMAT_COUNT
+            - 1));
+    EXPECT_EQ(hwc2_window_caps::get_format_capability(DRM_FORMAT_ARGB8888),
+            0u);
+}
+
+/* Until the kernel is queried every window is assumed to take every
+ * format */
+TEST_F(hwc2_window_caps_test, assumed_capabilities)
+{
+    hwc2_window_caps window_caps;
+
+    EXPECT_EQ(window_caps.get_capabilities(0), HWC2_WINDOW_CAP_COMMON
+            | HWC2_WINDOW_CAP_ROTATE_PLANAR | HWC2_WINDOW_CAP_FORMATS);
+    EXPECT_EQ(window_caps.get_capabilities(1), HWC2_WINDOW_CAP_COMMON
+            | HWC2_WINDOW_CAP_FORMATS);
+    EXPECT_EQ(window_caps.get_capabilities(3), HWC2_WINDOW_CAP_PITCH
+            | HWC2_WINDOW_CAP_FORMATS);
+    EXPECT_EQ(window_caps.get_layouts(), HWC2_WINDOW_CAP_LAYOUTS);
+    EXPECT_FALSE(window_caps.get_cursor_mode());
+    EXPECT_NE(window_caps.dump().find("formats assumed"), std::string::npos);
+}
+
+/* The windows take the formats their overlay engines list. A window that
+ * lists a yuv format can scan out yuv layers */
+TEST_F(hwc2_window_caps_test, queried_capabilities)
+{
+    hwc2_window_caps window_caps;
+    query(TEGRA_ADF_CAPABILITIES_CURSOR_MODE
+            | TEGRA_ADF_CAPABILITIES_BLOCKLINEAR, &window_caps);
+
+    EXPECT_EQ(window_caps.get_capabilities(0), HWC2_WINDOW_CAP_COMMON
+            | HWC2_WINDOW_CAP_ROTATE_PLANAR | HWC2_WINDOW_TEST_FORMATS);
+    EXPECT_EQ(window_caps.get_capabilities(2), HWC2_WINDOW_CAP_COMMON
+            | HWC2_WINDOW_TEST_FORMATS);
+    EXPECT_EQ(window_caps.get_capabilities(3), HWC2_WINDOW_CAP_PITCH
+            | HWC2_WINDOW_CAP_YUV | HWC2_WINDOW_TEST_FORMATS);
+    EXPECT_EQ(window_caps.get_layouts(), HWC2_WINDOW_CAP_LAYOUTS);
+    EXPECT_TRUE(window_caps.get_cursor_mode());
+    EXPECT_NE(window_caps.dump().find("formats from the kernel"),
+            std::string::npos);
+}
+
+/* Without block linear support no window is left with the layout */
+TEST_F(hwc2_window_caps_test, block_linear_is_dropped)
+{
+    hwc2_window_caps window_caps;
+    query(0, &window_caps);
+
+    for (size_t idx = 0; idx < HWC2_WINDOW_COUNT; idx++)
+        EXPECT_FALSE(window_caps.get_capabilities(idx)
+                & HWC2_WINDOW_CAP_BLOCK_LINEAR);
+    EXPECT_EQ(window_caps.get_layouts(), static_cast<uint32_t>(
+            HWC2_WINDOW_CAP_PITCH | HWC2_WINDOW_CAP_TILED));
+    EXPECT_FALSE(window_caps.get_cursor_mode());
+}
+
+/* A window needs a buffer, a frame of at least 4x4, at most a 2x downscale
+ * and a crop on whole pixels */
+TEST_F(hwc2_window_caps_test, size_limits)
+{
+    hwc2_window_caps window_caps;
+    hwc2_layer lyr(1);
+
+    EXPECT_FALSE(window_caps.is_supported(lyr));
+
+    set_layer(lyr, {0, 0, 4, 4}, {0, 0, 4, 4}, no_transform);
+    EXPECT_TRUE(window_caps.is_supported(lyr));
+    set_layer(lyr, {0, 0, 3, 4}, {0, 0, 3, 4}, no_transform);
+    EXPECT_FALSE(window_caps.is_supported(lyr));
+
+    /* Down to half size */
+    set_layer(lyr, {0, 0, 256, 256}, {0, 0, 128, 128}, no_transform);
+    EXPECT_TRUE(window_caps.is_supported(lyr));
+    set_layer(lyr, {0, 0, 256, 256}, {0, 0, 127, 128}, no_transform);
+    EXPECT_FALSE(window_caps.is_supported(lyr));
+
+    set_layer(lyr, {0.5f, 0, 256, 256}, {0, 0, 256, 256}, no_transform);
+    EXPECT_FALSE(window_caps.is_supported(lyr));
+}
+
+/* Rotated packed layers may be taller when they are not scaled */
+TEST_F(hwc2_window_caps_test, rotated_source_height_limits)
+{
+    hwc2_window_caps window_caps;
+    hwc2_layer lyr(1);
+
+    set_layer(lyr, {0, 0, 64, 3000}, {0, 0, 64, 3000}, HWC_TRANSFORM_ROT_90);
+    EXPECT_TRUE(window_caps.is_supported(lyr));
+    set_layer(lyr, {0, 0, 64, 3000}, {0, 0, 64, 2000}, HWC_TRANSFORM_ROT_90);
+    EXPECT_FALSE(window_caps.is_supported(lyr));
+    set_layer(lyr, {0, 0, 64, 2560}, {0, 0, 64, 2000}, HWC_TRANSFORM_ROT_90);
+    EXPECT_TRUE(window_caps.is_supported(lyr));
+    set_layer(lyr, {0, 0, 64, 3700}, {0, 0, 64, 3700}, HWC_TRANSFORM_ROT_90);
+    EXPECT_FALSE(window_caps.is_supported(lyr));
+}